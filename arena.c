@@ -0,0 +1,292 @@
+/**
+ * Memory arena for cached sample data.
+ *
+ * Blocks are laid out back to back from the start of the mapping,
+ * each preceded by a cache-line sized header that records its size,
+ * the size of the block before it and whether it is free. Allocation
+ * is first fit over the existing blocks, falling back to growing the
+ * top of the arena. Released blocks are coalesced with free
+ * neighbours, and a free block at the top shrinks the arena back.
+ * Sample loads are rare and the number of blocks is small, so the
+ * linear search is not a problem.
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "log.h"
+#include "mem.h"
+#include "mutex.h"
+
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define ARENA_ALIGN 64
+
+typedef struct Block {
+    /* bytes in this block, including the header */
+    size_t size;
+    /* bytes in the previous block, 0 for the first block */
+    size_t prev_size;
+    int free;
+} Block;
+
+#define HEADER_SIZE                                                 \
+    (((sizeof(Block) + ARENA_ALIGN - 1) / ARENA_ALIGN) * ARENA_ALIGN)
+
+struct Arena {
+    char *base;
+    /* bytes reserved */
+    size_t size;
+    /* bytes handed out as blocks (free or not) */
+    size_t top;
+    /* bytes faulted in, a multiple of ARENA_HUGE_PAGE */
+    size_t committed;
+    /* bytes currently allocated */
+    size_t used;
+    /* bytes mlock'ed, and how many we may lock */
+    size_t locked;
+    size_t lock_budget;
+    int hugetlb;
+    /* the last block, NULL if the arena is empty */
+    Block *last;
+    Mutex mutex;
+};
+
+static size_t
+round_up(size_t n, size_t align)
+{
+    return ((n + align - 1) / align) * align;
+}
+
+Arena
+Arena_init(size_t size, size_t lock_budget)
+{
+    Arena arena;
+    void *base;
+    int hugetlb = 1;
+
+    size = round_up(size, ARENA_HUGE_PAGE);
+    if (size == 0) {
+        return NULL;
+    }
+
+#ifdef MAP_HUGETLB
+    /* without MAP_NORESERVE this fails up front if there are not
+       enough huge pages, instead of failing on first touch */
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#else
+    base = MAP_FAILED;
+#endif
+    if (base == MAP_FAILED) {
+        hugetlb = 0;
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            LOG(Error, "could not reserve %lu bytes for arena",
+                (unsigned long) size);
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    NEW(arena);
+    arena->base = base;
+    arena->size = size;
+    arena->top = 0;
+    arena->committed = 0;
+    arena->used = 0;
+    arena->locked = 0;
+    arena->lock_budget = lock_budget;
+    arena->hugetlb = hugetlb;
+    arena->last = NULL;
+    arena->mutex = Mutex_init();
+    LOG(Info, "reserved %lu byte arena (%s pages)", (unsigned long) size,
+        hugetlb ? "huge" : "transparent huge");
+    return arena;
+}
+
+/**
+ * Make sure everything below @a top is faulted in, and locked
+ * while we are within the lock budget.
+ */
+static void
+Arena_commit(Arena arena, size_t top)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    while (arena->committed < top) {
+        char *granule = arena->base + arena->committed;
+        size_t i;
+        if (arena->locked + ARENA_HUGE_PAGE <= arena->lock_budget) {
+            /* mlock faults the pages in for us */
+            if (0 == mlock(granule, ARENA_HUGE_PAGE)) {
+                arena->locked += ARENA_HUGE_PAGE;
+                arena->committed += ARENA_HUGE_PAGE;
+                continue;
+            }
+            LOG(Warn, "could not mlock arena, locked %lu bytes",
+                (unsigned long) arena->locked);
+            arena->lock_budget = arena->locked;
+        }
+        for (i = 0; i < ARENA_HUGE_PAGE; i += page) {
+            granule[i] = 0;
+        }
+        arena->committed += ARENA_HUGE_PAGE;
+    }
+}
+
+static inline Block *
+next_block(Arena arena, Block *b)
+{
+    return b == arena->last ? NULL : (Block *) ((char *) b + b->size);
+}
+
+static inline Block *
+prev_block(Block *b)
+{
+    return b->prev_size == 0 ? NULL : (Block *) ((char *) b - b->prev_size);
+}
+
+void *
+Arena_alloc(Arena arena, size_t nbytes)
+{
+    assert(arena && nbytes > 0);
+    size_t size = HEADER_SIZE + round_up(nbytes, ARENA_ALIGN);
+    Block *b = NULL;
+
+    if (Mutex_lock(arena->mutex)) {
+        return NULL;
+    }
+
+    /* first fit */
+    if (arena->last != NULL) {
+        Block *it;
+        for (it = (Block *) arena->base; it != NULL;
+             it = next_block(arena, it)) {
+            if (it->free && it->size >= size) {
+                b = it;
+                break;
+            }
+        }
+    }
+
+    if (b != NULL) {
+        /* split off the remainder if it is worth keeping */
+        if (b->size - size >= HEADER_SIZE + ARENA_ALIGN) {
+            Block *rest = (Block *) ((char *) b + size);
+            Block *next = next_block(arena, b);
+            rest->size = b->size - size;
+            rest->prev_size = size;
+            rest->free = 1;
+            if (next != NULL) {
+                next->prev_size = rest->size;
+            } else {
+                arena->last = rest;
+            }
+            b->size = size;
+        }
+    } else if (arena->top + size <= arena->size) {
+        /* grow */
+        b = (Block *) (arena->base + arena->top);
+        Arena_commit(arena, arena->top + size);
+        b->size = size;
+        b->prev_size = arena->last ? arena->last->size : 0;
+        arena->last = b;
+        arena->top += size;
+    } else {
+        Mutex_unlock(arena->mutex);
+        return NULL;
+    }
+
+    b->free = 0;
+    arena->used += b->size;
+    Mutex_unlock(arena->mutex);
+    return (char *) b + HEADER_SIZE;
+}
+
+int
+Arena_contains(Arena arena, const void *ptr)
+{
+    assert(arena);
+    const char *p = (const char *) ptr;
+    return p >= arena->base && p < arena->base + arena->top;
+}
+
+void
+Arena_release(Arena arena, void *ptr)
+{
+    assert(arena && Arena_contains(arena, ptr));
+    Block *b = (Block *) ((char *) ptr - HEADER_SIZE);
+    Block *n, *p;
+
+    if (Mutex_lock(arena->mutex)) {
+        LOG(Error, "could not lock arena to release %p", ptr);
+        return;
+    }
+
+    assert(!b->free);
+    b->free = 1;
+    arena->used -= b->size;
+
+    /* merge with the following block */
+    n = next_block(arena, b);
+    if (n != NULL && n->free) {
+        Block *nn = next_block(arena, n);
+        b->size += n->size;
+        if (nn != NULL) {
+            nn->prev_size = b->size;
+        } else {
+            arena->last = b;
+        }
+    }
+    /* merge with the preceding block */
+    p = prev_block(b);
+    if (p != NULL && p->free) {
+        n = next_block(arena, b);
+        p->size += b->size;
+        if (n != NULL) {
+            n->prev_size = p->size;
+        } else {
+            arena->last = p;
+        }
+        b = p;
+    }
+    /* give the top of the arena back (it stays committed) */
+    if (b == arena->last) {
+        arena->top -= b->size;
+        arena->last = prev_block(b);
+    }
+
+    Mutex_unlock(arena->mutex);
+}
+
+size_t
+Arena_used(Arena arena)
+{
+    assert(arena);
+    return arena->used;
+}
+
+size_t
+Arena_locked(Arena arena)
+{
+    assert(arena);
+    return arena->locked;
+}
+
+void
+Arena_free(Arena *arena)
+{
+    assert(arena && *arena);
+    Arena a = *arena;
+    if (a->locked > 0) {
+        munlock(a->base, a->locked);
+    }
+    munmap(a->base, a->size);
+    Mutex_free(&a->mutex);
+    FREE(*arena);
+}
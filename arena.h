@@ -0,0 +1,71 @@
+/**
+ * Memory arena for cached sample data.
+ *
+ * The arena reserves one large mapping, backed by 2 MB huge
+ * pages when the system has them available (and by transparent
+ * huge pages otherwise). Memory is committed in huge-page sized
+ * granules as allocations need it: each granule is faulted in
+ * up front, and mlock'ed while the arena's lock budget allows,
+ * so the realtime thread never takes a page fault reading
+ * cached audio.
+ *
+ * Allocation and release are guarded by a mutex and must not be
+ * called from the realtime thread.
+ */
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+typedef struct Arena *Arena;
+
+/**
+ * Reserve an arena.
+ *
+ * @param size - bytes to reserve, rounded up to the huge page size
+ * @param lock_budget - at most this many bytes will be mlock'ed
+ *
+ * @return Arena, or NULL if no memory could be reserved
+ */
+Arena
+Arena_init(size_t size, size_t lock_budget);
+
+/**
+ * Allocate @a nbytes from the arena, aligned to a cache line.
+ *
+ * @return pointer, or NULL if the arena is full
+ */
+void *
+Arena_alloc(Arena arena, size_t nbytes);
+
+/**
+ * Determine if @a ptr was allocated from @a arena.
+ */
+int
+Arena_contains(Arena arena, const void *ptr);
+
+/**
+ * Return memory allocated with Arena_alloc to the arena.
+ */
+void
+Arena_release(Arena arena, void *ptr);
+
+/**
+ * Bytes currently allocated from the arena.
+ */
+size_t
+Arena_used(Arena arena);
+
+/**
+ * Bytes of the arena that are mlock'ed.
+ */
+size_t
+Arena_locked(Arena arena);
+
+/**
+ * Unmap an arena and everything allocated from it.
+ */
+void
+Arena_free(Arena *arena);
+
+#endif
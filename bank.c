@@ -0,0 +1,444 @@
+/**
+ * Sample banks
+ *
+ * File layout (all integers are host-endian, which is checked
+ * on load through the byte_order field):
+ *
+ *   BankHeader
+ *   BankEntry[count]    sorted by name
+ *   names               NUL-terminated strings
+ *   data                per entry, page aligned, in the bank's format:
+ *                         channel 0 frames, padded to BANK_CHANNEL_ALIGN
+ *                         channel 1 frames, padded to BANK_CHANNEL_ALIGN
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "convert.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+#include "sample-ram.h"
+
+#define BANK_MAGIC "LTNGBANK"
+#define BANK_VERSION 2
+#define BANK_BYTE_ORDER 0x01020304
+#define BANK_DATA_ALIGN 4096
+#define BANK_CHANNEL_ALIGN 64
+/* entries with more channels than this are taken to be corrupt */
+#define BANK_MAX_CHANNELS 64
+
+typedef struct BankHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count;
+    uint32_t samplerate;
+    /* SampleFormat of all sample data */
+    uint32_t format;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+    uint64_t data_offset;
+    uint64_t file_size;
+} BankHeader;
+
+typedef struct BankEntry {
+    uint64_t name_offset;
+    uint64_t data_offset;
+    uint64_t channel_stride;
+    uint64_t frames;
+    uint32_t channels;
+    uint32_t reserved;
+    uint64_t region_start;
+    uint64_t region_end;
+} BankEntry;
+
+struct Bank {
+    /* the mapping */
+    void *base;
+    size_t size;
+    const BankHeader *header;
+    const BankEntry *entries;
+    /* channel pointers of every entry, in one allocation, and
+       where the pointers of each entry start */
+    void **bufs;
+    void ***entry_bufs;
+};
+
+static uint64_t
+align_up(uint64_t n, uint64_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+/* temporary state for one entry while building a bank */
+typedef struct BuildItem {
+    const char *name;
+    SampleRam samp;
+    BankEntry entry;
+} BuildItem;
+
+static int
+build_item_cmp(const void *a, const void *b)
+{
+    return strcmp(((const BuildItem *) a)->name,
+                  ((const BuildItem *) b)->name);
+}
+
+static int
+write_padding(FILE *fp, uint64_t from, uint64_t to)
+{
+    static const char zeros[BANK_DATA_ALIGN];
+    while (from < to) {
+        size_t n = to - from > sizeof(zeros) ? sizeof(zeros) : to - from;
+        if (fwrite(zeros, 1, n, fp) != n) {
+            return 1;
+        }
+        from += n;
+    }
+    return 0;
+}
+
+int
+Bank_build(const char *file, const char **paths, const char **names,
+           int count, nframes_t samplerate, SampleFormat format)
+{
+    assert(file && paths && count > 0);
+    int i, error = 0;
+    channels_t chan;
+    BuildItem *items;
+    BankHeader header;
+    uint64_t frame, offset, names_size = 0;
+    char *planar = NULL;
+    FILE *fp = NULL;
+
+    if (format == SampleFormat_AUTO || format == SampleFormat_BLOCKS) {
+        LOG(Error, "Bank_build: banks need an explicit, uncompressed "
+            "sample format (%s)", file);
+        return 1;
+    }
+    const size_t sample_size = Convert_size(format);
+    const SampleStorage storage = { format, SampleLayout_PLANAR,
+                                    NULL, NULL, NULL, 0, 0,
+                                    SRCQuality_FASTEST };
+    items = CALLOC(count, sizeof(BuildItem));
+
+    /* decode and resample everything first so we know the layout */
+    for (i = 0; i < count; i++) {
+        items[i].name = names ? names[i] : paths[i];
+        items[i].samp = SampleRam_init(paths[i], 1.0, 1.0, samplerate,
+                                       &storage);
+        if (items[i].samp == NULL) {
+            LOG(Error, "Bank_build: could not load %s", paths[i]);
+            error = 1;
+            goto done;
+        }
+        names_size += strlen(items[i].name) + 1;
+    }
+    qsort(items, count, sizeof(BuildItem), build_item_cmp);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BANK_MAGIC, sizeof(header.magic));
+    header.version = BANK_VERSION;
+    header.byte_order = BANK_BYTE_ORDER;
+    header.count = count;
+    header.samplerate = samplerate;
+    header.format = format;
+    header.index_offset = sizeof(BankHeader);
+    header.names_offset = header.index_offset + count * sizeof(BankEntry);
+    header.names_size = names_size;
+    header.data_offset = align_up(header.names_offset + names_size,
+                                  BANK_DATA_ALIGN);
+
+    /* lay out entries */
+    uint64_t name_offset = header.names_offset;
+    offset = header.data_offset;
+    for (i = 0; i < count; i++) {
+        BankEntry *e = &items[i].entry;
+        nframes_t frames = SampleRam_frames(items[i].samp);
+        e->name_offset = name_offset;
+        name_offset += strlen(items[i].name) + 1;
+        e->channels = SampleRam_channels(items[i].samp);
+        e->frames = frames;
+        e->channel_stride = align_up(frames * sample_size, BANK_CHANNEL_ALIGN);
+        e->data_offset = offset;
+        e->region_start = 0;
+        e->region_end = frames;
+        e->reserved = 0;
+        offset = align_up(offset + e->channels * e->channel_stride,
+                          BANK_DATA_ALIGN);
+    }
+    header.file_size = offset;
+
+    fp = fopen(file, "wb");
+    if (fp == NULL) {
+        LOG(Error, "Bank_build: could not open %s for writing", file);
+        error = 1;
+        goto done;
+    }
+
+    /* header, index and names */
+    error = fwrite(&header, sizeof(header), 1, fp) != 1;
+    for (i = 0; !error && i < count; i++) {
+        error = fwrite(&items[i].entry, sizeof(BankEntry), 1, fp) != 1;
+    }
+    for (i = 0; !error && i < count; i++) {
+        size_t len = strlen(items[i].name) + 1;
+        error = fwrite(items[i].name, 1, len, fp) != len;
+    }
+    offset = header.names_offset + names_size;
+
+    /* sample data */
+    for (i = 0; !error && i < count; i++) {
+        const BankEntry *e = &items[i].entry;
+        error = write_padding(fp, offset, e->data_offset);
+        offset = e->data_offset;
+        const char *frames = SampleRam_interleaved(items[i].samp);
+        if (frames != NULL) {
+            /* float WAV files at the bank's rate are played from a
+               mapping, which keeps stereo interleaved */
+            planar = ALLOC(e->frames * sample_size + 1);
+        }
+        for (chan = 0; !error && chan < (channels_t) e->channels; chan++) {
+            const void *buf = SampleRam_buffer(items[i].samp, chan);
+            if (frames != NULL) {
+                for (frame = 0; frame < e->frames; frame++) {
+                    memcpy(planar + frame * sample_size,
+                           frames + (frame * e->channels + chan) * sample_size,
+                           sample_size);
+                }
+                buf = planar;
+            }
+            error = fwrite(buf, sample_size, e->frames, fp) != e->frames;
+            error = error || write_padding(fp, offset + e->frames * sample_size,
+                                           offset + e->channel_stride);
+            offset += e->channel_stride;
+        }
+        FREE(planar);
+    }
+    error = error || write_padding(fp, offset, header.file_size);
+
+    if (error) {
+        LOG(Error, "Bank_build: could not write %s", file);
+    }
+
+ done:
+    if (fp != NULL && fclose(fp) != 0) {
+        error = 1;
+    }
+    for (i = 0; i < count; i++) {
+        if (items[i].samp != NULL) {
+            SampleRam_free(&items[i].samp);
+        }
+    }
+    FREE(items);
+    return error;
+}
+
+static int
+Bank_validate(Bank bank)
+{
+    const BankHeader *h = bank->header;
+    uint32_t i;
+
+    if (bank->size < sizeof(BankHeader) ||
+        0 != memcmp(h->magic, BANK_MAGIC, sizeof(h->magic))) {
+        LOG(Error, "not a sample bank (%s)", "bad magic");
+        return 1;
+    }
+    if (h->byte_order != BANK_BYTE_ORDER || h->version != BANK_VERSION ||
+        (h->format != SampleFormat_FLOAT32 &&
+         h->format != SampleFormat_INT16 &&
+         h->format != SampleFormat_FLOAT16)) {
+        LOG(Error, "unsupported sample bank (version %u)", h->version);
+        return 1;
+    }
+    /* every size is checked against what is left of the mapping
+       rather than added to an offset, which could overflow */
+    if (h->file_size > bank->size ||
+        h->names_offset > bank->size ||
+        h->names_size > bank->size - h->names_offset ||
+        h->index_offset > h->names_offset ||
+        h->count > (h->names_offset - h->index_offset) / sizeof(BankEntry)) {
+        LOG(Error, "truncated sample bank (%lu bytes)",
+            (unsigned long) bank->size);
+        return 1;
+    }
+    for (i = 0; i < h->count; i++) {
+        const BankEntry *e = &bank->entries[i];
+        if (e->channels < 1 || e->channels > BANK_MAX_CHANNELS ||
+            e->data_offset % BANK_DATA_ALIGN != 0 ||
+            e->data_offset > bank->size ||
+            e->channel_stride > (bank->size - e->data_offset) / e->channels ||
+            e->frames > e->channel_stride / Convert_size(h->format) ||
+            e->region_start > e->region_end || e->region_end > e->frames ||
+            e->name_offset < h->names_offset ||
+            e->name_offset >= h->names_offset + h->names_size) {
+            LOG(Error, "corrupt sample bank entry %u", i);
+            return 1;
+        }
+    }
+    if (h->names_size > 0 &&
+        ((const char *) bank->base)[h->names_offset + h->names_size - 1]) {
+        LOG(Error, "corrupt sample bank %s", "names");
+        return 1;
+    }
+    return 0;
+}
+
+Bank
+Bank_open(const char *file)
+{
+    Bank bank;
+    struct stat st;
+    uint32_t i;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0) {
+        LOG(Error, "could not open bank %s", file);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        LOG(Error, "could not stat bank %s", file);
+        close(fd);
+        return NULL;
+    }
+
+    NEW(bank);
+    bank->size = st.st_size;
+    bank->base = mmap(NULL, bank->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (bank->base == MAP_FAILED) {
+        LOG(Error, "could not mmap bank %s", file);
+        FREE(bank);
+        return NULL;
+    }
+    /* we are about to play from it, so start reading it in now */
+    madvise(bank->base, bank->size, MADV_WILLNEED);
+
+    bank->header = (const BankHeader *) bank->base;
+    bank->entries = (const BankEntry *)
+        ((const char *) bank->base + bank->header->index_offset);
+    bank->bufs = NULL;
+    bank->entry_bufs = NULL;
+
+    if (Bank_validate(bank)) {
+        munmap(bank->base, bank->size);
+        FREE(bank);
+        return NULL;
+    }
+
+    size_t nbufs = 0;
+    for (i = 0; i < bank->header->count; i++) {
+        nbufs += bank->entries[i].channels;
+    }
+    if (bank->header->count > 0) {
+        bank->bufs = CALLOC(nbufs, sizeof(void *));
+        bank->entry_bufs = CALLOC(bank->header->count, sizeof(void **));
+    }
+    const size_t sample_size = Convert_size(bank->header->format);
+    nbufs = 0;
+    for (i = 0; i < bank->header->count; i++) {
+        const BankEntry *e = &bank->entries[i];
+        char *data = (char *) bank->base + e->data_offset;
+        uint32_t chan;
+        bank->entry_bufs[i] = &bank->bufs[nbufs];
+        for (chan = 0; chan < e->channels; chan++) {
+            bank->bufs[nbufs++] =
+                data + chan * e->channel_stride + e->region_start * sample_size;
+        }
+    }
+
+    LOG(Info, "mapped bank %s (%u samples)", file, bank->header->count);
+    return bank;
+}
+
+int
+Bank_count(Bank bank)
+{
+    assert(bank);
+    return (int) bank->header->count;
+}
+
+nframes_t
+Bank_samplerate(Bank bank)
+{
+    assert(bank);
+    return bank->header->samplerate;
+}
+
+SampleFormat
+Bank_format(Bank bank)
+{
+    assert(bank);
+    return (SampleFormat) bank->header->format;
+}
+
+int
+Bank_find(Bank bank, const char *name)
+{
+    assert(bank && name);
+    int lo = 0, hi = (int) bank->header->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, Bank_name(bank, mid));
+        if (cmp == 0) {
+            return mid;
+        } else if (cmp < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
+
+const char *
+Bank_name(Bank bank, int i)
+{
+    assert(bank && i >= 0 && i < Bank_count(bank));
+    return (const char *) bank->base + bank->entries[i].name_offset;
+}
+
+channels_t
+Bank_channels(Bank bank, int i)
+{
+    assert(bank && i >= 0 && i < Bank_count(bank));
+    return (channels_t) bank->entries[i].channels;
+}
+
+nframes_t
+Bank_frames(Bank bank, int i)
+{
+    assert(bank && i >= 0 && i < Bank_count(bank));
+    return bank->entries[i].region_end - bank->entries[i].region_start;
+}
+
+void **
+Bank_buffers(Bank bank, int i)
+{
+    assert(bank && i >= 0 && i < Bank_count(bank));
+    return bank->entry_bufs[i];
+}
+
+void
+Bank_free(Bank *bank)
+{
+    assert(bank && *bank);
+    Bank b = *bank;
+    munmap(b->base, b->size);
+    FREE(b->bufs);
+    FREE(b->entry_bufs);
+    FREE(*bank);
+}
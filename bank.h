@@ -0,0 +1,108 @@
+/**
+ * Sample banks
+ *
+ * A bank packs a whole kit of samples into a single file:
+ * a header, an index of entries (sorted by name), a block of
+ * NUL-terminated names and the sample data itself, stored planar
+ * at a fixed sample rate as 32-bit float or one of the compact
+ * 16-bit formats. Each entry's data is page aligned, and each
+ * channel within an entry is aligned
+ * to a cache line, so a bank can be mmap'ed and played from
+ * directly without copying or converting anything.
+ */
+#ifndef BANK_H_INCLUDED
+#define BANK_H_INCLUDED
+
+#include "lightning.h"
+
+typedef struct Bank *Bank;
+
+/**
+ * Build a bank file from a list of audio files.
+ * Every file is decoded and resampled to @a samplerate.
+ *
+ * @param file - path of the bank file to write
+ * @param paths - audio files to pack
+ * @param names - names the samples will be registered under,
+ *                or NULL to use @a paths
+ * @param count - number of entries in @a paths (and @a names)
+ * @param samplerate - sample rate of the packed data
+ * @param format - format of the packed data, SampleFormat_AUTO
+ *                 and SampleFormat_BLOCKS are not allowed
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+Bank_build(const char *file, const char **paths, const char **names,
+           int count, nframes_t samplerate, SampleFormat format);
+
+/**
+ * Map a bank file into memory.
+ *
+ * @return Bank, or NULL if the file could not be mapped or
+ *         is not a valid bank
+ */
+Bank
+Bank_open(const char *file);
+
+/**
+ * Number of samples in a bank.
+ */
+int
+Bank_count(Bank bank);
+
+/**
+ * Sample rate of the data in a bank.
+ */
+nframes_t
+Bank_samplerate(Bank bank);
+
+/**
+ * Format of the data in a bank.
+ */
+SampleFormat
+Bank_format(Bank bank);
+
+/**
+ * Find the index of the sample called @a name.
+ *
+ * @return index, or -1 if there is no such sample
+ */
+int
+Bank_find(Bank bank, const char *name);
+
+/**
+ * Name of the sample at index @a i.
+ * The string lives in the mapping.
+ */
+const char *
+Bank_name(Bank bank, int i);
+
+/**
+ * Number of channels stored for the sample at index @a i.
+ */
+channels_t
+Bank_channels(Bank bank, int i);
+
+/**
+ * Number of playable frames of the sample at index @a i.
+ */
+nframes_t
+Bank_frames(Bank bank, int i);
+
+/**
+ * Channel buffers (Bank_channels() of them) of the sample at
+ * index @a i, stored in the bank's format.
+ * The buffers point into the mapping and are only valid
+ * until Bank_free() is called.
+ */
+void **
+Bank_buffers(Bank bank, int i);
+
+/**
+ * Unmap a bank.
+ */
+void
+Bank_free(Bank *bank);
+
+#endif
@@ -0,0 +1,138 @@
+package lightning
+
+import (
+	"encoding/binary"
+	"math"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+// byte offsets in a bank file, see bank.c: the first entry, and
+// fields of the header and of an entry
+const (
+	bankVersion        = 8
+	bankFirstEntry     = 80
+	bankNamesSize      = 48
+	bankEntryDataStart = 8
+	bankEntryStride    = 16
+)
+
+// buildTestBank packs a mono and a stereo sample at 48 kHz
+func buildTestBank(t *testing.T, format SampleFormat) (string, map[string][][]float32) {
+	t.Helper()
+	dir := t.TempDir()
+	samples := map[string][][]float32{
+		"kick":  {make([]float32, 1000)},
+		"snare": {make([]float32, 2345), make([]float32, 2345)},
+	}
+	var paths, names []string
+	for name, channels := range samples {
+		for ch := range channels {
+			for i := range channels[ch] {
+				channels[ch][i] = float32(0.8 * math.Sin(float64(i*(ch+1))*0.05))
+			}
+		}
+		path := filepath.Join(dir, name+".wav")
+		writeWAV(t, path, 48000, channels)
+		paths = append(paths, path)
+		names = append(names, name)
+	}
+	bank := filepath.Join(dir, "kit.bank")
+	if err := BuildBank(bank, paths, names, 48000, format); err != nil {
+		t.Fatal(err)
+	}
+	return bank, samples
+}
+
+func TestBankRoundTrip(t *testing.T) {
+	// float samples at the bank rate are played from a mapping of the
+	// WAV file, so the builder reads them back interleaved
+	for _, format := range []SampleFormat{Float32, Int16, Float16} {
+		bank, samples := buildTestBank(t, format)
+		gotFormat, samplerate, entries, err := readBank(bank)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if gotFormat != format || samplerate != 48000 {
+			t.Fatalf("bank is %d at %d Hz, want %d at 48000 Hz", gotFormat, samplerate, format)
+		}
+		if len(entries) != len(samples) {
+			t.Fatalf("bank has %d samples, want %d", len(entries), len(samples))
+		}
+		for i, e := range entries {
+			if i > 0 && entries[i-1].Name >= e.Name {
+				t.Errorf("entries are not sorted by name: %s before %s", entries[i-1].Name, e.Name)
+			}
+			want, ok := samples[e.Name]
+			if !ok {
+				t.Fatalf("unexpected sample %s", e.Name)
+			}
+			if len(e.Channels) != len(want) {
+				t.Fatalf("%s has %d channels, want %d", e.Name, len(e.Channels), len(want))
+			}
+			for ch := range want {
+				// what the sample is stored as is what comes back
+				stored := convertToFloat(format, convertFromFloat(format, want[ch]), 0, len(want[ch]), 1.0)
+				if len(e.Channels[ch]) != len(stored) {
+					t.Fatalf("%s has %d frames, want %d", e.Name, len(e.Channels[ch]), len(stored))
+				}
+				for j := range stored {
+					if e.Channels[ch][j] != stored[j] {
+						t.Fatalf("format %d %s channel %d frame %d: got %v, want %v",
+							format, e.Name, ch, j, e.Channels[ch][j], stored[j])
+					}
+				}
+			}
+		}
+	}
+}
+
+// corruptBank writes value at offset in a copy of bank
+func corruptBank(t *testing.T, bank string, offset int, value uint64) string {
+	t.Helper()
+	data, err := os.ReadFile(bank)
+	if err != nil {
+		t.Fatal(err)
+	}
+	binary.LittleEndian.PutUint64(data[offset:], value)
+	file := filepath.Join(t.TempDir(), "corrupt.bank")
+	if err := os.WriteFile(file, data, 0o644); err != nil {
+		t.Fatal(err)
+	}
+	return file
+}
+
+func TestBankValidation(t *testing.T) {
+	bank, _ := buildTestBank(t, Int16)
+	data, err := os.ReadFile(bank)
+	if err != nil {
+		t.Fatal(err)
+	}
+	truncated := filepath.Join(t.TempDir(), "truncated.bank")
+	if err := os.WriteFile(truncated, data[:len(data)-4096], 0o644); err != nil {
+		t.Fatal(err)
+	}
+	badMagic := filepath.Join(t.TempDir(), "magic.bank")
+	if err := os.WriteFile(badMagic, append([]byte("NOTABANK"), data[8:]...), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	entry := bankFirstEntry
+	for name, file := range map[string]string{
+		"truncated": truncated,
+		"bad magic": badMagic,
+		// version 1 entries had loop points, which were never played
+		"version 1": corruptBank(t, bank, bankVersion, 0x01020304<<32|1),
+		// channels times the stride wraps around to a small number
+		"overflowing stride": corruptBank(t, bank, entry+bankEntryStride, 1<<63),
+		"data past the end":  corruptBank(t, bank, entry+bankEntryDataStart, uint64(len(data))),
+		"huge names":         corruptBank(t, bank, bankNamesSize, math.MaxUint64-100),
+	} {
+		if _, _, _, err := readBank(file); err == nil {
+			t.Errorf("%s bank was opened", name)
+		}
+	}
+	if _, _, _, err := readBank(bank); err != nil {
+		t.Errorf("could not open the bank the others were made from: %v", err)
+	}
+}
@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "convert.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+#include "sample.h"
+
+#define BENCH_CHANNELS 2
+
+/**
+ * Open a counter of last level cache misses for this thread.
+ *
+ * @return file descriptor, or -1 if the counter is not available
+ */
+static int
+open_miss_counter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Fill the buffers of one synthetic sample with noise.
+ */
+static void **
+make_buffers(SampleLayout layout, SampleFormat format)
+{
+    int chan, count = layout == SampleLayout_INTERLEAVED ? 1 : BENCH_CHANNELS;
+    nframes_t i, n = BENCH_SAMPLE_FRAMES * (BENCH_CHANNELS / count);
+    void **bufs = CALLOC(count, sizeof(void *));
+    sample_t *noise = ALLOC(n * SAMPLE_SIZE);
+    for (chan = 0; chan < count; chan++) {
+        for (i = 0; i < n; i++) {
+            noise[i] = rand() / (float) RAND_MAX - 0.5f;
+        }
+        bufs[chan] = ALLOC(n * Convert_size(format));
+        Convert_from_float(bufs[chan], format, noise, n);
+    }
+    FREE(noise);
+    return bufs;
+}
+
+int
+Bench_layout(SampleLayout layout, SampleFormat format, int voices,
+             pitch_t pitch, int cycles, LightningLayoutBench *result)
+{
+    assert(result);
+    int i, chan, cycle, fd, count;
+    nframes_t frame;
+    Sample *cached, *playing;
+    void ***bufs;
+    sample_t *collect[BENCH_CHANNELS], *sum[BENCH_CHANNELS];
+    uint64_t misses = 0;
+    double start, elapsed = 0.0;
+
+    if (voices < 1 || cycles < 1 || pitch <= 0.0 ||
+        (format != SampleFormat_FLOAT32 && format != SampleFormat_INT16 &&
+         format != SampleFormat_FLOAT16)) {
+        LOG(Error, "invalid layout benchmark (%d voices)", voices);
+        return 1;
+    }
+    count = layout == SampleLayout_INTERLEAVED ? 1 : BENCH_CHANNELS;
+    cached = CALLOC(voices, sizeof(Sample));
+    playing = CALLOC(voices, sizeof(Sample));
+    bufs = CALLOC(voices, sizeof(void **));
+    for (i = 0; i < voices; i++) {
+        bufs[i] = make_buffers(layout, format);
+        cached[i] = Sample_init_mapped("bench", BENCH_CHANNELS,
+                                       BENCH_SAMPLE_FRAMES, 48000, format,
+                                       layout, bufs[i]);
+    }
+    for (chan = 0; chan < BENCH_CHANNELS; chan++) {
+        collect[chan] = CALLOC(BENCH_CYCLE_FRAMES, SAMPLE_SIZE);
+        sum[chan] = CALLOC(BENCH_CYCLE_FRAMES, SAMPLE_SIZE);
+    }
+
+    fd = open_miss_counter();
+    for (cycle = 0; cycle < cycles; cycle++) {
+        /* (re)start voices outside the measured part */
+        for (i = 0; i < voices; i++) {
+            if (playing[i] && Sample_done(playing[i])) {
+                Sample_free(&playing[i]);
+            }
+            if (playing[i] == NULL) {
+                playing[i] = Sample_clone(cached[i], pitch, 0.5, 48000);
+            }
+        }
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        start = now();
+        for (chan = 0; chan < BENCH_CHANNELS; chan++) {
+            memset(sum[chan], 0, BENCH_CYCLE_FRAMES * SAMPLE_SIZE);
+        }
+        for (i = 0; i < voices; i++) {
+            Sample_write(playing[i], collect, BENCH_CHANNELS, BENCH_CYCLE_FRAMES);
+            for (chan = 0; chan < BENCH_CHANNELS; chan++) {
+                for (frame = 0; frame < BENCH_CYCLE_FRAMES; frame++) {
+                    sum[chan][frame] += collect[chan][frame];
+                }
+            }
+        }
+        elapsed += now() - start;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    result->voice_frames = (unsigned long long) voices * cycles * BENCH_CYCLE_FRAMES;
+    result->ns_per_voice_frame = elapsed * 1e9 / result->voice_frames;
+    result->misses_per_voice_frame = -1.0;
+    if (fd >= 0) {
+        if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+            result->misses_per_voice_frame = misses / (double) result->voice_frames;
+        }
+        close(fd);
+    }
+
+    for (i = 0; i < voices; i++) {
+        if (playing[i]) {
+            Sample_free(&playing[i]);
+        }
+        Sample_free(&cached[i]);
+        for (chan = 0; chan < count; chan++) {
+            FREE(bufs[i][chan]);
+        }
+        FREE(bufs[i]);
+    }
+    for (chan = 0; chan < BENCH_CHANNELS; chan++) {
+        FREE(collect[chan]);
+        FREE(sum[chan]);
+    }
+    FREE(bufs);
+    FREE(playing);
+    FREE(cached);
+    return 0;
+}
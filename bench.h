@@ -0,0 +1,32 @@
+/**
+ * Render benchmarks
+ *
+ * Renders voices from synthetic cached samples the way the
+ * realtime thread does, without JACK, so storage options can
+ * be compared on the machine that will run them.
+ */
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+#include "lightning.h"
+
+/* frames in each synthetic sample. with many voices this is
+   far more data than fits in the last level cache */
+#define BENCH_SAMPLE_FRAMES 65536
+
+/* frames rendered per cycle */
+#define BENCH_CYCLE_FRAMES 256
+
+/**
+ * Render @a cycles cycles of @a voices stereo voices at
+ * @a pitch from samples stored in @a format and @a layout.
+ * Every voice plays its own sample, and voices that finish
+ * are restarted.
+ *
+ * @return 0 on success, nonzero if the arguments are invalid
+ */
+int
+Bench_layout(SampleLayout layout, SampleFormat format, int voices,
+             pitch_t pitch, int cycles, LightningLayoutBench *result);
+
+#endif
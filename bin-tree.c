@@ -26,6 +26,11 @@ BinTree_insert_under(BinTree tree, struct node *root, struct node *n);
 static void *
 BinTree_lookup_under(BinTree tree, struct node *root, const char *key);
 
+static void
+BinTree_foreach_under(struct node *root,
+                      void (* f)(const char *key, void *value, void *arg),
+                      void *arg);
+
 static void
 BinTree_free_under(struct node *root);
 
@@ -147,6 +152,31 @@ BinTree_lookup_under(BinTree tree, struct node *root, const char *key)
     }
 }
 
+void
+BinTree_foreach(BinTree tree,
+                void (* f)(const char *key, void *value, void *arg),
+                void *arg)
+{
+    assert(tree && f);
+    if (tree->root != NULL) {
+        BinTree_foreach_under(tree->root, f, arg);
+    }
+}
+
+static void
+BinTree_foreach_under(struct node *root,
+                      void (* f)(const char *key, void *value, void *arg),
+                      void *arg)
+{
+    if (root->L != NULL) {
+        BinTree_foreach_under(root->L, f, arg);
+    }
+    f(root->key, root->value, arg);
+    if (root->R != NULL) {
+        BinTree_foreach_under(root->R, f, arg);
+    }
+}
+
 /* We may want to pass in a function pointer
    to free the nodes */
 void
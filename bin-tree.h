@@ -30,6 +30,14 @@ BinTree_insert(BinTree tree, const char *key, void *value);
 void *
 BinTree_lookup(BinTree tree, const char *key);
                
+/**
+ * Call @a f with every key and value in the tree, in key order.
+ */
+void
+BinTree_foreach(BinTree tree,
+                void (* f)(const char *key, void *value, void *arg),
+                void *arg);
+
 /**
  * Free all the tree's nodes and the tree structure itself
  */
@@ -0,0 +1,142 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "blocks.h"
+#include "codec.h"
+#include "convert.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+
+struct Blocks {
+    channels_t channels;
+    nframes_t frames;
+    nframes_t count;
+    /* channels * (count + 1) offsets into data, block b of
+       channel c spans offsets[c * (count + 1) + b] up to
+       the next offset */
+    uint32_t *offsets;
+    uint8_t *data;
+    size_t size;
+    /* single allocation holding offsets and data */
+    void *mem;
+    Arena arena;
+};
+
+Blocks
+Blocks_init(const sample_t **bufs, channels_t channels, nframes_t frames,
+            Arena arena)
+{
+    assert(bufs && channels > 0);
+    Blocks blocks;
+    channels_t chan;
+    nframes_t b;
+    int16_t pcm[BLOCKS_FRAMES];
+    size_t offsets_size, capacity, pos = 0;
+    uint8_t *scratch;
+
+    NEW(blocks);
+    blocks->channels = channels;
+    blocks->frames = frames;
+    blocks->count = (frames + BLOCKS_FRAMES - 1) / BLOCKS_FRAMES;
+    offsets_size = channels * (blocks->count + 1) * sizeof(uint32_t);
+
+    /* encode into a worst case sized scratch buffer, then
+       move it to its final home once we know the size */
+    capacity = channels * blocks->count * Codec_max_size(BLOCKS_FRAMES);
+    scratch = ALLOC(capacity > 0 ? capacity : 1);
+    blocks->offsets = ALLOC(offsets_size);
+    for (chan = 0; chan < channels; chan++) {
+        uint32_t *offsets = blocks->offsets + chan * (blocks->count + 1);
+        for (b = 0; b < blocks->count; b++) {
+            nframes_t n = Blocks_frames(blocks, b);
+            offsets[b] = (uint32_t) pos;
+            Convert_from_float(pcm, SampleFormat_INT16,
+                               bufs[chan] + b * BLOCKS_FRAMES, n);
+            pos += Codec_encode(pcm, n, scratch + pos);
+            /* offsets are 32 bits */
+            if (pos > UINT32_MAX) {
+                LOG(Error, "can not compress %u frames x %d channels, "
+                    "that is over 4 GiB", frames, channels);
+                FREE(blocks->offsets);
+                FREE(scratch);
+                FREE(blocks);
+                return NULL;
+            }
+        }
+        offsets[blocks->count] = (uint32_t) pos;
+    }
+    blocks->size = pos;
+
+    blocks->arena = arena;
+    blocks->mem = arena ? Arena_alloc(arena, offsets_size + pos) : NULL;
+    if (blocks->mem == NULL) {
+        blocks->mem = ALLOC(offsets_size + pos);
+    }
+    memcpy(blocks->mem, blocks->offsets, offsets_size);
+    memcpy((char *) blocks->mem + offsets_size, scratch, pos);
+    FREE(blocks->offsets);
+    FREE(scratch);
+    blocks->offsets = (uint32_t *) blocks->mem;
+    blocks->data = (uint8_t *) blocks->mem + offsets_size;
+
+    LOG(Debug, "compressed %u frames x %d channels to %lu bytes",
+        frames, channels, (unsigned long) pos);
+    return blocks;
+}
+
+channels_t
+Blocks_channels(Blocks blocks)
+{
+    assert(blocks);
+    return blocks->channels;
+}
+
+nframes_t
+Blocks_count(Blocks blocks)
+{
+    assert(blocks);
+    return blocks->count;
+}
+
+nframes_t
+Blocks_frames(Blocks blocks, nframes_t block)
+{
+    assert(blocks && block < blocks->count);
+    nframes_t start = block * BLOCKS_FRAMES;
+    return blocks->frames - start < BLOCKS_FRAMES
+        ? blocks->frames - start : BLOCKS_FRAMES;
+}
+
+size_t
+Blocks_size(Blocks blocks)
+{
+    assert(blocks);
+    return blocks->size;
+}
+
+int
+Blocks_decode(Blocks blocks, channels_t chan, nframes_t block, int16_t *out)
+{
+    assert(blocks && chan < blocks->channels && block < blocks->count);
+    const uint32_t *offsets = blocks->offsets + chan * (blocks->count + 1);
+    return Codec_decode(blocks->data + offsets[block],
+                        offsets[block + 1] - offsets[block],
+                        out, Blocks_frames(blocks, block));
+}
+
+void
+Blocks_free(Blocks *blocks)
+{
+    assert(blocks && *blocks);
+    Blocks b = *blocks;
+    if (b->arena && Arena_contains(b->arena, b->mem)) {
+        Arena_release(b->arena, b->mem);
+    } else {
+        FREE(b->mem);
+    }
+    FREE(*blocks);
+}
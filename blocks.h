@@ -0,0 +1,73 @@
+/**
+ * Block-compressed sample data
+ *
+ * Holds every channel of a sample as 16-bit audio compressed
+ * with the block codec in BLOCKS_FRAMES frame blocks. Any block
+ * can be decoded on its own, which is what the decode-ahead
+ * worker (see decoder.h) relies on.
+ */
+#ifndef BLOCKS_H_INCLUDED
+#define BLOCKS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "lightning.h"
+
+#define BLOCKS_FRAMES 4096
+
+typedef struct Blocks *Blocks;
+
+/**
+ * Compress @a channels buffers of @a frames frames.
+ * The compressed data is allocated from @a arena if it is not
+ * NULL and has room, and from the heap otherwise.
+ *
+ * @return Blocks, or NULL if the compressed data would be more
+ *         than 4 GiB, past which blocks can't be found in it
+ */
+Blocks
+Blocks_init(const sample_t **bufs, channels_t channels, nframes_t frames,
+            Arena arena);
+
+/**
+ * Number of channels.
+ */
+channels_t
+Blocks_channels(Blocks blocks);
+
+/**
+ * Number of blocks per channel. The last block may be short.
+ */
+nframes_t
+Blocks_count(Blocks blocks);
+
+/**
+ * Number of frames in block @a block.
+ */
+nframes_t
+Blocks_frames(Blocks blocks, nframes_t block);
+
+/**
+ * Bytes of compressed data.
+ */
+size_t
+Blocks_size(Blocks blocks);
+
+/**
+ * Decode block @a block of channel @a chan into @a out,
+ * which must hold BLOCKS_FRAMES samples.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+Blocks_decode(Blocks blocks, channels_t chan, nframes_t block, int16_t *out);
+
+/**
+ * Free compressed data.
+ */
+void
+Blocks_free(Blocks *blocks);
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * Lossless block codec for 16-bit audio
+ *
+ * Block layout:
+ *
+ *   1 byte      mode: CODEC_RAW, CODEC_CONSTANT, or CODEC_FIXED +
+ *               predictor order
+ *   raw:        frames little-endian int16 samples
+ *   constant:   one little-endian int16 sample (e.g. silence)
+ *   fixed:      order little-endian int16 warm-up samples, then a
+ *               bitstream (MSB first) with, for each partition of
+ *               CODEC_PARTITION residuals:
+ *                 5 bits    Rice parameter k, or CODEC_ESCAPE
+ *                 residuals zigzag coded; q zeros, a one, then the
+ *                           k low bits, or CODEC_ESCAPE_BITS bits
+ *                           each if the partition is escaped
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "codec.h"
+#include "lightning.h"
+
+#define CODEC_RAW 0
+#define CODEC_FIXED 1
+#define CODEC_MAX_ORDER 2
+#define CODEC_CONSTANT (CODEC_FIXED + CODEC_MAX_ORDER + 1)
+#define CODEC_MAX_RICE 20
+#define CODEC_ESCAPE 31
+/* zigzag coded residuals of an order 2 predictor fit in 19 bits */
+#define CODEC_ESCAPE_BITS 20
+
+typedef struct BitWriter {
+    uint8_t *out;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+} BitWriter;
+
+typedef struct BitReader {
+    const uint8_t *in;
+    size_t pos;
+    size_t len;
+    /* valid bits are left aligned */
+    uint64_t acc;
+    int bits;
+} BitReader;
+
+static inline void
+put_bits(BitWriter *w, uint32_t value, int nbits)
+{
+    assert(nbits <= 32);
+    w->acc = (w->acc << nbits) | (value & (uint32_t) ((1ull << nbits) - 1));
+    w->bits += nbits;
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        w->out[w->pos++] = (uint8_t) (w->acc >> w->bits);
+    }
+}
+
+static inline void
+put_rice(BitWriter *w, uint32_t u, int k)
+{
+    uint32_t q = u >> k;
+    while (q >= 32) {
+        put_bits(w, 0, 32);
+        q -= 32;
+    }
+    /* q zeros and the terminating one */
+    put_bits(w, 1, q + 1);
+    if (k > 0) {
+        put_bits(w, u, k);
+    }
+}
+
+static inline void
+flush_bits(BitWriter *w)
+{
+    if (w->bits > 0) {
+        put_bits(w, 0, 8 - w->bits);
+    }
+}
+
+static inline void
+refill(BitReader *r)
+{
+    while (r->bits <= 56 && r->pos < r->len) {
+        r->acc |= (uint64_t) r->in[r->pos++] << (56 - r->bits);
+        r->bits += 8;
+    }
+}
+
+static inline int
+get_bits(BitReader *r, int nbits, uint32_t *value)
+{
+    if (r->bits < nbits) {
+        refill(r);
+        if (r->bits < nbits) {
+            return 1;
+        }
+    }
+    *value = nbits == 0 ? 0 : (uint32_t) (r->acc >> (64 - nbits));
+    r->acc = nbits == 64 ? 0 : r->acc << nbits;
+    r->bits -= nbits;
+    return 0;
+}
+
+static inline int
+get_rice(BitReader *r, int k, uint32_t *value)
+{
+    uint32_t q = 0, low;
+    int zeros;
+    refill(r);
+    while (r->acc == 0) {
+        if (r->bits == 0) {
+            return 1;
+        }
+        q += r->bits;
+        r->bits = 0;
+        refill(r);
+    }
+    zeros = __builtin_clzll(r->acc);
+    q += zeros;
+    r->acc <<= zeros + 1;
+    r->bits -= zeros + 1;
+    if (get_bits(r, k, &low)) {
+        return 1;
+    }
+    *value = (q << k) | low;
+    return 0;
+}
+
+static inline uint32_t
+zigzag(int32_t v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static inline int32_t
+unzigzag(uint32_t u)
+{
+    return (int32_t) (u >> 1) ^ -(int32_t) (u & 1);
+}
+
+static inline int32_t
+predict(const int16_t *s, nframes_t i, int order)
+{
+    switch (order) {
+    case 0:  return 0;
+    case 1:  return s[i - 1];
+    default: return 2 * s[i - 1] - s[i - 2];
+    }
+}
+
+size_t
+Codec_max_size(nframes_t frames)
+{
+    return 1 + frames * sizeof(int16_t);
+}
+
+/* bits needed to code @a n residuals with Rice parameter @a k */
+static uint64_t
+rice_cost(const uint32_t *u, nframes_t n, int k)
+{
+    uint64_t bits = 0;
+    nframes_t i;
+    for (i = 0; i < n; i++) {
+        bits += (u[i] >> k) + 1 + k;
+    }
+    return bits;
+}
+
+static size_t
+encode_raw(const int16_t *in, nframes_t frames, uint8_t *out)
+{
+    nframes_t i;
+    out[0] = CODEC_RAW;
+    for (i = 0; i < frames; i++) {
+        out[1 + 2 * i] = (uint8_t) (in[i] & 0xff);
+        out[2 + 2 * i] = (uint8_t) ((uint16_t) in[i] >> 8);
+    }
+    return 1 + 2 * (size_t) frames;
+}
+
+size_t
+Codec_encode(const int16_t *in, nframes_t frames, uint8_t *out)
+{
+    uint32_t u[CODEC_PARTITION];
+    uint64_t sums[CODEC_MAX_ORDER + 1] = { 0 };
+    int order, best = 0, k;
+    nframes_t i, p;
+    BitWriter w;
+
+    if (frames <= CODEC_MAX_ORDER) {
+        return encode_raw(in, frames, out);
+    }
+    for (i = 1; i < frames && in[i] == in[0]; i++)
+        ;
+    if (i == frames) {
+        out[0] = CODEC_CONSTANT;
+        out[1] = (uint8_t) (in[0] & 0xff);
+        out[2] = (uint8_t) ((uint16_t) in[0] >> 8);
+        return 3;
+    }
+
+    /* pick the predictor with the smallest residual */
+    for (order = 0; order <= CODEC_MAX_ORDER; order++) {
+        for (i = CODEC_MAX_ORDER; i < frames; i++) {
+            int32_t res = in[i] - predict(in, i, order);
+            sums[order] += res < 0 ? -res : res;
+        }
+        if (sums[order] < sums[best]) {
+            best = order;
+        }
+    }
+
+    w.out = out;
+    w.pos = 0;
+    w.acc = 0;
+    w.bits = 0;
+    put_bits(&w, CODEC_FIXED + best, 8);
+    for (i = 0; i < (nframes_t) best; i++) {
+        put_bits(&w, (uint16_t) in[i] & 0xff, 8);
+        put_bits(&w, (uint16_t) in[i] >> 8, 8);
+    }
+
+    for (p = best; p < frames; p += CODEC_PARTITION) {
+        nframes_t n = frames - p < CODEC_PARTITION ? frames - p : CODEC_PARTITION;
+        uint64_t sum = 0, cost, best_cost;
+        int best_k = CODEC_ESCAPE, estimate = 0;
+        for (i = 0; i < n; i++) {
+            u[i] = zigzag(in[p + i] - predict(in, p + i, best));
+            sum += u[i];
+        }
+        /* the optimal parameter is close to log2 of the mean */
+        while (estimate < CODEC_MAX_RICE && ((uint64_t) n << (estimate + 1)) <= sum) {
+            estimate++;
+        }
+        best_cost = (uint64_t) n * CODEC_ESCAPE_BITS;
+        for (k = estimate > 0 ? estimate - 1 : 0;
+             k <= estimate + 1 && k <= CODEC_MAX_RICE; k++) {
+            cost = rice_cost(u, n, k);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_k = k;
+            }
+        }
+        /* give up as soon as we know raw is smaller */
+        if (w.pos + 8 + best_cost / 8 >= Codec_max_size(frames)) {
+            return encode_raw(in, frames, out);
+        }
+        put_bits(&w, best_k, 5);
+        for (i = 0; i < n; i++) {
+            if (best_k == CODEC_ESCAPE) {
+                put_bits(&w, u[i], CODEC_ESCAPE_BITS);
+            } else {
+                put_rice(&w, u[i], best_k);
+            }
+        }
+    }
+    flush_bits(&w);
+
+    if (w.pos >= Codec_max_size(frames)) {
+        return encode_raw(in, frames, out);
+    }
+    return w.pos;
+}
+
+int
+Codec_decode(const uint8_t *in, size_t len, int16_t *out, nframes_t frames)
+{
+    nframes_t i, p;
+    int order;
+    BitReader r;
+
+    if (len < 1) {
+        return 1;
+    }
+    if (in[0] == CODEC_RAW) {
+        if (len < Codec_max_size(frames)) {
+            return 1;
+        }
+        for (i = 0; i < frames; i++) {
+            out[i] = (int16_t) (in[1 + 2 * i] | (in[2 + 2 * i] << 8));
+        }
+        return 0;
+    }
+    if (in[0] == CODEC_CONSTANT) {
+        if (len < 3) {
+            return 1;
+        }
+        for (i = 0; i < frames; i++) {
+            out[i] = (int16_t) (in[1] | (in[2] << 8));
+        }
+        return 0;
+    }
+
+    order = in[0] - CODEC_FIXED;
+    if (order < 0 || order > CODEC_MAX_ORDER ||
+        len < 1 + 2 * (size_t) order || frames <= CODEC_MAX_ORDER) {
+        return 1;
+    }
+    for (i = 0; i < (nframes_t) order; i++) {
+        out[i] = (int16_t) (in[1 + 2 * i] | (in[2 + 2 * i] << 8));
+    }
+
+    r.in = in;
+    r.pos = 1 + 2 * order;
+    r.len = len;
+    r.acc = 0;
+    r.bits = 0;
+
+    for (p = order; p < frames; p += CODEC_PARTITION) {
+        nframes_t n = frames - p < CODEC_PARTITION ? frames - p : CODEC_PARTITION;
+        uint32_t k, u;
+        if (get_bits(&r, 5, &k)) {
+            return 1;
+        }
+        for (i = p; i < p + n; i++) {
+            int err = k == CODEC_ESCAPE
+                ? get_bits(&r, CODEC_ESCAPE_BITS, &u)
+                : get_rice(&r, (int) k, &u);
+            if (err) {
+                return 1;
+            }
+            out[i] = (int16_t) (unzigzag(u) + predict(out, i, order));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+/**
+ * Lossless block codec for 16-bit audio
+ *
+ * Each block is coded independently, so any block of a sample can
+ * be decoded without touching the ones before it. A block holds
+ * the residual of a fixed polynomial predictor (order 0 to 2, like
+ * FLAC's fixed predictors) Rice coded in partitions of
+ * CODEC_PARTITION samples, each with its own Rice parameter.
+ * Blocks of a single repeated value (silence) take three bytes,
+ * and blocks that do not compress are stored raw.
+ */
+#ifndef CODEC_H_INCLUDED
+#define CODEC_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lightning.h"
+
+#define CODEC_PARTITION 256
+
+/**
+ * Bytes needed to encode a block of @a frames samples in the
+ * worst case.
+ */
+size_t
+Codec_max_size(nframes_t frames);
+
+/**
+ * Encode @a frames samples from @a in.
+ * @a out must hold at least Codec_max_size(@a frames) bytes.
+ *
+ * @return bytes written to @a out
+ */
+size_t
+Codec_encode(const int16_t *in, nframes_t frames, uint8_t *out);
+
+/**
+ * Decode a block of @a frames samples that was encoded to
+ * @a len bytes.
+ *
+ * @return 0 on success, nonzero if the block is corrupt
+ */
+int
+Codec_decode(const uint8_t *in, size_t len, int16_t *out, nframes_t frames);
+
+#endif
@@ -0,0 +1,105 @@
+package lightning
+
+import (
+	"math"
+	"math/rand"
+	"testing"
+)
+
+func TestCodecIsLossless(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	random := make([]int16, 4096)
+	for i := range random {
+		random[i] = int16(rng.Intn(65536) - 32768)
+	}
+	extremes := make([]int16, 4096)
+	for i := range extremes {
+		// the largest steps the predictors can see
+		if i/3%2 == 0 {
+			extremes[i] = 32767
+		} else {
+			extremes[i] = -32768
+		}
+	}
+	sine := make([]int16, 1000)
+	for i := range sine {
+		sine[i] = int16(20000 * slowSine(i))
+	}
+	for name, in := range map[string][]int16{
+		"random":   random,
+		"extremes": extremes,
+		"silence":  make([]int16, 4096),
+		"sine":     sine,
+		"short":    {1, -1, 32767},
+		"single":   {-32768},
+	} {
+		out, size, err := codecRoundTrip(in)
+		if err != nil {
+			t.Fatalf("%s: %v", name, err)
+		}
+		for i := range in {
+			if out[i] != in[i] {
+				t.Fatalf("%s: sample %d decoded as %d, want %d", name, i, out[i], in[i])
+			}
+		}
+		if name == "silence" && size > 3 {
+			t.Errorf("silence took %d bytes, want 3", size)
+		}
+	}
+}
+
+func TestBlocksDecodeAhead(t *testing.T) {
+	// a few blocks and a short one, so the decoder wraps its slots
+	const frames = 9*4096 + 1234
+	rng := rand.New(rand.NewSource(2))
+	channels := [][]float32{make([]float32, frames), make([]float32, frames)}
+	want := [][]int16{make([]int16, frames), make([]int16, frames)}
+	for i := 0; i < frames; i++ {
+		want[0][i] = int16(12000 * slowSine(i))
+		want[1][i] = int16(rng.Intn(65536) - 32768)
+		for ch := range channels {
+			channels[ch][i] = float32(want[ch][i]) / 32768
+		}
+	}
+	blocks, err := compressBlocks(channels)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer blocks.free()
+	if blocks.count() != 10 {
+		t.Fatalf("%d frames make %d blocks, want 10", frames, blocks.count())
+	}
+	for ch := range want {
+		for b := 0; b < blocks.count(); b++ {
+			data, err := blocks.decode(ch, b)
+			if err != nil {
+				t.Fatal(err)
+			}
+			for i := range data {
+				if data[i] != want[ch][b*4096+i] {
+					t.Fatalf("channel %d block %d frame %d decoded as %d, want %d",
+						ch, b, i, data[i], want[ch][b*4096+i])
+				}
+			}
+		}
+	}
+	got, err := blocks.decodeAhead()
+	if err != nil {
+		t.Fatal(err)
+	}
+	for ch := range want {
+		if len(got[ch]) != frames {
+			t.Fatalf("channel %d decoded %d frames, want %d", ch, len(got[ch]), frames)
+		}
+		for i := range got[ch] {
+			if got[ch][i] != want[ch][i] {
+				t.Fatalf("channel %d frame %d decoded as %d, want %d", ch, i, got[ch][i], want[ch][i])
+			}
+		}
+	}
+}
+
+// slowSine is a sine slow enough for the predictors to compress well
+func slowSine(i int) float64 {
+	return math.Sin(float64(i) * 0.01)
+}
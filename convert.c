@@ -0,0 +1,254 @@
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include "convert.h"
+#include "lightning.h"
+
+size_t
+Convert_size(SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat_INT16:
+    case SampleFormat_FLOAT16:
+        return 2;
+    case SampleFormat_FLOAT32:
+        return SAMPLE_SIZE;
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+static uint16_t
+float_to_half(float f)
+{
+    union { uint32_t u; float f; } v;
+    v.f = f;
+    uint32_t sign = (v.u >> 16) & 0x8000;
+    uint32_t exp = (v.u >> 23) & 0xff;
+    uint32_t mant = v.u & 0x7fffff;
+    int32_t e = (int32_t) exp - 112;
+
+    if (exp == 0xff) {
+        /* inf or nan */
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    } else if (e >= 0x1f) {
+        /* overflow */
+        return sign | 0x7c00;
+    } else if (e <= 0) {
+        /* subnormal or zero */
+        if (e < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = 14 - e;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) {
+            h++;
+        }
+        return sign | h;
+    } else {
+        /* round to nearest even, carries into the exponent
+           (and to inf) on their own */
+        uint32_t h = ((uint32_t) e << 10) | (mant >> 13);
+        uint32_t rem = mant & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) {
+            h++;
+        }
+        return sign | h;
+    }
+}
+
+static void
+int16_to_float(sample_t *dst, const int16_t *src, nframes_t frames,
+               sample_t gain)
+{
+    nframes_t i = 0;
+    const sample_t scale = gain * (1.0f / 32768.0f);
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(scale);
+    for ( ; i + 8 <= frames; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        /* sign extend to 32 bits by unpacking into the high halves */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        dst[i] = src[i] * scale;
+    }
+}
+
+static void
+half_to_float(sample_t *dst, const uint16_t *src, nframes_t frames,
+              sample_t gain)
+{
+    nframes_t i = 0;
+#ifdef __F16C__
+    const __m128 vgain = _mm_set1_ps(gain);
+    for ( ; i + 4 <= frames; i += 4) {
+        __m128i h = _mm_loadl_epi64((const __m128i *) (src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtph_ps(h), vgain));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        dst[i] = gain * Convert_half_to_float(src[i]);
+    }
+}
+
+static void
+float_to_float(sample_t *dst, const sample_t *src, nframes_t frames,
+               sample_t gain)
+{
+    nframes_t i = 0;
+#ifdef __SSE2__
+    const __m128 vgain = _mm_set1_ps(gain);
+    for ( ; i + 4 <= frames; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), vgain));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        dst[i] = gain * src[i];
+    }
+}
+
+void
+Convert_to_float(sample_t *dst, const void *src, SampleFormat format,
+                 nframes_t offset, nframes_t frames, sample_t gain)
+{
+    switch (format) {
+    case SampleFormat_INT16:
+        int16_to_float(dst, (const int16_t *) src + offset, frames, gain);
+        break;
+    case SampleFormat_FLOAT16:
+        half_to_float(dst, (const uint16_t *) src + offset, frames, gain);
+        break;
+    default:
+        float_to_float(dst, (const sample_t *) src + offset, frames, gain);
+        break;
+    }
+}
+
+static void
+int16_to_float_stereo(sample_t *left, sample_t *right, const int16_t *src,
+                      nframes_t frames, sample_t gain)
+{
+    nframes_t i = 0;
+    const sample_t scale = gain * (1.0f / 32768.0f);
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(scale);
+    for ( ; i + 4 <= frames; i += 4) {
+        /* L0 R0 L1 R1 L2 R2 L3 R3 */
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        _mm_storeu_ps(left + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), vscale));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), vscale));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        left[i] = src[2 * i] * scale;
+        right[i] = src[2 * i + 1] * scale;
+    }
+}
+
+static void
+half_to_float_stereo(sample_t *left, sample_t *right, const uint16_t *src,
+                     nframes_t frames, sample_t gain)
+{
+    nframes_t i = 0;
+#ifdef __F16C__
+    const __m128 vgain = _mm_set1_ps(gain);
+    for ( ; i + 4 <= frames; i += 4) {
+        __m128i h = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+        __m128 lo = _mm_cvtph_ps(h);
+        __m128 hi = _mm_cvtph_ps(_mm_unpackhi_epi64(h, h));
+        _mm_storeu_ps(left + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), vgain));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), vgain));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        left[i] = gain * Convert_half_to_float(src[2 * i]);
+        right[i] = gain * Convert_half_to_float(src[2 * i + 1]);
+    }
+}
+
+static void
+float_to_float_stereo(sample_t *left, sample_t *right, const sample_t *src,
+                      nframes_t frames, sample_t gain)
+{
+    nframes_t i = 0;
+#ifdef __SSE2__
+    const __m128 vgain = _mm_set1_ps(gain);
+    for ( ; i + 4 <= frames; i += 4) {
+        __m128 a = _mm_loadu_ps(src + 2 * i);
+        __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+        _mm_storeu_ps(left + i, _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), vgain));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), vgain));
+    }
+#endif
+    for ( ; i < frames; i++) {
+        left[i] = gain * src[2 * i];
+        right[i] = gain * src[2 * i + 1];
+    }
+}
+
+void
+Convert_to_float_stereo(sample_t *left, sample_t *right, const void *src,
+                        SampleFormat format, nframes_t offset,
+                        nframes_t frames, sample_t gain)
+{
+    switch (format) {
+    case SampleFormat_INT16:
+        int16_to_float_stereo(left, right, (const int16_t *) src + 2 * offset,
+                              frames, gain);
+        break;
+    case SampleFormat_FLOAT16:
+        half_to_float_stereo(left, right, (const uint16_t *) src + 2 * offset,
+                             frames, gain);
+        break;
+    default:
+        float_to_float_stereo(left, right, (const sample_t *) src + 2 * offset,
+                              frames, gain);
+        break;
+    }
+}
+
+void
+Convert_from_float(void *dst, SampleFormat format,
+                   const sample_t *src, nframes_t frames)
+{
+    nframes_t i;
+    switch (format) {
+    case SampleFormat_INT16: {
+        int16_t *out = (int16_t *) dst;
+        for (i = 0; i < frames; i++) {
+            float v = roundf(src[i] * 32768.0f);
+            out[i] = v > 32767.0f ? 32767 : (v < -32768.0f ? -32768 : (int16_t) v);
+        }
+        break; }
+    case SampleFormat_FLOAT16: {
+        uint16_t *out = (uint16_t *) dst;
+        for (i = 0; i < frames; i++) {
+            out[i] = float_to_half(src[i]);
+        }
+        break; }
+    default:
+        memcpy(dst, src, frames * SAMPLE_SIZE);
+        break;
+    }
+}
@@ -0,0 +1,91 @@
+/**
+ * Sample format conversion
+ *
+ * Cached sample data can be stored as 32-bit float, 16-bit
+ * integer or 16-bit (half precision) float. These functions
+ * convert between the storage formats and sample_t, the format
+ * JACK and the mixing code work with. They are realtime safe.
+ */
+#ifndef CONVERT_H_INCLUDED
+#define CONVERT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lightning.h"
+
+/**
+ * Bytes per sample of a storage format.
+ * SampleFormat_AUTO is not a storage format.
+ */
+size_t
+Convert_size(SampleFormat format);
+
+/**
+ * Convert @a frames samples of @a format starting at
+ * @a src[@a offset] to sample_t, scaling them by @a gain.
+ */
+void
+Convert_to_float(sample_t *dst, const void *src, SampleFormat format,
+                 nframes_t offset, nframes_t frames, sample_t gain);
+
+/**
+ * Convert @a frames interleaved stereo frames of @a format
+ * starting at frame @a offset of @a src to a pair of sample_t
+ * buffers, scaling them by @a gain. Left and right are loaded
+ * together, so each frame touches a single memory stream.
+ */
+void
+Convert_to_float_stereo(sample_t *left, sample_t *right, const void *src,
+                        SampleFormat format, nframes_t offset,
+                        nframes_t frames, sample_t gain);
+
+/**
+ * Convert @a frames samples of sample_t to @a format, clipping
+ * if the format is an integer format.
+ */
+void
+Convert_from_float(void *dst, SampleFormat format,
+                   const sample_t *src, nframes_t frames);
+
+/**
+ * Convert a single half precision float.
+ */
+static inline sample_t
+Convert_half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    union { uint32_t u; float f; } v;
+    if (exp == 0) {
+        /* zero or subnormal */
+        v.f = (float) mant * (1.0f / 16777216.0f);
+        v.u |= sign;
+        return v.f;
+    } else if (exp == 0x1f) {
+        /* inf or nan */
+        v.u = sign | 0x7f800000 | (mant << 13);
+    } else {
+        v.u = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    return v.f;
+}
+
+/**
+ * Read one sample of @a format at @a src[@a index].
+ */
+static inline sample_t
+Convert_sample(const void *src, SampleFormat format, nframes_t index)
+{
+    switch (format) {
+    case SampleFormat_INT16:
+        return ((const int16_t *) src)[index] * (1.0f / 32768.0f);
+    case SampleFormat_FLOAT16:
+        return Convert_half_to_float(((const uint16_t *) src)[index]);
+    default:
+        return ((const sample_t *) src)[index];
+    }
+}
+
+#endif
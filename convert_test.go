@@ -0,0 +1,154 @@
+package lightning
+
+import (
+	"encoding/binary"
+	"math"
+	"testing"
+)
+
+// halfToFloat is the reference half precision decoder
+func halfToFloat(h uint16) float32 {
+	sign := uint32(h&0x8000) << 16
+	exp := uint32(h>>10) & 0x1f
+	mant := uint32(h & 0x3ff)
+	switch {
+	case exp == 0:
+		v := float32(mant) / (1 << 24)
+		if sign != 0 {
+			v = -v
+		}
+		return v
+	case exp == 0x1f:
+		return math.Float32frombits(sign | 0x7f800000 | mant<<13)
+	default:
+		return math.Float32frombits(sign | (exp+112)<<23 | mant<<13)
+	}
+}
+
+func sameFloat(a, b float32) bool {
+	return a == b || (a != a && b != b)
+}
+
+func TestInt16ToFloatMatchesScalar(t *testing.T) {
+	// odd lengths and offsets run the vector loop and its tail
+	src := make([]byte, 2*1031)
+	for i := 0; i < 1031; i++ {
+		binary.LittleEndian.PutUint16(src[2*i:], uint16(int16(i*67-34000)))
+	}
+	for _, gain := range []float32{1.0, 0.3} {
+		for _, offset := range []int{0, 3} {
+			got := convertToFloat(Int16, src, offset, 1021, gain)
+			scale := gain * (1.0 / 32768.0)
+			for i, v := range got {
+				s := int16(binary.LittleEndian.Uint16(src[2*(offset+i):]))
+				if want := float32(s) * scale; v != want {
+					t.Fatalf("gain %v offset %d sample %d: got %v, want %v", gain, offset, i, v, want)
+				}
+			}
+		}
+	}
+}
+
+func TestInt16RoundTrip(t *testing.T) {
+	src := make([]byte, 2*65536)
+	for i := 0; i < 65536; i++ {
+		binary.LittleEndian.PutUint16(src[2*i:], uint16(i))
+	}
+	back := convertFromFloat(Int16, convertToFloat(Int16, src, 0, 65536, 1.0))
+	for i := 0; i < 65536; i++ {
+		if got := binary.LittleEndian.Uint16(back[2*i:]); got != uint16(i) {
+			t.Fatalf("%d came back as %d", int16(i), int16(got))
+		}
+	}
+}
+
+func TestInt16Clips(t *testing.T) {
+	in := []float32{0, 0.5, -0.5, 1.0, -1.0, 2.0, -2.0, 1.0 / 65536}
+	want := []int16{0, 16384, -16384, 32767, -32768, 32767, -32768, 1}
+	out := convertFromFloat(Int16, in)
+	for i := range in {
+		if got := int16(binary.LittleEndian.Uint16(out[2*i:])); got != want[i] {
+			t.Errorf("%v: got %d, want %d", in[i], got, want[i])
+		}
+	}
+}
+
+func TestFloat16ToFloatMatchesScalar(t *testing.T) {
+	src := make([]byte, 2*65536)
+	for i := 0; i < 65536; i++ {
+		binary.LittleEndian.PutUint16(src[2*i:], uint16(i))
+	}
+	for _, gain := range []float32{1.0, 0.75} {
+		got := convertToFloat(Float16, src, 1, 65533, gain)
+		for i, v := range got {
+			if want := gain * halfToFloat(uint16(i+1)); !sameFloat(v, want) {
+				t.Fatalf("gain %v half %#04x: got %v, want %v", gain, i+1, v, want)
+			}
+		}
+	}
+}
+
+func TestFloat16RoundTrip(t *testing.T) {
+	src := make([]byte, 2*65536)
+	for i := 0; i < 65536; i++ {
+		binary.LittleEndian.PutUint16(src[2*i:], uint16(i))
+	}
+	back := convertFromFloat(Float16, convertToFloat(Float16, src, 0, 65536, 1.0))
+	for i := 0; i < 65536; i++ {
+		got := binary.LittleEndian.Uint16(back[2*i:])
+		if i&0x7c00 == 0x7c00 && i&0x3ff != 0 {
+			// every NaN comes back as a NaN
+			if got&0x7c00 != 0x7c00 || got&0x3ff == 0 {
+				t.Fatalf("NaN %#04x came back as %#04x", i, got)
+			}
+			continue
+		}
+		if got != uint16(i) {
+			t.Fatalf("%#04x came back as %#04x", i, got)
+		}
+	}
+}
+
+func TestFloat16Rounds(t *testing.T) {
+	in := []float32{
+		1 + 1.0/2048,    // half way, rounds to even
+		1 + 3.0/2048,    // half way, rounds to even
+		1 + 1.5/2048,    // rounds up
+		65504,           // largest half
+		65520,           // overflows
+		1.0 / (1 << 24), // smallest subnormal
+		1.0 / (1 << 26), // underflows
+		-2,
+	}
+	want := []uint16{0x3c00, 0x3c02, 0x3c01, 0x7bff, 0x7c00, 0x0001, 0x0000, 0xc000}
+	out := convertFromFloat(Float16, in)
+	for i := range in {
+		if got := binary.LittleEndian.Uint16(out[2*i:]); got != want[i] {
+			t.Errorf("%v: got %#04x, want %#04x", in[i], got, want[i])
+		}
+	}
+}
+
+func TestStereoMatchesPlanar(t *testing.T) {
+	const frames = 515
+	left := make([]float32, frames)
+	right := make([]float32, frames)
+	inter := make([]float32, 2*frames)
+	for i := 0; i < frames; i++ {
+		left[i] = float32(math.Sin(float64(i) * 0.01))
+		right[i] = float32(math.Cos(float64(i) * 0.03))
+		inter[2*i] = left[i]
+		inter[2*i+1] = right[i]
+	}
+	for _, format := range []SampleFormat{Float32, Int16, Float16} {
+		src := convertFromFloat(format, inter)
+		l, r := convertToFloatStereo(format, src, 2, frames-5, 0.5)
+		wantL := convertToFloat(format, convertFromFloat(format, left), 2, frames-5, 0.5)
+		wantR := convertToFloat(format, convertFromFloat(format, right), 2, frames-5, 0.5)
+		for i := range l {
+			if l[i] != wantL[i] || r[i] != wantR[i] {
+				t.Fatalf("format %d frame %d: got %v %v, want %v %v", format, i, l[i], r[i], wantL[i], wantR[i])
+			}
+		}
+	}
+}
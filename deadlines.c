@@ -0,0 +1,19 @@
+#include "deadlines.h"
+
+int
+Deadlines_insert(void **items, double *deadlines, int n, int max,
+                 void *item, double deadline)
+{
+    int i;
+    if (n == max && (n == 0 || deadline >= deadlines[n - 1])) {
+        return n;
+    }
+    i = n < max ? n++ : n - 1;
+    for (; i > 0 && deadlines[i - 1] > deadline; i--) {
+        items[i] = items[i - 1];
+        deadlines[i] = deadlines[i - 1];
+    }
+    items[i] = item;
+    deadlines[i] = deadline;
+    return n;
+}
@@ -0,0 +1,24 @@
+/**
+ * Earliest deadline first selection
+ *
+ * Picks the items with the earliest deadlines out of any number
+ * offered one at a time, keeping them in order of their deadlines
+ * in arrays of a fixed size.
+ */
+#ifndef DEADLINES_H_INCLUDED
+#define DEADLINES_H_INCLUDED
+
+/**
+ * Offer @a item, due at @a deadline, to the @a n items in @a items,
+ * whose deadlines are in @a deadlines in increasing order. It is
+ * put in its place if there are fewer than @a max items or it is
+ * due before the last, which is dropped to make room for it. Items
+ * with equal deadlines keep the order they were offered in.
+ *
+ * @return number of items now in @a items
+ */
+int
+Deadlines_insert(void **items, double *deadlines, int n, int max,
+                 void *item, double deadline);
+
+#endif
@@ -0,0 +1,218 @@
+#include <assert.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blocks.h"
+#include "decoder.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+#include "mutex.h"
+#include "thread.h"
+
+typedef struct Slot {
+    /* block held by this slot plus one, 0 if empty.
+       stored with release once the data is complete */
+    atomic_uint tag;
+    /* channels * BLOCKS_FRAMES decoded samples */
+    int16_t *data;
+} Slot;
+
+struct DecoderStream {
+    Decoder decoder;
+    Blocks blocks;
+    channels_t channels;
+    /* block the realtime thread is playing */
+    atomic_uint block;
+    /* block slot % DECODER_SLOTS lives in slot `slot` */
+    Slot slots[DECODER_SLOTS];
+    /* list of open streams (guarded by the decoder's mutex) */
+    DecoderStream prev;
+    DecoderStream next;
+};
+
+struct Decoder {
+    /* open streams, guarded by mutex */
+    DecoderStream streams;
+    Mutex mutex;
+    /* posted by the realtime thread when a stream moves on to
+       a new block. sem_post does not block or take a lock */
+    sem_t wake;
+    atomic_int running;
+    atomic_ulong underruns;
+    LightningThread thread;
+};
+
+static void *
+decode_ahead(void *arg);
+
+/**
+ * Decode the blocks @a stream will need next.
+ * Only slots that hold blocks more than one before the playing
+ * one are overwritten. The block just before it is left alone,
+ * as the realtime thread may still read it in the cycle it seeks
+ * past it, so it never sees a slot change under it.
+ */
+static void
+fill(DecoderStream stream)
+{
+    nframes_t count = Blocks_count(stream->blocks);
+    nframes_t first = atomic_load_explicit(&stream->block, memory_order_acquire);
+    nframes_t b;
+    channels_t chan;
+    for (b = first; b < first + DECODER_SLOTS - 1 && b < count; b++) {
+        Slot *slot = &stream->slots[b % DECODER_SLOTS];
+        if (atomic_load_explicit(&slot->tag, memory_order_relaxed) == b + 1) {
+            continue;
+        }
+        atomic_store_explicit(&slot->tag, 0, memory_order_relaxed);
+        for (chan = 0; chan < stream->channels; chan++) {
+            if (Blocks_decode(stream->blocks, chan, b,
+                              slot->data + chan * BLOCKS_FRAMES)) {
+                LOG(Error, "could not decode block %u", b);
+                break;
+            }
+        }
+        if (chan == stream->channels) {
+            atomic_store_explicit(&slot->tag, b + 1, memory_order_release);
+        }
+    }
+}
+
+Decoder
+Decoder_init(void)
+{
+    Decoder d;
+    NEW(d);
+    d->streams = NULL;
+    d->mutex = Mutex_init();
+    sem_init(&d->wake, 0, 0);
+    atomic_init(&d->running, 1);
+    atomic_init(&d->underruns, 0);
+    d->thread = LightningThread_create(decode_ahead, d);
+    return d;
+}
+
+DecoderStream
+Decoder_open(Decoder decoder, Blocks blocks)
+{
+    assert(decoder && blocks);
+    int i;
+    DecoderStream s;
+    NEW(s);
+    s->decoder = decoder;
+    s->blocks = blocks;
+    s->channels = Blocks_channels(blocks);
+    atomic_init(&s->block, 0);
+    for (i = 0; i < DECODER_SLOTS; i++) {
+        atomic_init(&s->slots[i].tag, 0);
+        s->slots[i].data = ALLOC(s->channels * BLOCKS_FRAMES * sizeof(int16_t));
+    }
+    /* prefill before anyone else can see the stream */
+    fill(s);
+    Mutex_lock(decoder->mutex);
+    s->prev = NULL;
+    s->next = decoder->streams;
+    if (decoder->streams) {
+        decoder->streams->prev = s;
+    }
+    decoder->streams = s;
+    Mutex_unlock(decoder->mutex);
+    return s;
+}
+
+unsigned long
+Decoder_underruns(Decoder decoder)
+{
+    assert(decoder);
+    return atomic_load(&decoder->underruns);
+}
+
+void
+DecoderStream_seek(DecoderStream stream, nframes_t block)
+{
+    assert(stream);
+    if (atomic_load_explicit(&stream->block, memory_order_relaxed) != block) {
+        atomic_store_explicit(&stream->block, block, memory_order_release);
+        sem_post(&stream->decoder->wake);
+    }
+}
+
+const int16_t *
+DecoderStream_block(DecoderStream stream, channels_t chan, nframes_t block)
+{
+    assert(stream && chan < stream->channels);
+    nframes_t first = atomic_load_explicit(&stream->block, memory_order_relaxed);
+    Slot *slot = &stream->slots[block % DECODER_SLOTS];
+    if (block + 1 >= first && block < first + DECODER_SLOTS - 1 &&
+        atomic_load_explicit(&slot->tag, memory_order_acquire) == block + 1) {
+        return slot->data + chan * BLOCKS_FRAMES;
+    }
+    atomic_fetch_add_explicit(&stream->decoder->underruns, 1,
+                              memory_order_relaxed);
+    return NULL;
+}
+
+void
+Decoder_close(DecoderStream *stream)
+{
+    assert(stream && *stream);
+    int i;
+    DecoderStream s = *stream;
+    Decoder d = s->decoder;
+    Mutex_lock(d->mutex);
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        d->streams = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    Mutex_unlock(d->mutex);
+    for (i = 0; i < DECODER_SLOTS; i++) {
+        FREE(s->slots[i].data);
+    }
+    FREE(*stream);
+}
+
+void
+Decoder_free(Decoder *decoder)
+{
+    assert(decoder && *decoder);
+    Decoder d = *decoder;
+    if (d->streams) {
+        LOG(Warn, "freeing a decoder with open streams (%p)", d->streams);
+    }
+    atomic_store(&d->running, 0);
+    sem_post(&d->wake);
+    LightningThread_join(d->thread);
+    LightningThread_free(&d->thread);
+    sem_destroy(&d->wake);
+    Mutex_free(&d->mutex);
+    FREE(*decoder);
+}
+
+static void *
+decode_ahead(void *arg)
+{
+    Decoder d = (Decoder) arg;
+    DecoderStream s;
+    while (atomic_load(&d->running)) {
+        if (sem_wait(&d->wake) != 0 && errno == EINTR) {
+            continue;
+        }
+        /* one pass serves every wakeup that has piled up */
+        while (sem_trywait(&d->wake) == 0)
+            ;
+        Mutex_lock(d->mutex);
+        for (s = d->streams; s != NULL; s = s->next) {
+            fill(s);
+        }
+        Mutex_unlock(d->mutex);
+    }
+    return NULL;
+}
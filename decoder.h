@@ -0,0 +1,82 @@
+/**
+ * Decode-ahead for block-compressed samples
+ *
+ * A Decoder owns a worker thread that keeps the next few blocks
+ * of every open stream decompressed in a small ring of slots, so
+ * the realtime thread only ever reads decoded PCM. The realtime
+ * thread tells a stream which block it is playing with
+ * DecoderStream_seek and reads blocks with DecoderStream_block,
+ * neither of which blocks or allocates.
+ */
+#ifndef DECODER_H_INCLUDED
+#define DECODER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "blocks.h"
+#include "lightning.h"
+
+/* blocks kept decoded for each stream: the one being played,
+   DECODER_SLOTS - 2 after it, and the one before it, which the
+   realtime thread may still be reading in the cycle it moves on */
+#define DECODER_SLOTS 5
+
+typedef struct Decoder *Decoder;
+
+typedef struct DecoderStream *DecoderStream;
+
+/**
+ * Start a decode-ahead worker.
+ */
+Decoder
+Decoder_init(void);
+
+/**
+ * Open a stream over @a blocks starting at block 0.
+ * The first DECODER_SLOTS - 1 blocks are decoded before this
+ * returns, so a voice can start playing immediately.
+ * Must not be called from the realtime thread.
+ */
+DecoderStream
+Decoder_open(Decoder decoder, Blocks blocks);
+
+/**
+ * Number of times the realtime thread asked for a block that
+ * had not been decoded yet.
+ */
+unsigned long
+Decoder_underruns(Decoder decoder);
+
+/**
+ * Tell the worker that @a block is being played, so the blocks
+ * after it should be decoded.
+ * Realtime safe.
+ */
+void
+DecoderStream_seek(DecoderStream stream, nframes_t block);
+
+/**
+ * Decoded samples of @a block for channel @a chan, or NULL if
+ * the block is not ready (which is counted as an underrun).
+ * Only blocks from the one before the last seek position up to
+ * DECODER_SLOTS - 2 blocks after it can be ready.
+ * Realtime safe.
+ */
+const int16_t *
+DecoderStream_block(DecoderStream stream, channels_t chan, nframes_t block);
+
+/**
+ * Close a stream and free its slots.
+ * Must not be called from the realtime thread.
+ */
+void
+Decoder_close(DecoderStream *stream);
+
+/**
+ * Stop the worker and free a Decoder.
+ * Every stream must have been closed.
+ */
+void
+Decoder_free(Decoder *decoder);
+
+#endif
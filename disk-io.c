@@ -0,0 +1,496 @@
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "deadlines.h"
+#include "disk-io.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+#include "mutex.h"
+#include "ringbuffer.h"
+#include "sf.h"
+#include "src.h"
+#include "thread.h"
+
+/* source frames read from disk at a time */
+#define DISK_CHUNK 4096
+
+/* frames of the file read at a time: half a ring, which is what
+   a stream is refilled with once its voice has used up half of
+   it. The read-ahead buffer is sized for float samples, so it
+   holds more frames than this of files in smaller formats */
+#define DISK_READAHEAD_FRAMES (DISK_RING_FRAMES / 2)
+
+/* streams served in one pass of the I/O thread, whose reads are
+   handed to the kernel together */
+#define DISK_BATCH 16
+
+/* the I/O thread looks at every stream at least this often,
+   even if nobody wakes it up */
+#define DISK_POLL_NS 20000000
+
+struct DiskStream {
+    DiskIO io;
+    SF sf;
+    /* output frames per second the voice plays through */
+    double rate;
+    /* when (on the monotonic clock) the voice will be done with
+       the frames before the stream and start reading it */
+    double lead_end;
+    /* read requests and bytes already added to the totals */
+    unsigned long reads;
+    uint64_t bytes;
+    /* channels in the file, and bytes per interleaved frame */
+    channels_t channels;
+    size_t frame_bytes;
+    double src_ratio;
+    /* converter for all channels (NULL without resampling) */
+    SRC src;
+    /* output frames still to be dropped before the start */
+    nframes_t skip;
+    /* output frames still to be delivered */
+    nframes_t remaining;
+    /* nonzero once the whole file has been read */
+    int eof;
+    /* set (with release) once everything is in the ringbuffer */
+    atomic_int done;
+    Ringbuffer ring;
+    /* interleaved source frames, of which in_pos are used up */
+    sample_t *inbuf;
+    nframes_t in_frames;
+    nframes_t in_pos;
+    /* resampled frames */
+    sample_t *interleaved;
+    /* list of open streams, nonzero while the I/O thread is
+       reading for the stream without holding the mutex, and
+       nonzero if DiskIO_close is waiting on served for it to
+       finish (all guarded by the DiskIO's mutex) */
+    DiskStream prev;
+    DiskStream next;
+    int busy;
+    int closing;
+    sem_t served;
+};
+
+struct DiskIO {
+    /* open streams, guarded by mutex */
+    DiskStream streams;
+    Mutex mutex;
+    /* posted by the realtime thread when a ringbuffer
+       runs low. sem_post does not block or take a lock */
+    sem_t wake;
+    atomic_int running;
+    LightningThread thread;
+    /* statistics, see LightningStreamStats */
+    atomic_ulong underruns;
+    atomic_ulong fill[LIGHTNING_FILL_BUCKETS];
+    atomic_ulong reads;
+    atomic_ullong bytes_read;
+    atomic_ulong min_slack_us;
+};
+
+static void *
+stream_from_disk(void *arg);
+
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Read the next chunk of the file if the last one is used up.
+ */
+static void
+read_chunk(DiskStream s)
+{
+    if (s->in_pos < s->in_frames || s->eof) {
+        return;
+    }
+    s->in_frames = SF_read(s->sf, s->inbuf, DISK_CHUNK);
+    s->in_pos = 0;
+    if (s->in_frames < DISK_CHUNK) {
+        s->eof = 1;
+    }
+}
+
+/**
+ * Convert one chunk of output and put it in the ringbuffer.
+ * The caller makes sure there is room for DISK_CHUNK frames.
+ *
+ * @return 0 if there may be more to do, nonzero if the stream
+ *         is finished or stuck
+ */
+static int
+produce(DiskStream s)
+{
+    int error;
+    nframes_t gen = 0, used = 0, first;
+    sample_t *interleaved;
+
+    read_chunk(s);
+    if (s->src == NULL) {
+        /* the file data can be used as it is */
+        gen = s->in_frames - s->in_pos;
+        gen = gen < DISK_CHUNK ? gen : DISK_CHUNK;
+        interleaved = s->inbuf + s->in_pos * s->channels;
+        used = gen;
+    } else {
+        /* one converter does every channel of the interleaved
+           frames at once */
+        AudioData data;
+        data.input = s->inbuf + s->in_pos * s->channels;
+        data.input_frames = s->in_frames - s->in_pos;
+        data.output = s->interleaved;
+        data.output_frames = DISK_CHUNK;
+        error = SRC_process_chunk(s->src, s->src_ratio, data,
+                                  s->eof, &used, &gen);
+        if (error) {
+            LOG(Error, "Error in sample rate conversion: %s",
+                SRC_strerror(error));
+            return 1;
+        }
+        interleaved = s->interleaved;
+    }
+    s->in_pos += used;
+
+    /* drop frames before the start (the converter needs them to
+       warm up) and frames past the end */
+    first = s->skip < gen ? s->skip : gen;
+    s->skip -= first;
+    gen = gen - first < s->remaining ? gen - first : s->remaining;
+    interleaved += first * s->channels;
+    Ringbuffer_write(s->ring, interleaved, gen * s->frame_bytes);
+    s->remaining -= gen;
+
+    if (s->remaining == 0 || (s->eof && s->in_pos == s->in_frames &&
+                              used == 0 && gen == 0 && first == 0)) {
+        return 1;
+    }
+    /* no progress without more input means the converter is
+       waiting for data we don't have */
+    return used == 0 && gen == 0 && first == 0 && s->in_pos < s->in_frames;
+}
+
+/**
+ * Seconds until the voice reading @a s runs out of data, if
+ * nothing more is read for it.
+ */
+static double
+slack(DiskStream s, double t)
+{
+    double buffered = Ringbuffer_read_space(s->ring) / s->frame_bytes;
+    double lead = s->lead_end > t ? s->lead_end - t : 0.0;
+    return lead + buffered / s->rate;
+}
+
+/**
+ * Find the (up to) DISK_BATCH streams with the earliest deadlines
+ * among those that have room for another chunk, put them in
+ * @a batch in order of their deadlines, and mark them busy.
+ * Called with the mutex held.
+ *
+ * @return number of streams in @a batch
+ */
+static int
+earliest(DiskIO io, double t, void **batch, double *deadlines)
+{
+    DiskStream s;
+    int i, n = 0;
+    for (s = io->streams; s != NULL; s = s->next) {
+        if (atomic_load_explicit(&s->done, memory_order_relaxed) ||
+            Ringbuffer_write_space(s->ring) < DISK_CHUNK * s->frame_bytes) {
+            continue;
+        }
+        n = Deadlines_insert(batch, deadlines, n, DISK_BATCH, s, slack(s, t));
+    }
+    for (i = 0; i < n; i++) {
+        s = batch[i];
+        s->busy = 1;
+    }
+    return n;
+}
+
+/**
+ * Read one chunk for @a s and update the statistics.
+ * Called without the mutex, with @a s marked busy so it is not
+ * freed in the meantime.
+ */
+static void
+serve(DiskIO io, DiskStream s, double deadline)
+{
+    unsigned long reads, slack_us = (unsigned long) (deadline * 1e6);
+    uint64_t bytes;
+    if (slack_us < atomic_load_explicit(&io->min_slack_us, memory_order_relaxed)) {
+        atomic_store_explicit(&io->min_slack_us, slack_us, memory_order_relaxed);
+    }
+    int finished = produce(s);
+    SF_io_stats(s->sf, &reads, &bytes);
+    atomic_fetch_add_explicit(&io->reads, reads - s->reads, memory_order_relaxed);
+    atomic_fetch_add_explicit(&io->bytes_read, bytes - s->bytes, memory_order_relaxed);
+    s->reads = reads;
+    s->bytes = bytes;
+    if (finished) {
+        atomic_store_explicit(&s->done, 1, memory_order_release);
+        SF_close(&s->sf);
+    }
+}
+
+DiskIO
+DiskIO_init(void)
+{
+    int i;
+    DiskIO io;
+    NEW(io);
+    io->streams = NULL;
+    io->mutex = Mutex_init();
+    sem_init(&io->wake, 0, 0);
+    atomic_init(&io->running, 1);
+    atomic_init(&io->underruns, 0);
+    for (i = 0; i < LIGHTNING_FILL_BUCKETS; i++) {
+        atomic_init(&io->fill[i], 0);
+    }
+    atomic_init(&io->reads, 0);
+    atomic_init(&io->bytes_read, 0);
+    atomic_init(&io->min_slack_us, ULONG_MAX);
+    io->thread = LightningThread_create(stream_from_disk, io);
+    return io;
+}
+
+DiskStream
+DiskIO_open(DiskIO io, const char *file, nframes_t output_sr,
+            nframes_t start, nframes_t frames, pitch_t pitch,
+            SRCQuality quality)
+{
+    assert(io && file);
+    DiskStream s;
+    SF sf = SF_open_stream(file);
+    if (sf == NULL) {
+        LOG(Warn, "could not open %s for streaming", file);
+        return NULL;
+    }
+    if (0 != SF_readahead(sf, (size_t) DISK_READAHEAD_FRAMES *
+                          SF_channels(sf) * SAMPLE_SIZE)) {
+        LOG(Warn, "could not allocate read-ahead for %s", file);
+    }
+    NEW(s);
+    s->io = io;
+    s->sf = sf;
+    s->rate = output_sr * fabs(pitch);
+    s->lead_end = now() + start / s->rate;
+    s->reads = 0;
+    s->bytes = 0;
+    s->channels = SF_channels(sf);
+    s->frame_bytes = s->channels * SAMPLE_SIZE;
+    s->src_ratio = output_sr / (double) SF_samplerate(sf);
+    s->remaining = frames;
+    s->eof = 0;
+    atomic_init(&s->done, 0);
+    s->in_frames = s->in_pos = 0;
+    /* without resampling we can seek straight to the start,
+       otherwise the converter is run from the top of the file
+       so its output lines up exactly with what came before */
+    if (s->src_ratio == 1.0 && SF_seek(sf, start) == 0) {
+        s->skip = 0;
+    } else {
+        s->skip = start;
+    }
+    s->ring = Ringbuffer_init(DISK_RING_FRAMES * s->frame_bytes);
+    if (0 != Ringbuffer_mlock(s->ring)) {
+        LOG(Warn, "Could not %s stream ringbuffer", "mlock");
+    }
+    s->inbuf = ALLOC(DISK_CHUNK * s->frame_bytes);
+    s->src = NULL;
+    s->interleaved = NULL;
+    if (s->src_ratio != 1.0) {
+        s->src = SRC_init(quality, s->channels);
+        s->interleaved = ALLOC(DISK_CHUNK * s->frame_bytes);
+    }
+    s->busy = 0;
+    s->closing = 0;
+    sem_init(&s->served, 0, 0);
+    Mutex_lock(io->mutex);
+    s->prev = NULL;
+    s->next = io->streams;
+    if (io->streams) {
+        io->streams->prev = s;
+    }
+    io->streams = s;
+    Mutex_unlock(io->mutex);
+    sem_post(&io->wake);
+    return s;
+}
+
+void
+DiskIO_stats(DiskIO io, LightningStreamStats *stats)
+{
+    assert(io && stats);
+    int i;
+    unsigned long slack_us;
+    DiskStream s;
+    stats->streams = 0;
+    Mutex_lock(io->mutex);
+    for (s = io->streams; s != NULL; s = s->next) {
+        stats->streams++;
+    }
+    Mutex_unlock(io->mutex);
+    stats->underruns = atomic_load(&io->underruns);
+    for (i = 0; i < LIGHTNING_FILL_BUCKETS; i++) {
+        stats->fill[i] = atomic_load(&io->fill[i]);
+    }
+    stats->reads = atomic_load(&io->reads);
+    stats->bytes_read = atomic_load(&io->bytes_read);
+    slack_us = atomic_load(&io->min_slack_us);
+    stats->min_slack_ms = slack_us == ULONG_MAX ? -1.0 : slack_us / 1000.0;
+}
+
+channels_t
+DiskStream_channels(DiskStream stream)
+{
+    assert(stream);
+    return stream->channels;
+}
+
+nframes_t
+DiskStream_read(DiskStream stream, sample_t *buf, nframes_t frames)
+{
+    assert(stream);
+    /* check done first, so a stream that finishes between the
+       two loads isn't mistaken for an underrun */
+    int done = atomic_load_explicit(&stream->done, memory_order_acquire);
+    size_t space = Ringbuffer_read_space(stream->ring) / stream->frame_bytes;
+    nframes_t n = space < frames ? space : frames;
+    Ringbuffer_read(stream->ring, (char *) buf, n * stream->frame_bytes);
+    if (!done) {
+        size_t bucket = space * LIGHTNING_FILL_BUCKETS / DISK_RING_FRAMES;
+        bucket = bucket < LIGHTNING_FILL_BUCKETS ? bucket : LIGHTNING_FILL_BUCKETS - 1;
+        atomic_fetch_add_explicit(&stream->io->fill[bucket], 1,
+                                  memory_order_relaxed);
+        if (n < frames) {
+            atomic_fetch_add_explicit(&stream->io->underruns, 1,
+                                      memory_order_relaxed);
+        }
+    }
+    if (!done && space - n < DISK_RING_FRAMES / 2) {
+        sem_post(&stream->io->wake);
+    }
+    return n;
+}
+
+void
+DiskIO_close(DiskStream *stream)
+{
+    assert(stream && *stream);
+    DiskStream s = *stream;
+    DiskIO io = s->io;
+    Mutex_lock(io->mutex);
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        io->streams = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    if (s->busy) {
+        /* the I/O thread is reading for it */
+        s->closing = 1;
+        Mutex_unlock(io->mutex);
+        while (sem_wait(&s->served) != 0 && errno == EINTR)
+            ;
+    } else {
+        Mutex_unlock(io->mutex);
+    }
+    sem_destroy(&s->served);
+    if (s->sf) {
+        SF_close(&s->sf);
+    }
+    Ringbuffer_free(&s->ring);
+    FREE(s->inbuf);
+    FREE(s->interleaved);
+    if (s->src) {
+        SRC_free(&s->src);
+    }
+    FREE(*stream);
+}
+
+void
+DiskIO_free(DiskIO *io)
+{
+    assert(io && *io);
+    DiskIO d = *io;
+    if (d->streams) {
+        LOG(Warn, "freeing disk I/O with open streams (%p)", d->streams);
+    }
+    atomic_store(&d->running, 0);
+    sem_post(&d->wake);
+    LightningThread_join(d->thread);
+    LightningThread_free(&d->thread);
+    sem_destroy(&d->wake);
+    Mutex_free(&d->mutex);
+    FREE(*io);
+}
+
+/**
+ * The I/O thread serves streams one chunk at a time in order of
+ * their deadlines (the time their voice will run out of data),
+ * until every ringbuffer is full. Each pass takes the DISK_BATCH
+ * earliest streams and asks the kernel for the reads of all of
+ * them before decoding any, so it can order and merge them, then
+ * serves them in deadline order. The mutex is only held to pick
+ * streams and to let them go, not while reading for them, so
+ * streams can be opened and closed while the disk is busy.
+ */
+static void *
+stream_from_disk(void *arg)
+{
+    DiskIO io = (DiskIO) arg;
+    void *batch[DISK_BATCH];
+    double deadlines[DISK_BATCH];
+    DiskStream s;
+    int i, n;
+    struct timespec timeout;
+    while (atomic_load(&io->running)) {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += DISK_POLL_NS;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        if (sem_timedwait(&io->wake, &timeout) != 0 && errno == EINTR) {
+            continue;
+        }
+        while (sem_trywait(&io->wake) == 0)
+            ;
+        do {
+            Mutex_lock(io->mutex);
+            n = earliest(io, now(), batch, deadlines);
+            Mutex_unlock(io->mutex);
+            for (i = 0; i < n; i++) {
+                s = batch[i];
+                SF_prefetch(s->sf);
+            }
+            for (i = 0; i < n; i++) {
+                s = batch[i];
+                serve(io, s, deadlines[i]);
+                Mutex_lock(io->mutex);
+                s->busy = 0;
+                if (s->closing) {
+                    sem_post(&s->served);
+                }
+                Mutex_unlock(io->mutex);
+            }
+        } while (n > 0 && atomic_load(&io->running));
+    }
+    return NULL;
+}
@@ -0,0 +1,96 @@
+/**
+ * Background disk streaming
+ *
+ * A DiskIO owns an I/O thread that keeps a ringbuffer of decoded,
+ * resampled, interleaved frames filled for every open stream. The
+ * realtime thread reads frames with DiskStream_read, which never
+ * blocks: if the I/O thread has fallen behind it gets fewer frames
+ * than it asked for.
+ *
+ * Reads are scheduled earliest deadline first: the stream whose
+ * voice will run out of data soonest is always served next, one
+ * chunk at a time, and files are read in large aligned requests
+ * (see SF_open_stream). The reads of the streams due next are
+ * handed to the kernel together before any of them is waited for.
+ * Disk reads are done without holding the lock that opening and
+ * closing streams take.
+ *
+ * Each stream costs about 225 KB per channel of its file: a
+ * ringbuffer of DISK_RING_FRAMES frames (128 KB), a read-ahead
+ * window of half of that (64 KB), and a chunk of file frames and
+ * of resampled frames (16 KB each).
+ */
+#ifndef DISK_IO_H_INCLUDED
+#define DISK_IO_H_INCLUDED
+
+#include "lightning.h"
+
+/* frames of audio buffered ahead of each stream */
+#define DISK_RING_FRAMES 32768
+
+typedef struct DiskIO *DiskIO;
+
+typedef struct DiskStream *DiskStream;
+
+/**
+ * Start an I/O thread.
+ */
+DiskIO
+DiskIO_init(void);
+
+/**
+ * Open @a file for streaming at @a output_samplerate, starting
+ * at output frame @a start. At most @a frames output frames are
+ * delivered. The voice is expected to play the @a start frames
+ * before the stream (from a head kept in RAM) first, at @a pitch,
+ * which is what its deadlines are worked out from.
+ * Resampling (if the file is not at @a output_samplerate) uses
+ * a converter of @a quality.
+ * The ringbuffer is filled by the I/O thread, so this does not
+ * read anything itself.
+ * Must not be called from the realtime thread.
+ *
+ * @return DiskStream, or NULL if @a file could not be opened
+ */
+DiskStream
+DiskIO_open(DiskIO io, const char *file, nframes_t output_samplerate,
+            nframes_t start, nframes_t frames, pitch_t pitch,
+            SRCQuality quality);
+
+/**
+ * Get streaming statistics.
+ */
+void
+DiskIO_stats(DiskIO io, LightningStreamStats *stats);
+
+/**
+ * Number of channels in each frame of @a stream (the number of
+ * channels in its file).
+ */
+channels_t
+DiskStream_channels(DiskStream stream);
+
+/**
+ * Read up to @a frames interleaved frames into @a buf.
+ * Realtime safe.
+ *
+ * @return number of frames read
+ */
+nframes_t
+DiskStream_read(DiskStream stream, sample_t *buf, nframes_t frames);
+
+/**
+ * Close a stream.
+ * Must not be called from the realtime thread.
+ */
+void
+DiskIO_close(DiskStream *stream);
+
+/**
+ * Stop the I/O thread and free a DiskIO.
+ * Every stream must have been closed.
+ */
+void
+DiskIO_free(DiskIO *io);
+
+#endif
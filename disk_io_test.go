@@ -0,0 +1,97 @@
+package lightning
+
+import (
+	"math/rand"
+	"path/filepath"
+	"sort"
+	"testing"
+	"time"
+)
+
+func TestDeadlinesKeepEarliestInOrder(t *testing.T) {
+	rng := rand.New(rand.NewSource(3))
+	for _, count := range []int{0, 1, 5, 16, 17, 100} {
+		for _, max := range []int{1, 4, 16} {
+			deadlines := make([]float64, count)
+			for i := range deadlines {
+				// few distinct values, so some are equal
+				deadlines[i] = float64(rng.Intn(10))
+			}
+			want := make([]int, count)
+			for i := range want {
+				want[i] = i
+			}
+			sort.SliceStable(want, func(a, b int) bool { return deadlines[want[a]] < deadlines[want[b]] })
+			if len(want) > max {
+				want = want[:max]
+			}
+			got := deadlinesInsert(deadlines, max)
+			if len(got) != len(want) {
+				t.Fatalf("%d of %d deadlines kept %d, want %d", max, count, len(got), len(want))
+			}
+			for i := range want {
+				if got[i] != want[i] {
+					t.Fatalf("%d of %d deadlines %v kept %v, want %v", max, count, deadlines, got, want)
+				}
+			}
+		}
+	}
+}
+
+func TestDiskStreamCountsUnderruns(t *testing.T) {
+	const frames = 3*diskRingFrames + 1000
+	file := filepath.Join(t.TempDir(), "stream.wav")
+	channels := [][]float32{make([]float32, frames), make([]float32, frames)}
+	for i := 0; i < frames; i++ {
+		channels[0][i] = float32(i) / frames
+		channels[1][i] = -float32(i) / frames
+	}
+	writeWAV(t, file, 48000, channels)
+	io := newDiskIO()
+	defer io.free()
+	stream, err := io.open(file, 48000, frames)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if stats := io.stats(); stats.Streams != 1 || stats.Underruns != 0 {
+		t.Fatalf("after opening a stream: %d streams, %d underruns, want 1 and 0",
+			stats.Streams, stats.Underruns)
+	}
+
+	// more than the ringbuffer holds can never be there
+	var got []float32
+	got = append(got, stream.read(diskRingFrames+1)...)
+	short := 1
+	for len(got) < 2*frames {
+		data := stream.read(1024)
+		if len(data) < 2*1024 && len(got)+len(data) < 2*frames {
+			short++
+		}
+		got = append(got, data...)
+		time.Sleep(time.Millisecond)
+	}
+	if underruns := io.stats().Underruns; underruns != uint64(short) {
+		t.Fatalf("%d reads came up short, but %d underruns were counted", short, underruns)
+	}
+	for i := 0; i < frames; i++ {
+		if got[2*i] != channels[0][i] || got[2*i+1] != channels[1][i] {
+			t.Fatalf("frame %d streamed as %v %v, want %v %v",
+				i, got[2*i], got[2*i+1], channels[0][i], channels[1][i])
+		}
+	}
+
+	// the end of the stream is not an underrun
+	time.Sleep(50 * time.Millisecond)
+	for i := 0; i < 3; i++ {
+		if data := stream.read(1024); len(data) != 0 {
+			t.Fatalf("read %d samples past the end", len(data))
+		}
+	}
+	if underruns := io.stats().Underruns; underruns != uint64(short) {
+		t.Fatalf("reading past the end counted %d underruns", underruns-uint64(short))
+	}
+	stream.close()
+	if streams := io.stats().Streams; streams != 0 {
+		t.Fatalf("%d streams open after closing the last", streams)
+	}
+}
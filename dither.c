@@ -0,0 +1,206 @@
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dither.h"
+#include "lightning.h"
+#include "mem.h"
+
+/* frames dithered at a time */
+#define DITHER_CHUNK_FRAMES 256
+
+/* random number generators, each a lane of a vector */
+#define DITHER_LANES 4
+
+/* taps of the noise shaping filter, which puts the noise about
+   12dB under flat TPDF at low frequencies and 11dB over it at
+   the Nyquist frequency (Wannamaker's three tap filter) */
+#define DITHER_SHAPE_1 1.623f
+#define DITHER_SHAPE_2 -0.982f
+#define DITHER_SHAPE_3 0.109f
+
+struct Dither {
+    channels_t channels;
+    /* samples are scaled to steps of one, clipped to
+       [min, max] and shifted left by shift */
+    sample_t scale;
+    sample_t min;
+    sample_t max;
+    int shift;
+    int shaped;
+    /* xorshift state of each lane */
+    uint32_t state[DITHER_LANES];
+    /* dither for a chunk */
+    sample_t *noise;
+    /* the last three errors of each channel, newest first */
+    sample_t *error;
+};
+
+Dither
+Dither_init(channels_t channels, int bits, int shaped)
+{
+    assert(channels > 0 && (bits == 16 || bits == 24));
+    Dither d;
+    int lane;
+    NEW(d);
+    d->channels = channels;
+    d->scale = (sample_t) (1 << (bits - 1));
+    d->min = -d->scale;
+    d->max = d->scale - 1.0f;
+    d->shift = 32 - bits;
+    d->shaped = shaped;
+    for (lane = 0; lane < DITHER_LANES; lane++) {
+        /* any seed but zero will do */
+        d->state[lane] = 0x9e3779b9u * (uint32_t) (lane + 1);
+    }
+    d->noise = ALLOC((DITHER_CHUNK_FRAMES * channels + DITHER_LANES) *
+                     SAMPLE_SIZE);
+    d->error = CALLOC(3 * channels, SAMPLE_SIZE);
+    return d;
+}
+
+/**
+ * Fill @a noise with @a n (rounded up to a whole number of
+ * vectors) TPDF dither values of up to one step either way.
+ */
+static void
+fill_noise(Dither d, sample_t *noise, size_t n)
+{
+    size_t i = 0;
+    int lane;
+    /* a uniform number in [-0.5, 0.5) from each 32 bit integer */
+    const sample_t unit = 1.0f / 4294967296.0f;
+#ifdef __SSE2__
+    const __m128 vunit = _mm_set1_ps(unit);
+    __m128i s = _mm_loadu_si128((const __m128i *) d->state);
+    __m128 u;
+    for ( ; i < n; i += DITHER_LANES) {
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+        s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+        u = _mm_cvtepi32_ps(s);
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+        s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+        s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+        u = _mm_add_ps(u, _mm_cvtepi32_ps(s));
+        _mm_storeu_ps(noise + i, _mm_mul_ps(u, vunit));
+    }
+    _mm_storeu_si128((__m128i *) d->state, s);
+#endif
+    for ( ; i < n; i += DITHER_LANES) {
+        for (lane = 0; lane < DITHER_LANES; lane++) {
+            uint32_t s = d->state[lane];
+            sample_t u;
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            u = (sample_t) (int32_t) s;
+            s ^= s << 13;
+            s ^= s >> 17;
+            s ^= s << 5;
+            u += (sample_t) (int32_t) s;
+            noise[i + lane] = u * unit;
+            d->state[lane] = s;
+        }
+    }
+}
+
+/**
+ * Clip @a v to [min, max] before it is converted, as converting
+ * a value out of range (or NaN) is undefined. NaN becomes min,
+ * which is what the vector path's max and min do with it.
+ */
+static inline int32_t
+quantize(Dither d, sample_t v)
+{
+    v = v > d->min ? v : d->min;
+    v = v < d->max ? v : d->max;
+    return (int32_t) ((uint32_t) lrintf(v) << d->shift);
+}
+
+static void
+dither_flat(Dither d, const sample_t *src, int32_t *dst, size_t n)
+{
+    size_t i = 0;
+    const sample_t *noise = d->noise;
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(d->scale);
+    const __m128 vmin = _mm_set1_ps(d->min);
+    const __m128 vmax = _mm_set1_ps(d->max);
+    const __m128i vshift = _mm_cvtsi32_si128(d->shift);
+    __m128 v;
+    for ( ; i + 4 <= n; i += 4) {
+        v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), vscale),
+                       _mm_loadu_ps(noise + i));
+        v = _mm_min_ps(_mm_max_ps(v, vmin), vmax);
+        /* rounds to nearest, like lrintf */
+        _mm_storeu_si128((__m128i *) (dst + i),
+                         _mm_sll_epi32(_mm_cvtps_epi32(v), vshift));
+    }
+#endif
+    for ( ; i < n; i++) {
+        dst[i] = quantize(d, src[i] * d->scale + noise[i]);
+    }
+}
+
+static void
+dither_shaped(Dither d, const sample_t *src, int32_t *dst, nframes_t frames)
+{
+    const channels_t channels = d->channels;
+    nframes_t frame;
+    channels_t chan;
+    sample_t v, q, *e;
+    size_t i = 0;
+    for (frame = 0; frame < frames; frame++) {
+        for (chan = 0; chan < channels; chan++, i++) {
+            e = d->error + 3 * chan;
+            v = src[i] * d->scale -
+                (DITHER_SHAPE_1 * e[0] + DITHER_SHAPE_2 * e[1] +
+                 DITHER_SHAPE_3 * e[2]);
+            /* rounded as a float, which can't overflow */
+            q = rintf(v + d->noise[i]);
+            /* the error before clipping, or clipping would feed
+               back into the filter and never die down. A sample
+               that is not finite would stay in it for good */
+            e[2] = e[1];
+            e[1] = e[0];
+            e[0] = isfinite(q) ? q - v : 0.0f;
+            dst[i] = quantize(d, q);
+        }
+    }
+}
+
+void
+Dither_process(Dither dither, const sample_t *src, int32_t *dst,
+               nframes_t frames)
+{
+    assert(dither && src && dst);
+    const channels_t channels = dither->channels;
+    nframes_t done, n;
+    for (done = 0; done < frames; done += n) {
+        n = frames - done;
+        n = n < DITHER_CHUNK_FRAMES ? n : DITHER_CHUNK_FRAMES;
+        fill_noise(dither, dither->noise, n * channels);
+        if (dither->shaped) {
+            dither_shaped(dither, src + done * channels,
+                          dst + done * channels, n);
+        } else {
+            dither_flat(dither, src + done * channels,
+                        dst + done * channels, n * channels);
+        }
+    }
+}
+
+void
+Dither_free(Dither *dither)
+{
+    assert(dither && *dither);
+    FREE((*dither)->noise);
+    FREE((*dither)->error);
+    FREE(*dither);
+}
@@ -0,0 +1,45 @@
+/**
+ * Dithering to integer samples
+ *
+ * Exports to 16 or 24-bit files quantize sample_t with triangular
+ * (TPDF) dither, two uniform random numbers summed, so the error
+ * is noise that does not depend on the signal instead of
+ * distortion. The dither is generated four lanes at a time, and
+ * without noise shaping the whole conversion is vectorized.
+ *
+ * With noise shaping the error of each sample is fed back through
+ * a three tap filter, which moves the noise from the lower
+ * frequencies, where it is most audible, up towards the Nyquist
+ * frequency. That loop runs a sample at a time per channel.
+ */
+#ifndef DITHER_H_INCLUDED
+#define DITHER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "lightning.h"
+
+typedef struct Dither *Dither;
+
+/**
+ * Set up dithering of @a channels interleaved channels to
+ * @a bits bits (16 or 24).
+ *
+ * @param  shaped - nonzero to shape the noise
+ */
+Dither
+Dither_init(channels_t channels, int bits, int shaped);
+
+/**
+ * Quantize @a frames interleaved frames of @a src to @a bits bits,
+ * clipping at full scale, and store them in the high bits of
+ * @a dst (the layout of sf_writef_int).
+ */
+void
+Dither_process(Dither dither, const sample_t *src, int32_t *dst,
+               nframes_t frames);
+
+void
+Dither_free(Dither *dither);
+
+#endif
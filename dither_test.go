@@ -0,0 +1,79 @@
+package lightning
+
+import (
+	"math"
+	"math/rand"
+	"testing"
+)
+
+func TestDitherStaysInRange(t *testing.T) {
+	rng := rand.New(rand.NewSource(4))
+	// an odd number of frames, so the vector loop leaves a tail
+	src := make([]float32, 2*1001)
+	for i := range src {
+		src[i] = float32(rng.Float64()*3 - 1.5)
+	}
+	special := []float32{float32(math.NaN()), float32(math.Inf(1)), float32(math.Inf(-1)), 1e30, -1e30, 1, -1}
+	// at the start, and again in the tail
+	copy(src, special)
+	copy(src[len(src)-len(special):], special)
+	for _, bits := range []int{16, 24} {
+		step := int32(1) << (32 - bits)
+		max := int32(math.MaxInt32) &^ (step - 1)
+		for _, shaped := range []bool{false, true} {
+			dst := dither(2, bits, shaped, src)
+			for i, v := range dst {
+				if v%step != 0 {
+					t.Fatalf("%d bits shaped %v: sample %d is %#x, which has low bits set", bits, shaped, i, v)
+				}
+			}
+			for _, at := range []int{0, len(src) - len(special)} {
+				got := dst[at : at+5]
+				want := []int32{math.MinInt32, max, math.MinInt32, max, math.MinInt32}
+				for i := range want {
+					if got[i] != want[i] {
+						t.Fatalf("%d bits shaped %v: %v became %#x, want %#x",
+							bits, shaped, src[at+i], got[i], want[i])
+					}
+				}
+			}
+		}
+	}
+}
+
+func TestDitherErrorIsSmallAndUnbiased(t *testing.T) {
+	const frames = 100001
+	for _, bits := range []int{16, 24} {
+		scale := math.Ldexp(1, bits-1)
+		for _, shaped := range []bool{false, true} {
+			// a constant and a sine, in two channels. The constant
+			// is small, so a float has room for the fractions of
+			// a step the dither adds to it even at 24 bits
+			src := make([]float32, 2*frames)
+			for i := 0; i < frames; i++ {
+				src[2*i] = 0.0123
+				src[2*i+1] = float32(0.9 * math.Sin(float64(i)*0.01))
+			}
+			dst := dither(2, bits, shaped, src)
+			// TPDF dither is up to a step either way, plus the
+			// rounding; shaping feeds back up to a few steps more
+			limit := 1.5
+			if shaped {
+				limit = 8
+			}
+			var sum float64
+			for i := range dst {
+				e := float64(dst[i]>>(32-bits)) - float64(src[i])*scale
+				if math.Abs(e) > limit {
+					t.Fatalf("%d bits shaped %v: sample %d is off by %.2f steps", bits, shaped, i, e)
+				}
+				if i%2 == 0 {
+					sum += e
+				}
+			}
+			if mean := sum / frames; math.Abs(mean) > 0.05 {
+				t.Errorf("%d bits shaped %v: error of a constant averages %.3f steps, want 0", bits, shaped, mean)
+			}
+		}
+	}
+}
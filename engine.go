@@ -6,26 +6,74 @@ package lightning
 
 // #cgo CFLAGS: -Wall -O2
 // #cgo LDFLAGS: -L. -lm -ljack -lsndfile -lpthread -lsamplerate -logg
+// #include <stdlib.h>
 // #include "lightning.h"
 import "C"
 
 import (
+	"encoding/binary"
 	"errors"
+	"io"
 	"math"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
 )
 
 // Engine provides methods for playing audio files with JACK
 type Engine interface {
 	// Connect JACK audio outputs
 	Connect(ch1 string, ch2 string) error
+	// ConnectPort connects one JACK output port (counting from 0)
+	ConnectPort(port int, dest string) error
+	// ConnectInput connects a JACK source to one input port
+	// (counting from 0)
+	ConnectInput(port int, src string) error
 	// PlaySample plays an audio sample
 	PlaySample(file string, pitch float64, gain float64) error
+	// AddBus adds a named mix bus
+	AddBus(name string) error
+	// PlaySampleOnBus plays an audio sample on a mix bus
+	PlaySampleOnBus(file string, pitch float64, gain float64, bus string) error
+	// SetBusGain sets the gain of a mix bus
+	SetBusGain(bus string, gain float64) error
 	// PlayNote plays a note
 	PlayNote(note *Note) error
+	// LoadBank maps a sample bank and caches all of its samples
+	LoadBank(file string) error
+	// LoadSamples caches samples ahead of playing them, loading
+	// them in parallel
+	LoadSamples(files []string, quality SRCQuality) error
+	// StreamStats returns statistics for samples streamed from disk
+	StreamStats() StreamStats
+	// CaptureStart starts capturing a take from the input ports
+	CaptureStart(max time.Duration) error
+	// CaptureFrames returns the frames captured by the running take
+	CaptureFrames() int
+	// CaptureStop stops capturing and caches the take under name
+	CaptureStop(name string) error
+	// ExportStats returns statistics for exporting
+	ExportStats() ExportStats
 	// ExportStart start exporting to an audio file
 	ExportStart(file string) int
+	// ExportStartWith starts exporting to an audio file in the
+	// format given by settings
+	ExportStartWith(file string, settings ExportSettings) int
 	// ExportStop stop the currently running export job if there is one
 	ExportStop() int
+	// ExportOpen starts an export that runs alongside any others
+	ExportOpen(file string, settings ExportSettings) (int, error)
+	// ExportClose stops an export started with ExportOpen
+	ExportClose(export int) error
+	// FrameTime returns the frame time of the next cycle
+	FrameTime() uint64
+	// ExportStartAt starts an export at a frame time
+	ExportStartAt(file string, settings ExportSettings, start uint64) (int, error)
+	// ExportStopAt stops an export at a frame time
+	ExportStopAt(export int, stop uint64) error
+	// OpenTap streams the output of a mix bus to the caller
+	OpenTap(bus string, buffer time.Duration) (*Tap, error)
 	// Close disconnect the jack client and free Lightning instance resources
 	Close()
 }
@@ -45,6 +93,53 @@ func (self *impl) Connect(ch1 string, ch2 string) error {
 	}
 }
 
+// ConnectPort connects one JACK output port
+func (self *impl) ConnectPort(port int, dest string) error {
+	cdest := C.CString(dest)
+	defer C.free(unsafe.Pointer(cdest))
+	if C.Lightning_connect_port(self.handle, C.int(port), cdest) != 0 {
+		return errors.New("could not connect to JACK sink")
+	}
+	return nil
+}
+
+// ConnectInput connects a JACK source to one input port
+func (self *impl) ConnectInput(port int, src string) error {
+	csrc := C.CString(src)
+	defer C.free(unsafe.Pointer(csrc))
+	if C.Lightning_connect_input(self.handle, C.int(port), csrc) != 0 {
+		return errors.New("could not connect JACK source")
+	}
+	return nil
+}
+
+// CaptureStart starts capturing a take of up to max from the input
+// ports. The take's buffers are allocated before it returns, so
+// capturing allocates nothing on the realtime thread.
+func (self *impl) CaptureStart(max time.Duration) error {
+	if C.Lightning_capture_start(self.handle, C.nframes_t(max/time.Millisecond)) != 0 {
+		return errors.New("could not start capturing")
+	}
+	return nil
+}
+
+// CaptureFrames returns the number of frames the running take has
+// captured so far
+func (self *impl) CaptureFrames() int {
+	return int(C.Lightning_capture_frames(self.handle))
+}
+
+// CaptureStop stops capturing and caches the take under name, so
+// PlaySample(name, ...) plays it right away
+func (self *impl) CaptureStop(name string) error {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	if C.Lightning_capture_stop(self.handle, cname) != 0 {
+		return errors.New("could not cache take")
+	}
+	return nil
+}
+
 // PlaySample play an audio sample
 func (self *impl) PlaySample(file string, pitch float64, gain float64) error {
 	err := C.Lightning_play_sample(
@@ -57,6 +152,340 @@ func (self *impl) PlaySample(file string, pitch float64, gain float64) error {
 	}
 }
 
+// AddBus adds a named mix bus. Samples played on it are summed
+// into it, and it is summed into the master output, so it can be
+// exported on its own as a stem.
+func (self *impl) AddBus(name string) error {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	if C.Lightning_add_bus(self.handle, cname) != 0 {
+		return errors.New("could not add bus")
+	}
+	return nil
+}
+
+// PlaySampleOnBus plays an audio sample on a bus added with AddBus,
+// or on "master"
+func (self *impl) PlaySampleOnBus(file string, pitch float64, gain float64, bus string) error {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	cbus := C.CString(bus)
+	defer C.free(unsafe.Pointer(cbus))
+	if C.Lightning_play_sample_on_bus(self.handle, cfile, C.pitch_t(pitch), C.gain_t(gain), cbus) != 0 {
+		return errors.New("could not play sample")
+	}
+	return nil
+}
+
+// SetBusGain sets the gain applied to the mix of a bus before it is
+// summed into the master bus, or to the output for "master" (or "").
+// It is applied once per bus, not per voice, and ramped over a cycle.
+func (self *impl) SetBusGain(bus string, gain float64) error {
+	var cbus *C.char
+	if bus != "" {
+		cbus = C.CString(bus)
+		defer C.free(unsafe.Pointer(cbus))
+	}
+	if C.Lightning_set_bus_gain(self.handle, cbus, C.gain_t(gain)) != 0 {
+		return errors.New("no such bus")
+	}
+	return nil
+}
+
+// LoadBank maps a sample bank built with BuildBank and caches all of
+// its samples, so they can be played by the names they were packed with
+func (self *impl) LoadBank(file string) error {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	if C.Lightning_load_bank(self.handle, cfile) != 0 {
+		return errors.New("could not load sample bank")
+	}
+	return nil
+}
+
+// LoadSamples decodes and resamples files on every core and caches
+// them, so the first time they are played does not touch the disk.
+// Resampling uses a converter of quality, which the samples keep
+// when JACK's sample rate changes.
+func (self *impl) LoadSamples(files []string, quality SRCQuality) error {
+	cfiles := cStrings(files)
+	defer freeCStrings(cfiles, len(files))
+	if C.Lightning_load_samples(self.handle, cfiles, C.int(len(files)), C.SRCQuality(quality)) != 0 {
+		return errors.New("could not load samples")
+	}
+	return nil
+}
+
+// StreamStats are statistics for samples streamed from disk
+type StreamStats struct {
+	// Streams is the number of streams currently open
+	Streams int
+	// Underruns counts the times a voice ran out of streamed data
+	Underruns uint64
+	// Fill[i] counts the times the audio thread found a stream's
+	// buffer between i and i+1 tenths full
+	Fill [C.LIGHTNING_FILL_BUCKETS]uint64
+	// Reads is the number of read requests issued to disk
+	Reads uint64
+	// BytesRead is the number of bytes read from disk
+	BytesRead uint64
+	// MinSlack is the least time any voice had left before running
+	// out of data when the I/O thread got to it (negative if
+	// nothing has been streamed yet)
+	MinSlack time.Duration
+}
+
+// StreamStats returns statistics for samples streamed from disk
+func (self *impl) StreamStats() StreamStats {
+	var cstats C.LightningStreamStats
+	C.Lightning_stream_stats(self.handle, &cstats)
+	stats := StreamStats{
+		Streams:   int(cstats.streams),
+		Underruns: uint64(cstats.underruns),
+		Reads:     uint64(cstats.reads),
+		BytesRead: uint64(cstats.bytes_read),
+		MinSlack:  time.Duration(float64(cstats.min_slack_ms) * float64(time.Millisecond)),
+	}
+	for i := range stats.Fill {
+		stats.Fill[i] = uint64(cstats.fill[i])
+	}
+	return stats
+}
+
+// ExportStats are statistics for exporting, since the engine started
+type ExportStats struct {
+	// RingFrames is the number of frames the export ringbuffer holds
+	RingFrames int
+	// HighWaterFrames is the most frames that have been waiting
+	// in the ringbuffer to be written
+	HighWaterFrames int
+	// Overruns counts the cycles that dropped frames because the
+	// ringbuffer was full
+	Overruns uint64
+	// DroppedFrames is the number of frames dropped
+	DroppedFrames uint64
+	// Gaps is the number of runs of dropped frames
+	Gaps uint64
+	// FramesWritten is the number of frames written to export files,
+	// including silence written in place of gaps
+	FramesWritten uint64
+}
+
+// ExportStats returns statistics for exporting
+func (self *impl) ExportStats() ExportStats {
+	var cstats C.LightningExportStats
+	C.Lightning_export_stats(self.handle, &cstats)
+	return ExportStats{
+		RingFrames:      int(cstats.ring_frames),
+		HighWaterFrames: int(cstats.high_water_frames),
+		Overruns:        uint64(cstats.overruns),
+		DroppedFrames:   uint64(cstats.dropped_frames),
+		Gaps:            uint64(cstats.gaps),
+		FramesWritten:   uint64(cstats.frames_written),
+	}
+}
+
+// cStrings copies a slice of go strings to a C array of C strings.
+// Free the result with freeCStrings.
+func cStrings(strs []string) **C.char {
+	ptrSize := unsafe.Sizeof((*C.char)(nil))
+	arr := (**C.char)(C.malloc(C.size_t(len(strs)) * C.size_t(ptrSize)))
+	for i, str := range strs {
+		elem := (**C.char)(unsafe.Pointer(uintptr(unsafe.Pointer(arr)) + uintptr(i)*ptrSize))
+		*elem = C.CString(str)
+	}
+	return arr
+}
+
+// freeCStrings frees an array allocated with cStrings
+func freeCStrings(arr **C.char, n int) {
+	ptrSize := unsafe.Sizeof((*C.char)(nil))
+	for i := 0; i < n; i++ {
+		elem := (**C.char)(unsafe.Pointer(uintptr(unsafe.Pointer(arr)) + uintptr(i)*ptrSize))
+		C.free(unsafe.Pointer(*elem))
+	}
+	C.free(unsafe.Pointer(arr))
+}
+
+// SampleFormat is a format cached sample data can be stored in
+type SampleFormat int
+
+const (
+	// Float32 stores samples as 32-bit floats
+	Float32 SampleFormat = C.SampleFormat_FLOAT32
+	// Int16 stores samples as 16-bit integers
+	Int16 SampleFormat = C.SampleFormat_INT16
+	// Float16 stores samples as half precision floats
+	Float16 SampleFormat = C.SampleFormat_FLOAT16
+	// AutoFormat uses Int16 for 16-bit sources and Float32 otherwise
+	AutoFormat SampleFormat = C.SampleFormat_AUTO
+	// Blocks stores 16-bit data losslessly compressed, for
+	// libraries that do not fit in memory otherwise
+	Blocks SampleFormat = C.SampleFormat_BLOCKS
+)
+
+// SampleLayout is how the channels of cached sample data are laid out
+type SampleLayout int
+
+const (
+	// Planar stores one buffer per channel
+	Planar SampleLayout = C.SampleLayout_PLANAR
+	// Interleaved stores the left and right frames of stereo
+	// samples next to each other (other samples stay planar)
+	Interleaved SampleLayout = C.SampleLayout_INTERLEAVED
+)
+
+// SRCQuality is the sample rate converter samples are resampled with
+type SRCQuality int
+
+const (
+	// SRCFastest is the fastest band-limited converter
+	SRCFastest SRCQuality = C.SRCQuality_FASTEST
+	// SRCMedium is a band-limited converter between SRCFastest
+	// and SRCBest in speed and quality
+	SRCMedium SRCQuality = C.SRCQuality_MEDIUM
+	// SRCBest is the highest quality band-limited converter
+	SRCBest SRCQuality = C.SRCQuality_BEST
+	// SRCLinear interpolates linearly, which is cheapest but
+	// lets through aliasing
+	SRCLinear SRCQuality = C.SRCQuality_LINEAR
+)
+
+// ExportFormat is a file format the output can be exported to
+type ExportFormat int
+
+const (
+	// ExportWAV writes WAV files
+	ExportWAV ExportFormat = C.ExportFormat_WAV
+	// ExportAIFF writes AIFF files
+	ExportAIFF ExportFormat = C.ExportFormat_AIFF
+	// ExportFLAC writes lossless FLAC files, about half the
+	// size of WAV
+	ExportFLAC ExportFormat = C.ExportFormat_FLAC
+	// ExportOGG writes lossy Ogg Vorbis files
+	ExportOGG ExportFormat = C.ExportFormat_OGG
+)
+
+// ExportDither is how exports to 16 or 24-bit files are quantized
+type ExportDither int
+
+const (
+	// DitherNone rounds to the nearest step
+	DitherNone ExportDither = C.ExportDither_NONE
+	// DitherTPDF adds triangular dither of up to one step either way
+	DitherTPDF ExportDither = C.ExportDither_TPDF
+	// DitherShaped adds TPDF dither with the noise shaped away from
+	// the frequencies where it is most audible
+	DitherShaped ExportDither = C.ExportDither_SHAPED
+)
+
+// ExportSettings is how ExportStartWith and ExportOpen write their file
+type ExportSettings struct {
+	// Format is the file format
+	Format ExportFormat
+	// Bits is the number of bits per sample: 16 or 24 for
+	// integer samples, 32 for float (WAV and AIFF only), or 0
+	// for the best the format has. OGG ignores it.
+	Bits int
+	// Quality goes from 0 to 1. It is how hard FLAC compresses
+	// (higher is smaller and slower to encode), or the Vorbis
+	// quality of OGG (higher is better and larger).
+	Quality float64
+	// Bus is the mix bus to record, "" (or "master") for the
+	// master output
+	Bus string
+	// Dither is how samples are quantized to 16 or 24 bits
+	Dither ExportDither
+}
+
+// cExportSettings converts settings for C. The bus name has to be
+// freed with freeExportSettings.
+func cExportSettings(settings ExportSettings) C.LightningExportSettings {
+	csettings := C.LightningExportSettings{
+		format:  C.ExportFormat(settings.Format),
+		bits:    C.int(settings.Bits),
+		quality: C.double(settings.Quality),
+		dither:  C.ExportDither(settings.Dither),
+	}
+	if settings.Bus != "" {
+		csettings.bus = C.CString(settings.Bus)
+	}
+	return csettings
+}
+
+func freeExportSettings(csettings *C.LightningExportSettings) {
+	if csettings.bus != nil {
+		C.free(unsafe.Pointer(csettings.bus))
+	}
+}
+
+// DefaultExportSettings returns the settings ExportStart uses
+func DefaultExportSettings() ExportSettings {
+	var csettings C.LightningExportSettings
+	C.Lightning_default_export_settings(&csettings)
+	return ExportSettings{
+		Format:  ExportFormat(csettings.format),
+		Bits:    int(csettings.bits),
+		Quality: float64(csettings.quality),
+		Dither:  ExportDither(csettings.dither),
+	}
+}
+
+// LayoutBench is the result of BenchLayout
+type LayoutBench struct {
+	// VoiceFrames is the number of voice-frames rendered
+	VoiceFrames uint64
+	// NsPerVoiceFrame is the rendering and mixing time per voice-frame
+	NsPerVoiceFrame float64
+	// MissesPerVoiceFrame is the number of last level cache misses
+	// per voice-frame, or negative if the hardware counters are not
+	// available
+	MissesPerVoiceFrame float64
+}
+
+// BenchLayout renders cycles 256 frame cycles of voices stereo voices
+// from synthetic samples stored with layout and format, and reports
+// how fast that was on this machine. It does not need a JACK server.
+func BenchLayout(layout SampleLayout, format SampleFormat, voices int, pitch float64, cycles int) (LayoutBench, error) {
+	var r C.LightningLayoutBench
+	if C.Lightning_bench_layout(C.SampleLayout(layout), C.SampleFormat(format), C.int(voices), C.pitch_t(pitch), C.int(cycles), &r) != 0 {
+		return LayoutBench{}, errors.New("invalid layout benchmark")
+	}
+	return LayoutBench{
+		VoiceFrames:         uint64(r.voice_frames),
+		NsPerVoiceFrame:     float64(r.ns_per_voice_frame),
+		MissesPerVoiceFrame: float64(r.misses_per_voice_frame),
+	}, nil
+}
+
+// BuildBank packs audio files into a single sample bank file.
+// The samples are resampled to samplerate, which should match
+// the sample rate of the JACK server the bank will be played with,
+// and stored in format (AutoFormat and Blocks are not allowed).
+// If names is nil the samples are registered under their paths,
+// otherwise it must have one name per path.
+func BuildBank(file string, paths []string, names []string, samplerate int, format SampleFormat) error {
+	if len(paths) == 0 {
+		return errors.New("no samples to pack")
+	}
+	if names != nil && len(names) != len(paths) {
+		return errors.New("need one name per sample")
+	}
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	cpaths := cStrings(paths)
+	defer freeCStrings(cpaths, len(paths))
+	var cnames **C.char
+	if names != nil {
+		cnames = cStrings(names)
+		defer freeCStrings(cnames, len(names))
+	}
+	if C.Lightning_build_bank(cfile, cpaths, cnames, C.int(len(paths)), C.nframes_t(samplerate), C.SampleFormat(format)) != 0 {
+		return errors.New("could not build sample bank")
+	}
+	return nil
+}
+
 // getPitch calculates the sample playback speed for a given midi note
 func getPitch(note *Note) float64 {
 	return float64(math.Pow(2.0, (float64(note.Number)-60.0)/12.0))
@@ -76,6 +505,235 @@ func (self *impl) ExportStart(file string) int {
 	))
 }
 
+// ExportStartWith starts exporting to an audio file in the format
+// given by settings. Start from DefaultExportSettings.
+func (self *impl) ExportStartWith(file string, settings ExportSettings) int {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	csettings := cExportSettings(settings)
+	defer freeExportSettings(&csettings)
+	return int(C.Lightning_export_start_with_settings(
+		self.handle, cfile, &csettings,
+	))
+}
+
+// ExportOpen starts an export of the master output or of a bus,
+// which runs alongside any others until ExportClose. Every export
+// of the same bus shares what is taken from the realtime thread.
+// It returns the number to close the export with.
+func (self *impl) ExportOpen(file string, settings ExportSettings) (int, error) {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	csettings := cExportSettings(settings)
+	defer freeExportSettings(&csettings)
+	export := int(C.Lightning_export_open(self.handle, cfile, &csettings))
+	if export < 0 {
+		return -1, errors.New("could not start export")
+	}
+	return export, nil
+}
+
+// ExportClose stops an export started with ExportOpen. The file is
+// finished in the background.
+func (self *impl) ExportClose(export int) error {
+	if C.Lightning_export_close(self.handle, C.int(export)) != 0 {
+		return errors.New("export is not running")
+	}
+	return nil
+}
+
+// FrameTime returns the time of the first frame of the next cycle, in
+// frames since the first cycle. A sample played now starts at about
+// this time.
+func (self *impl) FrameTime() uint64 {
+	return uint64(C.Lightning_frame_time(self.handle))
+}
+
+// ExportStartAt starts an export like ExportOpen whose first frame is
+// the one at frame time start, so the file lines up with notes played
+// at that time without trimming. If start has passed, the export
+// starts with the next cycle.
+func (self *impl) ExportStartAt(file string, settings ExportSettings, start uint64) (int, error) {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	csettings := cExportSettings(settings)
+	defer freeExportSettings(&csettings)
+	export := int(C.Lightning_export_start_at(self.handle, cfile, &csettings, C.position_t(start)))
+	if export < 0 {
+		return -1, errors.New("could not start export")
+	}
+	return export, nil
+}
+
+// ExportStopAt stops an export before the frame at frame time stop.
+// If stop has passed, the export stops after the current cycle. An
+// export can only be stopped once.
+func (self *impl) ExportStopAt(export int, stop uint64) error {
+	if C.Lightning_export_stop_at(self.handle, C.int(export), C.position_t(stop)) != 0 {
+		return errors.New("export is not running")
+	}
+	return nil
+}
+
+// tapPoll is how long a read of a tap waits before checking whether
+// the tap has been closed
+const tapPoll = 100 * time.Millisecond
+
+// Tap streams the output of the master bus or a named mix bus as
+// interleaved float32 frames, without an export file in between.
+// Output the reader does not keep up with is dropped and counted in
+// Stats. A Tap is read from one goroutine at a time.
+type Tap struct {
+	handle   C.Lightning
+	tap      C.int
+	channels int
+	closed   int32
+	// held while reading, so Close waits for a read to finish
+	mutex  sync.Mutex
+	frames []float32
+	rest   []byte
+}
+
+// TapStats are statistics for a Tap
+type TapStats struct {
+	// Channels is the number of interleaved channels of each frame
+	Channels int
+	// RingFrames is the number of frames the tap ringbuffer holds
+	RingFrames int
+	// FramesWritten is the number of frames written to the tap
+	FramesWritten uint64
+	// Overruns counts the writes dropped because the ringbuffer was
+	// full
+	Overruns uint64
+	// DroppedFrames is the number of frames dropped
+	DroppedFrames uint64
+}
+
+// OpenTap opens a tap of the mix bus named bus, or of the master
+// output if bus is empty, which holds buffer of output until it is
+// read.
+func (self *impl) OpenTap(bus string, buffer time.Duration) (*Tap, error) {
+	var cbus *C.char
+	if bus != "" {
+		cbus = C.CString(bus)
+		defer C.free(unsafe.Pointer(cbus))
+	}
+	tap := C.Lightning_tap_open(self.handle, cbus, C.nframes_t(buffer/time.Millisecond))
+	if tap < 0 {
+		return nil, errors.New("could not open tap")
+	}
+	t := &Tap{handle: self.handle, tap: tap}
+	t.channels = t.Stats().Channels
+	return t, nil
+}
+
+// ReadFrames reads up to len(buf) / channels interleaved frames into
+// buf, waiting for at least one. It returns the number of frames read,
+// and io.EOF once the tap is closed.
+func (self *Tap) ReadFrames(buf []float32) (int, error) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	return self.readFrames(buf)
+}
+
+func (self *Tap) readFrames(buf []float32) (int, error) {
+	frames := len(buf) / self.channels
+	if frames == 0 {
+		return 0, errors.New("buffer holds no frames")
+	}
+	for atomic.LoadInt32(&self.closed) == 0 {
+		n := C.Lightning_tap_read(self.handle, self.tap, (*C.sample_t)(unsafe.Pointer(&buf[0])),
+			C.nframes_t(frames), C.int(tapPoll/time.Millisecond))
+		if n > 0 {
+			return int(n), nil
+		}
+	}
+	return 0, io.EOF
+}
+
+// Read implements io.Reader, reading the interleaved frames as
+// little-endian float32 samples
+func (self *Tap) Read(p []byte) (int, error) {
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	if len(self.rest) == 0 {
+		frames := len(p) / (4 * self.channels)
+		if frames == 0 {
+			frames = 1
+		}
+		if cap(self.frames) < frames*self.channels {
+			self.frames = make([]float32, frames*self.channels)
+		}
+		n, err := self.readFrames(self.frames[:frames*self.channels])
+		if err != nil {
+			return 0, err
+		}
+		if cap(self.rest) < 4*n*self.channels {
+			self.rest = make([]byte, 4*n*self.channels)
+		}
+		self.rest = self.rest[:4*n*self.channels]
+		for i, sample := range self.frames[:n*self.channels] {
+			binary.LittleEndian.PutUint32(self.rest[4*i:], math.Float32bits(sample))
+		}
+	}
+	n := copy(p, self.rest)
+	self.rest = self.rest[n:]
+	return n, nil
+}
+
+// Blocks reads the tap on a goroutine of its own and sends blocks of
+// frames interleaved frames, until the tap is closed. The channel is
+// closed after the last block, which may be shorter.
+func (self *Tap) Blocks(frames int) <-chan []float32 {
+	blocks := make(chan []float32)
+	go func() {
+		defer close(blocks)
+		for {
+			block := make([]float32, frames*self.channels)
+			filled := 0
+			for filled < len(block) {
+				n, err := self.ReadFrames(block[filled:])
+				if err != nil {
+					if filled > 0 {
+						blocks <- block[:filled]
+					}
+					return
+				}
+				filled += n * self.channels
+			}
+			blocks <- block
+		}
+	}()
+	return blocks
+}
+
+// Stats returns statistics for the tap
+func (self *Tap) Stats() TapStats {
+	var cstats C.LightningTapStats
+	C.Lightning_tap_stats(self.handle, self.tap, &cstats)
+	return TapStats{
+		Channels:      int(cstats.channels),
+		RingFrames:    int(cstats.ring_frames),
+		FramesWritten: uint64(cstats.frames_written),
+		Overruns:      uint64(cstats.overruns),
+		DroppedFrames: uint64(cstats.dropped_frames),
+	}
+}
+
+// Close closes the tap, waiting for a read in progress to return
+// io.EOF
+func (self *Tap) Close() error {
+	if !atomic.CompareAndSwapInt32(&self.closed, 0, 1) {
+		return errors.New("tap is closed")
+	}
+	self.mutex.Lock()
+	defer self.mutex.Unlock()
+	if C.Lightning_tap_close(self.handle, self.tap) != 0 {
+		return errors.New("tap is not open")
+	}
+	return nil
+}
+
 // ExportStop stops exporting to an audio file
 func (self *impl) ExportStop() int {
 	return int(C.Lightning_export_stop(self.handle))
@@ -92,3 +750,93 @@ func NewEngine() Engine {
 	instance.handle = C.Lightning_init()
 	return instance
 }
+
+// Options configures an Engine created with NewEngineWithOptions
+type Options struct {
+	// CacheSize is the number of bytes of address space
+	// reserved for cached sample data
+	CacheSize uint64
+	// CacheLockBudget is the maximum number of bytes of cached
+	// sample data that will be locked into RAM
+	CacheLockBudget uint64
+	// CacheFormat is the format cached sample data is stored in
+	CacheFormat SampleFormat
+	// CacheLayout is the channel layout of cached sample data,
+	// see BenchLayout for choosing one
+	CacheLayout SampleLayout
+	// StreamHead is how much of the start of a sample streamed
+	// from disk is kept in RAM
+	StreamHead time.Duration
+	// StreamThreshold is the length above which samples are
+	// streamed from disk instead of being cached in RAM.
+	// Samples that would not fit in CacheSize are streamed too.
+	StreamThreshold time.Duration
+	// NativeRate keeps samples cached in RAM at the sample rate
+	// of their file. Voices convert them while playing, in the
+	// same step as changing their pitch, instead of resampling
+	// them once at load time.
+	NativeRate bool
+	// SRCQuality is the converter samples are resampled with,
+	// unless they are loaded with LoadSamples
+	SRCQuality SRCQuality
+	// OutputChannels is the number of JACK output ports.
+	// Mono samples play on every port, and channels of a
+	// sample past the last port are not played.
+	OutputChannels int
+	// InputChannels is the number of JACK input ports takes are
+	// captured from. With none, CaptureStart fails.
+	InputChannels int
+	// ExportBuffer is how much output the export ringbuffer holds,
+	// which is how long writing an export can stall before frames
+	// are dropped
+	ExportBuffer time.Duration
+	// ExportMarkGaps writes silence in place of frames dropped from
+	// an export, so the file stays in time with the output
+	ExportMarkGaps bool
+}
+
+// DefaultOptions returns the options NewEngine uses
+func DefaultOptions() Options {
+	var copts C.LightningOptions
+	C.Lightning_default_options(&copts)
+	return Options{
+		CacheSize:       uint64(copts.cache_size),
+		CacheLockBudget: uint64(copts.cache_lock_budget),
+		CacheFormat:     SampleFormat(copts.cache_format),
+		CacheLayout:     SampleLayout(copts.cache_layout),
+		StreamHead:      time.Duration(copts.stream_head_ms) * time.Millisecond,
+		StreamThreshold: time.Duration(copts.stream_threshold_ms) * time.Millisecond,
+		NativeRate:      copts.native_rate != 0,
+		SRCQuality:      SRCQuality(copts.src_quality),
+		OutputChannels:  int(copts.output_channels),
+		InputChannels:   int(copts.input_channels),
+		ExportBuffer:    time.Duration(copts.export_buffer_ms) * time.Millisecond,
+		ExportMarkGaps:  copts.export_mark_gaps != 0,
+	}
+}
+
+// NewEngineWithOptions initializes a new lightning engine with
+// non-default options. Start from DefaultOptions.
+func NewEngineWithOptions(opts Options) Engine {
+	var copts C.LightningOptions
+	C.Lightning_default_options(&copts)
+	copts.cache_size = C.size_t(opts.CacheSize)
+	copts.cache_lock_budget = C.size_t(opts.CacheLockBudget)
+	copts.cache_format = C.SampleFormat(opts.CacheFormat)
+	copts.cache_layout = C.SampleLayout(opts.CacheLayout)
+	copts.stream_head_ms = C.nframes_t(opts.StreamHead / time.Millisecond)
+	copts.stream_threshold_ms = C.nframes_t(opts.StreamThreshold / time.Millisecond)
+	if opts.NativeRate {
+		copts.native_rate = 1
+	}
+	copts.src_quality = C.SRCQuality(opts.SRCQuality)
+	copts.output_channels = C.channels_t(opts.OutputChannels)
+	copts.input_channels = C.channels_t(opts.InputChannels)
+	copts.export_buffer_ms = C.nframes_t(opts.ExportBuffer / time.Millisecond)
+	if opts.ExportMarkGaps {
+		copts.export_mark_gaps = 1
+	}
+	instance := new(impl)
+	instance.handle = C.Lightning_init_with_options(&copts)
+	return instance
+}
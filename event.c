@@ -37,6 +37,13 @@ LightningEvent_lock(LightningEvent e)
     return pthread_mutex_lock(&e->mutex);
 }
 
+int
+LightningEvent_unlock(LightningEvent e)
+{
+    assert(e);
+    return pthread_mutex_unlock(&e->mutex);
+}
+
 int
 LightningEvent_wait(LightningEvent e)
 {
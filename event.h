@@ -18,6 +18,12 @@ LightningEvent_init();
 int
 LightningEvent_lock(LightningEvent e);
 
+/**
+ * Unlock the event's mutex
+ */
+int
+LightningEvent_unlock(LightningEvent e);
+
 int
 LightningEvent_wait(LightningEvent e);
 
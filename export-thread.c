@@ -1,90 +1,24 @@
 /**
- * TODO: fix this implementation
+ * Exporting the output to audio files
  *
- * We need to
- * - start/stop a thread that is writing audio data to disk
- * - this thread will read data from a ringbuffer that
- *   is written to in the JACK realtime thread
- * - different thread(s) will be starting/stopping the disk thread
- *
- * start action algorithm:
- * - JackClient starts the disk thread
- * - stores a reference to the ExportThread
- * - immediately starts writing to the disk thread's ringbuffer
- * - disk thread immediately starts writing data from the ringbuffer to disk
- *
- * stop action algorithm:
- * (1) signal the disk thread that it is time to stop writing
- *     and close the file
- * (2) free the ExportThread structure
- *
- * the tricky part is how to synchronize with JackClient to
- * let it know when the stop action algorithm is complete, so
- * that it can set its export_thread pointer to NULL
- *
- * Alternative
- * -----------
- * Maybe the way to solve these problems is to always have the
- * disk thread running.
- *
- * In this scenario, there is no need to free the export thread structure.
- * We start up the disk thread after JackClient registers its process callback,
- * then we
- * (1) wait for a "start" event
- * (2) open an audio file for writing, and stream data to this file from a ringbuffer
- * (3) tell the disk thread to stop writing and close the file
- *
- * The start/stop mechanism could be acheived with a boolean variable
- * that is guarded by a mutex.
- *
- * The JACK realtime thread would never need to change the value of this boolean variable,
- * so there is no concern about blocking the realtime thread to access this variable.
- *
- * Call the boolean variable "exporting".
- *
- * JackClient would do the following in the realtime callback:
- * (1)  call ExportThread_write, which
- *   (1.1)  checks the value of exporting variable
- *   (1.2)  if it is false, do nothing
- *   (1.3)  otherwise
- *     (1.3.1)  write samples to the ringbuffer
- *     (1.3.2)  signal the data event
- *
- * The start algorithm:
- * (1)  signal the start event (with a filename value)
- * (2)  lock exporting mutex
- * (3)  set exporting to 1
- * (4)  unlock exporting mutex
- *
- * The stop algorithm:
- * (1)  lock exporting mutex
- * (2)  set exporting to 0
- * (3)  unlock exporting mutex
- *
- * The disk thread:
- * (1)  initializes local variables
- * (2)  waits for start event
- * (3)  opens file
- * (4)  enters infinite loop where it
- *   (4.1)  checks the value of exporting
- *   (4.2)  if true
- *     (4.2.1)  wait for data event
- *     (4.2.2)  write data from ringbuffer to disk
- *   (4.3)  if false
- *     (4.3.1)  close file
- *     (4.3.2)  go back to (2)
- *
- * JackClient_start_exporting should ideally check if the disk thread
- * is already running an export job and fail if it is.
- * Could expose a function
- * int ExportThread_is_exporting(...)
- * for JackClient to use to determine this.
+ * Every cycle the realtime thread writes each source being
+ * recorded (the master output or a mix bus) to a ringbuffer,
+ * without locking or allocating. The export thread moves the
+ * frames into shared blocks and hands each export the part
+ * between its start and stop times, which its encoder thread
+ * writes to the file.
  */
 #include <assert.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-#include "event.h"
+#include "dither.h"
 #include "export-thread.h"
 #include "log.h"
 #include "lightning.h"
@@ -94,212 +28,1181 @@
 #include "sf.h"
 #include "thread.h"
 
-static int
-ExportThread_set_exporting(ExportThread thread, int val);
+/* frames interleaved at a time, and frames of silence written
+   at a time */
+#define EXPORT_CHUNK_FRAMES 1024
 
-static int
-ExportThread_is_exporting(ExportThread thread);
+/* each ringbuffer holds at least this many frames, whatever
+   the latency budget */
+#define EXPORT_MIN_RING_FRAMES (2 * EXPORT_CHUNK_FRAMES)
 
-/* data for threads that write audio data to disk */
-struct ExportThread {
-    /* ringbuffer to read data from */
+/* Records each ringbuffer has room for besides its frames */
+#define EXPORT_RING_RECORDS 64
+
+/* bytes of frames in a block */
+#define EXPORT_BLOCK_BYTES (1 << 20)
+
+/* blocks of each source */
+#define EXPORT_BLOCKS 4
+
+/* the master output and every mix bus */
+#define EXPORT_MAX_SOURCES (LIGHTNING_MAX_BUSES + 1)
+
+/* ranges that can be waiting for an encoder thread: one for
+   every block of its source, and the end of the export */
+#define EXPORT_MAX_RANGES (EXPORT_BLOCKS + 1)
+
+/* disk space reserved ahead of what has been written */
+#define EXPORT_RESERVE_BYTES (64 << 20)
+
+/* the header of the file is brought up to date after this many
+   seconds of audio */
+#define EXPORT_HEADER_SECONDS 10
+
+/* stop time of an export that has not been closed */
+#define EXPORT_OPEN UINT64_MAX
+
+/* ioprio_set(2) arguments, which have no header */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_BE_LOWEST 7
+
+/**
+ * What the realtime thread writes to a ringbuffer before each
+ * cycle's frames: the time of the first frame, and the number
+ * of frames.
+ */
+typedef struct Record {
+    uint64_t time;
+    uint64_t frames;
+} Record;
+
+struct Source;
+
+/**
+ * Interleaved frames of a source that follow on from each other,
+ * the first of them at time.
+ */
+typedef struct Block {
+    sample_t *frames;
+    uint64_t time;
+    nframes_t fill;
+    /* one for the export thread while it fills the block, and
+       one for each Range of it an encoder thread has not
+       finished with */
+    atomic_int refs;
+    struct Source *source;
+} Block;
+
+/**
+ * Something that can be exported, with buffers the realtime
+ * thread reads every cycle.
+ */
+typedef struct Source {
+    char *name;
+    sample_t **bufs;
+    /* Records, each followed by its frames, and the bytes the
+       ringbuffer holds */
     Ringbuffer rb;
-    /* file name */
+    size_t ring_bytes;
+    /* exports of the source that have not finished, and the
+       earliest time any of them starts. the realtime thread
+       only writes to rb while there are any, and only frames
+       from that time on */
+    atomic_int recorders;
+    atomic_ullong from;
+    /* used by the realtime thread only: nonzero while cycles
+       are being dropped */
+    int dropping;
+    /* used by the export thread only: the Record being read,
+       with the time and number of the frames left to read, and
+       the block being filled, which is NULL while the encoder
+       threads hold every block */
+    Record record;
+    Block *block;
+    /* blocks, and a semaphore counting those no one holds */
+    Block blocks[EXPORT_BLOCKS];
+    sem_t free_blocks;
+    struct ExportThread *thread;
+} Source;
+
+/**
+ * frames frames of block, the first of them at time, which is
+ * offset frames into the block. A Range without a block ends
+ * an export that stops at time.
+ */
+typedef struct Range {
+    Block *block;
+    uint64_t time;
+    nframes_t offset;
+    nframes_t frames;
+} Range;
+
+typedef enum {
+    /* the slot is not in use */
+    Export_FREE,
+    /* ExportThread_open is setting the slot up */
+    Export_OPENING,
+    /* the export is running, or finishing */
+    Export_OPEN,
+    /* the encoder thread has closed the file, and has to be
+       joined before the slot is used again */
+    Export_DONE
+} ExportState;
+
+typedef struct Export {
+    atomic_int state;
+    struct ExportThread *thread;
+    /* the file, which belongs to the export, and its format */
     char *file;
-    /* start event, should be signalled with a filename */
-    LightningEvent start_event;
-    /* LightningEvent that signals there is data to write */
-    LightningEvent data_event;
+    SF_FMT format;
+    int bits;
+    double quality;
+    /* bits to dither to (0 leaves quantizing to libsndfile), and
+       nonzero to shape the noise */
+    int dither_bits;
+    int shaped;
+    /* the source recorded, the time of the first frame and the
+       time of the frame after the last one */
+    int source;
+    uint64_t start;
+    atomic_ullong stop;
+    /* Ranges for the encoder thread, which is woken for each */
+    Ringbuffer ranges;
+    sem_t wake;
+    LightningThread encoder;
+    /* used by the export thread only: frames before this time
+       have been handed to the encoder thread, and nonzero once
+       the end of the export has been */
+    uint64_t handed;
+    int finished;
+    /* used by the encoder thread only: the file, the time of the
+       frame it expects next, frames written to the file, frames
+       in the file when its header was last updated, zero once
+       reserving space for the file has failed, silence to fill
+       gaps with, and the dither with its integer samples */
+    SF sf;
+    uint64_t next;
+    uint64_t written;
+    uint64_t header_frames;
+    int reserve;
+    sample_t *silence;
+    Dither dither;
+    int32_t *pcm;
+} Export;
+
+struct ExportThread {
+    Source sources[EXPORT_MAX_SOURCES];
+    atomic_int nsources;
+    Export exports[LIGHTNING_MAX_EXPORTS];
+    /* buffer the realtime thread interleaves into */
+    sample_t *ibuf;
     /* JACK sample rate */
     nframes_t output_sr;
     /* output channels */
     channels_t channels;
+    /* frames each ringbuffer is asked to hold, and frames each
+       block holds */
+    nframes_t ring_frames;
+    nframes_t block_frames;
+    /* nonzero to write silence in place of gaps */
+    int mark_gaps;
+    /* used by the realtime thread only: the time of the next
+       frame it processes */
+    uint64_t clock;
+    /* the end of the cycle the realtime thread is on, which it
+       sets before writing the cycle, and the end of the last
+       cycle it has written */
+    atomic_ullong writing_to;
+    atomic_ullong written_to;
+    /* held while exports are added to or taken from the recorders
+       of a source */
+    Mutex recorders_mutex;
+    /* output taps, nonzero while the realtime thread is writing
+       to them, and the number of ExportThread_tap_close calls
+       waiting on written for it to finish */
+    _Atomic(OutputTap) taps[LIGHTNING_MAX_TAPS];
+    atomic_int writing;
+    atomic_int closers;
+    sem_t written;
+    /* posted when there is data to read, an export has been
+       closed or running has changed */
+    sem_t wake;
+    atomic_int running;
+    /* statistics */
+    atomic_ulong high_water;
+    atomic_ulong overruns;
+    atomic_ullong dropped;
+    atomic_ulong ngaps;
+    atomic_ullong frames_written;
     /* reference to the thread */
     LightningThread thread;
-    /* flag to tell whether we are currently exporting,
-       and associated mutex to protect concurrent reads/writes */
-    volatile int exporting;
-    Mutex exporting_mutex;
 };
 
 static void *
 export_thread(void *arg);
 
+static void *
+encoder_thread(void *arg);
+
 /**
- * Start a thread for writing to a file
+ * Start a thread for writing to files
  */
 ExportThread
-ExportThread_create(nframes_t output_sr, channels_t channels)
+ExportThread_create(nframes_t output_sr, channels_t channels,
+                    const LightningOptions *options)
 {
     ExportThread thread;
+    Export *export;
+    int i;
+    nframes_t ring_frames = (nframes_t) ((uint64_t) options->export_buffer_ms *
+                                         output_sr / 1000);
+    ring_frames = ring_frames > EXPORT_MIN_RING_FRAMES
+        ? ring_frames
+        : EXPORT_MIN_RING_FRAMES;
     NEW(thread);
-    thread->exporting = 0;
     thread->channels = channels;
-    thread->exporting_mutex = Mutex_init();
     thread->output_sr = output_sr;
-    thread->start_event = LightningEvent_init(NULL);
-    thread->data_event = LightningEvent_init(NULL);
-    thread->rb = Ringbuffer_init(4096 * SAMPLE_SIZE * channels);
+    thread->ring_frames = ring_frames;
+    thread->block_frames = EXPORT_BLOCK_BYTES / (SAMPLE_SIZE * channels);
+    thread->ibuf = ALLOC(EXPORT_CHUNK_FRAMES * SAMPLE_SIZE * channels);
+    thread->mark_gaps = options->export_mark_gaps;
+    thread->clock = 0;
+    atomic_init(&thread->nsources, 0);
+    atomic_init(&thread->writing_to, 0);
+    atomic_init(&thread->written_to, 0);
+    for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+        export = &thread->exports[i];
+        atomic_init(&export->state, Export_FREE);
+        export->thread = thread;
+        export->file = NULL;
+        atomic_init(&export->stop, EXPORT_OPEN);
+        export->ranges = Ringbuffer_init(EXPORT_MAX_RANGES * sizeof(Range) + 1);
+        sem_init(&export->wake, 0, 0);
+        export->encoder = NULL;
+        export->silence = CALLOC(EXPORT_CHUNK_FRAMES * channels, SAMPLE_SIZE);
+        export->dither = NULL;
+        export->pcm = ALLOC(EXPORT_CHUNK_FRAMES * channels * sizeof(int32_t));
+    }
+    atomic_init(&thread->high_water, 0);
+    atomic_init(&thread->overruns, 0);
+    atomic_init(&thread->dropped, 0);
+    atomic_init(&thread->ngaps, 0);
+    atomic_init(&thread->frames_written, 0);
+    if (0 != mlock(thread->ibuf, EXPORT_CHUNK_FRAMES * SAMPLE_SIZE * channels)) {
+        LOG(Warn, "Could not %s export buffers", "mlock");
+    }
+    thread->recorders_mutex = Mutex_init();
+    for (i = 0; i < LIGHTNING_MAX_TAPS; i++) {
+        atomic_init(&thread->taps[i], NULL);
+    }
+    atomic_init(&thread->writing, 0);
+    atomic_init(&thread->closers, 0);
+    sem_init(&thread->written, 0, 0);
+    sem_init(&thread->wake, 0, 0);
+    atomic_init(&thread->running, 1);
     thread->thread = LightningThread_create(export_thread, thread);
     return thread;
 }
 
+int
+ExportThread_add_source(ExportThread thread, const char *name,
+                        sample_t **bufs)
+{
+    assert(thread && name && bufs);
+    int i, index = atomic_load(&thread->nsources);
+    size_t name_bytes = strlen(name);
+    Source *source;
+    if (index == EXPORT_MAX_SOURCES) {
+        LOG(Error, "no room to export %s", name);
+        return -1;
+    }
+    source = &thread->sources[index];
+    source->name = ALLOC(name_bytes + 1);
+    memcpy(source->name, name, name_bytes + 1);
+    source->bufs = bufs;
+    /* one byte of a ringbuffer is never written, and it may
+       be rounded up, so ask it how much it holds */
+    source->rb = Ringbuffer_init(thread->ring_frames * SAMPLE_SIZE *
+                                 thread->channels +
+                                 EXPORT_RING_RECORDS * sizeof(Record) + 1);
+    source->ring_bytes = Ringbuffer_write_space(source->rb);
+    if (0 != Ringbuffer_mlock(source->rb)) {
+        LOG(Warn, "Could not %s export buffers", "mlock");
+    }
+    atomic_init(&source->recorders, 0);
+    atomic_init(&source->from, EXPORT_OPEN);
+    source->dropping = 0;
+    source->record.time = source->record.frames = 0;
+    source->block = NULL;
+    for (i = 0; i < EXPORT_BLOCKS; i++) {
+        source->blocks[i].frames = ALLOC(thread->block_frames * SAMPLE_SIZE *
+                                         thread->channels);
+        source->blocks[i].time = 0;
+        source->blocks[i].fill = 0;
+        atomic_init(&source->blocks[i].refs, 0);
+        source->blocks[i].source = source;
+    }
+    sem_init(&source->free_blocks, 0, EXPORT_BLOCKS);
+    source->thread = thread;
+    /* the other threads see the source from here on */
+    atomic_store(&thread->nsources, index + 1);
+    return index;
+}
+
 /**
- * Write some samples to the export thread's ring buffer
- * Beware that this function must be realtime safe!
+ * Interleave @a frames frames of @a channels buffers in @a bufs,
+ * starting at frame @a offset, into @a out.
+ * Inlined into the kernels below, which each get a copy of the
+ * loop with the channel count known at compile time for the
+ * compiler to unroll and vectorize.
  */
-nframes_t
-ExportThread_write(ExportThread thread, sample_t **bufs, nframes_t frames)
+static inline void
+interleave_channels(sample_t *out, sample_t **bufs, const int channels,
+                    nframes_t offset, nframes_t frames)
 {
-    assert(thread);
-
-    int is_exporting = ExportThread_is_exporting(thread);
+    int chan;
+    nframes_t frame;
+    for (chan = 0; chan < channels; chan++) {
+        sample_t *restrict dst = out + chan;
+        const sample_t *restrict src = bufs[chan] + offset;
+        for (frame = 0; frame < frames; frame++) {
+            dst[frame * channels] = src[frame];
+        }
+    }
+}
 
-    if (is_exporting) {
-        channels_t chan = 0;
-        nframes_t frame = 0;
-        size_t bytes_total = frames * thread->channels * SAMPLE_SIZE;
+static void
+interleave_stereo(sample_t *out, sample_t **bufs, nframes_t offset,
+                  nframes_t frames)
+{
+    nframes_t frame;
+    sample_t *restrict dst = out;
+    const sample_t *restrict left = bufs[0] + offset;
+    const sample_t *restrict right = bufs[1] + offset;
+    for (frame = 0; frame < frames; frame++) {
+        dst[2 * frame] = left[frame];
+        dst[2 * frame + 1] = right[frame];
+    }
+}
 
-        /* allocate and fill interleaved buffer */
+static void
+interleave(sample_t *out, sample_t **bufs, channels_t channels,
+           nframes_t offset, nframes_t frames)
+{
+    switch (channels) {
+    case 1:
+        memcpy(out, bufs[0] + offset, frames * SAMPLE_SIZE);
+        break;
+    case 2:
+        interleave_stereo(out, bufs, offset, frames);
+        break;
+    default:
+        interleave_channels(out, bufs, channels, offset, frames);
+        break;
+    }
+}
 
-        sample_t ibuf[ frames * thread->channels * SAMPLE_SIZE ];
-        for (chan = 0; chan < thread->channels; chan++) {
-            for (frame = 0; frame < frames; frame++) {
-                ibuf[ chan + (frame * thread->channels) ] = bufs[chan][frame];
-            }
+/**
+ * Find whether the realtime thread can write the cycle from
+ * @a start to the ringbuffer of @a source, and where in the
+ * cycle to start (the first frame an export wants) if it can.
+ * Counts the cycle as dropped if it does not fit.
+ *
+ * @return nonzero if the cycle is to be written from @a record
+ */
+static int
+start_record(ExportThread thread, Source *source, uint64_t start,
+             nframes_t frames, Record *record)
+{
+    const size_t frame_bytes = thread->channels * SAMPLE_SIZE;
+    uint64_t from = atomic_load(&source->from);
+    size_t space, bytes;
+    unsigned long fill;
+    if (from >= start + frames) {
+        return 0;
+    }
+    record->time = from > start ? from : start;
+    record->frames = start + frames - record->time;
+    bytes = sizeof(Record) + record->frames * frame_bytes;
+    /* cycles go into the ringbuffer whole or not at all */
+    space = Ringbuffer_write_space(source->rb);
+    if (space < bytes) {
+        atomic_fetch_add_explicit(&thread->overruns, 1,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&thread->dropped, record->frames,
+                                  memory_order_relaxed);
+        if (!source->dropping) {
+            atomic_fetch_add_explicit(&thread->ngaps, 1,
+                                      memory_order_relaxed);
+            source->dropping = 1;
         }
+        return 0;
+    }
+    source->dropping = 0;
+    Ringbuffer_write(source->rb, record, sizeof(Record));
+    fill = (source->ring_bytes - space + bytes) / frame_bytes;
+    if (fill > atomic_load_explicit(&thread->high_water,
+                                    memory_order_relaxed)) {
+        atomic_store_explicit(&thread->high_water, fill,
+                              memory_order_relaxed);
+    }
+    return 1;
+}
 
-        /* write interleaved data to ringbuffer */
+/**
+ * Write a cycle of every source that is being exported or
+ * tapped to its ringbuffer and those of its output taps.
+ * Beware that this function must be realtime safe!
+ */
+void
+ExportThread_write(ExportThread thread, nframes_t frames)
+{
+    assert(thread);
+    const size_t frame_bytes = thread->channels * SAMPLE_SIZE;
+    int s, t, ntaps, closers, nsources = atomic_load(&thread->nsources);
+    int recorders, record, recording = 0;
+    nframes_t first, skip, done, chunk;
+    uint64_t start = thread->clock;
+    OutputTap taps[LIGHTNING_MAX_TAPS], tap;
+    Record rec;
+    Source *source;
 
-        size_t bytes_written =                          \
-            Ringbuffer_write(thread->rb, ibuf, bytes_total);
+    /* the output taps are not freed while this is nonzero */
+    atomic_fetch_add(&thread->writing, 1);
+    thread->clock += frames;
+    /* exports opened from here on start after this cycle */
+    atomic_store(&thread->writing_to, thread->clock);
+    for (s = 0; s < nsources; s++) {
+        source = &thread->sources[s];
+        ntaps = 0;
+        for (t = 0; t < LIGHTNING_MAX_TAPS; t++) {
+            tap = atomic_load(&thread->taps[t]);
+            /* a cycle is written to a tap whole, or not at all */
+            if (tap && OutputTap_source(tap) == s &&
+                OutputTap_begin(tap, frames)) {
+                taps[ntaps++] = tap;
+            }
+        }
+        recorders = atomic_load(&source->recorders);
+        if (recorders == 0) {
+            source->dropping = 0;
+        }
+        recording |= recorders > 0;
+        record = recorders > 0 &&
+            start_record(thread, source, start, frames, &rec);
+        if (!record && ntaps == 0) {
+            continue;
+        }
+        /* interleave each chunk once for the ringbuffer and
+           every tap */
+        first = ntaps == 0 ? (nframes_t) (rec.time - start) : 0;
+        for (done = first; done < frames; done += chunk) {
+            chunk = frames - done;
+            chunk = chunk < EXPORT_CHUNK_FRAMES ? chunk : EXPORT_CHUNK_FRAMES;
+            interleave(thread->ibuf, source->bufs, thread->channels, done,
+                       chunk);
+            if (record && start + done + chunk > rec.time) {
+                skip = start + done < rec.time
+                    ? (nframes_t) (rec.time - start - done)
+                    : 0;
+                Ringbuffer_write(source->rb,
+                                 thread->ibuf + skip * thread->channels,
+                                 (chunk - skip) * frame_bytes);
+            }
+            for (t = 0; t < ntaps; t++) {
+                OutputTap_write(taps[t], thread->ibuf, chunk);
+            }
+        }
+        for (t = 0; t < ntaps; t++) {
+            OutputTap_end(taps[t], frames);
+        }
+    }
+    atomic_store(&thread->written_to, thread->clock);
+    atomic_fetch_sub(&thread->writing, 1);
+    for (closers = atomic_load(&thread->closers); closers > 0; closers--) {
+        sem_post(&thread->written);
+    }
+    if (recording) {
+        sem_post(&thread->wake);
+    }
+}
 
-        LightningEvent_broadcast(thread->data_event, NULL);
+/**
+ * Find the SF_FMT for @a settings.
+ *
+ * @return 0 on success, nonzero if the settings are not supported
+ */
+static int
+export_format(const LightningExportSettings *settings, SF_FMT *format)
+{
+    switch (settings->format) {
+    case ExportFormat_WAV:  *format = SF_FMT_WAV;  break;
+    case ExportFormat_AIFF: *format = SF_FMT_AIFF; break;
+    case ExportFormat_FLAC: *format = SF_FMT_FLAC; break;
+    case ExportFormat_OGG:  *format = SF_FMT_OGG;  break;
+    default:
+        return 1;
+    }
+    switch (settings->bits) {
+    case 0:
+    case 16:
+    case 24:
+        return 0;
+    case 32:
+        /* FLAC has no float samples */
+        return *format == SF_FMT_FLAC;
+    default:
+        return 1;
+    }
+}
 
-        return bytes_written / (thread->channels * SAMPLE_SIZE);
-    } else {
+/**
+ * Bits @a settings are dithered to, or 0 if they are not.
+ */
+static int
+dither_bits(const LightningExportSettings *settings, SF_FMT format)
+{
+    if (settings->dither == ExportDither_NONE || format == SF_FMT_OGG) {
         return 0;
     }
+    if (settings->bits == 16 || settings->bits == 24) {
+        return settings->bits;
+    }
+    /* FLAC is always integer, 24 bits unless asked for 16 */
+    return format == SF_FMT_FLAC ? 24 : 0;
 }
 
+/**
+ * Find the source named @a name, or the master output (the
+ * first source) if @a name is NULL.
+ *
+ * @return index of the source, or -1 if there is none
+ */
 static int
-ExportThread_set_exporting(ExportThread thread, int val)
+find_source(ExportThread thread, const char *name)
 {
-    if (Mutex_lock(thread->exporting_mutex)) {
-        LOG(Warn, "could not lock %s", "exporting_mutex");
-        return 1;
+    int s, nsources = atomic_load(&thread->nsources);
+    if (name == NULL) {
+        return nsources > 0 ? 0 : -1;
+    }
+    for (s = 0; s < nsources; s++) {
+        if (strcmp(thread->sources[s].name, name) == 0) {
+            return s;
+        }
     }
-    LOG(Debug, "setting exporting to %d", val);
-    thread->exporting = val;
-    return Mutex_unlock(thread->exporting_mutex);
+    return -1;
 }
 
+/**
+ * Claim a slot for an export, joining the encoder thread of the
+ * export that had it last.
+ *
+ * @return index of the slot, or -1 if they are all in use
+ */
 static int
-ExportThread_is_exporting(ExportThread thread)
+claim_export(ExportThread thread)
 {
-    int result;
-    if (Mutex_lock(thread->exporting_mutex)) {
-        LOG(Warn, "could not lock %s", "exporting_mutex");
-        return 0;
+    int i, state;
+    Export *export;
+    for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+        export = &thread->exports[i];
+        state = Export_FREE;
+        if (atomic_compare_exchange_strong(&export->state, &state,
+                                           Export_OPENING)) {
+            return i;
+        }
+        state = Export_DONE;
+        if (atomic_compare_exchange_strong(&export->state, &state,
+                                           Export_OPENING)) {
+            LightningThread_join(export->encoder);
+            LightningThread_free(&export->encoder);
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Lower the earliest start time of @a source to @a time.
+ */
+static void
+record_from(Source *source, uint64_t time)
+{
+    if (time < atomic_load(&source->from)) {
+        atomic_store(&source->from, time);
     }
-    result = thread->exporting != 0;
-    /* LOG(Debug, "exporting = %d", thread->exporting); */
-    Mutex_unlock(thread->exporting_mutex);
-    return result;
 }
 
 int
-ExportThread_start(ExportThread thread, const char *file)
+ExportThread_open(ExportThread thread, const char *file,
+                  const LightningExportSettings *settings, position_t start)
 {
-    assert(thread && thread->start_event);
-    LightningEvent_signal(thread->start_event, (void *) file);
-    return ExportThread_set_exporting(thread, 1);
+    assert(thread && file && settings);
+    int index, source;
+    uint64_t now;
+    SF_FMT format;
+    Export *export;
+    if (export_format(settings, &format)) {
+        LOG(Error, "can not export %s in format %d with %d bits",
+            file, (int) settings->format, settings->bits);
+        return -1;
+    }
+    source = find_source(thread, settings->bus);
+    if (source < 0) {
+        LOG(Error, "can not export %s, there is no bus %s", file,
+            settings->bus);
+        return -1;
+    }
+    index = claim_export(thread);
+    if (index < 0) {
+        LOG(Warn, "too many exports, not exporting to %s", file);
+        return -1;
+    }
+    export = &thread->exports[index];
+    export->file = (char *) file;
+    export->format = format;
+    export->bits = settings->bits;
+    export->quality = settings->quality;
+    export->dither_bits = dither_bits(settings, format);
+    export->shaped = settings->dither == ExportDither_SHAPED;
+    export->source = source;
+    export->finished = 0;
+    atomic_store(&export->stop, EXPORT_OPEN);
+    Mutex_lock(thread->recorders_mutex);
+    /* the realtime thread writes every cycle that ends after
+       writing_to, from the earliest start time, once it sees
+       the export, so lower the start time and count it before
+       looking at writing_to */
+    record_from(&thread->sources[source], start);
+    atomic_fetch_add(&thread->sources[source].recorders, 1);
+    now = atomic_load(&thread->writing_to);
+    if (start < now) {
+        if (start > 0) {
+            LOG(Warn, "frame %lu has passed, exporting %s from frame %lu",
+                (unsigned long) start, file, (unsigned long) now);
+        }
+        start = now;
+    }
+    export->start = export->handed = start;
+    atomic_store(&export->state, Export_OPEN);
+    Mutex_unlock(thread->recorders_mutex);
+    LOG(Debug, "start exporting %s from %s at frame %lu", file,
+        thread->sources[source].name, (unsigned long) export->start);
+    export->encoder = LightningThread_create(encoder_thread, export);
+    return index;
 }
 
 int
-ExportThread_stop(ExportThread thread)
+ExportThread_close(ExportThread thread, int export, position_t stop)
 {
     assert(thread);
-    int error = ExportThread_set_exporting(thread, 0);
-    if (error) {
-        LOG(Warn, "could not set exporting to %d", 0);
-        return error;
+    unsigned long long open = EXPORT_OPEN;
+    /* frames up to writing_to may have been handed out already */
+    uint64_t now = atomic_load(&thread->writing_to);
+    if (stop < now) {
+        if (stop > 0) {
+            LOG(Warn, "frame %lu has passed, stopping export %d at "
+                "frame %lu", (unsigned long) stop, export,
+                (unsigned long) now);
+        }
+        stop = now;
     }
-    return LightningEvent_broadcast(thread->data_event, NULL);
+    if (export < 0 || export >= LIGHTNING_MAX_EXPORTS ||
+        atomic_load(&thread->exports[export].state) != Export_OPEN ||
+        !atomic_compare_exchange_strong(&thread->exports[export].stop, &open,
+                                        stop)) {
+        LOG(Warn, "export %d is not running", export);
+        return 1;
+    }
+    return sem_post(&thread->wake);
+}
+
+int
+ExportThread_tap_open(ExportThread thread, const char *bus,
+                      nframes_t ring_frames)
+{
+    assert(thread);
+    int t, source = find_source(thread, bus);
+    OutputTap tap, none;
+    if (source < 0) {
+        LOG(Error, "can not tap bus %s, there is no such bus", bus);
+        return -1;
+    }
+    ring_frames = ring_frames > EXPORT_MIN_RING_FRAMES
+        ? ring_frames
+        : EXPORT_MIN_RING_FRAMES;
+    tap = OutputTap_init(source, thread->channels, ring_frames);
+    for (t = 0; t < LIGHTNING_MAX_TAPS; t++) {
+        none = NULL;
+        if (atomic_compare_exchange_strong(&thread->taps[t], &none, tap)) {
+            return t;
+        }
+    }
+    LOG(Warn, "too many output taps, not tapping %s",
+        bus ? bus : "master");
+    OutputTap_free(&tap);
+    return -1;
+}
+
+OutputTap
+ExportThread_tap(ExportThread thread, int tap)
+{
+    assert(thread);
+    if (tap < 0 || tap >= LIGHTNING_MAX_TAPS) {
+        return NULL;
+    }
+    return atomic_load(&thread->taps[tap]);
+}
+
+int
+ExportThread_tap_close(ExportThread thread, int tap)
+{
+    assert(thread);
+    OutputTap closed;
+    if (tap < 0 || tap >= LIGHTNING_MAX_TAPS ||
+        (closed = atomic_exchange(&thread->taps[tap], NULL)) == NULL) {
+        LOG(Warn, "output tap %d is not open", tap);
+        return 1;
+    }
+    /* the realtime thread may have loaded the tap before it was
+       taken out, in which case it posts written once it is done */
+    atomic_fetch_add(&thread->closers, 1);
+    while (atomic_load(&thread->writing)) {
+        sem_wait(&thread->written);
+    }
+    atomic_fetch_sub(&thread->closers, 1);
+    OutputTap_free(&closed);
+    return 0;
+}
+
+position_t
+ExportThread_time(ExportThread thread)
+{
+    assert(thread);
+    return atomic_load(&thread->writing_to);
 }
 
 /**
- * Destroy an export thread
+ * Destroy an export thread. Exports that are still running stop
+ * where the realtime thread has got to.
  */
 void
 ExportThread_free(ExportThread *thread)
 {
     assert(thread && *thread);
     ExportThread t = *thread;
-    Ringbuffer_free(&t->rb);
-    LightningEvent_free(&t->start_event);
-    LightningEvent_free(&t->data_event);
-    Mutex_free(&t->exporting_mutex);
-    FREE(t->file);
+    Export *export;
+    OutputTap tap;
+    int i, s;
+    atomic_store(&t->running, 0);
+    sem_post(&t->wake);
+    LightningThread_join(t->thread);
+    LightningThread_free(&t->thread);
+    Mutex_free(&t->recorders_mutex);
+    for (i = 0; i < LIGHTNING_MAX_TAPS; i++) {
+        if ((tap = atomic_load(&t->taps[i]))) {
+            OutputTap_free(&tap);
+        }
+    }
+    for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+        export = &t->exports[i];
+        if (export->encoder) {
+            LightningThread_join(export->encoder);
+            LightningThread_free(&export->encoder);
+        }
+        Ringbuffer_free(&export->ranges);
+        sem_destroy(&export->wake);
+        FREE(export->silence);
+        FREE(export->pcm);
+    }
+    /* encoder threads post it when they release a block */
+    sem_destroy(&t->wake);
+    sem_destroy(&t->written);
+    for (s = 0; s < atomic_load(&t->nsources); s++) {
+        FREE(t->sources[s].name);
+        Ringbuffer_free(&t->sources[s].rb);
+        for (i = 0; i < EXPORT_BLOCKS; i++) {
+            FREE(t->sources[s].blocks[i].frames);
+        }
+        sem_destroy(&t->sources[s].free_blocks);
+    }
+    FREE(t->ibuf);
+    FREE(*thread);
 }
 
-static void *
-export_thread(void *arg)
+void
+ExportThread_stats(ExportThread thread, LightningExportStats *stats)
 {
-    static const nframes_t samples_wanted = 512;
+    assert(thread && stats);
+    stats->ring_frames = atomic_load(&thread->nsources) > 0
+        ? (thread->sources[0].ring_bytes - EXPORT_RING_RECORDS * sizeof(Record)) /
+          (SAMPLE_SIZE * thread->channels)
+        : thread->ring_frames;
+    stats->high_water_frames = atomic_load(&thread->high_water);
+    stats->overruns = atomic_load(&thread->overruns);
+    stats->dropped_frames = atomic_load(&thread->dropped);
+    stats->gaps = atomic_load(&thread->ngaps);
+    stats->frames_written = atomic_load(&thread->frames_written);
+}
 
-    ExportThread thread = (ExportThread) arg;
-    const size_t bytes_wanted = samples_wanted * SAMPLE_SIZE * thread->channels;
-    sample_t buf[samples_wanted * thread->channels];
+/**
+ * Put the calling thread in the lowest best-effort I/O class.
+ */
+static void
+lower_io_priority(void)
+{
+#ifdef SYS_ioprio_set
+    /* 0 is the calling thread */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | IOPRIO_BE_LOWEST)) {
+        LOG(Warn, "Could not lower the I/O priority of the %s thread",
+            "export");
+    }
+#endif
+}
 
- wait_for_start_event:
-    /* wait for the start event */
-    LightningEvent_wait(thread->start_event);
+/**
+ * Take a block of @a source that no one holds. If there is none,
+ * wait for the encoder threads to finish with one if @a wait is
+ * nonzero, and otherwise return NULL.
+ */
+static Block *
+take_block(Source *source, int wait)
+{
+    int i, refs;
+    if (wait) {
+        sem_wait(&source->free_blocks);
+    } else if (sem_trywait(&source->free_blocks) != 0) {
+        return NULL;
+    }
+    for (i = 0; i < EXPORT_BLOCKS; i++) {
+        refs = 0;
+        if (atomic_compare_exchange_strong(&source->blocks[i].refs,
+                                           &refs, 1)) {
+            source->blocks[i].fill = 0;
+            return &source->blocks[i];
+        }
+    }
+    /* the semaphore counts the blocks no one holds */
+    assert(0);
+    return NULL;
+}
 
-    char *file = (char *) LightningEvent_value(thread->start_event);
-    LOG(Debug, "exporting to %s", file);
-    SF sf = SF_open_write(file, thread->channels, thread->output_sr, SF_FMT_WAV);
+static void
+release_block(Block *block)
+{
+    if (atomic_fetch_sub(&block->refs, 1) == 1) {
+        sem_post(&block->source->free_blocks);
+        /* the source may be waiting for it */
+        sem_post(&block->source->thread->wake);
+    }
+}
 
-    if (sf == NULL) {
-        LOG(Error, "%s", SF_strerror(sf));
-        return NULL;
+/**
+ * Hand @a export the frames of @a block it has not been handed
+ * yet, up to its stop time.
+ */
+static void
+hand_range(Export *export, Block *block)
+{
+    Range range;
+    uint64_t stop = atomic_load(&export->stop);
+    uint64_t from = export->handed > block->time ? export->handed : block->time;
+    uint64_t to = block->time + block->fill;
+    to = to < stop ? to : stop;
+    if (to <= from) {
+        return;
     }
+    range.block = block;
+    range.time = from;
+    range.offset = (nframes_t) (from - block->time);
+    range.frames = (nframes_t) (to - from);
+    atomic_fetch_add(&block->refs, 1);
+    Ringbuffer_write(export->ranges, &range, sizeof(Range));
+    export->handed = to;
+    sem_post(&export->wake);
+}
 
-    LOG(Debug, "start exporting %s", file);
-    
-    int exporting = 1;
+/**
+ * Hand every export of @a source its part of the block being
+ * filled, and start a new one if there is a block free (or
+ * wait for one if @a wait is nonzero).
+ */
+static void
+retire_block(ExportThread thread, Source *source, int wait)
+{
+    int i;
+    Export *export;
+    for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+        export = &thread->exports[i];
+        if (atomic_load(&export->state) == Export_OPEN &&
+            !export->finished &&
+            &thread->sources[export->source] == source) {
+            hand_range(export, source->block);
+        }
+    }
+    release_block(source->block);
+    source->block = take_block(source, wait);
+}
 
-    while (1) {
-        /* wait for data */
-        LightningEvent_wait(thread->data_event);
+/**
+ * Hand @a export what it has left, and tell its encoder thread
+ * to finish.
+ */
+static void
+end_export(ExportThread thread, Export *export)
+{
+    Source *source = &thread->sources[export->source];
+    Export *other;
+    Range range;
+    uint64_t from = EXPORT_OPEN;
+    int i;
+    hand_range(export, source->block);
+    range.block = NULL;
+    range.time = atomic_load(&export->stop);
+    range.offset = range.frames = 0;
+    Ringbuffer_write(export->ranges, &range, sizeof(Range));
+    sem_post(&export->wake);
+    export->finished = 1;
+    /* the source is written from the earliest start of the
+       exports that are left */
+    Mutex_lock(thread->recorders_mutex);
+    for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+        other = &thread->exports[i];
+        if (atomic_load(&other->state) == Export_OPEN &&
+            !other->finished && other->source == export->source &&
+            other->start < from) {
+            from = other->start;
+        }
+    }
+    atomic_store(&source->from, from);
+    atomic_fetch_sub(&source->recorders, 1);
+    Mutex_unlock(thread->recorders_mutex);
+}
+
+/**
+ * Move everything in the ringbuffer of @a source into blocks.
+ * If the encoder threads hold every block of the source, leave
+ * the rest in the ringbuffer (unless @a wait is nonzero) so the
+ * other sources are drained in the meantime.
+ *
+ * @return nonzero if the ringbuffer was emptied
+ */
+static int
+drain(ExportThread thread, Source *source, int wait)
+{
+    const size_t frame_bytes = thread->channels * SAMPLE_SIZE;
+    Block *block;
+    uint64_t n;
+    for (;;) {
+        if (source->block == NULL) {
+            source->block = take_block(source, wait);
+            if (source->block == NULL) {
+                return 0;
+            }
+        }
+        block = source->block;
+        if (source->record.frames == 0) {
+            if (Ringbuffer_read_space(source->rb) < sizeof(Record)) {
+                return 1;
+            }
+            Ringbuffer_read(source->rb, (char *) &source->record,
+                            sizeof(Record));
+            /* frames that do not follow on from the block's
+               start a new one */
+            if (block->fill > 0 &&
+                block->time + block->fill != source->record.time) {
+                retire_block(thread, source, wait);
+            }
+            continue;
+        }
+        if (block->fill == 0) {
+            block->time = source->record.time;
+        }
+        n = Ringbuffer_read_space(source->rb) / frame_bytes;
+        n = n < source->record.frames ? n : source->record.frames;
+        if (n > thread->block_frames - block->fill) {
+            n = thread->block_frames - block->fill;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        Ringbuffer_read(source->rb,
+                        (char *) (block->frames + block->fill * thread->channels),
+                        n * frame_bytes);
+        block->fill += n;
+        source->record.time += n;
+        source->record.frames -= n;
+        if (block->fill == thread->block_frames) {
+            retire_block(thread, source, wait);
+        }
+    }
+}
 
-        exporting = ExportThread_is_exporting(thread);
+static void *
+export_thread(void *arg)
+{
+    ExportThread thread = (ExportThread) arg;
+    Export *export;
+    uint64_t written_to;
+    int i, s, running, seen = 0;
+    int drained[EXPORT_MAX_SOURCES];
 
-        if (exporting) {
-            /* read data from the ringbuffer and write it to the file,
-               assume data in ringbuffer is interleaved */
-            size_t bytes_read = 0;
-            nframes_t frames_read = 0;
-            do {
-                bytes_read = Ringbuffer_read(thread->rb,
-                                             (void *) buf,
-                                             bytes_wanted);
+    do {
+        sem_wait(&thread->wake);
+        running = atomic_load(&thread->running);
 
-                frames_read = bytes_read / (SAMPLE_SIZE * thread->channels);
-                SF_write(sf, buf, frames_read);
-            } while (bytes_read == bytes_wanted);
-        } else {
-            LOG(Debug, "done exporting %s", file);
-            break;
+        /* every cycle that ends by written_to is in the
+           ringbuffers (or was dropped) before they are drained */
+        written_to = atomic_load(&thread->written_to);
+        seen = atomic_load(&thread->nsources);
+        /* a source whose blocks are all with its encoder threads
+           is skipped, and drained once one of them is released;
+           on the way out every source is drained to the end */
+        for (s = 0; s < seen; s++) {
+            drained[s] = drain(thread, &thread->sources[s], !running);
+        }
+        for (i = 0; i < LIGHTNING_MAX_EXPORTS; i++) {
+            export = &thread->exports[i];
+            if (atomic_load(&export->state) != Export_OPEN ||
+                export->finished || export->source >= seen ||
+                !drained[export->source]) {
+                continue;
+            }
+            /* on the way out, stop where the realtime thread
+               has got to */
+            if (!running && atomic_load(&export->stop) > written_to) {
+                atomic_store(&export->stop, written_to);
+            }
+            if (atomic_load(&export->stop) <= written_to) {
+                end_export(thread, export);
+            }
+        }
+    } while (running);
+
+    return NULL;
+}
+
+/**
+ * Write @a frames frames of @a buf to the file of @a export,
+ * dithering them first if it is dithered.
+ */
+static void
+write_frames(ExportThread thread, Export *export, sample_t *buf,
+             nframes_t frames)
+{
+    nframes_t done, n;
+    if (export->dither == NULL) {
+        SF_write(export->sf, buf, frames);
+    } else {
+        for (done = 0; done < frames; done += n) {
+            n = frames - done;
+            n = n < EXPORT_CHUNK_FRAMES ? n : EXPORT_CHUNK_FRAMES;
+            Dither_process(export->dither, buf + done * thread->channels,
+                           export->pcm, n);
+            SF_write_int(export->sf, export->pcm, n);
         }
     }
+    export->written += frames;
+    atomic_fetch_add(&thread->frames_written, frames);
+}
 
-    SF_close(&sf);
+/**
+ * Log a gap of @a frames frames, and with mark_gaps write
+ * silence in its place.
+ */
+static void
+fill_gap(ExportThread thread, Export *export, uint64_t frames)
+{
+    nframes_t n;
+    export->next += frames;
+    if (export->sf == NULL) {
+        return;
+    }
+    LOG(Warn, "export of %s dropped %lu frames at frame %lu",
+        export->file, (unsigned long) frames,
+        (unsigned long) export->written);
+    while (thread->mark_gaps && frames > 0) {
+        n = frames < EXPORT_CHUNK_FRAMES ? frames : EXPORT_CHUNK_FRAMES;
+        write_frames(thread, export, export->silence, n);
+        frames -= n;
+    }
+}
 
-    LOG(Debug, "closed %s", file);
-    FREE(file);
+/**
+ * Write @a range to the file of @a export, reserving space ahead
+ * of it first, and bring the header up to date every
+ * EXPORT_HEADER_SECONDS.
+ */
+static void
+write_range(ExportThread thread, Export *export, const Range *range)
+{
+    export->next = range->time + range->frames;
+    if (export->sf == NULL) {
+        return;
+    }
+    if (export->reserve && SF_reserve(export->sf, EXPORT_RESERVE_BYTES)) {
+        LOG(Debug, "could not reserve space for %s", export->file);
+        export->reserve = 0;
+    }
+    write_frames(thread, export,
+                 range->block->frames + range->offset * thread->channels,
+                 range->frames);
+    SF_writeback(export->sf);
+    if (export->written - export->header_frames >=
+        (uint64_t) EXPORT_HEADER_SECONDS * thread->output_sr) {
+        if (SF_update_header(export->sf)) {
+            LOG(Warn, "could not update the header of %s", export->file);
+        }
+        export->header_frames = export->written;
+    }
+}
+
+static void *
+encoder_thread(void *arg)
+{
+    Export *export = (Export *) arg;
+    ExportThread thread = export->thread;
+    Range range;
+
+    lower_io_priority();
+    export->sf = SF_open_write(export->file, thread->channels,
+                               thread->output_sr, export->format,
+                               export->bits, export->quality);
+    if (export->sf == NULL) {
+        LOG(Error, "could not export to %s", export->file);
+    }
+    if (export->dither_bits) {
+        export->dither = Dither_init(thread->channels, export->dither_bits,
+                                     export->shaped);
+    }
+    export->next = export->start;
+    export->written = export->header_frames = 0;
+    export->reserve = 1;
 
-    goto wait_for_start_event;
+    for (;;) {
+        sem_wait(&export->wake);
+        Ringbuffer_read(export->ranges, (char *) &range, sizeof(Range));
+        if (range.time > export->next) {
+            fill_gap(thread, export, range.time - export->next);
+        }
+        if (range.block == NULL) {
+            break;
+        }
+        write_range(thread, export, &range);
+        release_block(range.block);
+    }
 
+    if (export->sf) {
+        SF_close(&export->sf);
+        LOG(Debug, "done exporting %s", export->file);
+    }
+    if (export->dither) {
+        Dither_free(&export->dither);
+    }
+    FREE(export->file);
+    atomic_store(&export->state, Export_DONE);
     return NULL;
 }
@@ -2,52 +2,134 @@
 #define EXPORT_THREAD_H_INCLUDED
 
 #include "lightning.h"
+#include "output-tap.h"
 
 typedef struct ExportThread *ExportThread;
 
 /**
- * Start a thread for writing to a file
+ * Start a thread for writing to files
  *
  * @param  output_sr - Output sample rate
  * @param  channels - Output channels
+ * @param  options - export_buffer_ms sizes the ringbuffers, and
+ *                   export_mark_gaps fills dropped frames with silence
  *
  * @return ExportThread structure
  */
 ExportThread
-ExportThread_create(nframes_t output_sr, channels_t channels);
+ExportThread_create(nframes_t output_sr, channels_t channels,
+                    const LightningOptions *options);
 
 /**
- * Make the export thread wait for data
+ * Add something that can be exported: buffers, one per output
+ * channel, that hold a cycle of audio whenever
+ * ExportThread_write is called. The first source added is the
+ * master output, which exports of no bus record.
+ * Must not be called while another source is being added.
  *
  * @param  thread - ExportThread, can not be NULL
- * @param  bufs - Sample buffers
- * @param  frames - Number of frames to write. Each buffer in @a bufs must contain this many frames.
+ * @param  name - name exports find the source by
+ * @param  bufs - buffers, which must stay at the same address
+ *                for as long as @a thread exists
+ *
+ * @return index of the source, or -1 if there is no room for it
+ */
+int
+ExportThread_add_source(ExportThread thread, const char *name,
+                        sample_t **bufs);
+
+/**
+ * Hand the export thread a cycle of every source that is being
+ * exported.
+ * Realtime safe: this takes no locks and does not allocate.
+ * Cycles that do not fit in a ringbuffer are dropped, and
+ * counted in the statistics.
+ *
+ * @param  thread - ExportThread, can not be NULL
+ * @param  frames - Number of frames in the cycle. Each buffer of
+ *                  every source must contain this many frames.
  */
-nframes_t
-ExportThread_write(ExportThread thread, sample_t **bufs, nframes_t frames);
+void
+ExportThread_write(ExportThread thread, nframes_t frames);
 
 /**
- * Start exporting to a file.
- * Fails if the export thread is already exporting.
+ * Start exporting the source named by @a settings (the master
+ * output if its bus is NULL) to a file, which is encoded on a
+ * thread of its own. The first frame exported is the one at
+ * time @a start (see ExportThread_time), which may be part way
+ * through a cycle. If that time has passed (0 always has), the
+ * export starts with the cycle after the one the realtime thread
+ * is on.
+ * On success @a file belongs to the export, which frees it.
  *
  * @param  thread - ExportThread, can not be NULL
  * @param  file - file to save exported data in
+ * @param  settings - format, bit depth, quality and bus of the file
+ * @param  start - time of the first frame to export
  *
- * @return 0 on success, nonzero on failure
+ * @return the number of the export, or -1 on failure (including
+ *         settings that are not supported, and too many exports)
  */
 int
-ExportThread_start(ExportThread thread, const char *file);
+ExportThread_open(ExportThread thread, const char *file,
+                  const LightningExportSettings *settings, position_t start);
 
 /**
- * Stop exporting to a file.
- * Does nothing if the export thread is not currently exporting.
+ * Stop an export before the frame at time @a stop, or after the
+ * cycle the realtime thread is on if that time has passed (0
+ * always has). Its file is finished in the background. An
+ * export can only be stopped once.
  *
  * @param  thread - ExportThread
+ * @param  export - number of the export
+ * @param  stop - time of the frame after the last one to export
+ *
+ * @return 0 on success, nonzero if the export is not running
+ */
+int
+ExportThread_close(ExportThread thread, int export, position_t stop);
+
+/**
+ * Time of the first frame of the next cycle the realtime thread
+ * processes, counting frames from the first cycle. A sample
+ * played now starts at about this time.
+ */
+position_t
+ExportThread_time(ExportThread thread);
+
+/**
+ * Open an output tap of the mix bus named @a bus (the master
+ * output if it is NULL) holding at least @a ring_frames frames.
+ * The realtime thread writes every cycle to it from the next one
+ * on.
+ *
+ * @return the number of the tap, or -1 on failure (there is no
+ *         such bus, or LIGHTNING_MAX_TAPS taps are open)
+ */
+int
+ExportThread_tap_open(ExportThread thread, const char *bus,
+                      nframes_t ring_frames);
+
+/**
+ * The output tap numbered @a tap, or NULL if it is not open.
+ */
+OutputTap
+ExportThread_tap(ExportThread thread, int tap);
+
+/**
+ * Close an output tap, waiting for the realtime thread to finish
+ * writing to it. No read of the tap can be in progress.
  *
- * @return 0 on success, nonzero on failure
+ * @return 0 on success, nonzero if the tap is not open
  */
 int
-ExportThread_stop(ExportThread thread);
+ExportThread_tap_close(ExportThread thread, int tap);
+
+/**
+ * Get statistics for exporting.
+ */
+void
+ExportThread_stats(ExportThread thread, LightningExportStats *stats);
 
 /**
  * Destroy an export thread
@@ -0,0 +1,244 @@
+package lightning
+
+import (
+	"os"
+	"path/filepath"
+	"syscall"
+	"testing"
+	"time"
+)
+
+func TestExportIsFrameExact(t *testing.T) {
+	const cycle = 256
+	for _, span := range [][2]uint64{
+		{0, cycle},                    // whole cycles
+		{300, 1000},                   // part way through cycles at both ends
+		{cycle + 1, 2*cycle - 1},      // inside one cycle
+		{5 * cycle, 5*cycle + 140000}, // across more than one block
+	} {
+		start, stop := span[0], span[1]
+		file := filepath.Join(t.TempDir(), "ramp.wav")
+		cycles := int(stop/cycle) + 2
+		if err := exportRamp(file, cycle, cycles, start, stop); err != nil {
+			t.Fatal(err)
+		}
+		channels, err := readWAV(file)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(channels) != 2 {
+			t.Fatalf("export has %d channels, want 2", len(channels))
+		}
+		if frames := uint64(len(channels[0])); frames != stop-start {
+			t.Fatalf("export from %d to %d has %d frames, want %d", start, stop, frames, stop-start)
+		}
+		for i := range channels[0] {
+			want := float32(start+uint64(i)) / rampScale
+			if channels[0][i] != want || channels[1][i] != -want {
+				t.Fatalf("export from %d to %d frame %d: got %v %v, want %v %v",
+					start, stop, i, channels[0][i], channels[1][i], want, -want)
+			}
+		}
+	}
+}
+
+func TestExportReportsOverruns(t *testing.T) {
+	// cycles of more than a ringbuffer holds are always dropped,
+	// and the small ones are drained before the next
+	const small, big = 256, 8192
+	cycles := []int{small, small, small, big, big, small, small, big, small, small}
+	var total, dropped uint64
+	for _, frames := range cycles {
+		total += uint64(frames)
+		if frames == big {
+			dropped += big
+		}
+	}
+	for _, markGaps := range []bool{false, true} {
+		file := filepath.Join(t.TempDir(), "gaps.wav")
+		thread := newExportThread(2, 1, markGaps)
+		thread.addSource("master")
+		settings := DefaultExportSettings()
+		settings.Bits = 32
+		export, err := thread.open(file, settings, 0)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if err := thread.close(export, total); err != nil {
+			t.Fatal(err)
+		}
+		if ring := thread.stats().RingFrames; ring >= big {
+			t.Fatalf("ringbuffer holds %d frames, want fewer than %d", ring, big)
+		}
+		for _, frames := range cycles {
+			thread.write(frames, ramp)
+			time.Sleep(2 * time.Millisecond)
+		}
+		stats := thread.stats()
+		if stats.Overruns != 3 || stats.DroppedFrames != dropped || stats.Gaps != 2 {
+			t.Fatalf("mark gaps %v: %d overruns, %d frames dropped, %d gaps, want 3, %d, 2",
+				markGaps, stats.Overruns, stats.DroppedFrames, stats.Gaps, dropped)
+		}
+		// the frames of the file, and where they came from
+		var want []uint64
+		var kept []bool
+		var at uint64
+		for _, frames := range cycles {
+			for i := 0; i < frames; i++ {
+				if frames != big || markGaps {
+					want = append(want, at)
+					kept = append(kept, frames != big)
+				}
+				at++
+			}
+		}
+		for wait := 0; thread.stats().FramesWritten < uint64(len(want)) && wait < 1000; wait++ {
+			time.Sleep(time.Millisecond)
+		}
+		if written := thread.stats().FramesWritten; written != uint64(len(want)) {
+			t.Fatalf("mark gaps %v: %d frames written, want %d", markGaps, written, len(want))
+		}
+		thread.free()
+		channels, err := readWAV(file)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(channels[0]) != len(want) {
+			t.Fatalf("mark gaps %v: export has %d frames, want %d", markGaps, len(channels[0]), len(want))
+		}
+		for i, at := range want {
+			left, right := ramp(0, 0, at), ramp(0, 1, at)
+			if !kept[i] {
+				left, right = 0, 0
+			}
+			if channels[0][i] != left || channels[1][i] != right {
+				t.Fatalf("mark gaps %v: frame %d is %v %v, want %v %v",
+					markGaps, i, channels[0][i], channels[1][i], left, right)
+			}
+		}
+	}
+}
+
+// allocated is the size of file and the disk space it takes up, both
+// 0 until the export thread has created it
+func allocated(t *testing.T, file string) (int64, int64) {
+	t.Helper()
+	info, err := os.Stat(file)
+	if os.IsNotExist(err) {
+		return 0, 0
+	} else if err != nil {
+		t.Fatal(err)
+	}
+	return info.Size(), info.Sys().(*syscall.Stat_t).Blocks * 512
+}
+
+func TestExportReservesSpaceAhead(t *testing.T) {
+	const cycle = 4096
+	// four and a half 1 MiB blocks of stereo float frames
+	const frames = 9 * 65536
+	dir := t.TempDir()
+	probe, err := os.Create(filepath.Join(dir, "probe"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	canReserve := syscall.Fallocate(int(probe.Fd()), 1, 0, 1<<20) == nil // FALLOC_FL_KEEP_SIZE
+	probe.Close()
+
+	file := filepath.Join(dir, "long.wav")
+	thread := newExportThread(2, frames*1000/48000+1000, false)
+	thread.addSource("master")
+	settings := DefaultExportSettings()
+	settings.Bits = 32
+	export, err := thread.open(file, settings, 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := thread.close(export, frames); err != nil {
+		t.Fatal(err)
+	}
+	for thread.time < frames/2 {
+		thread.write(cycle, ramp)
+	}
+	size, disk := allocated(t, file)
+	for wait := 0; size < 1<<20 && wait < 1000; wait++ {
+		time.Sleep(time.Millisecond)
+		size, disk = allocated(t, file)
+	}
+	if size < 1<<20 {
+		t.Fatal("no block was written")
+	}
+	if canReserve && disk < size+32<<20 {
+		t.Errorf("while exporting, %d bytes take up %d, want room reserved ahead", size, disk)
+	}
+	for thread.time < frames {
+		thread.write(cycle, ramp)
+	}
+	thread.free()
+
+	size, disk = allocated(t, file)
+	if disk > size+1<<20 {
+		t.Errorf("once exported, %d bytes take up %d, want the reserved space given back", size, disk)
+	}
+	channels, err := readWAV(file)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(channels[0]) != frames {
+		t.Fatalf("export has %d frames, want %d", len(channels[0]), frames)
+	}
+	for i := range channels[0] {
+		if channels[0][i] != ramp(0, 0, uint64(i)) || channels[1][i] != ramp(0, 1, uint64(i)) {
+			t.Fatalf("frame %d is %v %v, want %v %v", i, channels[0][i], channels[1][i],
+				ramp(0, 0, uint64(i)), ramp(0, 1, uint64(i)))
+		}
+	}
+}
+
+func TestBusesExportSeparately(t *testing.T) {
+	const frames = 5000
+	thread := newExportThread(2, 1000, false)
+	thread.addSource("master")
+	thread.addSource("drums")
+	// each source has a ramp of its own
+	busRamp := func(source int, ch int, t uint64) float32 {
+		return ramp(source, ch, t) + float32(source)
+	}
+	dir := t.TempDir()
+	settings := DefaultExportSettings()
+	settings.Bits = 32
+	files := []string{filepath.Join(dir, "master.wav"), filepath.Join(dir, "drums.wav")}
+	for source, bus := range []string{"", "drums"} {
+		settings.Bus = bus
+		export, err := thread.open(files[source], settings, 0)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if err := thread.close(export, frames); err != nil {
+			t.Fatal(err)
+		}
+	}
+	settings.Bus = "keys"
+	if _, err := thread.open(filepath.Join(dir, "keys.wav"), settings, 0); err == nil {
+		t.Fatal("exported a bus that does not exist")
+	}
+	for thread.time < frames {
+		thread.write(256, busRamp)
+	}
+	thread.free()
+	for source, file := range files {
+		channels, err := readWAV(file)
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(channels[0]) != frames {
+			t.Fatalf("%s has %d frames, want %d", file, len(channels[0]), frames)
+		}
+		for i := range channels[0] {
+			left, right := busRamp(source, 0, uint64(i)), busRamp(source, 1, uint64(i))
+			if channels[0][i] != left || channels[1][i] != right {
+				t.Fatalf("%s frame %d is %v %v, want %v %v",
+					file, i, channels[0][i], channels[1][i], left, right)
+			}
+		}
+	}
+}
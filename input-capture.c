@@ -0,0 +1,208 @@
+#include <assert.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "input-capture.h"
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+
+/**
+ * Channel buffers of a take, its sample rate, how far they have
+ * been filled, and nonzero once the take has been cut.
+ */
+typedef struct Take {
+    sample_t **bufs;
+    nframes_t size;
+    nframes_t samplerate;
+    atomic_uint frames;
+    atomic_int cut;
+} Take;
+
+struct InputCapture {
+    channels_t channels;
+    /* the running take, NULL if there is none */
+    _Atomic(Take *) take;
+    /* nonzero while the realtime thread is writing to the take */
+    atomic_int writing;
+    /* set by InputCapture_stop when it has to wait for writing to
+       drop to zero, in which case whoever takes it back to zero
+       clears it and posts done */
+    atomic_int stopping;
+    sem_t done;
+    /* held by whoever is starting or stopping a take, so there
+       is only one take at a time */
+    atomic_flag busy;
+};
+
+InputCapture
+InputCapture_init(channels_t channels)
+{
+    assert(channels > 0);
+    InputCapture capture;
+    NEW(capture);
+    capture->channels = channels;
+    atomic_init(&capture->take, NULL);
+    atomic_init(&capture->writing, 0);
+    atomic_init(&capture->stopping, 0);
+    sem_init(&capture->done, 0, 0);
+    atomic_flag_clear(&capture->busy);
+    return capture;
+}
+
+int
+InputCapture_start(InputCapture capture, nframes_t frames,
+                   nframes_t samplerate)
+{
+    assert(capture && frames > 0);
+    const size_t bytes = (size_t) frames * SAMPLE_SIZE;
+    channels_t chan;
+    Take *take;
+    if (atomic_flag_test_and_set(&capture->busy)) {
+        LOG(Warn, "already capturing %d channels", capture->channels);
+        return 1;
+    }
+    NEW(take);
+    take->bufs = CALLOC(capture->channels, sizeof(sample_t *));
+    take->size = frames;
+    take->samplerate = samplerate;
+    atomic_init(&take->frames, 0);
+    atomic_init(&take->cut, 0);
+    for (chan = 0; chan < capture->channels; chan++) {
+        take->bufs[chan] = ALLOC(bytes);
+        /* fault every page in now rather than in the realtime
+           thread, and keep them in */
+        memset(take->bufs[chan], 0, bytes);
+        if (0 != mlock(take->bufs[chan], bytes)) {
+            LOG(Warn, "Could not %s capture buffers", "mlock");
+        }
+    }
+    atomic_store(&capture->take, take);
+    return 0;
+}
+
+/**
+ * Done with the take, wake InputCapture_stop if it is waiting
+ * for that. Realtime safe.
+ */
+static void
+release(InputCapture capture)
+{
+    if (atomic_fetch_sub(&capture->writing, 1) == 1 &&
+        atomic_exchange(&capture->stopping, 0)) {
+        sem_post(&capture->done);
+    }
+}
+
+void
+InputCapture_write(InputCapture capture, sample_t **in, nframes_t frames)
+{
+    Take *take;
+    nframes_t at, n;
+    channels_t chan;
+    /* the take is not freed while this is nonzero */
+    atomic_fetch_add(&capture->writing, 1);
+    take = atomic_load(&capture->take);
+    if (take && !atomic_load_explicit(&take->cut, memory_order_relaxed)) {
+        at = atomic_load_explicit(&take->frames, memory_order_relaxed);
+        n = take->size - at;
+        n = n < frames ? n : frames;
+        for (chan = 0; chan < capture->channels; chan++) {
+            memcpy(take->bufs[chan] + at, in[chan], n * SAMPLE_SIZE);
+        }
+        atomic_store_explicit(&take->frames, at + n, memory_order_release);
+    }
+    release(capture);
+}
+
+int
+InputCapture_cut(InputCapture capture)
+{
+    assert(capture);
+    Take *take;
+    atomic_fetch_add(&capture->writing, 1);
+    take = atomic_load(&capture->take);
+    if (take) {
+        atomic_store(&take->cut, 1);
+    }
+    release(capture);
+    return take != NULL;
+}
+
+nframes_t
+InputCapture_frames(InputCapture capture)
+{
+    assert(capture);
+    nframes_t frames = 0;
+    Take *take;
+    atomic_fetch_add(&capture->writing, 1);
+    take = atomic_load(&capture->take);
+    if (take) {
+        frames = atomic_load_explicit(&take->frames, memory_order_acquire);
+    }
+    release(capture);
+    return frames;
+}
+
+sample_t **
+InputCapture_stop(InputCapture capture, nframes_t *frames,
+                  nframes_t *samplerate)
+{
+    assert(capture && frames && samplerate);
+    sample_t **bufs;
+    channels_t chan;
+    Take *take = atomic_exchange(&capture->take, NULL);
+    if (take == NULL) {
+        LOG(Warn, "not capturing %d channels", capture->channels);
+        return NULL;
+    }
+    /* the take is out of reach now, wait for anyone who got it
+       before it was taken out. If writing is already zero we
+       clear stopping ourselves, unless somebody leaving beat us
+       to it, in which case they post done */
+    atomic_store(&capture->stopping, 1);
+    if (atomic_load(&capture->writing) != 0 ||
+        !atomic_exchange(&capture->stopping, 0)) {
+        while (sem_wait(&capture->done) != 0 && errno == EINTR)
+            ;
+    }
+    *frames = atomic_load(&take->frames);
+    *samplerate = take->samplerate;
+    if (*frames == take->size) {
+        LOG(Warn, "take filled its %u frames and was cut short",
+            take->size);
+    }
+    /* the take is kept for as long as it is cached, so give
+       back what it did not use */
+    for (chan = 0; chan < capture->channels; chan++) {
+        munlock(take->bufs[chan], (size_t) take->size * SAMPLE_SIZE);
+        RESIZE(take->bufs[chan], (long) (*frames > 0 ? *frames : 1) *
+               SAMPLE_SIZE);
+    }
+    bufs = take->bufs;
+    FREE(take);
+    atomic_flag_clear(&capture->busy);
+    return bufs;
+}
+
+void
+InputCapture_free(InputCapture *capture)
+{
+    assert(capture && *capture);
+    channels_t chan;
+    nframes_t frames, samplerate;
+    sample_t **bufs;
+    if (atomic_load(&(*capture)->take)) {
+        bufs = InputCapture_stop(*capture, &frames, &samplerate);
+        for (chan = 0; chan < (*capture)->channels; chan++) {
+            FREE(bufs[chan]);
+        }
+        FREE(bufs);
+    }
+    sem_destroy(&(*capture)->done);
+    FREE(*capture);
+}
@@ -0,0 +1,84 @@
+/**
+ * Capturing JACK input into the sample cache
+ *
+ * A take is recorded into channel buffers that are allocated,
+ * locked and faulted in before it starts, so the realtime thread
+ * only copies frames into memory that is already there. When the
+ * take is stopped the buffers are cut down to the frames captured,
+ * unlocked and handed to the caller, which publishes them in the
+ * sample cache (see Samples_add_take); any resampling happens
+ * there, off the realtime thread.
+ */
+#ifndef INPUT_CAPTURE_H_INCLUDED
+#define INPUT_CAPTURE_H_INCLUDED
+
+#include "lightning.h"
+
+typedef struct InputCapture *InputCapture;
+
+/**
+ * Set up capturing of @a channels input channels.
+ */
+InputCapture
+InputCapture_init(channels_t channels);
+
+/**
+ * Allocate buffers for a take of up to @a frames frames at
+ * @a samplerate and start capturing into them from the next cycle
+ * on. A take that fills its buffers stops capturing, but is kept
+ * until InputCapture_stop.
+ *
+ * @return 0 on success, nonzero if a take is already running
+ */
+int
+InputCapture_start(InputCapture capture, nframes_t frames,
+                   nframes_t samplerate);
+
+/**
+ * Copy a cycle of input into the running take, if there is one.
+ * Realtime safe.
+ *
+ * @param  in - buffers of every input channel, each holding
+ *              @a frames frames
+ */
+void
+InputCapture_write(InputCapture capture, sample_t **in, nframes_t frames);
+
+/**
+ * Stop the running take from capturing any more frames, keeping
+ * what it has until InputCapture_stop. Used when the frames that
+ * would follow could not go in the same take, such as when the
+ * sample rate changes.
+ *
+ * @return nonzero if there was a take to cut
+ */
+int
+InputCapture_cut(InputCapture capture);
+
+/**
+ * Frames captured by the running take so far.
+ */
+nframes_t
+InputCapture_frames(InputCapture capture);
+
+/**
+ * Stop the running take, waiting for the realtime thread to be
+ * done with it.
+ *
+ * @param  frames - set to the number of frames captured
+ * @param  samplerate - set to the sample rate the take started at
+ *
+ * @return the channel buffers of the take, each holding @a frames
+ *         frames (or one frame if there are none) and no longer
+ *         locked, which belong to the caller from now on (free each
+ *         and then the array with FREE), or NULL if no take is
+ *         running
+ */
+sample_t **
+InputCapture_stop(InputCapture capture, nframes_t *frames,
+                  nframes_t *samplerate);
+
+void
+InputCapture_free(InputCapture *capture);
+
+#endif
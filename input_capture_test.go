@@ -0,0 +1,143 @@
+package lightning
+
+import (
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// captured is the input channel ch has at frame time t
+func captured(ch int, t uint64) float32 {
+	return float32(t)/rampScale + float32(ch)
+}
+
+// checkTake checks that take holds frames frames of input from frame
+// time from on
+func checkTake(t *testing.T, what string, take [][]float32, frames int, from uint64) {
+	t.Helper()
+	for ch := range take {
+		if len(take[ch]) != frames {
+			t.Fatalf("%s: channel %d has %d frames, want %d", what, ch, len(take[ch]), frames)
+		}
+		for i, v := range take[ch] {
+			if want := captured(ch, from+uint64(i)); v != want {
+				t.Fatalf("%s: channel %d frame %d is %v, want %v", what, ch, i, v, want)
+			}
+		}
+	}
+}
+
+func TestCaptureTakes(t *testing.T) {
+	capture := newCapture(2)
+	defer capture.free()
+	if _, _, err := capture.stop(); err == nil {
+		t.Fatal("stopped a take that was never started")
+	}
+	if capture.cut() {
+		t.Fatal("cut a take that was never started")
+	}
+
+	// input before a take is not captured
+	capture.write(256, captured)
+	if err := capture.start(48000, 44100); err != nil {
+		t.Fatal(err)
+	}
+	if err := capture.start(48000, 44100); err == nil {
+		t.Fatal("started a take while one was running")
+	}
+	from := capture.time
+	for c := 0; c < 10; c++ {
+		capture.write(1000, captured)
+	}
+	if frames := capture.frames(); frames != 10000 {
+		t.Fatalf("take has %d frames, want 10000", frames)
+	}
+	take, samplerate, err := capture.stop()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if samplerate != 44100 {
+		t.Fatalf("take is at %d Hz, want 44100", samplerate)
+	}
+	checkTake(t, "take", take, 10000, from)
+
+	// a cut take keeps what it had
+	if err := capture.start(48000, 48000); err != nil {
+		t.Fatal(err)
+	}
+	from = capture.time
+	capture.write(3000, captured)
+	if !capture.cut() {
+		t.Fatal("could not cut a running take")
+	}
+	capture.write(3000, captured)
+	take, samplerate, err = capture.stop()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if samplerate != 48000 {
+		t.Fatalf("cut take is at %d Hz, want 48000", samplerate)
+	}
+	checkTake(t, "cut take", take, 3000, from)
+
+	// a full take stops at its size, part way through a cycle
+	if err := capture.start(2500, 48000); err != nil {
+		t.Fatal(err)
+	}
+	from = capture.time
+	for c := 0; c < 4; c++ {
+		capture.write(1000, captured)
+	}
+	take, _, err = capture.stop()
+	if err != nil {
+		t.Fatal(err)
+	}
+	checkTake(t, "full take", take, 2500, from)
+
+	// an empty take has no frames
+	if err := capture.start(1000, 48000); err != nil {
+		t.Fatal(err)
+	}
+	take, _, err = capture.stop()
+	if err != nil {
+		t.Fatal(err)
+	}
+	checkTake(t, "empty take", take, 0, 0)
+}
+
+func TestCaptureStopsWhileWriting(t *testing.T) {
+	const size = 5000
+	capture := newCapture(2)
+	defer capture.free()
+	var done atomic.Bool
+	finished := make(chan struct{})
+	// the realtime thread, which never waits for a take
+	go func() {
+		defer close(finished)
+		for !done.Load() {
+			capture.write(64, captured)
+		}
+	}()
+	for round := 0; round < 60; round++ {
+		if err := capture.start(size, 48000); err != nil {
+			t.Fatal(err)
+		}
+		// stop some takes at once, and let others fill up
+		for capture.frames() < round%3*size/2 {
+			time.Sleep(10 * time.Microsecond)
+		}
+		take, _, err := capture.stop()
+		if err != nil {
+			t.Fatal(err)
+		}
+		if len(take[0]) > size {
+			t.Fatalf("round %d: take has %d frames, want at most %d", round, len(take[0]), size)
+		}
+		if len(take[0]) > 0 {
+			// it starts wherever the writer was, and has no holes
+			checkTake(t, "take", take, len(take[0]), uint64(take[0][0]*rampScale))
+		}
+	}
+	done.Store(true)
+	<-finished
+}
@@ -0,0 +1,681 @@
+package lightning
+
+// Access to parts of the engine that the package's tests check
+// directly, without a JACK server.
+
+// #include <stdlib.h>
+// #include "bank.h"
+// #include "blocks.h"
+// #include "codec.h"
+// #include "convert.h"
+// #include "deadlines.h"
+// #include "decoder.h"
+// #include "disk-io.h"
+// #include "dither.h"
+// #include "export-thread.h"
+// #include "input-capture.h"
+// #include "lightning.h"
+// #include "mem.h"
+// #include "samples.h"
+//
+// /* free the buffers of a take InputCapture_stop hands back */
+// static void
+// free_take(sample_t **bufs, channels_t channels)
+// {
+//     channels_t chan;
+//     for (chan = 0; chan < channels; chan++) {
+//         FREE(bufs[chan]);
+//     }
+//     FREE(bufs);
+// }
+import "C"
+
+import (
+	"errors"
+	"fmt"
+	"time"
+	"unsafe"
+)
+
+// rampScale is what exportRamp divides frame times by
+const rampScale = 16384
+
+// diskRingFrames is the most frames a disk stream holds
+const diskRingFrames = C.DISK_RING_FRAMES
+
+// convertFromFloat converts src to format with Convert_from_float
+func convertFromFloat(format SampleFormat, src []float32) []byte {
+	dst := make([]byte, len(src)*int(C.Convert_size(C.SampleFormat(format))))
+	if len(src) > 0 {
+		C.Convert_from_float(unsafe.Pointer(&dst[0]), C.SampleFormat(format),
+			(*C.sample_t)(unsafe.Pointer(&src[0])), C.nframes_t(len(src)))
+	}
+	return dst
+}
+
+// convertToFloat converts frames samples of src, which is in format,
+// from sample offset on with Convert_to_float
+func convertToFloat(format SampleFormat, src []byte, offset int, frames int, gain float32) []float32 {
+	dst := make([]float32, frames)
+	if frames > 0 {
+		C.Convert_to_float((*C.sample_t)(unsafe.Pointer(&dst[0])), unsafe.Pointer(&src[0]),
+			C.SampleFormat(format), C.nframes_t(offset), C.nframes_t(frames), C.sample_t(gain))
+	}
+	return dst
+}
+
+// convertToFloatStereo converts frames interleaved stereo frames of
+// src, which is in format, from frame offset on with
+// Convert_to_float_stereo
+func convertToFloatStereo(format SampleFormat, src []byte, offset int, frames int, gain float32) ([]float32, []float32) {
+	left := make([]float32, frames)
+	right := make([]float32, frames)
+	if frames > 0 {
+		C.Convert_to_float_stereo((*C.sample_t)(unsafe.Pointer(&left[0])),
+			(*C.sample_t)(unsafe.Pointer(&right[0])), unsafe.Pointer(&src[0]),
+			C.SampleFormat(format), C.nframes_t(offset), C.nframes_t(frames), C.sample_t(gain))
+	}
+	return left, right
+}
+
+// bankEntry is a sample read back from a bank
+type bankEntry struct {
+	Name     string
+	Channels [][]float32
+}
+
+// readBank maps a bank with Bank_open and converts every sample in
+// it to float
+func readBank(file string) (SampleFormat, int, []bankEntry, error) {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	bank := C.Bank_open(cfile)
+	if bank == nil {
+		return 0, 0, nil, errors.New("could not open sample bank")
+	}
+	defer C.Bank_free(&bank)
+	format := C.Bank_format(bank)
+	entries := make([]bankEntry, int(C.Bank_count(bank)))
+	for i := range entries {
+		frames := C.Bank_frames(bank, C.int(i))
+		channels := int(C.Bank_channels(bank, C.int(i)))
+		bufs := unsafe.Slice(C.Bank_buffers(bank, C.int(i)), channels)
+		entries[i].Name = C.GoString(C.Bank_name(bank, C.int(i)))
+		entries[i].Channels = make([][]float32, channels)
+		for ch := range bufs {
+			data := make([]float32, int(frames))
+			if frames > 0 {
+				C.Convert_to_float((*C.sample_t)(unsafe.Pointer(&data[0])), bufs[ch],
+					format, 0, frames, 1.0)
+			}
+			entries[i].Channels[ch] = data
+		}
+	}
+	return SampleFormat(format), int(C.Bank_samplerate(bank)), entries, nil
+}
+
+// exportRamp drives an export thread through cycles cycles of
+// cycleFrames frames of a stereo master output, in which the left
+// channel of the frame at time t is t / rampScale and the right is
+// its negation, and exports it from frame time start to stop to a
+// 32-bit float WAV file
+func exportRamp(file string, cycleFrames int, cycles int, start uint64, stop uint64) error {
+	// the cycles come faster than they would from JACK, so make
+	// room for all of them rather than drop any
+	thread := newExportThread(2, cycleFrames*cycles*1000/48000+1000, false)
+	defer thread.free()
+	thread.addSource("master")
+	settings := DefaultExportSettings()
+	settings.Bits = 32
+	export, err := thread.open(file, settings, start)
+	if err != nil {
+		return err
+	}
+	if err := thread.close(export, stop); err != nil {
+		return err
+	}
+	for c := 0; c < cycles; c++ {
+		thread.write(cycleFrames, ramp)
+	}
+	return nil
+}
+
+// ramp is the left and right channel of the frame at time t of the
+// output exportRamp exports
+func ramp(source int, ch int, t uint64) float32 {
+	if ch == 0 {
+		return float32(t) / rampScale
+	}
+	return -float32(t) / rampScale
+}
+
+// testExportThread is an ExportThread whose sources are written here
+// in place of the realtime thread
+type testExportThread struct {
+	thread   C.ExportThread
+	channels int
+	sources  []**C.sample_t
+	time     uint64
+}
+
+// exportCycleFrames is the most frames testExportThread.write writes
+// at a time
+const exportCycleFrames = 16384
+
+// newExportThread starts an ExportThread at 48 kHz whose
+// ringbuffers hold bufferMs of output
+func newExportThread(channels int, bufferMs int, markGaps bool) *testExportThread {
+	var options C.LightningOptions
+	C.Lightning_default_options(&options)
+	options.export_buffer_ms = C.nframes_t(bufferMs)
+	options.export_mark_gaps = 0
+	if markGaps {
+		options.export_mark_gaps = 1
+	}
+	return &testExportThread{
+		thread:   C.ExportThread_create(48000, C.channels_t(channels), &options),
+		channels: channels,
+	}
+}
+
+// addSource adds a source for exports and taps of the bus name
+func (e *testExportThread) addSource(name string) int {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	bufs := (**C.sample_t)(C.malloc(C.size_t(e.channels) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	for i := range unsafe.Slice(bufs, e.channels) {
+		unsafe.Slice(bufs, e.channels)[i] = (*C.sample_t)(C.malloc(exportCycleFrames * C.sizeof_sample_t))
+	}
+	e.sources = append(e.sources, bufs)
+	return int(C.ExportThread_add_source(e.thread, cname, bufs))
+}
+
+// open starts exporting to file from frame time start
+func (e *testExportThread) open(file string, settings ExportSettings, start uint64) (int, error) {
+	// the export frees its file
+	cfile := C.CString(file)
+	csettings := cExportSettings(settings)
+	defer freeExportSettings(&csettings)
+	export := C.ExportThread_open(e.thread, cfile, &csettings, C.position_t(start))
+	if export < 0 {
+		C.free(unsafe.Pointer(cfile))
+		return 0, errors.New("could not export")
+	}
+	return int(export), nil
+}
+
+// close stops export before frame time stop
+func (e *testExportThread) close(export int, stop uint64) error {
+	if C.ExportThread_close(e.thread, C.int(export), C.position_t(stop)) != 0 {
+		return errors.New("export is not running")
+	}
+	return nil
+}
+
+// write fills every source with a cycle of frames frames, channel ch
+// of source source at frame time t being sample(source, ch, t), and
+// hands it to the export thread
+func (e *testExportThread) write(frames int, sample func(source int, ch int, t uint64) float32) {
+	for source, bufs := range e.sources {
+		for ch, buf := range unsafe.Slice(bufs, e.channels) {
+			data := unsafe.Slice((*float32)(unsafe.Pointer(buf)), frames)
+			for i := range data {
+				data[i] = sample(source, ch, e.time+uint64(i))
+			}
+		}
+	}
+	C.ExportThread_write(e.thread, C.nframes_t(frames))
+	e.time += uint64(frames)
+}
+
+// stats returns ExportThread_stats
+func (e *testExportThread) stats() ExportStats {
+	var cstats C.LightningExportStats
+	C.ExportThread_stats(e.thread, &cstats)
+	return ExportStats{
+		RingFrames:      int(cstats.ring_frames),
+		HighWaterFrames: int(cstats.high_water_frames),
+		Overruns:        uint64(cstats.overruns),
+		DroppedFrames:   uint64(cstats.dropped_frames),
+		Gaps:            uint64(cstats.gaps),
+		FramesWritten:   uint64(cstats.frames_written),
+	}
+}
+
+// tapOpen opens an output tap of bus ("" for the master output)
+// holding at least ringFrames frames
+func (e *testExportThread) tapOpen(bus string, ringFrames int) (int, error) {
+	var cbus *C.char
+	if bus != "" {
+		cbus = C.CString(bus)
+		defer C.free(unsafe.Pointer(cbus))
+	}
+	tap := C.ExportThread_tap_open(e.thread, cbus, C.nframes_t(ringFrames))
+	if tap < 0 {
+		return 0, errors.New("could not open tap")
+	}
+	return int(tap), nil
+}
+
+// tapRead reads up to frames interleaved frames from tap, waiting up
+// to timeoutMs for some
+func (e *testExportThread) tapRead(tap int, frames int, timeoutMs int) []float32 {
+	buf := make([]float32, frames*e.channels)
+	n := C.OutputTap_read(C.ExportThread_tap(e.thread, C.int(tap)),
+		(*C.sample_t)(unsafe.Pointer(&buf[0])), C.nframes_t(frames), C.int(timeoutMs))
+	return buf[:int(n)*e.channels]
+}
+
+// tapStats returns the statistics of tap
+func (e *testExportThread) tapStats(tap int) TapStats {
+	var cstats C.LightningTapStats
+	C.OutputTap_stats(C.ExportThread_tap(e.thread, C.int(tap)), &cstats)
+	return TapStats{
+		Channels:      int(cstats.channels),
+		RingFrames:    int(cstats.ring_frames),
+		FramesWritten: uint64(cstats.frames_written),
+		Overruns:      uint64(cstats.overruns),
+		DroppedFrames: uint64(cstats.dropped_frames),
+	}
+}
+
+// tapClose closes tap
+func (e *testExportThread) tapClose(tap int) error {
+	if C.ExportThread_tap_close(e.thread, C.int(tap)) != 0 {
+		return errors.New("tap is not open")
+	}
+	return nil
+}
+
+// free finishes every export, waits for their files to be closed,
+// and frees the thread and the sources
+func (e *testExportThread) free() {
+	C.ExportThread_free(&e.thread)
+	for _, bufs := range e.sources {
+		for _, buf := range unsafe.Slice(bufs, e.channels) {
+			C.free(unsafe.Pointer(buf))
+		}
+		C.free(unsafe.Pointer(bufs))
+	}
+}
+
+// codecRoundTrip encodes in as one block with Codec_encode and
+// decodes it again, and returns the decoded samples and the size of
+// the block
+func codecRoundTrip(in []int16) ([]int16, int, error) {
+	frames := C.nframes_t(len(in))
+	block := make([]byte, int(C.Codec_max_size(frames)))
+	out := make([]int16, len(in))
+	size := C.Codec_encode((*C.int16_t)(unsafe.Pointer(&in[0])), frames,
+		(*C.uint8_t)(unsafe.Pointer(&block[0])))
+	if C.Codec_decode((*C.uint8_t)(unsafe.Pointer(&block[0])), size,
+		(*C.int16_t)(unsafe.Pointer(&out[0])), frames) != 0 {
+		return nil, 0, errors.New("could not decode block")
+	}
+	return out, int(size), nil
+}
+
+// testBlocks is sample data compressed with Blocks_init
+type testBlocks struct {
+	blocks C.Blocks
+}
+
+// compressBlocks compresses planar channels with Blocks_init
+func compressBlocks(channels [][]float32) (*testBlocks, error) {
+	frames := len(channels[0])
+	bufs := (**C.sample_t)(C.malloc(C.size_t(len(channels)) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	defer C.free(unsafe.Pointer(bufs))
+	ptrs := unsafe.Slice(bufs, len(channels))
+	for ch := range channels {
+		ptrs[ch] = (*C.sample_t)(C.malloc(C.size_t(frames+1) * C.sizeof_sample_t))
+		defer C.free(unsafe.Pointer(ptrs[ch]))
+		copy(unsafe.Slice((*float32)(unsafe.Pointer(ptrs[ch])), frames), channels[ch])
+	}
+	blocks := C.Blocks_init(bufs, C.channels_t(len(channels)), C.nframes_t(frames), nil)
+	if blocks == nil {
+		return nil, errors.New("could not compress")
+	}
+	return &testBlocks{blocks}, nil
+}
+
+// count is the number of blocks per channel
+func (b *testBlocks) count() int {
+	return int(C.Blocks_count(b.blocks))
+}
+
+// decode decodes block block of channel ch with Blocks_decode
+func (b *testBlocks) decode(ch int, block int) ([]int16, error) {
+	out := make([]int16, C.BLOCKS_FRAMES)
+	if C.Blocks_decode(b.blocks, C.channels_t(ch), C.nframes_t(block),
+		(*C.int16_t)(unsafe.Pointer(&out[0]))) != 0 {
+		return nil, fmt.Errorf("could not decode block %d of channel %d", block, ch)
+	}
+	return out[:int(C.Blocks_frames(b.blocks, C.nframes_t(block)))], nil
+}
+
+// decodeAhead reads every block of b in order through a Decoder
+// stream, the way a voice does, except that it waits for the worker
+// to decode the blocks ahead of each one. Each block must still be
+// readable once the stream has moved on to the next.
+func (b *testBlocks) decodeAhead() ([][]int16, error) {
+	decoder := C.Decoder_init()
+	defer C.Decoder_free(&decoder)
+	stream := C.Decoder_open(decoder, b.blocks)
+	defer C.Decoder_close(&stream)
+	channels := int(C.Blocks_channels(b.blocks))
+	count := b.count()
+	out := make([][]int16, channels)
+	read := func(ch int, block int) []int16 {
+		data := C.DecoderStream_block(stream, C.channels_t(ch), C.nframes_t(block))
+		if data == nil {
+			return nil
+		}
+		return unsafe.Slice((*int16)(unsafe.Pointer(data)),
+			int(C.Blocks_frames(b.blocks, C.nframes_t(block))))
+	}
+	for block := 0; block < count; block++ {
+		C.DecoderStream_seek(stream, C.nframes_t(block))
+		last := min(block+C.DECODER_SLOTS-2, count-1)
+		for wait := 0; read(0, last) == nil; wait++ {
+			if wait == 1000 {
+				return nil, fmt.Errorf("block %d was not decoded", last)
+			}
+			time.Sleep(time.Millisecond)
+		}
+		for ch := range out {
+			if block > 0 && read(ch, block-1) == nil {
+				return nil, fmt.Errorf("block %d was dropped on moving to block %d", block-1, block)
+			}
+			data := read(ch, block)
+			if data == nil {
+				return nil, fmt.Errorf("block %d was not decoded", block)
+			}
+			out[ch] = append(out[ch], data...)
+		}
+	}
+	return out, nil
+}
+
+// free frees b
+func (b *testBlocks) free() {
+	C.Blocks_free(&b.blocks)
+}
+
+// deadlinesInsert offers each of deadlines in turn to
+// Deadlines_insert, keeping at most max, and returns the indices
+// into deadlines of the ones it kept, in the order it kept them
+func deadlinesInsert(deadlines []float64, max int) []int {
+	items := (*unsafe.Pointer)(C.malloc(C.size_t(max+1) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	defer C.free(unsafe.Pointer(items))
+	// the items are bytes of this, so their offsets in it are
+	// their indices
+	base := C.malloc(C.size_t(len(deadlines) + 1))
+	defer C.free(base)
+	kept := make([]C.double, max+1)
+	n := C.int(0)
+	for i, d := range deadlines {
+		n = C.Deadlines_insert(items, &kept[0], n, C.int(max),
+			unsafe.Add(base, i), C.double(d))
+	}
+	order := make([]int, int(n))
+	for i, item := range unsafe.Slice(items, int(n)) {
+		order[i] = int(uintptr(item) - uintptr(base))
+	}
+	return order
+}
+
+// testDiskIO is a DiskIO and its I/O thread
+type testDiskIO struct {
+	io C.DiskIO
+}
+
+// testDiskStream is a stream opened with DiskIO_open
+type testDiskStream struct {
+	stream   C.DiskStream
+	channels int
+}
+
+// newDiskIO starts a DiskIO
+func newDiskIO() *testDiskIO {
+	return &testDiskIO{C.DiskIO_init()}
+}
+
+// open opens file for streaming frames frames at samplerate from its
+// start, at the file's pitch
+func (d *testDiskIO) open(file string, samplerate int, frames int) (*testDiskStream, error) {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	stream := C.DiskIO_open(d.io, cfile, C.nframes_t(samplerate), 0,
+		C.nframes_t(frames), 1.0, C.SRCQuality_MEDIUM)
+	if stream == nil {
+		return nil, errors.New("could not open stream")
+	}
+	return &testDiskStream{stream, int(C.DiskStream_channels(stream))}, nil
+}
+
+// stats returns DiskIO_stats
+func (d *testDiskIO) stats() StreamStats {
+	var cstats C.LightningStreamStats
+	C.DiskIO_stats(d.io, &cstats)
+	return StreamStats{
+		Streams:   int(cstats.streams),
+		Underruns: uint64(cstats.underruns),
+		Reads:     uint64(cstats.reads),
+		BytesRead: uint64(cstats.bytes_read),
+	}
+}
+
+// free stops the I/O thread
+func (d *testDiskIO) free() {
+	C.DiskIO_free(&d.io)
+}
+
+// read reads up to frames interleaved frames with DiskStream_read
+func (s *testDiskStream) read(frames int) []float32 {
+	buf := make([]float32, frames*s.channels)
+	n := C.DiskStream_read(s.stream, (*C.sample_t)(unsafe.Pointer(&buf[0])), C.nframes_t(frames))
+	return buf[:int(n)*s.channels]
+}
+
+// close closes the stream
+func (s *testDiskStream) close() {
+	C.DiskIO_close(&s.stream)
+}
+
+// testSamples is a Samples object whose output is written here in
+// place of the realtime thread
+type testSamples struct {
+	samps    C.Samples
+	bufs     **C.sample_t
+	channels int
+}
+
+// samplesCycle is the number of frames written at a time
+const samplesCycle = 256
+
+// newSamples makes a Samples object with the default options at
+// samplerate
+func newSamples(samplerate int) *testSamples {
+	var options C.LightningOptions
+	C.Lightning_default_options(&options)
+	channels := int(options.output_channels)
+	bufs := (**C.sample_t)(C.malloc(C.size_t(channels) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	for i := range unsafe.Slice(bufs, channels) {
+		unsafe.Slice(bufs, channels)[i] = (*C.sample_t)(C.malloc(samplesCycle * C.sizeof_sample_t))
+	}
+	return &testSamples{C.Samples_init(C.nframes_t(samplerate), &options), bufs, channels}
+}
+
+// play starts playing file on mix bus bus at its own pitch and
+// full gain
+func (s *testSamples) play(file string, bus int) error {
+	cfile := C.CString(file)
+	defer C.free(unsafe.Pointer(cfile))
+	if C.Samples_play_on_bus(s.samps, cfile, 1.0, 1.0, C.int(bus)) == nil {
+		return errors.New("could not play sample")
+	}
+	return nil
+}
+
+// write runs Samples_write for a cycle of samplesCycle frames and
+// returns the output channels
+func (s *testSamples) write() ([][]float32, error) {
+	if C.Samples_write(s.samps, s.bufs, C.channels_t(s.channels), samplesCycle) != 0 {
+		return nil, errors.New("could not write samples")
+	}
+	out := make([][]float32, s.channels)
+	for ch, buf := range unsafe.Slice(s.bufs, s.channels) {
+		out[ch] = append([]float32(nil), unsafe.Slice((*float32)(unsafe.Pointer(buf)), samplesCycle)...)
+	}
+	return out, nil
+}
+
+// addBus adds a mix bus with Samples_add_bus
+func (s *testSamples) addBus(name string) int {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	return int(C.Samples_add_bus(s.samps, cname))
+}
+
+// removeBus takes back the last mix bus with Samples_remove_bus
+func (s *testSamples) removeBus(bus int) {
+	C.Samples_remove_bus(s.samps, C.int(bus))
+}
+
+// bus finds a mix bus with Samples_bus
+func (s *testSamples) bus(name string) int {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	return int(C.Samples_bus(s.samps, cname))
+}
+
+// busBuffers returns the address of the summing buffers of bus, and
+// what is in them
+func (s *testSamples) busBuffers(bus int) (uintptr, [][]float32) {
+	bufs := C.Samples_bus_buffers(s.samps, C.int(bus))
+	out := make([][]float32, s.channels)
+	for ch, buf := range unsafe.Slice(bufs, s.channels) {
+		out[ch] = append([]float32(nil), unsafe.Slice((*float32)(unsafe.Pointer(buf)), samplesCycle)...)
+	}
+	return uintptr(unsafe.Pointer(bufs)), out
+}
+
+// setSamplerate starts converting the cache to samplerate with
+// Samples_set_samplerate
+func (s *testSamples) setSamplerate(samplerate int) error {
+	if C.Samples_set_samplerate(s.samps, C.nframes_t(samplerate)) != 0 {
+		return errors.New("could not set sample rate")
+	}
+	return nil
+}
+
+// samplerate is the rate the cache is at
+func (s *testSamples) samplerate() int {
+	return int(C.Samples_samplerate(s.samps))
+}
+
+// free frees the Samples object and the output buffers
+func (s *testSamples) free() {
+	C.Samples_free(&s.samps)
+	for _, buf := range unsafe.Slice(s.bufs, s.channels) {
+		C.free(unsafe.Pointer(buf))
+	}
+	C.free(unsafe.Pointer(s.bufs))
+}
+
+// dither quantizes interleaved frames of src to bits bits with
+// Dither_process, in one call
+func dither(channels int, bits int, shaped bool, src []float32) []int32 {
+	shape := C.int(0)
+	if shaped {
+		shape = 1
+	}
+	d := C.Dither_init(C.channels_t(channels), C.int(bits), shape)
+	defer C.Dither_free(&d)
+	dst := make([]int32, len(src))
+	frames := len(src) / channels
+	if frames > 0 {
+		C.Dither_process(d, (*C.sample_t)(unsafe.Pointer(&src[0])),
+			(*C.int32_t)(unsafe.Pointer(&dst[0])), C.nframes_t(frames))
+	}
+	return dst
+}
+
+// testCapture is an InputCapture whose input is written here in
+// place of the realtime thread
+type testCapture struct {
+	capture  C.InputCapture
+	in       **C.sample_t
+	channels int
+	time     uint64
+}
+
+// captureCycleFrames is the most frames testCapture.write writes at
+// a time
+const captureCycleFrames = 4096
+
+// newCapture sets up capturing of channels channels
+func newCapture(channels int) *testCapture {
+	in := (**C.sample_t)(C.malloc(C.size_t(channels) * C.size_t(unsafe.Sizeof(uintptr(0)))))
+	for i := range unsafe.Slice(in, channels) {
+		unsafe.Slice(in, channels)[i] = (*C.sample_t)(C.malloc(captureCycleFrames * C.sizeof_sample_t))
+	}
+	return &testCapture{C.InputCapture_init(C.channels_t(channels)), in, channels, 0}
+}
+
+// start starts a take of up to frames frames at samplerate
+func (c *testCapture) start(frames int, samplerate int) error {
+	if C.InputCapture_start(c.capture, C.nframes_t(frames), C.nframes_t(samplerate)) != 0 {
+		return errors.New("a take is running")
+	}
+	return nil
+}
+
+// write hands the capture a cycle of frames frames of input, channel
+// ch at frame time t being sample(ch, t)
+func (c *testCapture) write(frames int, sample func(ch int, t uint64) float32) {
+	for ch, buf := range unsafe.Slice(c.in, c.channels) {
+		data := unsafe.Slice((*float32)(unsafe.Pointer(buf)), frames)
+		for i := range data {
+			data[i] = sample(ch, c.time+uint64(i))
+		}
+	}
+	C.InputCapture_write(c.capture, c.in, C.nframes_t(frames))
+	c.time += uint64(frames)
+}
+
+// cut stops the take from capturing more, and reports whether there
+// was one
+func (c *testCapture) cut() bool {
+	return C.InputCapture_cut(c.capture) != 0
+}
+
+// frames is the number of frames the take has captured
+func (c *testCapture) frames() int {
+	return int(C.InputCapture_frames(c.capture))
+}
+
+// stop stops the take and returns what it captured and the rate it
+// started at
+func (c *testCapture) stop() ([][]float32, int, error) {
+	var frames, samplerate C.nframes_t
+	bufs := C.InputCapture_stop(c.capture, &frames, &samplerate)
+	if bufs == nil {
+		return nil, 0, errors.New("no take is running")
+	}
+	defer C.free_take(bufs, C.channels_t(c.channels))
+	take := make([][]float32, c.channels)
+	for ch, buf := range unsafe.Slice(bufs, c.channels) {
+		take[ch] = append([]float32(nil), unsafe.Slice((*float32)(unsafe.Pointer(buf)), int(frames))...)
+	}
+	return take, int(samplerate), nil
+}
+
+// free frees the capture and its input buffers
+func (c *testCapture) free() {
+	C.InputCapture_free(&c.capture)
+	for _, buf := range unsafe.Slice(c.in, c.channels) {
+		C.free(unsafe.Pointer(buf))
+	}
+	C.free(unsafe.Pointer(c.in))
+}
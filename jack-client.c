@@ -4,6 +4,7 @@
  */
 #include <assert.h>
 #include <jack/jack.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +12,7 @@
 
 #include "event.h"
 #include "export-thread.h"
+#include "input-capture.h"
 #include "jack-client.h"
 #include "lightning.h"
 #include "log.h"
@@ -30,15 +32,28 @@ struct JackClient {
     const char *server_name;
     void *data;
     jack_client_t *jack_client;
-    jack_port_t *jack_output_port_1;
-    jack_port_t *jack_output_port_2;
+    /* output ports, one per channel */
+    jack_port_t **output_ports;
+    channels_t channels;
+    /* input ports and their buffers, and the takes captured
+       from them (NULL if there are no input ports) */
+    jack_port_t **input_ports;
+    channels_t input_channels;
+    sample_t **inputs;
+    InputCapture capture;
     AudioCallback audio_callback;
+    /* called with samplerate_data when the sample rate changes */
+    SampleRateCallback samplerate_callback;
+    void *samplerate_data;
     sample_t **buffers;
     /* client state */
     JackClientState state;
     Mutex state_mutex;
-    /* Thread for exporting to audio file */
+    /* Thread for exporting to audio files */
     ExportThread export_thread;
+    /* the export JackClient_export_start started, -1 if there is
+       none and -2 while one is starting */
+    atomic_int export;
 };
 
 /* state-handling functions */
@@ -67,7 +82,17 @@ static int
 samplerate_callback(nframes_t sr,
                     void *data)
 {
+    JackClient client = (JackClient) data;
+    LOG(Info, "JACK sample rate is %u Hz", sr);
+    /* a take is at the rate it started at, so it ends here */
+    if (client->capture && InputCapture_cut(client->capture)) {
+        LOG(Warn, "sample rate changed, take cut short at %u frames",
+            InputCapture_frames(client->capture));
+    }
     /* Notify client code that depends on the output sample rate */
+    if (client->samplerate_callback) {
+        return client->samplerate_callback(sr, client->samplerate_data);
+    }
     return 0;
 }
 
@@ -101,22 +126,36 @@ process(jack_nframes_t nframes, void *arg)
     if (! JackClient_is_processing(client)) {
         return 0;
     }
+    channels_t chan;
+    /* capture input before anything is played in response to it */
+    if (client->capture) {
+        for (chan = 0; chan < client->input_channels; chan++) {
+            client->inputs[chan] = \
+                jack_port_get_buffer(client->input_ports[chan], nframes);
+        }
+        InputCapture_write(client->capture, client->inputs, nframes);
+    }
     /* setup output sample buffers */
-    client->buffers[0] = jack_port_get_buffer(client->jack_output_port_1, nframes);
-    client->buffers[1] = jack_port_get_buffer(client->jack_output_port_2, nframes);
+    for (chan = 0; chan < client->channels; chan++) {
+        client->buffers[chan] = jack_port_get_buffer(client->output_ports[chan],
+                                                     nframes);
+    }
     /* write data to the output buffer */
     int result = client->audio_callback(client->buffers,
-                                        2,
+                                        client->channels,
                                         (nframes_t) nframes,
                                         client->data);
-    /* possible write data to an audio file */
-    ExportThread_write(client->export_thread, client->buffers, nframes);
+    /* possible write data to audio files */
+    ExportThread_write(client->export_thread, nframes);
     return result;
 }
 
 JackClient
-JackClient_init(AudioCallback audio_callback, void *client_data)
+JackClient_init(AudioCallback audio_callback, void *client_data,
+                const LightningOptions *options)
 {
+    assert(options && options->output_channels > 0);
+    channels_t channels = options->output_channels;
     JackClient client;
     NEW(client);
     /* initialize state mutex and set state to Initializing */
@@ -134,8 +173,26 @@ JackClient_init(AudioCallback audio_callback, void *client_data)
     nframes_t sr = jack_get_sample_rate(client->jack_client);
     client->data = client_data;
     client->audio_callback = audio_callback;
-    client->export_thread = ExportThread_create(sr, 2);
-    client->buffers = CALLOC(2, sizeof(sample_t*));
+    client->samplerate_callback = NULL;
+    client->samplerate_data = NULL;
+    client->channels = channels;
+    client->export_thread = ExportThread_create(sr, channels, options);
+    atomic_init(&client->export, -1);
+    client->buffers = CALLOC(channels, sizeof(sample_t*));
+    client->output_ports = CALLOC(channels, sizeof(jack_port_t *));
+    client->input_channels = options->input_channels;
+    if (client->input_channels > 0) {
+        client->input_ports = CALLOC(client->input_channels,
+                                     sizeof(jack_port_t *));
+        client->inputs = CALLOC(client->input_channels, sizeof(sample_t *));
+        client->capture = InputCapture_init(client->input_channels);
+    } else {
+        client->input_ports = NULL;
+        client->inputs = NULL;
+        client->capture = NULL;
+    }
+    /* the output buffers are exported as the master bus */
+    ExportThread_add_source(client->export_thread, "master", client->buffers);
     return client;
 }
 
@@ -175,24 +232,35 @@ int
 JackClient_setup_ports(JackClient client)
 {
     assert(client);
+    channels_t chan;
+    char name[32];
     /* register output ports */
-    client->jack_output_port_1 = \
-        jack_port_register(client->jack_client,
-                           "output_1",
-                           JACK_DEFAULT_AUDIO_TYPE,
-                           JackPortIsOutput,
-                           0);
-
-    client->jack_output_port_2 = \
-        jack_port_register(client->jack_client,
-                           "output_2",
-                           JACK_DEFAULT_AUDIO_TYPE,
-                           JackPortIsOutput,
-                           0);
-
-    if (NULL == client->jack_output_port_2) {
-        fprintf(stderr, "wtf\n");
-        exit(EXIT_FAILURE);
+    for (chan = 0; chan < client->channels; chan++) {
+        snprintf(name, sizeof(name), "output_%d", chan + 1);
+        client->output_ports[chan] = \
+            jack_port_register(client->jack_client,
+                               name,
+                               JACK_DEFAULT_AUDIO_TYPE,
+                               JackPortIsOutput,
+                               0);
+        if (NULL == client->output_ports[chan]) {
+            fprintf(stderr, "Could not register port %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* register input ports */
+    for (chan = 0; chan < client->input_channels; chan++) {
+        snprintf(name, sizeof(name), "input_%d", chan + 1);
+        client->input_ports[chan] = \
+            jack_port_register(client->jack_client,
+                               name,
+                               JACK_DEFAULT_AUDIO_TYPE,
+                               JackPortIsInput,
+                               0);
+        if (NULL == client->input_ports[chan]) {
+            fprintf(stderr, "Could not register port %s\n", name);
+            exit(EXIT_FAILURE);
+        }
     }
     /* set state to Processing */
     if (JackClient_set_state(client, JackClientState_Processing)) {
@@ -203,31 +271,57 @@ JackClient_setup_ports(JackClient client)
 }
 
 int
-JackClient_connect_to(JackClient client, const char *ch1, const char *ch2)
+JackClient_connect_port(JackClient client, int port, const char *dest)
 {
     assert(client);
-
+    if (port < 0 || port >= client->channels) {
+        LOG(Error, "No output port %d\n", port + 1);
+        return 1;
+    }
     int err = jack_connect(client->jack_client,
-                           jack_port_name(client->jack_output_port_1),
-                           ch1);
-    /* connect playback_1 */
+                           jack_port_name(client->output_ports[port]),
+                           dest);
     if (err) {
         LOG(Error, "Could not connect %s to %s\n",
-            jack_port_name(client->jack_output_port_1),
-            ch1);
-        return err;
+            jack_port_name(client->output_ports[port]),
+            dest);
     }
-    /* connect playback_2 */
-    err = jack_connect(client->jack_client,
-                       jack_port_name(client->jack_output_port_2),
-                       ch2);
+    return err;
+}
+
+int
+JackClient_connect_input(JackClient client, int port, const char *src)
+{
+    assert(client);
+    if (port < 0 || port >= client->input_channels) {
+        LOG(Error, "No input port %d\n", port + 1);
+        return 1;
+    }
+    int err = jack_connect(client->jack_client,
+                           src,
+                           jack_port_name(client->input_ports[port]));
     if (err) {
         LOG(Error, "Could not connect %s to %s\n",
-            jack_port_name(client->jack_output_port_2),
-            ch2);
+            src,
+            jack_port_name(client->input_ports[port]));
+    }
+    return err;
+}
+
+int
+JackClient_connect_to(JackClient client, const char *ch1, const char *ch2)
+{
+    assert(client);
+    /* connect playback_1 */
+    int err = JackClient_connect_port(client, 0, ch1);
+    if (err) {
         return err;
     }
-    return 0;
+    /* connect playback_2 (mono clients only have the one) */
+    if (client->channels < 2) {
+        return 0;
+    }
+    return JackClient_connect_port(client, 1, ch2);
 }
 
 void
@@ -250,9 +344,9 @@ JackClient_set_samplerate_callback(JackClient jack,
                                    void *arg)
 {
     assert(jack);
-    return jack_set_sample_rate_callback(jack->jack_client,
-                                         callback,
-                                         arg);
+    jack->samplerate_callback = callback;
+    jack->samplerate_data = arg;
+    return 0;
 }
 
 nframes_t
@@ -265,23 +359,167 @@ JackClient_buffersize(JackClient jack)
 int
 JackClient_playback_ports(JackClient jack)
 {
-    return 2;
+    assert(jack);
+    return jack->channels;
+}
+
+int
+JackClient_capture_ports(JackClient jack)
+{
+    assert(jack);
+    return jack->input_channels;
+}
+
+int
+JackClient_capture_start(JackClient client, nframes_t frames)
+{
+    assert(client);
+    if (client->capture == NULL) {
+        LOG(Error, "can not capture %u frames, there are no input ports",
+            frames);
+        return 1;
+    }
+    /* the take carries its rate from the moment it is armed, so
+       a cut never finds it with the rate of the last one */
+    nframes_t sr = jack_get_sample_rate(client->jack_client);
+    if (InputCapture_start(client->capture, frames, sr)) {
+        return 1;
+    }
+    /* a rate change between reading the rate and arming the take
+       found nothing to cut */
+    if (jack_get_sample_rate(client->jack_client) != sr) {
+        InputCapture_cut(client->capture);
+        LOG(Warn, "sample rate changed, take cut short at %u frames",
+            InputCapture_frames(client->capture));
+    }
+    return 0;
+}
+
+nframes_t
+JackClient_capture_frames(JackClient client)
+{
+    assert(client);
+    return client->capture ? InputCapture_frames(client->capture) : 0;
+}
+
+sample_t **
+JackClient_capture_stop(JackClient client, nframes_t *frames,
+                        nframes_t *samplerate)
+{
+    assert(client && frames && samplerate);
+    if (client->capture == NULL) {
+        LOG(Error, "can not stop capturing, there are %s", "no input ports");
+        return NULL;
+    }
+    return InputCapture_stop(client->capture, frames, samplerate);
 }
 
 /**
  * Start exporting to an audio file
- * Return 0 on success, nonzero on failure
+ * Return the number of the export, or -1 on failure
  */
 int
-JackClient_export_start(JackClient client, const char *file)
+JackClient_export_open(JackClient client, const char *file,
+                       const LightningExportSettings *settings,
+                       position_t start)
 {
     assert(client && client->export_thread);
-    LOG(Debug, "starting export for %s", file);
+    LOG(Debug, "opening export for %s", file);
     size_t len = strlen(file);
     char *copy = ALLOC( len + 1 );
+    int export;
     memcpy(copy, file, len);
     copy[len] = '\0';
-    return ExportThread_start(client->export_thread, copy);
+    export = ExportThread_open(client->export_thread, copy, settings, start);
+    if (export < 0) {
+        FREE(copy);
+    }
+    return export;
+}
+
+int
+JackClient_export_close(JackClient client, int export, position_t stop)
+{
+    assert(client && client->export_thread);
+    return ExportThread_close(client->export_thread, export, stop);
+}
+
+position_t
+JackClient_frame_time(JackClient client)
+{
+    assert(client && client->export_thread);
+    return ExportThread_time(client->export_thread);
+}
+
+int
+JackClient_add_export_source(JackClient client, const char *name,
+                             sample_t **bufs)
+{
+    assert(client && client->export_thread);
+    return ExportThread_add_source(client->export_thread, name, bufs) < 0;
+}
+
+/**
+ * Start exporting to an audio file
+ * Return 0 on success, nonzero on failure
+ */
+int
+JackClient_export_start(JackClient client, const char *file,
+                        const LightningExportSettings *settings)
+{
+    assert(client && client->export_thread);
+    int export = -1;
+    if (!atomic_compare_exchange_strong(&client->export, &export, -2)) {
+        LOG(Warn, "already exporting, not exporting to %s", file);
+        return 1;
+    }
+    export = JackClient_export_open(client, file, settings, 0);
+    atomic_store(&client->export, export);
+    return export < 0;
+}
+
+void
+JackClient_export_stats(JackClient client, LightningExportStats *stats)
+{
+    assert(client && client->export_thread);
+    ExportThread_stats(client->export_thread, stats);
+}
+
+int
+JackClient_tap_open(JackClient client, const char *bus, nframes_t buffer_ms)
+{
+    assert(client && client->export_thread);
+    nframes_t sr = jack_get_sample_rate(client->jack_client);
+    nframes_t frames = (nframes_t) ((uint64_t) sr * buffer_ms / 1000);
+    return ExportThread_tap_open(client->export_thread, bus, frames);
+}
+
+nframes_t
+JackClient_tap_read(JackClient client, int tap, sample_t *buf,
+                    nframes_t frames, int timeout_ms)
+{
+    assert(client && client->export_thread);
+    OutputTap t = ExportThread_tap(client->export_thread, tap);
+    return t ? OutputTap_read(t, buf, frames, timeout_ms) : 0;
+}
+
+int
+JackClient_tap_stats(JackClient client, int tap, LightningTapStats *stats)
+{
+    assert(client && client->export_thread);
+    OutputTap t = ExportThread_tap(client->export_thread, tap);
+    if (!t) {
+        return 1;
+    }
+    OutputTap_stats(t, stats);
+    return 0;
+}
+
+int
+JackClient_tap_close(JackClient client, int tap)
+{
+    assert(client && client->export_thread);
+    return ExportThread_tap_close(client->export_thread, tap);
 }
 
 /**
@@ -292,7 +530,12 @@ int
 JackClient_export_stop(JackClient client)
 {
     assert(client && client->export_thread);
-    return ExportThread_stop(client->export_thread);
+    int export = atomic_load(&client->export);
+    if (export < 0 ||
+        !atomic_compare_exchange_strong(&client->export, &export, -1)) {
+        return 0;
+    }
+    return ExportThread_close(client->export_thread, export, 0);
 }
 
 void
@@ -302,13 +545,15 @@ JackClient_free(JackClient *jack)
     JackClient j = *jack;
     JackClient_set_state(*jack, JackClientState_Finished);
     Mutex_free(&j->state_mutex);
-    /* I don't think we should have to care about freeing the
-       resources created for this thread since this thread exists
-       for the entire duration of our program */
-    /* ExportThread_free(&j->export_thread); */
     /* close jack client */
     FREE(j->buffers);
+    FREE(j->output_ports);
     jack_client_close(j->jack_client);
+    if (j->capture) {
+        InputCapture_free(&j->capture);
+        FREE(j->inputs);
+        FREE(j->input_ports);
+    }
     ExportThread_free(&j->export_thread);
     FREE(*jack);
 }
@@ -21,9 +21,12 @@ typedef struct JackClient *JackClient;
  * Initialize an audio engine.
  * @param realtime callback used to fill frame buffer
  * @client_data pointer to data passed to callback
+ * @options output_channels is the number of output ports,
+ *          and the export_ options configure exporting
  */
 JackClient
-JackClient_init(AudioCallback audio_callback, void *client_data);
+JackClient_init(AudioCallback audio_callback, void *client_data,
+                const LightningOptions *options);
 
 /**
  * Register callbacks for a JackClient.
@@ -42,7 +45,9 @@ int
 JackClient_activate(JackClient client);
 
 /**
- * Setup the output ports for a JackClient.
+ * Setup the output ports for a JackClient
+ * (output_1 to output_N, one per channel), and its input ports
+ * (input_1 to input_N) if it has any.
  *
  * @param client   {JackClient}
  *
@@ -66,12 +71,35 @@ JackClient_setup_ports(JackClient client);
 int
 JackClient_connect_to(JackClient client, const char *ch1, const char *ch2);
 
+/**
+ * Connect output port @a port (counting from 0) to the jack
+ * input @a dest.
+ *
+ * @return 0 (success), nonzero (failure)
+ */
+int
+JackClient_connect_port(JackClient client, int port, const char *dest);
+
+/**
+ * Connect the jack output @a src to input port @a port (counting
+ * from 0).
+ *
+ * @return 0 (success), nonzero (failure)
+ */
+int
+JackClient_connect_input(JackClient client, int port, const char *src);
+
 void
 JackClient_set_data(JackClient client, void *data);
 
 nframes_t
 JackClient_samplerate(JackClient jack);
 
+/**
+ * Call @a callback with @a arg whenever JACK's sample rate
+ * changes. It is called from JACK's notification thread, not
+ * the realtime thread, but should return quickly.
+ */
 int
 JackClient_set_samplerate_callback(JackClient jack,
                                    SampleRateCallback callback,
@@ -83,13 +111,127 @@ JackClient_buffersize(JackClient jack);
 int
 JackClient_playback_ports(JackClient jack);
 
+int
+JackClient_capture_ports(JackClient jack);
+
+/**
+ * Start capturing a take of up to @a frames frames from the input
+ * ports. The buffers are allocated here, not on the realtime
+ * thread.
+ *
+ * @return 0 on success, nonzero on failure (there are no input
+ *         ports, or a take is running already)
+ */
+int
+JackClient_capture_start(JackClient client, nframes_t frames);
+
+/**
+ * Frames captured by the running take so far
+ */
+nframes_t
+JackClient_capture_frames(JackClient client);
+
+/**
+ * Stop capturing, see InputCapture_stop
+ *
+ * @param  samplerate - set to the sample rate the take started at
+ *
+ * @return buffers of every input channel, which belong to the
+ *         caller, or NULL if no take is running
+ */
+sample_t **
+JackClient_capture_stop(JackClient client, nframes_t *frames,
+                        nframes_t *samplerate);
+
+/**
+ * Start exporting to an audio file in the format given by
+ * @a settings
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+JackClient_export_start(JackClient client, const char *file,
+                        const LightningExportSettings *settings);
+
+/**
+ * Start an export of the master output or of the bus named by
+ * @a settings, which runs alongside any others, at frame time
+ * @a start (0 for now)
+ *
+ * @return the number of the export, or -1 on failure
+ */
+int
+JackClient_export_open(JackClient client, const char *file,
+                       const LightningExportSettings *settings,
+                       position_t start);
+
+/**
+ * Stop an export started with JackClient_export_open before
+ * frame time @a stop (0 for now)
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+JackClient_export_close(JackClient client, int export, position_t stop);
+
+/**
+ * Time of the first frame of the next cycle, counting frames
+ * from the first cycle
+ */
+position_t
+JackClient_frame_time(JackClient client);
+
+/**
+ * Make the buffers of a mix bus exportable under @a name. The
+ * buffers must hold the bus's mix whenever the audio callback
+ * returns, and stay at the same address.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+JackClient_add_export_source(JackClient client, const char *name,
+                             sample_t **bufs);
+
+/**
+ * Get statistics for exporting.
+ */
+void
+JackClient_export_stats(JackClient client, LightningExportStats *stats);
+
+/**
+ * Open a tap of the mix bus named @a bus (NULL for the master
+ * output) that holds @a buffer_ms milliseconds of output.
+ *
+ * @return the number of the tap, or -1 on failure
+ */
+int
+JackClient_tap_open(JackClient client, const char *bus, nframes_t buffer_ms);
+
+/**
+ * Read up to @a frames interleaved frames from a tap, waiting up
+ * to @a timeout_ms milliseconds if there are none.
+ *
+ * @return number of frames read
+ */
+nframes_t
+JackClient_tap_read(JackClient client, int tap, sample_t *buf,
+                    nframes_t frames, int timeout_ms);
+
+/**
+ * Get statistics for a tap.
+ *
+ * @return 0 on success, nonzero if the tap is not open
+ */
+int
+JackClient_tap_stats(JackClient client, int tap, LightningTapStats *stats);
+
 /**
- * Start exporting to an audio file
+ * Close a tap opened with JackClient_tap_open
  *
  * @return 0 on success, nonzero on failure
  */
 int
-JackClient_export_start(JackClient client, const char *file);
+JackClient_tap_close(JackClient client, int tap);
 
 /**
  * Stop recording output to audio file
@@ -0,0 +1,40 @@
+package lightning
+
+import "testing"
+
+const benchVoices = 64
+
+func benchmarkLayout(b *testing.B, layout SampleLayout, format SampleFormat, pitch float64) {
+	r, err := BenchLayout(layout, format, benchVoices, pitch, b.N)
+	if err != nil {
+		b.Fatal(err)
+	}
+	b.ReportMetric(r.NsPerVoiceFrame, "ns/voice-frame")
+	if r.MissesPerVoiceFrame >= 0 {
+		b.ReportMetric(r.MissesPerVoiceFrame, "misses/voice-frame")
+	}
+}
+
+func BenchmarkPlanarFloat32(b *testing.B) {
+	benchmarkLayout(b, Planar, Float32, 1.0)
+}
+
+func BenchmarkInterleavedFloat32(b *testing.B) {
+	benchmarkLayout(b, Interleaved, Float32, 1.0)
+}
+
+func BenchmarkPlanarInt16(b *testing.B) {
+	benchmarkLayout(b, Planar, Int16, 1.0)
+}
+
+func BenchmarkInterleavedInt16(b *testing.B) {
+	benchmarkLayout(b, Interleaved, Int16, 1.0)
+}
+
+func BenchmarkPlanarFloat32Pitched(b *testing.B) {
+	benchmarkLayout(b, Planar, Float32, 1.5)
+}
+
+func BenchmarkInterleavedFloat32Pitched(b *testing.B) {
+	benchmarkLayout(b, Interleaved, Float32, 1.5)
+}
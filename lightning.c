@@ -4,15 +4,22 @@
 #include <assert.h>
 #include <string.h>
 
+#include "bank.h"
+#include "bench.h"
 #include "jack-client.h"
 #include "lightning.h"
 #include "log.h"
 #include "mem.h"
+#include "mutex.h"
 #include "samples.h"
 
 struct Lightning {
     JackClient jack_client;
     Samples samples;
+    /* held while a bus is added along with its export source, and
+       while buses are looked up by name, so nobody sees a bus that
+       is taken back because its export source could not be added */
+    Mutex bus_mutex;
 };
 
 /* realtime callback */
@@ -20,20 +27,52 @@ static int
 audio_callback(sample_t **buffers, channels_t channels,
                nframes_t frames, void *data);
                
+/* called when JACK's sample rate changes */
+static int
+samplerate_callback(nframes_t sr, void *data);
+
 /**
  * Initialize jack_client and samples,
  * and use samples as the data for the jack_client
  * realtime callback.
  */
 static void
-initialize_jack_client(Lightning lightning);
+initialize_jack_client(Lightning lightning, const LightningOptions *options);
 
 Lightning
 Lightning_init()
 {
+    LightningOptions options;
+    Lightning_default_options(&options);
+    return Lightning_init_with_options(&options);
+}
+
+void
+Lightning_default_options(LightningOptions *options)
+{
+    assert(options);
+    options->cache_size = (size_t) 1 << 30;
+    options->cache_lock_budget = (size_t) 256 << 20;
+    options->cache_format = SampleFormat_FLOAT32;
+    options->cache_layout = SampleLayout_PLANAR;
+    options->stream_head_ms = 250;
+    options->stream_threshold_ms = 30000;
+    options->native_rate = 0;
+    options->src_quality = SRCQuality_FASTEST;
+    options->output_channels = 2;
+    options->input_channels = 0;
+    options->export_buffer_ms = 1000;
+    options->export_mark_gaps = 0;
+}
+
+Lightning
+Lightning_init_with_options(const LightningOptions *options)
+{
+    assert(options && options->output_channels > 0);
     Lightning lightning;
     NEW(lightning);
-    initialize_jack_client(lightning);
+    lightning->bus_mutex = Mutex_init();
+    initialize_jack_client(lightning, options);
     return lightning;
 }
 
@@ -44,6 +83,20 @@ Lightning_connect_to(Lightning lightning, const char *ch1, const char *ch2)
     return JackClient_connect_to(lightning->jack_client, ch1, ch2);
 }
 
+int
+Lightning_connect_port(Lightning lightning, int port, const char *dest)
+{
+    assert(lightning);
+    return JackClient_connect_port(lightning->jack_client, port, dest);
+}
+
+int
+Lightning_connect_input(Lightning lightning, int port, const char *src)
+{
+    assert(lightning);
+    return JackClient_connect_input(lightning->jack_client, port, src);
+}
+
 /**
  * Play a sample
  */
@@ -57,14 +110,248 @@ Lightning_play_sample(Lightning lightning,
     return NULL == Samples_play(lightning->samples, file, pitch, gain);
 }
 
+int
+Lightning_add_bus(Lightning lightning, const char *name)
+{
+    assert(lightning && lightning->samples && name);
+    int bus;
+    Mutex_lock(lightning->bus_mutex);
+    bus = Samples_add_bus(lightning->samples, name);
+    if (bus < 0) {
+        Mutex_unlock(lightning->bus_mutex);
+        return 1;
+    }
+    if (JackClient_add_export_source(lightning->jack_client, name,
+                                     Samples_bus_buffers(lightning->samples,
+                                                         bus))) {
+        LOG(Error, "could not export bus %s, not adding it", name);
+        Samples_remove_bus(lightning->samples, bus);
+        Mutex_unlock(lightning->bus_mutex);
+        return 1;
+    }
+    Mutex_unlock(lightning->bus_mutex);
+    return 0;
+}
+
+int
+Lightning_play_sample_on_bus(Lightning lightning, const char *file,
+                             pitch_t pitch, gain_t gain, const char *bus)
+{
+    assert(lightning && lightning->samples);
+    int error;
+    Mutex_lock(lightning->bus_mutex);
+    int index = Samples_bus(lightning->samples, bus);
+    if (index < 0) {
+        Mutex_unlock(lightning->bus_mutex);
+        LOG(Warn, "there is no bus %s", bus);
+        return 1;
+    }
+    error = NULL == Samples_play_on_bus(lightning->samples, file, pitch, gain,
+                                        index);
+    Mutex_unlock(lightning->bus_mutex);
+    return error;
+}
+
+int
+Lightning_set_bus_gain(Lightning lightning, const char *bus, gain_t gain)
+{
+    assert(lightning && lightning->samples);
+    Mutex_lock(lightning->bus_mutex);
+    int index = Samples_bus(lightning->samples, bus);
+    if (index < 0) {
+        Mutex_unlock(lightning->bus_mutex);
+        LOG(Warn, "there is no bus %s", bus);
+        return 1;
+    }
+    Samples_set_bus_gain(lightning->samples, index, gain);
+    Mutex_unlock(lightning->bus_mutex);
+    return 0;
+}
+
+int
+Lightning_build_bank(const char *file, const char **paths,
+                     const char **names, int count, nframes_t samplerate,
+                     SampleFormat format)
+{
+    return Bank_build(file, paths, names, count, samplerate, format);
+}
+
+int
+Lightning_bench_layout(SampleLayout layout, SampleFormat format,
+                       int voices, pitch_t pitch, int cycles,
+                       LightningLayoutBench *result)
+{
+    return Bench_layout(layout, format, voices, pitch, cycles, result);
+}
+
+int
+Lightning_load_bank(Lightning lightning, const char *file)
+{
+    assert(lightning && lightning->samples);
+    return Samples_load_bank(lightning->samples, file);
+}
+
+int
+Lightning_load_samples(Lightning lightning, const char **files, int count,
+                       SRCQuality quality)
+{
+    assert(lightning && lightning->samples);
+    return Samples_load_all(lightning->samples, files, count, quality);
+}
+
+int
+Lightning_capture_start(Lightning lightning, nframes_t max_ms)
+{
+    assert(lightning);
+    nframes_t sr = JackClient_samplerate(lightning->jack_client);
+    nframes_t frames = (nframes_t) ((uint64_t) sr * max_ms / 1000);
+    if (frames == 0) {
+        LOG(Error, "can not capture a take of %u ms", max_ms);
+        return 1;
+    }
+    return JackClient_capture_start(lightning->jack_client, frames);
+}
+
+nframes_t
+Lightning_capture_frames(Lightning lightning)
+{
+    assert(lightning);
+    return JackClient_capture_frames(lightning->jack_client);
+}
+
+int
+Lightning_capture_stop(Lightning lightning, const char *name)
+{
+    assert(lightning && lightning->samples && name);
+    channels_t chan, channels = JackClient_capture_ports(lightning->jack_client);
+    nframes_t frames, sr;
+    sample_t **bufs = JackClient_capture_stop(lightning->jack_client, &frames,
+                                              &sr);
+    if (bufs == NULL) {
+        return 1;
+    }
+    if (frames == 0) {
+        LOG(Warn, "take %s is empty, not caching it", name);
+    } else if (Samples_add_take(lightning->samples, name, channels, frames,
+                                sr, bufs) == 0) {
+        return 0;
+    }
+    for (chan = 0; chan < channels; chan++) {
+        FREE(bufs[chan]);
+    }
+    FREE(bufs);
+    return 1;
+}
+
+void
+Lightning_stream_stats(Lightning lightning, LightningStreamStats *stats)
+{
+    assert(lightning && lightning->samples);
+    Samples_stream_stats(lightning->samples, stats);
+}
+
+void
+Lightning_export_stats(Lightning lightning, LightningExportStats *stats)
+{
+    assert(lightning && lightning->jack_client);
+    JackClient_export_stats(lightning->jack_client, stats);
+}
+
 /**
  * Start exporting to an audio file
  */
 int
 Lightning_export_start(Lightning lightning, const char *file)
+{
+    LightningExportSettings settings;
+    Lightning_default_export_settings(&settings);
+    return Lightning_export_start_with_settings(lightning, file, &settings);
+}
+
+void
+Lightning_default_export_settings(LightningExportSettings *settings)
+{
+    assert(settings);
+    settings->format = ExportFormat_WAV;
+    settings->bits = 0;
+    settings->quality = 0.5;
+    settings->bus = NULL;
+    settings->dither = ExportDither_TPDF;
+}
+
+int
+Lightning_export_open(Lightning lightning, const char *file,
+                      const LightningExportSettings *settings)
+{
+    return Lightning_export_start_at(lightning, file, settings, 0);
+}
+
+int
+Lightning_export_close(Lightning lightning, int export)
+{
+    return Lightning_export_stop_at(lightning, export, 0);
+}
+
+position_t
+Lightning_frame_time(Lightning lightning)
 {
     assert(lightning);
-    return JackClient_export_start(lightning->jack_client, file);
+    return JackClient_frame_time(lightning->jack_client);
+}
+
+int
+Lightning_export_start_at(Lightning lightning, const char *file,
+                          const LightningExportSettings *settings,
+                          position_t start)
+{
+    assert(lightning && file && settings);
+    return JackClient_export_open(lightning->jack_client, file, settings,
+                                  start);
+}
+
+int
+Lightning_export_stop_at(Lightning lightning, int export, position_t stop)
+{
+    assert(lightning);
+    return JackClient_export_close(lightning->jack_client, export, stop);
+}
+
+int
+Lightning_tap_open(Lightning lightning, const char *bus, nframes_t buffer_ms)
+{
+    assert(lightning);
+    return JackClient_tap_open(lightning->jack_client, bus, buffer_ms);
+}
+
+nframes_t
+Lightning_tap_read(Lightning lightning, int tap, sample_t *buf,
+                   nframes_t frames, int timeout_ms)
+{
+    assert(lightning && buf);
+    return JackClient_tap_read(lightning->jack_client, tap, buf, frames,
+                               timeout_ms);
+}
+
+int
+Lightning_tap_stats(Lightning lightning, int tap, LightningTapStats *stats)
+{
+    assert(lightning && stats);
+    return JackClient_tap_stats(lightning->jack_client, tap, stats);
+}
+
+int
+Lightning_tap_close(Lightning lightning, int tap)
+{
+    assert(lightning);
+    return JackClient_tap_close(lightning->jack_client, tap);
+}
+
+int
+Lightning_export_start_with_settings(Lightning lightning, const char *file,
+                                     const LightningExportSettings *settings)
+{
+    assert(lightning && file && settings);
+    return JackClient_export_start(lightning->jack_client, file, settings);
 }
 
 /**
@@ -91,6 +378,7 @@ Lightning_free(Lightning *lightning)
     Lightning s = *lightning;
     Samples_free(&s->samples);
     JackClient_free(&s->jack_client);
+    Mutex_free(&s->bus_mutex);
     FREE(*lightning);
 }
 
@@ -105,16 +393,26 @@ audio_callback(sample_t **buffers,
     return 0;
 }
 
+static int
+samplerate_callback(nframes_t sr, void *data)
+{
+    Samples samples = (Samples) data;
+    return Samples_set_samplerate(samples, sr);
+}
+
 static void
-initialize_jack_client(Lightning lightning)
+initialize_jack_client(Lightning lightning, const LightningOptions *options)
 {
     lightning->jack_client =                    \
-        JackClient_init(audio_callback, NULL);
+        JackClient_init(audio_callback, NULL, options);
 
     lightning->samples =                                                \
-        Samples_init(JackClient_samplerate(lightning->jack_client));
+        Samples_init(JackClient_samplerate(lightning->jack_client), options);
     
     JackClient_set_data(lightning->jack_client, lightning->samples);
+    JackClient_set_samplerate_callback(lightning->jack_client,
+                                       samplerate_callback,
+                                       lightning->samples);
     JackClient_setup_callbacks(lightning->jack_client);
     JackClient_activate(lightning->jack_client);
     JackClient_setup_ports(lightning->jack_client);
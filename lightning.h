@@ -1,16 +1,98 @@
 #ifndef LIGHTNING_H_INCLUDED
 #define LIGHTNING_H_INCLUDED
 
+#include <stddef.h>
 #include <stdint.h>
 #include <jack/jack.h>
 
 #define SAMPLE_SIZE sizeof(sample_t)
 
+/* named mix buses that can be added besides the master bus */
+#define LIGHTNING_MAX_BUSES 8
+
+/* exports that can run at once */
+#define LIGHTNING_MAX_EXPORTS 16
+
+/* output taps that can be open at once */
+#define LIGHTNING_MAX_TAPS 8
+
 typedef enum {
     SampleType_RAM,
     SampleType_DISK
 } SampleType;
 
+/**
+ * Formats cached sample data can be stored in.
+ * Compact formats halve the memory and memory bandwidth
+ * used by each voice, and are converted to sample_t
+ * while rendering.
+ */
+typedef enum {
+    /* 32-bit float */
+    SampleFormat_FLOAT32,
+    /* 16-bit signed integer */
+    SampleFormat_INT16,
+    /* 16-bit (half precision) float */
+    SampleFormat_FLOAT16,
+    /* INT16 for 16-bit (or smaller) integer sources, FLOAT32 otherwise */
+    SampleFormat_AUTO,
+    /* 16-bit integer, losslessly compressed in independent blocks
+       and decoded ahead of each playing voice */
+    SampleFormat_BLOCKS
+} SampleFormat;
+
+/**
+ * How the channels of cached sample data are laid out.
+ */
+typedef enum {
+    /* one buffer per channel */
+    SampleLayout_PLANAR,
+    /* stereo samples keep left and right frames next to each
+       other in a single buffer, so a voice reads one memory
+       stream instead of two. other channel counts, and the
+       compressed format, are always planar */
+    SampleLayout_INTERLEAVED
+} SampleLayout;
+
+/**
+ * Sample rate converters (from libsamplerate) samples can be
+ * resampled with when they are loaded. Better converters are
+ * slower.
+ */
+typedef enum {
+    /* band limited sinc interpolation, fastest of the three */
+    SRCQuality_FASTEST,
+    SRCQuality_MEDIUM,
+    SRCQuality_BEST,
+    /* linear interpolation, much faster but not band limited */
+    SRCQuality_LINEAR
+} SRCQuality;
+
+/**
+ * File formats the output can be exported to.
+ */
+typedef enum {
+    ExportFormat_WAV,
+    ExportFormat_AIFF,
+    /* lossless, about half the size of WAV */
+    ExportFormat_FLAC,
+    /* Ogg Vorbis, lossy */
+    ExportFormat_OGG
+} ExportFormat;
+
+/**
+ * How exports to 16 or 24-bit files are quantized.
+ */
+typedef enum {
+    /* rounded to the nearest step */
+    ExportDither_NONE,
+    /* triangular (TPDF) dither of up to one step either way */
+    ExportDither_TPDF,
+    /* TPDF dither with the noise shaped away from the
+       frequencies where it is most audible */
+    ExportDither_SHAPED
+} ExportDither;
+
 /**
  * Compare two opaque types
  * Return negative if a < b
@@ -82,6 +164,154 @@ typedef struct AudioData {
     sample_t *output;
 } AudioData;
 
+/**
+ * Options for Lightning_init_with_options.
+ * Use Lightning_default_options to initialize this
+ * structure before changing the fields you care about.
+ */
+typedef struct LightningOptions {
+    /* bytes of address space reserved for cached sample data */
+    size_t cache_size;
+    /* at most this many bytes of cached sample data are
+       locked into RAM */
+    size_t cache_lock_budget;
+    /* format cached sample data is stored in */
+    SampleFormat cache_format;
+    /* channel layout of cached sample data */
+    SampleLayout cache_layout;
+    /* milliseconds at the start of samples streamed from disk
+       that are kept in RAM */
+    nframes_t stream_head_ms;
+    /* samples longer than this many milliseconds, and samples
+       that would not fit in what is left of cache_size, are
+       streamed from disk instead of being cached in RAM */
+    nframes_t stream_threshold_ms;
+    /* nonzero to keep samples cached in RAM at the sample rate
+       of their file instead of resampling them when they are
+       loaded. voices then step through them at their pitch times
+       the ratio of the two rates, interpolating between frames,
+       which uses less memory, loads faster and only interpolates
+       once */
+    int native_rate;
+    /* converter used to resample samples that are not loaded
+       with a quality of their own */
+    SRCQuality src_quality;
+    /* number of JACK output ports. sample channels are played
+       on the port with the same index (mono samples on every
+       port), channels past the last port are not played */
+    channels_t output_channels;
+    /* number of JACK input ports, which takes are captured from
+       (see Lightning_capture_start). 0 registers none */
+    channels_t input_channels;
+    /* milliseconds of output the export ringbuffer holds, which
+       is how long writing the export file can stall before
+       frames are dropped */
+    nframes_t export_buffer_ms;
+    /* nonzero to write silence in place of frames that were
+       dropped from an export, so the file stays in time with
+       the output */
+    int export_mark_gaps;
+} LightningOptions;
+
+/**
+ * How Lightning_export_open and
+ * Lightning_export_start_with_settings write their file.
+ * Use Lightning_default_export_settings to initialize this
+ * structure before changing the fields you care about.
+ */
+typedef struct LightningExportSettings {
+    ExportFormat format;
+    /* bits per sample: 16 or 24 for integer samples, 32 for
+       float (WAV and AIFF only), or 0 for the format's best.
+       OGG ignores it */
+    int bits;
+    /* from 0 to 1: how hard FLAC compresses (higher is smaller
+       and slower to encode), or the Vorbis quality of OGG
+       (higher is better and larger) */
+    double quality;
+    /* mix bus to record, NULL (or "master") for the master
+       output. the name is only used while the export starts */
+    const char *bus;
+    /* how samples are quantized to 16 or 24 bits (FLAC with
+       bits 0 is 24 bits). the dither is worked out on the
+       encoder thread */
+    ExportDither dither;
+} LightningExportSettings;
+
+/**
+ * Result of Lightning_bench_layout.
+ */
+typedef struct LightningLayoutBench {
+    /* voice-frames rendered (voices times frames) */
+    unsigned long long voice_frames;
+    /* time spent rendering and mixing per voice-frame */
+    double ns_per_voice_frame;
+    /* last level cache misses per voice-frame, negative if the
+       hardware counters are not available */
+    double misses_per_voice_frame;
+} LightningLayoutBench;
+
+#define LIGHTNING_FILL_BUCKETS 10
+
+/**
+ * Statistics for samples streamed from disk.
+ * Counters start at zero when Lightning is initialized.
+ */
+typedef struct LightningStreamStats {
+    /* streams currently open */
+    unsigned long streams;
+    /* times a voice ran out of streamed data before the end */
+    unsigned long underruns;
+    /* how full stream ringbuffers were each time the audio
+       thread read from one: fill[i] counts reads that found
+       the ringbuffer between i and i + 1 tenths full */
+    unsigned long fill[LIGHTNING_FILL_BUCKETS];
+    /* read requests issued to disk, and bytes read */
+    unsigned long reads;
+    unsigned long long bytes_read;
+    /* least time any voice had left before running out of data
+       when the I/O thread got to it, in milliseconds (-1 if no
+       data has been streamed yet) */
+    double min_slack_ms;
+} LightningStreamStats;
+
+/**
+ * Statistics for exporting. Each bus that is being exported has
+ * a ringbuffer of its own, and these add up all of them.
+ */
+typedef struct LightningExportStats {
+    /* frames each export ringbuffer holds */
+    unsigned long ring_frames;
+    /* most frames that have been waiting in a ringbuffer */
+    unsigned long high_water_frames;
+    /* cycles that dropped frames because a ringbuffer was
+       full, and the frames they dropped */
+    unsigned long overruns;
+    unsigned long long dropped_frames;
+    /* runs of dropped frames, each of which is a gap in the
+       export (filled with silence with export_mark_gaps) */
+    unsigned long gaps;
+    /* frames written to export files, including silence
+       written in place of gaps */
+    unsigned long long frames_written;
+} LightningExportStats;
+
+/**
+ * Statistics for an output tap.
+ */
+typedef struct LightningTapStats {
+    /* interleaved channels of each frame read */
+    channels_t channels;
+    /* frames the tap ringbuffer holds */
+    unsigned long ring_frames;
+    /* frames written to the tap */
+    unsigned long long frames_written;
+    /* writes that were dropped because the reader fell behind
+       and the ringbuffer was full, and the frames they held */
+    unsigned long overruns;
+    unsigned long long dropped_frames;
+} LightningTapStats;
+
 /**
  * Main lightning data structure.
  *
@@ -105,6 +335,19 @@ typedef struct Lightning *Lightning;
 Lightning
 Lightning_init();
 
+/**
+ * Fill @a options with the values Lightning_init uses.
+ */
+void
+Lightning_default_options(LightningOptions *options);
+
+/**
+ * Initialize a Lightning instance with non-default options.
+ * @param options Options, see Lightning_default_options
+ */
+Lightning
+Lightning_init_with_options(const LightningOptions *options);
+
 /**
  * Connect lightning to a pair of JACK sinks.
  * @param lightning Lightning instance
@@ -115,6 +358,26 @@ Lightning_init();
 int
 Lightning_connect_to(Lightning lightning, const char *ch1, const char *ch2);
 
+/**
+ * Connect one output port to a JACK sink.
+ * @param lightning Lightning instance
+ * @param port output port, counting from 0
+ * @param dest JACK input to connect it to
+ * @return 0 (success), nonzero (failure)
+ */
+int
+Lightning_connect_port(Lightning lightning, int port, const char *dest);
+
+/**
+ * Connect a JACK source to one input port.
+ * @param lightning Lightning instance
+ * @param port input port, counting from 0
+ * @param src JACK output to connect to it
+ * @return 0 (success), nonzero (failure)
+ */
+int
+Lightning_connect_input(Lightning lightning, int port, const char *src);
+
 /**
  * Play a sample.
  * @param lightning Lightning instance
@@ -127,14 +390,254 @@ int
 Lightning_play_sample(Lightning lightning, const char *file,
                       pitch_t pitch, gain_t gain);
 
+/**
+ * Add a named mix bus. Voices played on it are summed into it,
+ * and it is summed into the master output, so an export can
+ * record it on its own as a stem.
+ * Must not be called while another bus is being added.
+ * @param lightning Lightning instance
+ * @param name Name of the bus, which must not be "master"
+ * @return 0 success, nonzero failure (the name is taken, or
+ *         there are LIGHTNING_MAX_BUSES buses already)
+ */
+int
+Lightning_add_bus(Lightning lightning, const char *name);
+
+/**
+ * Play a sample on a mix bus.
+ * @param lightning Lightning instance
+ * @param file Audio file to play
+ * @param pitch Playback speed
+ * @param gain Gain [0.0, 1.0]
+ * @param bus Bus added with Lightning_add_bus, or "master"
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_play_sample_on_bus(Lightning lightning, const char *file,
+                             pitch_t pitch, gain_t gain, const char *bus);
+
+/**
+ * Set the gain of a mix bus. It is applied once to the bus's mix
+ * before that is summed into the master bus, not to each voice on
+ * it, and stems exported from the bus have it applied. The gain of
+ * the master bus is applied to the output. Changes are ramped over
+ * one cycle.
+ * @param lightning Lightning instance
+ * @param bus Bus added with Lightning_add_bus, or NULL (or
+ *        "master") for the master bus
+ * @param gain Gain, 1.0 leaves the bus as it is
+ * @return 0 success, nonzero if there is no such bus
+ */
+int
+Lightning_set_bus_gain(Lightning lightning, const char *bus, gain_t gain);
+
+/**
+ * Pack a set of audio files into a sample bank.
+ * Every file is decoded and resampled to @a samplerate, so
+ * build banks at the sample rate they will be played at.
+ * @param file Path of the bank to write
+ * @param paths Audio files to pack
+ * @param names Names to register the samples under, or NULL to use @a paths
+ * @param count Number of files
+ * @param samplerate Sample rate of the packed data
+ * @param format Format of the packed data
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_build_bank(const char *file, const char **paths,
+                     const char **names, int count, nframes_t samplerate,
+                     SampleFormat format);
+
+/**
+ * Measure how fast voices render from cached samples stored
+ * with @a layout and @a format on this machine, to pick the
+ * cache_layout that suits a deployment. Needs no JACK server.
+ * @param layout Channel layout to measure
+ * @param format Storage format (FLOAT32, INT16 or FLOAT16)
+ * @param voices Number of stereo voices playing at once
+ * @param pitch Playback speed of every voice
+ * @param cycles Number of 256 frame cycles to render
+ * @param result Filled in with the measurements
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_bench_layout(SampleLayout layout, SampleFormat format,
+                       int voices, pitch_t pitch, int cycles,
+                       LightningLayoutBench *result);
+
+/**
+ * Map a sample bank and add all of its samples to the cache.
+ * The samples can then be played by name with Lightning_play_sample.
+ * @param lightning Lightning instance
+ * @param file Bank file built with Lightning_build_bank
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_load_bank(Lightning lightning, const char *file);
+
+/**
+ * Load samples into the cache ahead of playing them, decoding
+ * and resampling them on as many threads as there are cores.
+ * @param lightning Lightning instance
+ * @param files Audio files to load
+ * @param count Number of files
+ * @param quality Sample rate converter for these samples
+ * @return 0 success, nonzero if any file could not be loaded
+ */
+int
+Lightning_load_samples(Lightning lightning, const char **files, int count,
+                       SRCQuality quality);
+
+/**
+ * Start capturing a take from the input ports. Buffers for up to
+ * @a max_ms milliseconds are allocated and locked in RAM before
+ * this returns, so capturing does not allocate on the realtime
+ * thread. Only one take is captured at a time.
+ * @param lightning Lightning instance
+ * @param max_ms Longest take, after which capturing stops
+ * @return 0 success, nonzero failure (including no input ports
+ *         or a take running already)
+ */
+int
+Lightning_capture_start(Lightning lightning, nframes_t max_ms);
+
+/**
+ * Frames captured by the running take so far.
+ * @param lightning Lightning instance
+ * @return number of frames, 0 if no take is running
+ */
+nframes_t
+Lightning_capture_frames(Lightning lightning);
+
+/**
+ * Stop capturing and cache the take under @a name, so it plays
+ * with Lightning_play_sample right away. A take at another rate
+ * than the output (if the rate changed while capturing) is
+ * converted before this returns.
+ * @param lightning Lightning instance
+ * @param name Name to play the take by, which must not be
+ *        cached already
+ * @return 0 success, nonzero failure (the take is thrown away)
+ */
+int
+Lightning_capture_stop(Lightning lightning, const char *name);
+
+/**
+ * Get statistics for samples streamed from disk.
+ * @param lightning Lightning instance
+ * @param stats Filled in with the current statistics
+ */
+void
+Lightning_stream_stats(Lightning lightning, LightningStreamStats *stats);
+
+/**
+ * Get statistics for exporting, since the engine started.
+ * @param lightning Lightning instance
+ * @param stats Filled in with the current statistics
+ */
+void
+Lightning_export_stats(Lightning lightning, LightningExportStats *stats);
+
 /**
  * Start exporting to an audio file
+ * The file is a WAV file of float samples.
  * @param lightning Lightning instance
  * @return 0 success, nonzero failure
  */
 int
 Lightning_export_start(Lightning lightning, const char *file);
 
+/**
+ * Fill @a settings with the settings Lightning_export_start uses.
+ */
+void
+Lightning_default_export_settings(LightningExportSettings *settings);
+
+/**
+ * Start an export of the master output or of a mix bus, which
+ * runs alongside any others until Lightning_export_close. Every
+ * export of the same bus shares what is taken from the realtime
+ * thread, so a master bounce and a set of stems cost little more
+ * than one export.
+ * @param lightning Lightning instance
+ * @param file Audio file to export to
+ * @param settings Format of the file and the bus to record
+ * @return export number to close the export with, or -1 on
+ *         failure (including LIGHTNING_MAX_EXPORTS exports
+ *         running already)
+ */
+int
+Lightning_export_open(Lightning lightning, const char *file,
+                      const LightningExportSettings *settings);
+
+/**
+ * Stop an export started with Lightning_export_open. The file is
+ * finished in the background.
+ * @param lightning Lightning instance
+ * @param export Export number
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_export_close(Lightning lightning, int export);
+
+/**
+ * Time of the first frame of the next cycle, in frames since
+ * the first cycle. A sample played now starts at about this
+ * time, so a note played when this is t and an export started
+ * at t line up.
+ * @param lightning Lightning instance
+ * @return frame time
+ */
+position_t
+Lightning_frame_time(Lightning lightning);
+
+/**
+ * Start an export like Lightning_export_open whose first frame
+ * is the one at frame time @a start, which can be part way
+ * through a cycle, so the file needs no trimming. If @a start
+ * has passed, the export starts with the next cycle.
+ * @param lightning Lightning instance
+ * @param file Audio file to export to
+ * @param settings Format of the file and the bus to record
+ * @param start Frame time of the first frame, see Lightning_frame_time
+ * @return export number, or -1 on failure
+ */
+int
+Lightning_export_start_at(Lightning lightning, const char *file,
+                          const LightningExportSettings *settings,
+                          position_t start);
+
+/**
+ * Stop an export before the frame at frame time @a stop, so the
+ * file ends on that exact frame. If @a stop has passed, the
+ * export stops after the current cycle. An export can only be
+ * stopped once.
+ * @param lightning Lightning instance
+ * @param export Export number
+ * @param stop Frame time of the frame after the last one
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_export_stop_at(Lightning lightning, int export, position_t stop);
+
+/**
+ * Start exporting to an audio file in the format given by
+ * @a settings. The file is encoded on a thread of its own, so
+ * a slow encoder does not hold up taking the output from the
+ * realtime thread.
+ * This is an export like those of Lightning_export_open, which
+ * Lightning_export_stop closes. Only one can be started this
+ * way at a time.
+ * @param lightning Lightning instance
+ * @param file Audio file to export to
+ * @param settings Format of the file, see Lightning_default_export_settings
+ * @return 0 success, nonzero failure (including settings that
+ *         are not supported)
+ */
+int
+Lightning_export_start_with_settings(Lightning lightning, const char *file,
+                                     const LightningExportSettings *settings);
+
 /**
  * If currently exporting, stop.
  * @param lightning Lightning instance
@@ -143,6 +646,56 @@ Lightning_export_start(Lightning lightning, const char *file);
 int
 Lightning_export_stop(Lightning lightning);
 
+/**
+ * Open a tap that streams the output of a mix bus to the caller,
+ * for encoding or sending over the network without a file in
+ * between. The realtime thread writes every cycle to a ringbuffer
+ * from which Lightning_tap_read takes interleaved frames; when the
+ * reader falls behind, output that does not fit is dropped and
+ * counted in Lightning_tap_stats.
+ * @param lightning Lightning instance
+ * @param bus Name of the bus to tap, NULL for the master output
+ * @param buffer_ms Milliseconds of output the tap holds
+ * @return tap number, or -1 on failure (including
+ *         LIGHTNING_MAX_TAPS taps open already)
+ */
+int
+Lightning_tap_open(Lightning lightning, const char *bus,
+                   nframes_t buffer_ms);
+
+/**
+ * Read up to @a frames interleaved frames from a tap, waiting up
+ * to @a timeout_ms milliseconds if there are none.
+ * @param lightning Lightning instance
+ * @param tap Tap number
+ * @param buf Room for @a frames frames of every channel
+ * @return number of frames read, 0 on timeout or if the tap is
+ *         not open
+ */
+nframes_t
+Lightning_tap_read(Lightning lightning, int tap, sample_t *buf,
+                   nframes_t frames, int timeout_ms);
+
+/**
+ * Get statistics for a tap.
+ * @param lightning Lightning instance
+ * @param tap Tap number
+ * @param stats Filled in with the current statistics
+ * @return 0 success, nonzero if the tap is not open
+ */
+int
+Lightning_tap_stats(Lightning lightning, int tap, LightningTapStats *stats);
+
+/**
+ * Close a tap. This can not be called while a read of the tap is
+ * in progress.
+ * @param lightning Lightning instance
+ * @param tap Tap number
+ * @return 0 success, nonzero failure
+ */
+int
+Lightning_tap_close(Lightning lightning, int tap);
+
 /**
  * Lightning_wait causes the current thread to wait for all
  * currently playing samples to finish.
@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "lightning.h"
+#include "log.h"
+#include "mem.h"
+#include "output-tap.h"
+#include "ringbuffer.h"
+
+struct OutputTap {
+    int source;
+    channels_t channels;
+    /* interleaved frames, and the frames the ringbuffer holds */
+    Ringbuffer rb;
+    nframes_t ring_frames;
+    /* posted whenever frames are written */
+    sem_t ready;
+    /* statistics */
+    atomic_ullong frames_written;
+    atomic_ulong overruns;
+    atomic_ullong dropped;
+};
+
+OutputTap
+OutputTap_init(int source, channels_t channels, nframes_t ring_frames)
+{
+    OutputTap tap;
+    NEW(tap);
+    tap->source = source;
+    tap->channels = channels;
+    /* one byte of a ringbuffer is never written, and it may
+       be rounded up, so ask it how many frames it holds */
+    tap->rb = Ringbuffer_init(ring_frames * SAMPLE_SIZE * channels + 1);
+    tap->ring_frames = Ringbuffer_write_space(tap->rb) /
+        (SAMPLE_SIZE * channels);
+    if (0 != Ringbuffer_mlock(tap->rb)) {
+        LOG(Warn, "Could not %s output tap buffers", "mlock");
+    }
+    sem_init(&tap->ready, 0, 0);
+    atomic_init(&tap->frames_written, 0);
+    atomic_init(&tap->overruns, 0);
+    atomic_init(&tap->dropped, 0);
+    return tap;
+}
+
+int
+OutputTap_source(OutputTap tap)
+{
+    assert(tap);
+    return tap->source;
+}
+
+int
+OutputTap_begin(OutputTap tap, nframes_t frames)
+{
+    /* the reader only makes more room, so the rest of the cycle
+       fits if it fits now */
+    if (Ringbuffer_write_space(tap->rb) < frames * SAMPLE_SIZE * tap->channels) {
+        atomic_fetch_add_explicit(&tap->overruns, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&tap->dropped, frames, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+void
+OutputTap_write(OutputTap tap, const sample_t *buf, nframes_t frames)
+{
+    Ringbuffer_write(tap->rb, (void *) buf,
+                     frames * SAMPLE_SIZE * tap->channels);
+}
+
+void
+OutputTap_end(OutputTap tap, nframes_t frames)
+{
+    atomic_fetch_add_explicit(&tap->frames_written, frames,
+                              memory_order_relaxed);
+    sem_post(&tap->ready);
+}
+
+nframes_t
+OutputTap_read(OutputTap tap, sample_t *buf, nframes_t frames,
+               int timeout_ms)
+{
+    assert(tap && buf);
+    const size_t frame_bytes = SAMPLE_SIZE * tap->channels;
+    struct timespec timeout;
+    size_t n;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += timeout_ms / 1000;
+    timeout.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+    for (;;) {
+        n = Ringbuffer_read_space(tap->rb) / frame_bytes;
+        if (n > 0) {
+            break;
+        }
+        /* posts for frames that have been read already */
+        while (sem_trywait(&tap->ready) == 0)
+            ;
+        if (Ringbuffer_read_space(tap->rb) >= frame_bytes) {
+            continue;
+        }
+        if (timeout_ms <= 0 ||
+            (sem_timedwait(&tap->ready, &timeout) != 0 && errno != EINTR)) {
+            return 0;
+        }
+    }
+    n = n < frames ? n : frames;
+    Ringbuffer_read(tap->rb, (char *) buf, n * frame_bytes);
+    return (nframes_t) n;
+}
+
+void
+OutputTap_stats(OutputTap tap, LightningTapStats *stats)
+{
+    assert(tap && stats);
+    stats->channels = tap->channels;
+    stats->ring_frames = tap->ring_frames;
+    stats->frames_written = atomic_load(&tap->frames_written);
+    stats->overruns = atomic_load(&tap->overruns);
+    stats->dropped_frames = atomic_load(&tap->dropped);
+}
+
+void
+OutputTap_free(OutputTap *tap)
+{
+    assert(tap && *tap);
+    Ringbuffer_free(&(*tap)->rb);
+    sem_destroy(&(*tap)->ready);
+    FREE(*tap);
+}
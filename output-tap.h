@@ -0,0 +1,81 @@
+/**
+ * Streaming output to clients in the same process
+ *
+ * An output tap is a ringbuffer of interleaved frames of the
+ * master output or of a mix bus, which the realtime thread writes
+ * every cycle (see ExportThread_write) and a client reads from
+ * whenever it likes, without touching a file. Neither side takes
+ * a lock: the realtime thread wakes a waiting reader with
+ * sem_post, and drops a cycle that does not fit as a whole
+ * instead of waiting, and counts it.
+ */
+#ifndef OUTPUT_TAP_H_INCLUDED
+#define OUTPUT_TAP_H_INCLUDED
+
+#include "lightning.h"
+
+typedef struct OutputTap *OutputTap;
+
+/**
+ * Make a tap of source @a source (see ExportThread_add_source)
+ * that holds @a ring_frames frames of @a channels channels.
+ */
+OutputTap
+OutputTap_init(int source, channels_t channels, nframes_t ring_frames);
+
+/**
+ * The source @a tap reads.
+ */
+int
+OutputTap_source(OutputTap tap);
+
+/**
+ * Start writing a cycle of @a frames frames: check that the whole
+ * cycle fits, and count it as dropped if it does not.
+ * Realtime safe.
+ *
+ * @return nonzero if the cycle is to be written, with
+ *         OutputTap_write and then OutputTap_end
+ */
+int
+OutputTap_begin(OutputTap tap, nframes_t frames);
+
+/**
+ * Write @a frames interleaved frames of the cycle started with
+ * OutputTap_begin.
+ * Realtime safe.
+ */
+void
+OutputTap_write(OutputTap tap, const sample_t *buf, nframes_t frames);
+
+/**
+ * Finish writing a cycle of @a frames frames, and wake the reader.
+ * Realtime safe.
+ */
+void
+OutputTap_end(OutputTap tap, nframes_t frames);
+
+/**
+ * Read up to @a frames interleaved frames into @a buf. If there
+ * are none, wait up to @a timeout_ms milliseconds for some.
+ *
+ * @return number of frames read, 0 if there were none in time
+ */
+nframes_t
+OutputTap_read(OutputTap tap, sample_t *buf, nframes_t frames,
+               int timeout_ms);
+
+/**
+ * Get statistics for @a tap.
+ */
+void
+OutputTap_stats(OutputTap tap, LightningTapStats *stats);
+
+/**
+ * Free a tap. The realtime thread must be done with it, and no
+ * read can be in progress.
+ */
+void
+OutputTap_free(OutputTap *tap);
+
+#endif
@@ -0,0 +1,112 @@
+package lightning
+
+import (
+	"testing"
+)
+
+// checkRamp checks that interleaved stereo frames are those of the
+// output exportRamp exports from frame time from on
+func checkRamp(t *testing.T, what string, frames []float32, from uint64) {
+	t.Helper()
+	for i := 0; i < len(frames)/2; i++ {
+		at := from + uint64(i)
+		if frames[2*i] != ramp(0, 0, at) || frames[2*i+1] != ramp(0, 1, at) {
+			t.Fatalf("%s: frame %d is %v %v, want %v %v", what, i,
+				frames[2*i], frames[2*i+1], ramp(0, 0, at), ramp(0, 1, at))
+		}
+	}
+}
+
+func TestTapStreamsOutput(t *testing.T) {
+	const cycle, cycles = 256, 400
+	thread := newExportThread(2, 1000, false)
+	defer thread.free()
+	thread.addSource("master")
+	thread.addSource("drums")
+	if _, err := thread.tapOpen("keys", 0); err == nil {
+		t.Fatal("tapped a bus that does not exist")
+	}
+	// big enough for every cycle, so none are dropped
+	tap, err := thread.tapOpen("", cycle*cycles)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if stats := thread.tapStats(tap); stats.Channels != 2 || stats.RingFrames < cycle*cycles {
+		t.Fatalf("tap has %d channels and holds %d frames, want 2 and %d",
+			stats.Channels, stats.RingFrames, cycle*cycles)
+	}
+	if got := thread.tapRead(tap, 100, 10); len(got) != 0 {
+		t.Fatalf("read %d samples before anything was written", len(got))
+	}
+
+	// read while the cycles are written
+	read := make(chan []float32)
+	go func() {
+		var got []float32
+		for len(got) < 2*cycle*cycles {
+			got = append(got, thread.tapRead(tap, 1000, 1000)...)
+		}
+		read <- got
+	}()
+	for c := 0; c < cycles; c++ {
+		thread.write(cycle, ramp)
+	}
+	checkRamp(t, "tap", <-read, 0)
+	stats := thread.tapStats(tap)
+	if stats.FramesWritten != cycle*cycles || stats.Overruns != 0 {
+		t.Fatalf("%d frames written with %d overruns, want %d and 0",
+			stats.FramesWritten, stats.Overruns, cycle*cycles)
+	}
+	if err := thread.tapClose(tap); err != nil {
+		t.Fatal(err)
+	}
+	if err := thread.tapClose(tap); err == nil {
+		t.Fatal("closed a tap twice")
+	}
+}
+
+func TestTapDropsWholeCycles(t *testing.T) {
+	const cycle = 256
+	thread := newExportThread(2, 1000, false)
+	defer thread.free()
+	thread.addSource("master")
+	tap, err := thread.tapOpen("", 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	ring := thread.tapStats(tap).RingFrames
+	fit := ring / cycle
+	// nothing is read, so the cycles after the ones that fit are
+	// dropped
+	for c := 0; c < fit+5; c++ {
+		thread.write(cycle, ramp)
+	}
+	stats := thread.tapStats(tap)
+	if stats.FramesWritten != uint64(fit*cycle) || stats.Overruns != 5 || stats.DroppedFrames != 5*cycle {
+		t.Fatalf("ring of %d frames: %d frames written, %d overruns, %d frames dropped, want %d, 5, %d",
+			ring, stats.FramesWritten, stats.Overruns, stats.DroppedFrames, fit*cycle, 5*cycle)
+	}
+	var got []float32
+	for len(got) < 2*fit*cycle {
+		frames := thread.tapRead(tap, cycle, 1000)
+		if len(frames) == 0 {
+			t.Fatalf("read %d frames, want %d", len(got)/2, fit*cycle)
+		}
+		got = append(got, frames...)
+	}
+	checkRamp(t, "cycles that fit", got, 0)
+	if left := thread.tapRead(tap, cycle, 10); len(left) != 0 {
+		t.Fatalf("read %d more samples than were written", len(left))
+	}
+	// once there is room the reader gets whole cycles again
+	resume := thread.time
+	thread.write(cycle, ramp)
+	got = thread.tapRead(tap, cycle, 1000)
+	if len(got) != 2*cycle {
+		t.Fatalf("read %d frames after the drops, want %d", len(got)/2, cycle)
+	}
+	checkRamp(t, "cycle after the drops", got, resume)
+	if err := thread.tapClose(tap); err != nil {
+		t.Fatal(err)
+	}
+}
@@ -42,6 +42,20 @@ Ringbuffer_write(Ringbuffer rb, void *buf, size_t len)
     return jack_ringbuffer_write(rb->jrb, buf, len);
 }
 
+size_t
+Ringbuffer_read_space(Ringbuffer rb)
+{
+    assert(rb);
+    return jack_ringbuffer_read_space(rb->jrb);
+}
+
+size_t
+Ringbuffer_write_space(Ringbuffer rb)
+{
+    assert(rb);
+    return jack_ringbuffer_write_space(rb->jrb);
+}
+
 void
 Ringbuffer_free(Ringbuffer *rb)
 {
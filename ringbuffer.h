@@ -34,6 +34,18 @@ Ringbuffer_read(Ringbuffer rb, char *buf, size_t len);
 size_t
 Ringbuffer_write(Ringbuffer rb, void *buf, size_t len);
 
+/**
+ * Number of bytes that can be read from @a rb.
+ */
+size_t
+Ringbuffer_read_space(Ringbuffer rb);
+
+/**
+ * Number of bytes that can be written to @a rb.
+ */
+size_t
+Ringbuffer_write_space(Ringbuffer rb);
+
 /**
  * Free a ringbuffer.
  */
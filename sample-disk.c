@@ -1,24 +1,244 @@
 #include <assert.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
 
+#include "clip.h"
+#include "disk-io.h"
+#include "event.h"
+#include "lightning.h"
+#include "log.h"
 #include "mem.h"
-#include "ringbuffer.h"
 #include "sample-disk.h"
-#include "thread.h"
-#include "lightning.h"
+#include "sf.h"
+#include "src.h"
+
+/* stream frames pulled out of the ringbuffer at a time */
+#define SCRATCH_FRAMES 256
+
+/* source frames past the head fed to the converter, so it has
+   all the input it needs to finish the head */
+#define HEAD_LOOKAHEAD 4096
+
+typedef enum {
+    Processing,
+    Finished,
+} State;
 
 struct SampleDisk {
     char *path;
+    pitch_t pitch;
+    gain_t gain;
+    /* frames in the sample after resampling */
+    nframes_t frames;
+    nframes_t output_sr;
+    /* channels in the file */
+    channels_t channels;
+    /* converter the head and streams are resampled with */
+    SRCQuality quality;
+    /* the first head_frames frames of each channel, kept in RAM */
+    sample_t **head;
+    nframes_t head_frames;
+    /* zero if head belongs to the cached sample we were
+       cloned from */
+    int owns_head;
+    DiskIO io;
+    /* the tail of a playing clone (NULL if it all fits in the
+       head), and frames we have taken out of its ringbuffer.
+       scratch_start is the stream frame at scratch[0] */
+    DiskStream stream;
+    sample_t *scratch;
+    nframes_t scratch_start;
+    nframes_t scratch_frames;
+    /* play position, and how far past it a repitched voice is */
+    nframes_t framep;
+    double phase;
+    State state;
+    LightningEvent done_event;
 };
 
+/**
+ * Streams only run forwards, so a pitch that is not positive
+ * plays at the slowest speed instead of backwards.
+ */
+static pitch_t
+clip_pitch(pitch_t pitch)
+{
+    return pitch <= 0.0 ? 0.0001 : clip(pitch, 0.0001f, 32.0f);
+}
+
+static void
+SampleDisk_set_path(SampleDisk samp, const char *path)
+{
+    size_t path_bytes = strlen(path);
+    samp->path = ALLOC(path_bytes + 1);
+    memcpy(samp->path, path, path_bytes);
+    samp->path[path_bytes] = '\0';
+}
+
+/**
+ * Decode and resample the head of @a sf into @a s->head.
+ * Enough input past the head is fed to the converter that the
+ * head matches what a stream starting from the top produces.
+ */
+static int
+load_head(SampleDisk s, SF sf)
+{
+    int chan, error = 0;
+    channels_t channels = SF_channels(sf);
+    sample_t *outbuf;
+    nframes_t file_frames = SF_frames(sf);
+    double src_ratio = s->output_sr / (double) SF_samplerate(sf);
+    nframes_t in_frames = (nframes_t) ceil(s->head_frames / src_ratio) + HEAD_LOOKAHEAD;
+    nframes_t i, read = 0, n;
+    in_frames = in_frames < file_frames ? in_frames : file_frames;
+
+    sample_t *inbuf = ALLOC((in_frames + 1) * channels * SAMPLE_SIZE);
+    while (read < in_frames) {
+        n = SF_read(sf, inbuf + read * channels, in_frames - read);
+        if (n == 0) {
+            break;
+        }
+        read += n;
+    }
+    /* resample every channel at once, then de-interleave */
+    if (src_ratio == 1.0) {
+        outbuf = inbuf;
+        n = read < s->head_frames ? read : s->head_frames;
+    } else {
+        SRC src = SRC_init(s->quality, channels);
+        AudioData data;
+        nframes_t used = 0, gen = 0, consumed = 0;
+        int last = read == file_frames;
+        outbuf = CALLOC((s->head_frames + 1) * channels, SAMPLE_SIZE);
+        n = 0;
+        do {
+            data.input = inbuf + consumed * channels;
+            data.input_frames = read - consumed;
+            data.output = outbuf + n * channels;
+            data.output_frames = s->head_frames - n;
+            error = SRC_process_chunk(src, src_ratio, data, last,
+                                      &used, &gen);
+            consumed += used;
+            n += gen;
+        } while (!error && n < s->head_frames && (used || gen));
+        SRC_free(&src);
+        if (error) {
+            LOG(Error, "Error in sample rate conversion: %s",
+                SRC_strerror(error));
+        }
+    }
+    for (chan = 0; chan < channels; chan++) {
+        s->head[chan] = CALLOC(s->head_frames > 0 ? s->head_frames : 1,
+                               SAMPLE_SIZE);
+        for (i = 0; i < n; i++) {
+            s->head[chan][i] = outbuf[i * channels + chan];
+        }
+    }
+    if (outbuf != inbuf) {
+        FREE(outbuf);
+    }
+    FREE(inbuf);
+    return error;
+}
+
+SampleDisk
+SampleDisk_init(const char *file, pitch_t pitch, gain_t gain,
+                nframes_t output_sr, const SampleStorage *storage)
+{
+    assert(storage && storage->io);
+    SampleDisk s;
+    SF sf = SF_open_read(file);
+    if (sf == NULL) {
+        LOG(Warn, "could not open %s\n", file);
+        return NULL;
+    }
+    NEW(s);
+    SampleDisk_set_path(s, file);
+    s->pitch = clip_pitch(pitch);
+    s->gain = clip(gain, 0.0f, 1.0f);
+    s->output_sr = output_sr;
+    s->frames = (nframes_t) ceil(SF_frames(sf) * (output_sr / (double) SF_samplerate(sf)));
+    s->head_frames = (nframes_t) ((uint64_t) storage->stream_head_ms * output_sr / 1000);
+    s->head_frames = s->head_frames < s->frames ? s->head_frames : s->frames;
+    s->channels = SF_channels(sf);
+    s->quality = storage->quality;
+    s->head = CALLOC(s->channels, sizeof(sample_t *));
+    s->owns_head = 1;
+    s->io = storage->io;
+    s->stream = NULL;
+    s->scratch = NULL;
+    s->scratch_start = s->scratch_frames = 0;
+    s->framep = 0;
+    s->phase = 0.0;
+    s->state = Processing;
+    s->done_event = LightningEvent_init();
+    if (load_head(s, sf)) {
+        SF_close(&sf);
+        SampleDisk_free(&s);
+        return NULL;
+    }
+    SF_close(&sf);
+    LOG(Debug, "SampleDisk_init: loaded %u of %u frames of %s",
+        s->head_frames, s->frames, file);
+    return s;
+}
+
 SampleDisk
-SampleDisk_init(const char *file, pitch_t pitch,
-                gain_t gain, nframes_t output_samplerate)
+SampleDisk_clone(SampleDisk orig, pitch_t pitch, gain_t gain,
+                 nframes_t output_sr)
 {
+    assert(orig);
     SampleDisk s;
     NEW(s);
+    SampleDisk_set_path(s, orig->path);
+    s->pitch = clip_pitch(pitch);
+    s->gain = clip(gain, 0.0f, 1.0f);
+    s->output_sr = output_sr;
+    s->channels = orig->channels;
+    s->quality = orig->quality;
+    s->head = orig->head;
+    s->owns_head = 0;
+    if (output_sr == orig->output_sr) {
+        s->frames = orig->frames;
+        s->head_frames = orig->head_frames;
+    } else {
+        /* played after a rate change but before the cache was
+           resampled (see Samples_set_samplerate): the head is at
+           the old rate, so stream all of it at the new one */
+        LOG(Warn, "%s is cached at %u Hz, streaming it all at %u Hz",
+            orig->path, orig->output_sr, output_sr);
+        s->frames = (nframes_t) ceil(orig->frames *
+                                     (output_sr / (double) orig->output_sr));
+        s->head_frames = 0;
+    }
+    s->io = orig->io;
+    s->stream = NULL;
+    s->scratch = NULL;
+    if (s->frames > s->head_frames) {
+        s->stream = DiskIO_open(s->io, s->path, s->output_sr,
+                                s->head_frames, s->frames - s->head_frames,
+                                s->pitch, s->quality);
+        s->scratch = ALLOC(SCRATCH_FRAMES * s->channels * SAMPLE_SIZE);
+    }
+    s->scratch_start = s->scratch_frames = 0;
+    s->framep = 0;
+    s->phase = 0.0;
+    s->state = Processing;
+    s->done_event = LightningEvent_init();
     return s;
 }
 
+SampleDisk
+SampleDisk_resample(SampleDisk orig, nframes_t output_sr,
+                    const SampleStorage *storage)
+{
+    assert(orig && storage);
+    SampleStorage st = *storage;
+    st.quality = orig->quality;
+    return SampleDisk_init(orig->path, 1.0, 1.0, output_sr, &st);
+}
+
 const char *
 SampleDisk_path(SampleDisk samp)
 {
@@ -26,26 +246,141 @@ SampleDisk_path(SampleDisk samp)
     return samp->path;
 }
 
+nframes_t
+SampleDisk_frames(SampleDisk samp)
+{
+    assert(samp);
+    return samp->frames;
+}
+
+/**
+ * Find frame @a index of the streamed tail, pulling frames out of
+ * the ringbuffer as needed. Frames before @a index are dropped,
+ * so after an underrun the stream catches up with the play
+ * position instead of falling behind it.
+ *
+ * @return the frame, or NULL if it has not been read from disk yet
+ */
+static const sample_t *
+stream_frame(SampleDisk s, nframes_t index)
+{
+    while (index >= s->scratch_start + s->scratch_frames) {
+        nframes_t n;
+        s->scratch_start += s->scratch_frames;
+        s->scratch_frames = 0;
+        n = DiskStream_read(s->stream, s->scratch, SCRATCH_FRAMES);
+        if (n == 0) {
+            return NULL;
+        }
+        s->scratch_frames = n;
+    }
+    return s->scratch + (index - s->scratch_start) * s->channels;
+}
+
 nframes_t
 SampleDisk_write(SampleDisk samp, sample_t **buffers, channels_t channels,
                  nframes_t frames)
 {
+    assert(samp);
+    int chan;
+    /* channels past the last output are not played, mono
+       samples are rendered once and copied to every output */
+    int chans = samp->channels < channels ? samp->channels : channels;
+    nframes_t frame, index, playable = 0, frames_used;
+    nframes_t offset = samp->framep;
+    sample_t gain = (sample_t) samp->gain;
+    double frame_index = samp->phase;
+    const sample_t *tail;
+
+    if (samp->state != Processing) {
+        return 0;
+    }
+
+    if (samp->pitch == 1.0) {
+        playable = offset < samp->frames ? samp->frames - offset : 0;
+        playable = playable < frames ? playable : frames;
+        frames_used = playable;
+    } else {
+        while (playable < frames && offset + (long) frame_index < samp->frames) {
+            frame_index += samp->pitch;
+            playable++;
+        }
+        frames_used = (long) frame_index;
+    }
+
+    frame_index = samp->phase;
+    for (frame = 0; frame < playable; frame++) {
+        index = offset + (long) frame_index;
+        if (index < samp->head_frames) {
+            for (chan = 0; chan < chans; chan++) {
+                buffers[chan][frame] = gain * samp->head[chan][index];
+            }
+        } else if (samp->stream &&
+                   (tail = stream_frame(samp, index - samp->head_frames))) {
+            for (chan = 0; chan < chans; chan++) {
+                buffers[chan][frame] = gain * tail[chan];
+            }
+        } else {
+            for (chan = 0; chan < chans; chan++) {
+                buffers[chan][frame] = 0.0f;
+            }
+        }
+        frame_index += samp->pitch;
+    }
+    for (chan = 0; chan < chans; chan++) {
+        memset(buffers[chan] + playable, 0, (frames - playable) * SAMPLE_SIZE);
+    }
+    for (chan = chans; chan < channels; chan++) {
+        if (chans == 1) {
+            memcpy(buffers[chan], buffers[0], frames * SAMPLE_SIZE);
+        } else {
+            memset(buffers[chan], 0, frames * SAMPLE_SIZE);
+        }
+    }
+
+    if (playable < frames) {
+        samp->state = Finished;
+        LightningEvent_try_broadcast(samp->done_event, NULL);
+    } else {
+        /* carry the fraction over so repitched voices keep
+           their exact speed */
+        samp->framep += frames_used;
+        samp->phase = frame_index - frames_used;
+    }
     return 0;
 }
 
 int
 SampleDisk_done(SampleDisk samp)
 {
-    return 1;
+    assert(samp);
+    return samp->state == Finished;
 }
 
 int
 SampleDisk_wait(SampleDisk samp)
 {
-    return 0;
+    assert(samp);
+    return LightningEvent_wait(samp->done_event);
 }
 
 void
 SampleDisk_free(SampleDisk *samp)
 {
+    assert(samp && *samp);
+    int chan;
+    SampleDisk s = *samp;
+    if (s->stream) {
+        DiskIO_close(&s->stream);
+    }
+    if (s->owns_head) {
+        for (chan = 0; chan < s->channels; chan++) {
+            FREE(s->head[chan]);
+        }
+        FREE(s->head);
+    }
+    FREE(s->scratch);
+    FREE(s->path);
+    LightningEvent_free(&s->done_event);
+    FREE(*samp);
 }
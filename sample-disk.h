@@ -2,16 +2,47 @@
 #define SAMPLE_DISK_H_INCLUDED
 
 #include "lightning.h"
+#include "sample-storage.h"
 
 typedef struct SampleDisk *SampleDisk;
 
+/**
+ * Load the head of a sample to be streamed from disk.
+ * The first @a storage->stream_head_ms milliseconds are decoded,
+ * resampled and kept in RAM so playback can start at once. The
+ * rest is streamed by the I/O thread of @a storage for every
+ * clone that is played.
+ */
 SampleDisk
 SampleDisk_init(const char *file, pitch_t pitch,
-                gain_t gain, nframes_t output_samplerate);
+                gain_t gain, nframes_t output_samplerate,
+                const SampleStorage *storage);
+
+/**
+ * Clone a sample for playing. The clone shares the head of
+ * @a orig and opens its own stream for the tail.
+ */
+SampleDisk
+SampleDisk_clone(SampleDisk orig, pitch_t pitch,
+                 gain_t gain, nframes_t output_samplerate);
+
+/**
+ * Load the head of @a orig again for a new output sample rate,
+ * resampled with the converter @a orig was loaded with.
+ */
+SampleDisk
+SampleDisk_resample(SampleDisk orig, nframes_t output_samplerate,
+                    const SampleStorage *storage);
 
 const char *
 SampleDisk_path(SampleDisk samp);
 
+/**
+ * Number of frames in the sample (after resampling).
+ */
+nframes_t
+SampleDisk_frames(SampleDisk samp);
+
 nframes_t
 SampleDisk_write(SampleDisk samp, sample_t **buffers, channels_t channels,
                  nframes_t frames);
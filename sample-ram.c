@@ -6,7 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "blocks.h"
 #include "clip.h"
+#include "convert.h"
+#include "decoder.h"
 #include "event.h"
 #include "lightning.h"
 #include "log.h"
@@ -16,6 +20,9 @@
 #include "sf.h"
 #include "src.h"
 
+/* frames decoded from a file at a time while it is loaded */
+#define LOAD_CHUNK_FRAMES 4096
+
 typedef enum {
     Initializing,
     /* ready for processing */
@@ -28,12 +35,49 @@ struct SampleRam {
     char *path;
     pitch_t pitch;
     gain_t gain;
-    // channels, frames, and samplerate
+    // channels (of stored data), frames, and samplerate
     channels_t channels;
     nframes_t frames;
     int samplerate;
-    // buffers to hold sample data (one per channel)
-    sample_t **framebufs;
+    // sample rate of the stored frames (the output rate they
+    // were resampled to, or samplerate if native is set)
+    nframes_t rate;
+    int native;
+    // converter the stored frames were (or will be, after a
+    // change of output rate) resampled with
+    SRCQuality quality;
+    // stored frames to advance per output frame, which is the
+    // pitch times rate over the output rate
+    double step;
+    // fractional part of the play position
+    double phase;
+    // buffers to hold sample data (one per channel, or a
+    // single buffer of interleaved frames), stored in format
+    void **framebufs;
+    SampleFormat format;
+    SampleLayout layout;
+    // compressed sample data, used instead of framebufs
+    // when format is SampleFormat_BLOCKS
+    Blocks blocks;
+    // worker that decodes blocks ahead of playing clones, and
+    // the stream a clone reads decoded blocks from
+    Decoder decoder;
+    DecoderStream stream;
+    // zero if framebufs (or blocks) belong to someone else (a
+    // cached sample we were cloned from, or a mapped bank)
+    int owns_buffers;
+    // nonzero if framebufs are mapped from a bank
+    int mapped;
+    // float WAV file framebufs[0] points into, which is played
+    // without being decoded (owned by us, NULL if there is none)
+    SFMap map;
+    // for samples converted from mapped data, a mapped sample
+    // wrapping the original data, so converting again starts
+    // from the bank's rate rather than ours (owned by us)
+    SampleRam origin;
+    // arena framebufs were allocated from (NULL if they
+    // came from the heap)
+    Arena arena;
     // track read position in file (guarded by mutex)
     nframes_t framep;
     Mutex framep_mutex;
@@ -53,14 +97,7 @@ static void
 initialize_state(SampleRam s);
 
 static void
-allocate_frame_buffers(SampleRam s, nframes_t frames);
-
-/**
- * Copy framebufs from src to dest. Time-scale with @a pitch, and
- * scale amplitude with gain.
- */
-static void
-copy_frame_buffers(SampleRam dest, SampleRam src, gain_t gain);
+allocate_frame_buffers(SampleRam s, nframes_t frames, Arena arena);
 
 static int
 SampleRam_set_state(SampleRam samp, State state);
@@ -91,6 +128,15 @@ SampleRam_is_processing(SampleRam samp)
     return samp->state == Processing;
 }
 
+/**
+ * Number of frame buffers holding the sample data.
+ */
+static inline int
+framebuf_count(SampleRam samp)
+{
+    return samp->layout == SampleLayout_INTERLEAVED ? 1 : samp->channels;
+}
+
 /**
  * Set a sample's path.
  */
@@ -105,77 +151,354 @@ SampleRam_set_path(SampleRam samp, const char *path)
 }
 
 /**
- * De-interleave and resample a buffer that has
- * been read from disk.
+ * Copy @a frames interleaved frames of @a chans channels from
+ * @a buf into one buffer per channel, starting at frame @a pos
+ * of each. Stereo gets its own loop, which the compiler can
+ * vectorize.
  */
-static int
-SampleRam_set_buffers(SampleRam samp, sample_t *buf, nframes_t output_sr)
-{
-    /* sample-rate converters */
-    SRC srcs[2];
-    srcs[0] = SRC_init();
-    srcs[1] = SRC_init();
-    /* de-interleaved buffers */
-    sample_t *di_bufs[2];
-    di_bufs[0] = ALLOC( samp->frames * SAMPLE_SIZE );
-    di_bufs[1] = ALLOC( samp->frames * SAMPLE_SIZE );
-    /* de-interleave */
+static void
+deinterleave(const sample_t *buf, int chans, nframes_t frames,
+             sample_t **out, nframes_t pos)
+{
     int i;
-    unsigned int j;
-    LOG(Info, "samp->channels = %d", samp->channels);
-    if (samp->channels == 1) {
-        for (j = 0; j < samp->frames; j++) {
-            di_bufs[0][j] = di_bufs[1][j] = buf[j];
+    nframes_t j;
+    if (chans == 2) {
+        const sample_t *restrict in = buf;
+        sample_t *restrict left = out[0] + pos;
+        sample_t *restrict right = out[1] + pos;
+        for (j = 0; j < frames; j++) {
+            left[j] = in[2 * j];
+            right[j] = in[2 * j + 1];
         }
-    } else if (samp->channels == 2) {
-        for (j = 0; j < samp->frames; j++) {
-            for (i = 0; i < samp->channels; i++) {
-                di_bufs[i][j] = buf[ (j * samp->channels) + i ];
-            }
+        return;
+    }
+    for (j = 0; j < frames; j++) {
+        for (i = 0; i < chans; i++) {
+            out[i][pos + j] = buf[ (j * chans) + i ];
         }
-    } else {
-        LOG(Error, "Unsupported number of channels (%d). "
-            "Only stereo and mono are supported.\n", samp->channels);
-        return 1;
     }
-    /* perform sample rate conversion */
-    double src_ratio = output_sr / (double) samp->samplerate;
-    nframes_t output_frames = (nframes_t) ceil(samp->frames * src_ratio);
+}
+
+/**
+ * Resample @a in_frames interleaved frames of @a chans channels
+ * from @a in with a single multichannel converter, and
+ * de-interleave them into @a out, which must hold
+ * @a output_frames frames per channel.
+ * Frames the converter does not produce are zeroed.
+ */
+static int
+resample_interleaved(const sample_t *in, int chans, nframes_t in_frames,
+                     double src_ratio, SRCQuality quality,
+                     sample_t **out, nframes_t output_frames)
+{
+    SRC src = SRC_init(quality, chans);
+    /* mono output goes straight to its buffer */
+    sample_t *buf = chans == 1
+        ? out[0]
+        : ALLOC(((size_t) output_frames + 1) * chans * SAMPLE_SIZE);
     int error, end_of_input = 0;
     AudioData audio_data;
     nframes_t frames_consumed = 0, frames_produced = 0;
     nframes_t input_frames_used, output_frames_gen;
-    while (frames_consumed < samp->frames) {
+    while (frames_consumed < in_frames) {
         input_frames_used = 0;
         output_frames_gen = 0;
-        audio_data.input_frames = samp->frames - frames_consumed;
+        audio_data.input_frames = in_frames - frames_consumed;
         audio_data.output_frames = output_frames - frames_produced;
-        for (i = 0; i < 2; i++) {
-            audio_data.output = &samp->framebufs[i][frames_produced];
-            audio_data.input = &di_bufs[i][frames_consumed];
-            error = SRC_process(srcs[i], src_ratio, audio_data,
-                                &input_frames_used, &output_frames_gen,
-                                &end_of_input);
-            if (error) {
-                LOG(Error, "Error in sample rate conversion: %s",
-                    SRC_strerror(error));
-            }
+        audio_data.output = buf + (size_t) frames_produced * chans;
+        audio_data.input = (sample_t *) in + (size_t) frames_consumed * chans;
+        error = SRC_process(src, src_ratio, audio_data,
+                            &input_frames_used, &output_frames_gen,
+                            &end_of_input);
+        if (error) {
+            LOG(Error, "Error in sample rate conversion: %s",
+                SRC_strerror(error));
         }
-        if (end_of_input) {
+        /* when downsampling the output can fill up before the
+           input runs out, which would otherwise loop forever */
+        if (end_of_input || (input_frames_used == 0 && output_frames_gen == 0)) {
             break;
         } else {
             frames_consumed += input_frames_used;
             frames_produced += output_frames_gen;
         }
     }
+    memset(buf + (size_t) frames_produced * chans, 0,
+           (size_t) (output_frames - frames_produced) * chans * SAMPLE_SIZE);
+    if (chans > 1) {
+        deinterleave(buf, chans, output_frames, out, 0);
+        FREE(buf);
+    }
+    SRC_free(&src);
+    return 0;
+}
 
-    FREE(di_bufs[0]);
-    FREE(di_bufs[1]);
-    SRC_free(&srcs[0]);
-    SRC_free(&srcs[1]);
-    /* FREE(srcs[0]); */
-    /* FREE(srcs[1]); */
+/**
+ * Pick the format and layout @a s is stored in, given the
+ * bit depth of its source data.
+ */
+static void
+choose_storage(SampleRam s, const SampleStorage *storage, int bits)
+{
+    /* 16-bit sources lose nothing when they are stored as 16-bit */
+    SampleFormat format = storage->format;
+    if (format == SampleFormat_AUTO) {
+        format = bits <= 16 ? SampleFormat_INT16 : SampleFormat_FLOAT32;
+    }
+    /* compressed samples can't be played without a decoder */
+    if (format == SampleFormat_BLOCKS && s->decoder == NULL) {
+        format = SampleFormat_INT16;
+    }
+    s->format = format;
+    /* only uncompressed stereo is interleaved */
+    s->layout = storage->layout;
+    if (s->channels != 2 || s->format == SampleFormat_BLOCKS) {
+        s->layout = SampleLayout_PLANAR;
+    }
+}
+
+/**
+ * Get a float buffer per channel to resample @a output_frames
+ * frames into. Planar float data is resampled straight into the
+ * frame buffers, compact formats and interleaved data are
+ * converted by store_buffers afterwards.
+ */
+static sample_t **
+output_buffers(SampleRam s, nframes_t output_frames, Arena arena)
+{
+    int i;
+    sample_t **outbufs = CALLOC(s->channels, sizeof(sample_t *));
+    if (s->format == SampleFormat_FLOAT32 &&
+        s->layout == SampleLayout_PLANAR) {
+        allocate_frame_buffers(s, output_frames, arena);
+        for (i = 0; i < s->channels; i++) {
+            outbufs[i] = (sample_t *) s->framebufs[i];
+        }
+    } else {
+        for (i = 0; i < s->channels; i++) {
+            outbufs[i] = ALLOC(output_frames * SAMPLE_SIZE);
+        }
+    }
+    return outbufs;
+}
+
+/**
+ * Store the resampled data in @a outbufs in the sample's format
+ * and layout (unless resampling failed), then free the buffers
+ * output_buffers handed out.
+ *
+ * @return nonzero if resampling failed or the data could not
+ *         be stored
+ */
+static int
+store_buffers(SampleRam s, sample_t **outbufs, nframes_t output_frames,
+              Arena arena, int error)
+{
+    int i;
+    if (s->format == SampleFormat_BLOCKS) {
+        if (!error) {
+            s->blocks = Blocks_init((const sample_t **) outbufs,
+                                    s->channels, output_frames, arena);
+            s->owns_buffers = 1;
+            error = s->blocks == NULL;
+        }
+        for (i = 0; i < s->channels; i++) {
+            FREE(outbufs[i]);
+        }
+    } else if (s->layout == SampleLayout_INTERLEAVED) {
+        if (!error) {
+            nframes_t j;
+            sample_t *interleaved = ALLOC(output_frames * 2 * SAMPLE_SIZE);
+            for (j = 0; j < output_frames; j++) {
+                interleaved[2 * j] = outbufs[0][j];
+                interleaved[2 * j + 1] = outbufs[1][j];
+            }
+            allocate_frame_buffers(s, output_frames, arena);
+            Convert_from_float(s->framebufs[0], s->format,
+                               interleaved, output_frames * 2);
+            FREE(interleaved);
+        }
+        for (i = 0; i < s->channels; i++) {
+            FREE(outbufs[i]);
+        }
+    } else if (s->format != SampleFormat_FLOAT32) {
+        if (!error) {
+            allocate_frame_buffers(s, output_frames, arena);
+            for (i = 0; i < s->channels; i++) {
+                Convert_from_float(s->framebufs[i], s->format,
+                                   outbufs[i], output_frames);
+            }
+        }
+        for (i = 0; i < s->channels; i++) {
+            FREE(outbufs[i]);
+        }
+    }
+    FREE(outbufs);
+    return error;
+}
 
+/**
+ * Where load_frames puts the frames of a sample as they are
+ * decoded. Float planar data, and data that is compressed once
+ * it has all been loaded, goes to a float buffer per channel in
+ * @a planar. Otherwise @a planar is NULL and frames are
+ * converted straight into the frame buffers, by way of
+ * @a scratch for planar data.
+ */
+typedef struct Loader {
+    SampleRam s;
+    sample_t **planar;
+    sample_t **scratch;
+    /* output frames to store, and how many have been stored */
+    nframes_t frames;
+    nframes_t pos;
+} Loader;
+
+/**
+ * Store @a n interleaved frames from @a buf after the frames
+ * that are already stored. Frames past the end are dropped.
+ */
+static void
+store_frames(Loader *ld, const sample_t *buf, nframes_t n)
+{
+    int i;
+    SampleRam s = ld->s;
+    /* not used when there is a planar buffer, which blocks have */
+    size_t size = ld->planar ? 0 : Convert_size(s->format);
+    n = n < ld->frames - ld->pos ? n : ld->frames - ld->pos;
+    if (ld->planar) {
+        deinterleave(buf, s->channels, n, ld->planar, ld->pos);
+    } else if (s->layout == SampleLayout_INTERLEAVED) {
+        Convert_from_float((char *) s->framebufs[0] + ld->pos * 2 * size,
+                           s->format, buf, n * 2);
+    } else {
+        deinterleave(buf, s->channels, n, ld->scratch, 0);
+        for (i = 0; i < s->channels; i++) {
+            Convert_from_float((char *) s->framebufs[i] + ld->pos * size,
+                               s->format, ld->scratch[i], n);
+        }
+    }
+    ld->pos += n;
+}
+
+/**
+ * Decode @a sf a chunk at a time, resampling each chunk from
+ * the file's rate to @a rate as it goes, and store the frames
+ * through @a ld. Only a few chunks are held at once, whatever
+ * the length of the file.
+ * If the file ends before the frames it reported, the rest of
+ * the sample is silent.
+ */
+static int
+load_frames(Loader *ld, SF sf, nframes_t rate)
+{
+    SampleRam s = ld->s;
+    int i, chans = s->channels, error = 0, eof = 0;
+    double src_ratio = rate / (double) s->samplerate;
+    size_t chunk_bytes = (size_t) LOAD_CHUNK_FRAMES * chans * SAMPLE_SIZE;
+    sample_t *in = ALLOC(chunk_bytes);
+    sample_t *out = src_ratio == 1.0 ? NULL : ALLOC(chunk_bytes);
+    SRC src = out ? SRC_init(s->quality, chans) : NULL;
+    AudioData data;
+    nframes_t have = 0, read = 0, n, used, gen;
+    if (ld->planar == NULL && s->layout == SampleLayout_PLANAR) {
+        ld->scratch = CALLOC(chans, sizeof(sample_t *));
+        for (i = 0; i < chans; i++) {
+            ld->scratch[i] = ALLOC(LOAD_CHUNK_FRAMES * SAMPLE_SIZE);
+        }
+    }
+    while (ld->pos < ld->frames) {
+        /* top up the input chunk, reading no further than the
+           frames the file reported */
+        n = 0;
+        if (!eof && have < LOAD_CHUNK_FRAMES) {
+            n = s->frames - read;
+            n = n < LOAD_CHUNK_FRAMES - have ? n : LOAD_CHUNK_FRAMES - have;
+            n = n > 0 ? SF_read(sf, in + have * chans, n) : 0;
+            eof = n == 0;
+            read += n;
+            have += n;
+        }
+        if (src == NULL) {
+            if (have == 0) {
+                break;
+            }
+            store_frames(ld, in, have);
+            have = 0;
+            continue;
+        }
+        used = gen = 0;
+        data.input = in;
+        data.input_frames = have;
+        data.output = out;
+        data.output_frames = LOAD_CHUNK_FRAMES;
+        error = SRC_process_chunk(src, src_ratio, data, eof, &used, &gen);
+        if (error) {
+            LOG(Error, "Error in sample rate conversion: %s",
+                SRC_strerror(error));
+            break;
+        }
+        store_frames(ld, out, gen);
+        have -= used;
+        memmove(in, in + (size_t) used * chans, (size_t) have * chans * SAMPLE_SIZE);
+        /* the converter has been flushed, or is stuck */
+        if (n == 0 && used == 0 && gen == 0) {
+            break;
+        }
+    }
+    if (read < s->frames) {
+        LOG(Warn, "%s ended %u frames early", s->path, s->frames - read);
+    }
+    memset(in, 0, chunk_bytes);
+    while (!error && ld->pos < ld->frames) {
+        store_frames(ld, in, LOAD_CHUNK_FRAMES);
+    }
+    if (ld->scratch) {
+        for (i = 0; i < chans; i++) {
+            FREE(ld->scratch[i]);
+        }
+        FREE(ld->scratch);
+    }
+    if (src) {
+        SRC_free(&src);
+    }
+    FREE(out);
+    FREE(in);
+    return error;
+}
+
+/**
+ * Play @a file straight from a mapping of it, if it holds mono
+ * or stereo float frames at the rate @a s is to be stored at,
+ * and @a s is to be stored as float. Stereo is played
+ * interleaved, the way it is laid out in the file.
+ *
+ * @return 0 if @a s now plays from the mapping
+ */
+static int
+map_file(SampleRam s, const char *file)
+{
+    SFMap map;
+    if (s->format != SampleFormat_FLOAT32 || s->rate != s->samplerate ||
+        s->channels > 2) {
+        return 1;
+    }
+    map = SFMap_open(file);
+    if (map == NULL) {
+        return 1;
+    }
+    if (SFMap_channels(map) != s->channels ||
+        SFMap_samplerate(map) != s->samplerate ||
+        SFMap_frames(map) < s->frames) {
+        SFMap_free(&map);
+        return 1;
+    }
+    s->map = map;
+    s->layout = s->channels == 2
+        ? SampleLayout_INTERLEAVED
+        : SampleLayout_PLANAR;
+    s->framebufs = CALLOC(1, sizeof(void *));
+    s->framebufs[0] = (void *) SFMap_data(map);
     return 0;
 }
 
@@ -184,13 +507,24 @@ SampleRam_set_buffers(SampleRam samp, sample_t *buf, nframes_t output_sr)
  * perform sample rate conversion, then cache this data in memory.
  */
 SampleRam
-SampleRam_init(const char *file, pitch_t pitch, gain_t gain, nframes_t output_sr)
+SampleRam_init(const char *file, pitch_t pitch, gain_t gain,
+               nframes_t output_sr, const SampleStorage *storage)
 {
+    int error;
     SampleRam s;
     /* initialize state mutex and set state to Processing */
     NEW(s);
     initialize_state(s);
     SampleRam_set_path(s, file);
+    s->framebufs = NULL;
+    s->blocks = NULL;
+    s->decoder = storage->decoder;
+    s->stream = NULL;
+    s->owns_buffers = 0;
+    s->mapped = 0;
+    s->origin = NULL;
+    s->map = NULL;
+    s->arena = NULL;
     /* open audio file */
     SF sf = SF_open_read(file);
     if (sf == NULL) {
@@ -210,43 +544,193 @@ SampleRam_init(const char *file, pitch_t pitch, gain_t gain, nframes_t output_sr
     s->channels = SF_channels(sf);
     s->frames = SF_frames(sf);
     s->samplerate = SF_samplerate(sf);
+    s->native = storage->native_rate;
+    s->quality = storage->quality;
+    s->rate = s->native ? s->samplerate : output_sr;
+    s->step = s->pitch;
+    s->phase = 0.0;
     s->done_event = LightningEvent_init(NULL);
-    /* allocate stereo buffers */
-    double src_ratio = output_sr / (double) s->samplerate;
-    nframes_t output_frames = (nframes_t) ceil(s->frames * src_ratio);
-    allocate_frame_buffers(s, output_frames);
-    /* read the file */
-    /* some files seem to report a smaller number of frames than
-       the data they actually contain.
-       this code was segfault'ing when trying to read
-       http://www.freesound.org/people/madjad/sounds/21653/ */
-    const nframes_t frames = (4096 / SAMPLE_SIZE) / s->channels;
-    sample_t *framebuf = ALLOC( (s->frames + frames) * s->channels * SAMPLE_SIZE );
-    long total_frames = SF_read(sf, framebuf, frames);
-
-    while (total_frames < s->frames) {
-        total_frames +=                         \
-            SF_read(sf, framebuf + (total_frames * s->channels), frames);
-    }
-    assert(total_frames == s->frames);
+    s->src_ratio = 1.0;
+    choose_storage(s, storage, SF_bits(sf));
+    /* frames are stored as they are decoded, resampled to the
+       output rate (or, at the native rate, just de-interleaved) */
+    double src_ratio = s->rate / (double) s->samplerate;
+    nframes_t output_frames = s->native
+        ? s->frames
+        : (nframes_t) ceil(s->frames * src_ratio);
+    Loader ld = { s, NULL, NULL, output_frames, 0 };
+    if (map_file(s, file) == 0) {
+        LOG(Debug, "playing %s from its mapping", file);
+        error = 0;
+    } else if (s->format == SampleFormat_BLOCKS ||
+               (s->format == SampleFormat_FLOAT32 &&
+                s->layout == SampleLayout_PLANAR)) {
+        ld.planar = output_buffers(s, output_frames, storage->arena);
+        error = load_frames(&ld, sf, s->rate);
+    } else {
+        allocate_frame_buffers(s, output_frames, storage->arena);
+        error = load_frames(&ld, sf, s->rate);
+    }
     SF_close(&sf);
-
-    /* de-interleave (if necessary) and resample */
-    SampleRam_set_buffers(s, framebuf, output_sr);
-
-    FREE(framebuf);
+    if (ld.planar) {
+        error = store_buffers(s, ld.planar, output_frames, storage->arena,
+                              error);
+    }
+    s->framep_mutex = Mutex_init();
+    if (error) {
+        SampleRam_free(&s);
+        return NULL;
+    }
 
     /* set frames member to the number of frames that are
        actually in framebuf after resampling */
     s->frames = output_frames;
     s->framep = 0;
-    s->framep_mutex = Mutex_init();
     s->total_frames_written = 0;
     SampleRam_set_state_or_exit(s, Processing);
     LOG(Debug, "SampleRam_init: done loading %s", file);
     return s;
 }
 
+SampleRam
+SampleRam_init_mapped(const char *name, channels_t channels,
+                      nframes_t frames, nframes_t samplerate,
+                      SampleFormat format, SampleLayout layout,
+                      void **framebufs)
+{
+    assert(channels > 0);
+    assert(layout == SampleLayout_PLANAR || channels == 2);
+    SampleRam s;
+    NEW(s);
+    initialize_state(s);
+    SampleRam_set_path(s, name);
+    s->pitch = 1.0;
+    s->gain = 1.0;
+    s->channels = channels;
+    s->frames = frames;
+    s->samplerate = samplerate;
+    s->rate = samplerate;
+    s->native = 0;
+    s->quality = SRCQuality_FASTEST;
+    s->step = 1.0;
+    s->phase = 0.0;
+    s->src_ratio = 1.0;
+    s->done_event = LightningEvent_init(NULL);
+    s->framebufs = framebufs;
+    s->format = format;
+    s->layout = layout;
+    s->blocks = NULL;
+    s->decoder = NULL;
+    s->stream = NULL;
+    s->owns_buffers = 0;
+    s->mapped = 1;
+    s->origin = NULL;
+    s->map = NULL;
+    s->arena = NULL;
+    s->framep = 0;
+    s->framep_mutex = Mutex_init();
+    s->total_frames_written = 0;
+    SampleRam_set_state_or_exit(s, Processing);
+    return s;
+}
+
+/**
+ * Convert mapped sample data to @a output_sr. @a mapped is kept
+ * as the origin of the new sample.
+ */
+static SampleRam
+convert_mapped(SampleRam mapped, nframes_t output_sr,
+               const SampleStorage *storage)
+{
+    int i, error;
+    nframes_t j;
+    sample_t *in, **outbufs;
+    double src_ratio = output_sr / (double) mapped->samplerate;
+    nframes_t output_frames = (nframes_t) ceil(mapped->frames * src_ratio);
+    SampleRam s;
+    NEW(s);
+    initialize_state(s);
+    SampleRam_set_path(s, mapped->path);
+    s->pitch = 1.0;
+    s->gain = 1.0;
+    s->channels = mapped->channels;
+    s->samplerate = mapped->samplerate;
+    s->rate = output_sr;
+    s->native = 0;
+    s->quality = storage->quality;
+    s->step = 1.0;
+    s->phase = 0.0;
+    s->src_ratio = 1.0;
+    s->done_event = LightningEvent_init(NULL);
+    s->framebufs = NULL;
+    s->blocks = NULL;
+    s->decoder = storage->decoder;
+    s->stream = NULL;
+    s->owns_buffers = 0;
+    s->mapped = 0;
+    s->origin = mapped;
+    s->map = NULL;
+    s->arena = NULL;
+    choose_storage(s, storage,
+                   mapped->format == SampleFormat_INT16 ? 16 : 32);
+    /* the converter wants interleaved float frames */
+    in = ALLOC(((size_t) mapped->frames + 1) * s->channels * SAMPLE_SIZE);
+    for (j = 0; j < mapped->frames; j++) {
+        for (i = 0; i < s->channels; i++) {
+            in[j * s->channels + i] = mapped->layout == SampleLayout_PLANAR
+                ? Convert_sample(mapped->framebufs[i], mapped->format, j)
+                : Convert_sample(mapped->framebufs[0], mapped->format,
+                                 2 * j + i);
+        }
+    }
+    outbufs = output_buffers(s, output_frames, storage->arena);
+    error = resample_interleaved(in, s->channels, mapped->frames, src_ratio,
+                                 s->quality, outbufs, output_frames);
+    FREE(in);
+    error = store_buffers(s, outbufs, output_frames, storage->arena, error);
+    s->framep_mutex = Mutex_init();
+    if (error) {
+        SampleRam_free(&s);
+        return NULL;
+    }
+    s->frames = output_frames;
+    s->framep = 0;
+    s->total_frames_written = 0;
+    SampleRam_set_state_or_exit(s, Processing);
+    return s;
+}
+
+SampleRam
+SampleRam_resample(SampleRam orig, nframes_t output_sr,
+                   const SampleStorage *storage)
+{
+    assert(orig);
+    SampleRam src = orig->origin ? orig->origin : orig, mapped;
+    /* keep the converter the sample was loaded with */
+    SampleStorage st = *storage;
+    st.quality = orig->quality;
+    if (!src->mapped) {
+        return SampleRam_init(orig->path, orig->pitch, orig->gain,
+                              output_sr, &st);
+    }
+    /* a fresh wrapper around the bank's data, which is played
+       in place if the bank is already at the new rate */
+    mapped = SampleRam_init_mapped(src->path, src->channels, src->frames,
+                                   src->samplerate, src->format,
+                                   src->layout, src->framebufs);
+    if (src->samplerate == output_sr) {
+        return mapped;
+    }
+    return convert_mapped(mapped, output_sr, &st);
+}
+
+/**
+ * Clones share the frame buffers of the cached sample, so
+ * playing a sample never copies its audio data. Gain is
+ * applied when the clone is written to the output buffers.
+ * Clones of compressed samples get their own decode-ahead
+ * stream.
+ */
 SampleRam
 SampleRam_clone(SampleRam orig, pitch_t pitch, gain_t gain, nframes_t output_sr)
 {
@@ -259,11 +743,28 @@ SampleRam_clone(SampleRam orig, pitch_t pitch, gain_t gain, nframes_t output_sr)
     s->frames = orig->frames;
     s->channels = orig->channels;
     s->samplerate = orig->samplerate;
+    s->rate = orig->rate;
+    s->native = orig->native;
+    s->quality = orig->quality;
+    /* exactly the pitch if the data is at the output rate */
+    s->step = orig->rate == output_sr
+        ? pitch
+        : pitch * orig->rate / (double) output_sr;
+    s->phase = 0.0;
     s->src_ratio = output_sr / (double) orig->samplerate;
     s->done_event = LightningEvent_init(NULL);
     SampleRam_set_path(s, orig->path);
-    allocate_frame_buffers(s, s->frames);
-    copy_frame_buffers(s, orig, s->gain);
+    s->framebufs = orig->framebufs;
+    s->format = orig->format;
+    s->layout = orig->layout;
+    s->blocks = orig->blocks;
+    s->decoder = orig->decoder;
+    s->stream = orig->blocks ? Decoder_open(orig->decoder, orig->blocks) : NULL;
+    s->owns_buffers = 0;
+    s->mapped = 0;
+    s->origin = NULL;
+    s->map = NULL;
+    s->arena = NULL;
     s->framep = 0;
     s->framep_mutex = Mutex_init();
     s->total_frames_written = 0;
@@ -282,6 +783,196 @@ SampleRam_path(SampleRam samp)
     return samp->path;
 }
 
+channels_t
+SampleRam_channels(SampleRam samp)
+{
+    assert(samp);
+    return samp->channels;
+}
+
+nframes_t
+SampleRam_frames(SampleRam samp)
+{
+    assert(samp);
+    return samp->frames;
+}
+
+int
+SampleRam_native(SampleRam samp)
+{
+    assert(samp);
+    return samp->native;
+}
+
+SampleFormat
+SampleRam_format(SampleRam samp)
+{
+    assert(samp);
+    return samp->format;
+}
+
+const void *
+SampleRam_buffer(SampleRam samp, channels_t chan)
+{
+    assert(samp && chan >= 0 && chan < samp->channels);
+    if (samp->layout != SampleLayout_PLANAR) {
+        return NULL;
+    }
+    return samp->framebufs ? samp->framebufs[chan] : NULL;
+}
+
+const void *
+SampleRam_interleaved(SampleRam samp)
+{
+    assert(samp);
+    if (samp->layout != SampleLayout_INTERLEAVED) {
+        return NULL;
+    }
+    return samp->framebufs ? samp->framebufs[0] : NULL;
+}
+
+/**
+ * Interpolate between @a a and the frame after it, @a b.
+ */
+static inline sample_t
+lerp(sample_t a, sample_t b, double frac)
+{
+    return a + (b - a) * (sample_t) frac;
+}
+
+/**
+ * Write @a playable frames of channel @a chan starting at
+ * @a offset from the decoded blocks of a compressed sample.
+ * Blocks that were not decoded in time are played as silence.
+ */
+static void
+write_blocks(SampleRam samp, channels_t chan, sample_t *out,
+             nframes_t offset, nframes_t playable, sample_t gain)
+{
+    nframes_t frame, n, index, current = 0;
+    const int16_t *block = NULL, *next;
+    double frame_index = samp->phase;
+    sample_t a, b;
+
+    if (samp->step == 1.0) {
+        /* convert a block at a time */
+        for (frame = 0; frame < playable; frame += n) {
+            index = offset + frame;
+            n = BLOCKS_FRAMES - index % BLOCKS_FRAMES;
+            n = n < playable - frame ? n : playable - frame;
+            block = DecoderStream_block(samp->stream, chan,
+                                        index / BLOCKS_FRAMES);
+            if (block) {
+                Convert_to_float(out + frame, block, SampleFormat_INT16,
+                                 index % BLOCKS_FRAMES, n, gain);
+            } else {
+                memset(out + frame, 0, n * SAMPLE_SIZE);
+            }
+        }
+        return;
+    }
+    for (frame = 0; frame < playable; frame++) {
+        index = offset + (long) frame_index;
+        if (block == NULL || index / BLOCKS_FRAMES != current) {
+            current = index / BLOCKS_FRAMES;
+            block = DecoderStream_block(samp->stream, chan, current);
+        }
+        a = block
+            ? Convert_sample(block, SampleFormat_INT16, index % BLOCKS_FRAMES)
+            : 0.0f;
+        if (samp->native) {
+            /* the frame after the last one in a block starts
+               the next block */
+            if ((index + 1) % BLOCKS_FRAMES) {
+                next = block;
+            } else if (index + 1 < samp->frames) {
+                next = DecoderStream_block(samp->stream, chan, current + 1);
+            } else {
+                next = NULL;
+            }
+            b = next
+                ? Convert_sample(next, SampleFormat_INT16,
+                                 (index + 1) % BLOCKS_FRAMES)
+                : 0.0f;
+            a = lerp(a, b, frame_index - (long) frame_index);
+        }
+        out[frame] = gain * a;
+        frame_index += samp->step;
+    }
+}
+
+/**
+ * Write @a playable frames of channel @a chan starting at
+ * @a offset from a planar frame buffer.
+ */
+static void
+write_planar(SampleRam samp, channels_t chan, sample_t *out,
+             nframes_t offset, nframes_t playable, sample_t gain)
+{
+    const void *src = samp->framebufs[chan];
+    nframes_t frame, index;
+    double frame_index = samp->phase;
+    sample_t b;
+    if (samp->step == 1.0) {
+        /* contiguous input, convert the whole run at once */
+        Convert_to_float(out, src, samp->format, offset, playable, gain);
+        return;
+    }
+    if (samp->native) {
+        for (frame = 0; frame < playable; frame++) {
+            index = offset + (long) frame_index;
+            b = index + 1 < samp->frames
+                ? Convert_sample(src, samp->format, index + 1)
+                : 0.0f;
+            out[frame] = gain * lerp(Convert_sample(src, samp->format, index),
+                                     b, frame_index - (long) frame_index);
+            frame_index += samp->step;
+        }
+        return;
+    }
+    for (frame = 0; frame < playable; frame++) {
+        out[frame] = gain * Convert_sample(src, samp->format,
+                                           offset + (long) frame_index);
+        frame_index += samp->step;
+    }
+}
+
+/**
+ * Write @a playable frames of the first @a chans channels
+ * starting at @a offset from an interleaved stereo buffer.
+ * Both channels of a frame are read together.
+ */
+static void
+write_interleaved(SampleRam samp, sample_t **buffers, int chans,
+                  nframes_t offset, nframes_t playable, sample_t gain)
+{
+    const void *src = samp->framebufs[0];
+    nframes_t frame, index;
+    double frame_index = samp->phase;
+    int chan;
+    sample_t b;
+    if (samp->step == 1.0 && chans == 2) {
+        Convert_to_float_stereo(buffers[0], buffers[1], src, samp->format,
+                                offset, playable, gain);
+        return;
+    }
+    for (frame = 0; frame < playable; frame++) {
+        index = offset + (long) frame_index;
+        for (chan = 0; chan < chans; chan++) {
+            buffers[chan][frame] = gain * Convert_sample(src, samp->format,
+                                                         2 * index + chan);
+            if (samp->native) {
+                b = index + 1 < samp->frames
+                    ? Convert_sample(src, samp->format, 2 * (index + 1) + chan)
+                    : 0.0f;
+                buffers[chan][frame] = lerp(buffers[chan][frame], gain * b,
+                                            frame_index - (long) frame_index);
+            }
+        }
+        frame_index += samp->step;
+    }
+}
+
 nframes_t
 SampleRam_write(SampleRam samp, sample_t **buffers, channels_t channels,
                 nframes_t frames)
@@ -294,47 +985,69 @@ SampleRam_write(SampleRam samp, sample_t **buffers, channels_t channels,
     }
 
     nframes_t len = samp->frames;
-    /* we ensure at initialization that mono samples fill
-       stereo buffers */
-    int chans = 2;
-    /* int chans = (int) samp->channels; */
+    /* channels past the last output are not played, mono
+       samples are rendered once and copied to every output */
+    int chans = samp->channels < channels ? samp->channels : channels;
+    sample_t gain = (sample_t) samp->gain;
     nframes_t offset = samp->framep;
     int chan = 0;
-    long frame = 0;
-    long prev_frame = 0;
-    long input_frame = 0;
-    double frame_index = 0.0;
+    nframes_t playable = 0;
+    double frame_index = samp->phase;
     int at_end = 0;
     nframes_t frames_used = 0;
 
-    while (frame < frames) {
+    /* find out how many output frames we can fill before running
+       out of input, and how far the input advances */
+    if (samp->step == 1.0) {
+        playable = offset < len ? len - offset : 0;
+        playable = playable < frames ? playable : frames;
+        frames_used = playable;
+    } else {
+        while (playable < frames && offset + (long) frame_index < len) {
+            /* nudge the sample index forward
+               this may not actually advance the frame pointer */
+            frame_index += samp->step;
+            playable++;
+        }
+        frames_used = (long) frame_index;
+    }
+    at_end = playable < frames;
+
+    if (samp->stream) {
+        /* let the decoder know where we are */
+        DecoderStream_seek(samp->stream, offset / BLOCKS_FRAMES);
+    }
+
+    if (samp->layout == SampleLayout_INTERLEAVED) {
+        write_interleaved(samp, buffers, chans, offset, playable, gain);
+    } else {
         for (chan = 0; chan < chans; chan++) {
-            if (offset + input_frame < len) {
-                buffers[chan][frame] =                      \
-                    samp->framebufs[chan][offset + input_frame];
+            if (samp->stream) {
+                write_blocks(samp, chan, buffers[chan], offset, playable, gain);
             } else {
-                at_end = 1;
-                buffers[chan][frame] = 0.0f;
+                write_planar(samp, chan, buffers[chan], offset, playable, gain);
             }
         }
-        if (!at_end) {
-            /* store previous frame index */
-            prev_frame = (long) frame_index;
-            /* nudge the sample index forward
-               this may not actually advance the frame pointer */
-            frame_index = frame_index + samp->pitch;
-            input_frame = (long) frame_index;
-            frames_used += input_frame - prev_frame;
+    }
+    for (chan = 0; at_end && chan < chans; chan++) {
+        memset(buffers[chan] + playable, 0, (frames - playable) * SAMPLE_SIZE);
+    }
+    for (chan = chans; chan < channels; chan++) {
+        if (chans == 1) {
+            memcpy(buffers[chan], buffers[0], frames * SAMPLE_SIZE);
+        } else {
+            memset(buffers[chan], 0, frames * SAMPLE_SIZE);
         }
-        /* advance the output frame pointer */
-        frame++;
     }
 
     if (at_end) {
         SampleRam_set_state(samp, Finished);
         LightningEvent_try_broadcast(samp->done_event, NULL);
     } else {
+        /* carry the fraction over so repitched voices keep
+           their exact speed */
         samp->framep += frames_used;
+        samp->phase = frame_index - frames_used;
     }
 
     return 0;
@@ -371,12 +1084,29 @@ SampleRam_free(SampleRam *samp)
     Mutex_free(&s->framep_mutex);
     /* free the state mutex */
     Mutex_free(&s->state_mutex);
-    LOG(Debug, "SampleRam_free s->framebufs[0]  %p", s->framebufs[0]);
-    LOG(Debug, "SampleRam_free s->framebufs[1]  %p", s->framebufs[1]);
-    for (i = 0; i < s->channels; i++) {
-        FREE(s->framebufs[i]);
+    if (s->stream) {
+        Decoder_close(&s->stream);
+    }
+    if (s->owns_buffers && s->blocks) {
+        Blocks_free(&s->blocks);
+    } else if (s->owns_buffers) {
+        LOG(Debug, "SampleRam_free s->framebufs[0]  %p", s->framebufs[0]);
+        for (i = 0; i < framebuf_count(s); i++) {
+            if (s->arena && Arena_contains(s->arena, s->framebufs[i])) {
+                Arena_release(s->arena, s->framebufs[i]);
+            } else {
+                FREE(s->framebufs[i]);
+            }
+        }
+        FREE(s->framebufs);
+    }
+    if (s->map) {
+        FREE(s->framebufs);
+        SFMap_free(&s->map);
+    }
+    if (s->origin) {
+        SampleRam_free(&s->origin);
     }
-    FREE(s->framebufs);
     void *p = *samp;
     FREE(*samp);
     LOG(Debug, "freed %p", p);
@@ -412,34 +1142,28 @@ initialize_state(SampleRam s)
     SampleRam_set_state_or_exit(s, Initializing);
 }
 
-static void
-allocate_frame_buffers(SampleRam s, nframes_t frames)
-{
-    size_t sz = frames * SAMPLE_SIZE;
-    s->framebufs = CALLOC(2, sizeof(sample_t*));
-    LOG(Debug, "allocating frame buffers of size %ld", sz);
-    s->framebufs[0] = ALLOC(frames * SAMPLE_SIZE);
-    s->framebufs[1] = ALLOC(frames * SAMPLE_SIZE);
-    LOG(Debug, "allocated s->framebufs[0]  %p", s->framebufs[0]);
-    LOG(Debug, "allocated s->framebufs[1]  %p", s->framebufs[1]);
-}
-
 /**
- * This function is used for loading cached samples.
- * It doesn't matter if we use src or dest in the loop
- * conditions.
+ * Allocate frame buffers from @a arena, or from the heap if
+ * there is no arena or it is full.
  */
 static void
-copy_frame_buffers(SampleRam dest, SampleRam src, gain_t gain)
+allocate_frame_buffers(SampleRam s, nframes_t frames, Arena arena)
 {
-    int i;
-    unsigned int j;
-    for (j = 0; j < dest->frames; j++) {
-        /* we deliberately initialize the samples in a way that
-           fills stereo buffers even if the sample is mono on disk */
-        /* for (i = 0; i < dest->channels; i++) { */
-        for (i = 0; i < 2; i++) {
-            dest->framebufs[i][j] = gain * src->framebufs[i][j];
+    int i, count = framebuf_count(s);
+    size_t sz = frames * Convert_size(s->format) * (s->channels / count);
+    s->framebufs = CALLOC(count, sizeof(void *));
+    s->owns_buffers = 1;
+    s->arena = arena;
+    LOG(Debug, "allocating frame buffers of size %ld", sz);
+    for (i = 0; i < count; i++) {
+        s->framebufs[i] = arena ? Arena_alloc(arena, sz) : NULL;
+        if (s->framebufs[i] == NULL) {
+            if (arena) {
+                LOG(Warn, "sample cache arena is full, using heap for %s",
+                    s->path);
+            }
+            s->framebufs[i] = ALLOC(sz);
         }
     }
+    LOG(Debug, "allocated s->framebufs[0]  %p", s->framebufs[0]);
 }
@@ -2,6 +2,7 @@
 #define SAMPLE_RAM_H_INCLUDED
 
 #include "lightning.h"
+#include "sample-storage.h"
 
 typedef struct SampleRam *SampleRam;
 
@@ -13,12 +14,48 @@ typedef struct SampleRam *SampleRam;
  * time you load a particular sample. After that it should
  * be cached and subsequent calls to Sample_play should
  * be much faster.
+ * The cached data is stored as described by @a storage.
+ * Frame buffers are allocated from its arena if it is not NULL
+ * and has room, and from the heap otherwise.
  */
 SampleRam
 SampleRam_init(const char *file,
                pitch_t pitch,
                gain_t gain,
-               nframes_t output_samplerate);
+               nframes_t output_samplerate,
+               const SampleStorage *storage);
+
+/**
+ * Wrap frame buffers that are owned by someone else (e.g. a
+ * memory-mapped bank) in a SampleRam without copying them.
+ * @a framebufs must hold @a channels buffers of
+ * @a frames frames each (or, for an interleaved stereo
+ * @a layout, one buffer of @a frames stereo frames), stored in
+ * @a format, and must outlive the returned sample.
+ */
+SampleRam
+SampleRam_init_mapped(const char *name,
+                      channels_t channels,
+                      nframes_t frames,
+                      nframes_t samplerate,
+                      SampleFormat format,
+                      SampleLayout layout,
+                      void **framebufs);
+
+/**
+ * Make a copy of the cached sample @a orig for a new output
+ * sample rate, stored as described by @a storage. Samples loaded
+ * from a file are read from it again, mapped samples are
+ * converted from the original mapped data (or wrapped again
+ * if it is already at @a output_samplerate).
+ * @a orig is left as it is, so clones can keep playing it.
+ *
+ * @return the new sample, or NULL on failure
+ */
+SampleRam
+SampleRam_resample(SampleRam orig,
+                   nframes_t output_samplerate,
+                   const SampleStorage *storage);
 
 SampleRam
 SampleRam_clone(SampleRam orig,
@@ -32,6 +69,45 @@ SampleRam_clone(SampleRam orig,
 const char *
 SampleRam_path(SampleRam samp);
 
+/**
+ * Number of channel buffers held by the sample.
+ */
+channels_t
+SampleRam_channels(SampleRam samp);
+
+/**
+ * Number of frames in each channel buffer.
+ */
+nframes_t
+SampleRam_frames(SampleRam samp);
+
+/**
+ * Nonzero if the sample is stored at the sample rate of its
+ * file, so it plays at any output rate without being converted.
+ */
+int
+SampleRam_native(SampleRam samp);
+
+/**
+ * Format the channel buffers are stored in.
+ */
+SampleFormat
+SampleRam_format(SampleRam samp);
+
+/**
+ * Get the (read-only) data for one channel, or NULL if the
+ * sample is stored as SampleFormat_BLOCKS or interleaved.
+ */
+const void *
+SampleRam_buffer(SampleRam samp, channels_t chan);
+
+/**
+ * Get the (read-only) frames of a sample stored interleaved, or
+ * NULL if it is stored planar or as SampleFormat_BLOCKS.
+ */
+const void *
+SampleRam_interleaved(SampleRam samp);
+
 /**
  * Write sample data to some buffers.
  * Returns the number of frames written.
@@ -0,0 +1,34 @@
+#ifndef SAMPLE_STORAGE_H_INCLUDED
+#define SAMPLE_STORAGE_H_INCLUDED
+
+#include "arena.h"
+#include "decoder.h"
+#include "disk-io.h"
+#include "lightning.h"
+
+/**
+ * Where and how cached sample data is kept.
+ */
+typedef struct SampleStorage {
+    /* format cached data is stored in */
+    SampleFormat format;
+    /* channel layout of cached data */
+    SampleLayout layout;
+    /* arena cached data is allocated from, or NULL for the heap */
+    Arena arena;
+    /* decode-ahead worker for SampleFormat_BLOCKS, samples are
+       stored as SampleFormat_INT16 instead if this is NULL */
+    Decoder decoder;
+    /* I/O thread for samples streamed from disk */
+    DiskIO io;
+    /* milliseconds at the start of a streamed sample that are
+       kept in RAM */
+    nframes_t stream_head_ms;
+    /* nonzero to keep samples cached in RAM at their own sample
+       rate and convert them while playing */
+    int native_rate;
+    /* converter used to resample samples as they are loaded */
+    SRCQuality quality;
+} SampleStorage;
+
+#endif
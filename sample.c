@@ -1,70 +1,253 @@
 #include <assert.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "lightning.h"
 #include "mem.h"
 #include "sample.h"
+#include "sample-disk.h"
 #include "sample-ram.h"
 
-#define SAMPLE_TYPE SampleType_RAM
+/**
+ * Operations every kind of sample implements.
+ * Each Sample carries the table for the storage it was
+ * loaded into, so RAM and disk samples can be mixed freely.
+ */
+typedef struct SampleOps {
+    SampleType type;
+    void *(* clone)(void *orig, pitch_t pitch, gain_t gain,
+                    nframes_t output_samplerate);
+    void *(* resample)(void *orig, nframes_t output_samplerate,
+                       const SampleStorage *storage);
+    const char *(* path)(void *impl);
+    nframes_t (* frames)(void *impl);
+    nframes_t (* write)(void *impl, sample_t **buffers,
+                        channels_t channels, nframes_t frames);
+    int (* done)(void *impl);
+    int (* wait)(void *impl);
+    void (* free)(void *impl);
+} SampleOps;
+
+struct Sample {
+    const SampleOps *ops;
+    /* SampleRam or SampleDisk */
+    void *impl;
+    /* for clones, the cached sample whose data they share */
+    Sample orig;
+    /* references to a cached sample: one held by whoever loaded
+       it and one for every clone of it that has not been freed */
+    atomic_int refs;
+    /* mix bus a clone is played on, 0 for the master bus */
+    int bus;
+};
+
+static void *
+ram_clone(void *orig, pitch_t pitch, gain_t gain, nframes_t output_sr)
+{
+    return SampleRam_clone((SampleRam) orig, pitch, gain, output_sr);
+}
+
+static void *
+ram_resample(void *orig, nframes_t output_sr, const SampleStorage *storage)
+{
+    return SampleRam_resample((SampleRam) orig, output_sr, storage);
+}
+
+static const char *
+ram_path(void *impl)
+{
+    return SampleRam_path((SampleRam) impl);
+}
+
+static nframes_t
+ram_frames(void *impl)
+{
+    return SampleRam_frames((SampleRam) impl);
+}
+
+static nframes_t
+ram_write(void *impl, sample_t **buffers, channels_t channels,
+          nframes_t frames)
+{
+    return SampleRam_write((SampleRam) impl, buffers, channels, frames);
+}
+
+static int
+ram_done(void *impl)
+{
+    return SampleRam_done((SampleRam) impl);
+}
+
+static int
+ram_wait(void *impl)
+{
+    return SampleRam_wait((SampleRam) impl);
+}
+
+static void
+ram_free(void *impl)
+{
+    SampleRam s = (SampleRam) impl;
+    SampleRam_free(&s);
+}
+
+static const SampleOps ram_ops = {
+    SampleType_RAM,
+    ram_clone, ram_resample, ram_path, ram_frames, ram_write,
+    ram_done, ram_wait, ram_free
+};
+
+static void *
+disk_clone(void *orig, pitch_t pitch, gain_t gain, nframes_t output_sr)
+{
+    return SampleDisk_clone((SampleDisk) orig, pitch, gain, output_sr);
+}
+
+static void *
+disk_resample(void *orig, nframes_t output_sr, const SampleStorage *storage)
+{
+    return SampleDisk_resample((SampleDisk) orig, output_sr, storage);
+}
+
+static const char *
+disk_path(void *impl)
+{
+    return SampleDisk_path((SampleDisk) impl);
+}
+
+static nframes_t
+disk_frames(void *impl)
+{
+    return SampleDisk_frames((SampleDisk) impl);
+}
+
+static nframes_t
+disk_write(void *impl, sample_t **buffers, channels_t channels,
+           nframes_t frames)
+{
+    return SampleDisk_write((SampleDisk) impl, buffers, channels, frames);
+}
+
+static int
+disk_done(void *impl)
+{
+    return SampleDisk_done((SampleDisk) impl);
+}
+
+static int
+disk_wait(void *impl)
+{
+    return SampleDisk_wait((SampleDisk) impl);
+}
 
 static void
-not_implemented(void)
+disk_free(void *impl)
 {
-    fprintf(stderr, "SampleDisk not implemented\n");
-    exit(EXIT_FAILURE);
+    SampleDisk s = (SampleDisk) impl;
+    SampleDisk_free(&s);
 }
 
+static const SampleOps disk_ops = {
+    SampleType_DISK,
+    disk_clone, disk_resample, disk_path, disk_frames, disk_write,
+    disk_done, disk_wait, disk_free
+};
+
 /**
  * Read a sound file, de-interleave the channels if necessary,
- * perform sample rate conversion, then cache this data in memory.
+ * perform sample rate conversion, then cache this data in memory
+ * (or keep its head in memory and stream the rest from disk).
  */
 Sample
-Sample_init(const char *file, pitch_t pitch,
-            gain_t gain, nframes_t output_sr)
+Sample_init(const char *file, SampleType type, pitch_t pitch,
+            gain_t gain, nframes_t output_sr,
+            const SampleStorage *storage)
 {
     Sample s;
     NEW(s);
-    switch (SAMPLE_TYPE) {
+    s->orig = NULL;
+    atomic_init(&s->refs, 1);
+    s->bus = 0;
+    switch (type) {
     case SampleType_RAM: {
-        s->ram = SampleRam_init(file, pitch, gain, output_sr);
+        s->ops = &ram_ops;
+        s->impl = SampleRam_init(file, pitch, gain, output_sr, storage);
         break; }
     case SampleType_DISK: {
-        not_implemented();
+        s->ops = &disk_ops;
+        s->impl = SampleDisk_init(file, pitch, gain, output_sr, storage);
         break; }
     }
     return s;
 }
 
+Sample
+Sample_init_mapped(const char *name, channels_t channels,
+                   nframes_t frames, nframes_t samplerate,
+                   SampleFormat format, SampleLayout layout,
+                   void **framebufs)
+{
+    Sample s;
+    NEW(s);
+    s->orig = NULL;
+    atomic_init(&s->refs, 1);
+    s->bus = 0;
+    s->ops = &ram_ops;
+    s->impl = SampleRam_init_mapped(name, channels, frames, samplerate,
+                                    format, layout, framebufs);
+    return s;
+}
+
 Sample
 Sample_clone(Sample orig, pitch_t pitch, gain_t gain, nframes_t output_sr)
 {
+    assert(orig && orig->impl);
     Sample s;
     NEW(s);
-    switch (SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        s->ram = SampleRam_clone(orig->ram, pitch, gain, output_sr);
-        break; }
-    case SampleType_DISK: {
-        not_implemented();
-        break; }
+    atomic_fetch_add_explicit(&orig->refs, 1, memory_order_relaxed);
+    s->orig = orig;
+    atomic_init(&s->refs, 1);
+    s->bus = 0;
+    s->ops = orig->ops;
+    s->impl = orig->ops->clone(orig->impl, pitch, gain, output_sr);
+    return s;
+}
+
+Sample
+Sample_resample(Sample orig, nframes_t output_sr,
+                const SampleStorage *storage)
+{
+    assert(orig);
+    Sample s;
+    /* samples kept at their native rate play at any rate */
+    if (orig->ops == &ram_ops && orig->impl &&
+        SampleRam_native((SampleRam) orig->impl)) {
+        atomic_fetch_add_explicit(&orig->refs, 1, memory_order_relaxed);
+        return orig;
     }
+    NEW(s);
+    s->orig = NULL;
+    atomic_init(&s->refs, 1);
+    s->bus = 0;
+    s->ops = orig->ops;
+    s->impl = orig->impl
+        ? orig->ops->resample(orig->impl, output_sr, storage)
+        : NULL;
     return s;
 }
 
 int
 Sample_isnull(Sample samp)
 {
-    if (samp == NULL)
-        return 1;
+    return samp == NULL || samp->impl == NULL;
+}
 
-    switch(SAMPLE_TYPE) {
-    case SampleType_RAM:
-        return samp->ram == NULL;
-    case SampleType_DISK:
-        not_implemented();
-    }
+SampleType
+Sample_type(Sample samp)
+{
+    assert(samp);
+    return samp->ops->type;
 }
 
 /**
@@ -74,11 +257,14 @@ const char *
 Sample_path(Sample samp)
 {
     assert(samp);
-    switch(SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        return SampleRam_path(samp->ram); }
-    case SampleType_DISK: not_implemented();
-    }
+    return samp->ops->path(samp->impl);
+}
+
+nframes_t
+Sample_frames(Sample samp)
+{
+    assert(samp);
+    return samp->ops->frames(samp->impl);
 }
 
 nframes_t
@@ -86,33 +272,35 @@ Sample_write(Sample samp, sample_t **buffers, channels_t channels,
              nframes_t frames)
 {
     assert(samp);
-    switch(SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        return SampleRam_write(samp->ram, buffers, channels, frames); }
-    case SampleType_DISK: not_implemented();
-    }
+    return samp->ops->write(samp->impl, buffers, channels, frames);
+}
+
+void
+Sample_set_bus(Sample samp, int bus)
+{
+    assert(samp && bus >= 0);
+    samp->bus = bus;
+}
+
+int
+Sample_bus(Sample samp)
+{
+    assert(samp);
+    return samp->bus;
 }
 
 int
 Sample_done(Sample samp)
 {
     assert(samp);
-    switch (SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        return SampleRam_done(samp->ram); }
-    case SampleType_DISK: not_implemented();
-    }
+    return samp->ops->done(samp->impl);
 }
 
 int
 Sample_wait(Sample samp)
 {
     assert(samp);
-    switch (SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        return SampleRam_wait(samp->ram); }
-    case SampleType_DISK: not_implemented();
-    }
+    return samp->ops->wait(samp->impl);
 }
 
 /**
@@ -122,11 +310,22 @@ void
 Sample_free(Sample *samp)
 {
     assert(samp && *samp);
-    switch (SAMPLE_TYPE) {
-    case SampleType_RAM: {
-        SampleRam_free(&(*samp)->ram);
-        break; }
-    case SampleType_DISK: not_implemented();
+    if ((*samp)->impl != NULL) {
+        (*samp)->ops->free((*samp)->impl);
+    }
+    if ((*samp)->orig != NULL) {
+        Sample_release(&(*samp)->orig);
     }
     FREE(*samp);
 }
+
+void
+Sample_release(Sample *samp)
+{
+    assert(samp && *samp);
+    if (atomic_fetch_sub_explicit(&(*samp)->refs, 1,
+                                  memory_order_acq_rel) == 1) {
+        Sample_free(samp);
+    }
+    *samp = NULL;
+}
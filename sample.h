@@ -5,10 +5,12 @@
 #include "sample-disk.h"
 #include "sample-ram.h"
 
-typedef union Sample {
-    SampleRam ram;
-    SampleDisk disk;
-} *Sample;
+/**
+ * A sample kept in RAM or streamed from disk.
+ * Calls are dispatched to the storage the sample was loaded
+ * into at runtime, so both kinds can play side by side.
+ */
+typedef struct Sample *Sample;
 
 /**
  * Play a sample.
@@ -18,15 +20,31 @@ typedef union Sample {
  * time you load a particular sample. After that it should
  * be cached and subsequent calls to Sample_play should
  * be much faster.
+ * Cached data is stored as described by @a storage, either
+ * entirely in RAM or (for SampleType_DISK) as a head in RAM
+ * with the rest streamed from disk.
+ */
+Sample
+Sample_init(const char *file, SampleType type, pitch_t pitch,
+            gain_t gain, nframes_t output_samplerate,
+            const SampleStorage *storage);
+
+/**
+ * Wrap sample data that has already been loaded (or mapped)
+ * somewhere else. The data is not copied, so @a framebufs
+ * must outlive the sample.
  */
 Sample
-Sample_init(const char *file, pitch_t pitch,
-            gain_t gain, nframes_t output_samplerate);
+Sample_init_mapped(const char *name, channels_t channels,
+                   nframes_t frames, nframes_t samplerate,
+                   SampleFormat format, SampleLayout layout,
+                   void **framebufs);
 
 /**
  * Sample_clone clones a sample structure.
  * This is used to create clones of cached sample data.
  * The clone is then added to the play buffer for the rt callback to pick up.
+ * The clone holds a reference to @a orig until it is freed.
  */
 Sample
 Sample_clone(Sample orig,
@@ -34,6 +52,22 @@ Sample_clone(Sample orig,
              gain_t gain,
              nframes_t output_samplerate);
 
+/**
+ * Make a copy of the cached sample @a orig for a new output
+ * sample rate, in the same kind of storage. The copy is loaded
+ * from the original data rather than converted from @a orig,
+ * and @a orig is left as it is, so clones of it can keep
+ * playing while the copy is made.
+ * Samples cached at their native rate play at any output rate,
+ * so for those @a orig itself is returned with another
+ * reference taken. Either way, drop the result with
+ * Sample_release.
+ */
+Sample
+Sample_resample(Sample orig,
+                nframes_t output_samplerate,
+                const SampleStorage *storage);
+
 /**
  * Determine if the underlying sample structure is null.
  * This should be used to determine if there were any errors
@@ -45,12 +79,24 @@ Sample_clone(Sample orig,
 int
 Sample_isnull(Sample samp);
 
+/**
+ * Get the kind of storage this sample is played from.
+ */
+SampleType
+Sample_type(Sample samp);
+
 /**
  * Get the path this sample was loaded from.
  */
 const char *
 Sample_path(Sample samp);
 
+/**
+ * Number of frames in the sample (after resampling).
+ */
+nframes_t
+Sample_frames(Sample samp);
+
 /**
  * Write sample data to some buffers.
  * Returns the number of frames written.
@@ -61,6 +107,19 @@ Sample_write(Sample samp,
              channels_t channels,
              nframes_t frames);
 
+/**
+ * Play a clone on mix bus @a bus (see Samples_add_bus) instead
+ * of the master bus. Must be called before the clone is played.
+ */
+void
+Sample_set_bus(Sample samp, int bus);
+
+/**
+ * Get the mix bus a clone is played on, 0 for the master bus.
+ */
+int
+Sample_bus(Sample samp);
+
 /**
  * Return 1 if the sample is done playing, 0 otherwise.
  */
@@ -76,8 +135,17 @@ Sample_wait(Sample samp);
 
 /**
  * Free resources associated with a Sample.
+ * Use Sample_release for cached samples, which clones may still
+ * be playing from.
  */
 void
 Sample_free(Sample *samp);
 
+/**
+ * Drop a reference to a cached sample. It is freed once its
+ * last clone has been freed too.
+ */
+void
+Sample_release(Sample *samp);
+
 #endif
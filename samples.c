@@ -2,29 +2,68 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "bank.h"
 #include "bin-tree.h"
+#include "decoder.h"
+#include "disk-io.h"
 #include "event.h"
 #include "lightning.h"
 #include "log.h"
 #include "mem.h"
+#include "mutex.h"
 #include "realtime.h"
 #include "ringbuffer.h"
 #include "sample.h"
 #include "samples.h"
+#include "sf.h"
 #include "thread.h"
 
-#define ASSUMED_CHANNELS 2
+/* frames each summing buffer holds */
+#define AUX_BUF_FRAMES 2048
+
+/**
+ * Channel buffers of a take captured from the input ports, which
+ * its cached sample plays in place.
+ */
+typedef struct Take {
+    sample_t **bufs;
+    channels_t channels;
+} Take;
 
 struct Samples {
-    /* output sample rate */
+    /* output sample rate and number of output channels */
     nframes_t output_sr;
+    channels_t channels;
     /* sample cache */
     BinTree cache;
+    /* guards cache, output_sr and cache_bytes, which the rate
+       thread replaces when the output sample rate changes */
+    Mutex cache_mutex;
+    /* output sample rate the cache should be converted to, and
+       the thread that converts it (woken through rate_wake) */
+    atomic_uint target_sr;
+    atomic_int running;
+    sem_t rate_wake;
+    LightningThread rate_thread;
+    /* format, arena, decoder and disk I/O for cached sample
+       data (the arena is NULL if it could not be reserved, in
+       which case we use the heap) */
+    SampleStorage storage;
+    /* samples longer than stream_threshold_ms, or that would
+       take cache_bytes past cache_size, are streamed from disk */
+    nframes_t stream_threshold_ms;
+    size_t cache_size;
+    /* (estimated) bytes of sample data cached in RAM so far */
+    size_t cache_bytes;
     /* sample that are actively playing on any
        given audio cycle */
     Sample active[MAX_POLYPHONY];
@@ -51,10 +90,26 @@ struct Samples {
     Sample new_sample;
     /* summing buffers */
     sample_t **sum_bufs;
+    /* names and summing buffers of the mix buses. bus 0 is the
+       master bus, whose buffers are sum_bufs. buses are only
+       ever added, and nbuses is raised once a bus is ready */
+    char *bus_names[LIGHTNING_MAX_BUSES + 1];
+    sample_t **bus_bufs[LIGHTNING_MAX_BUSES + 1];
+    atomic_int nbuses;
+    /* gain of each bus, and the gain the realtime thread applied
+       to it last cycle, which it ramps to the new one */
+    _Atomic(sample_t) bus_gain[LIGHTNING_MAX_BUSES + 1];
+    sample_t bus_level[LIGHTNING_MAX_BUSES + 1];
     /* sample collecting buffers */
     sample_t **collect_bufs;
     /* directories to search for audio files */
     char **dirs;
+    /* mapped sample banks */
+    Bank *banks;
+    int nbanks;
+    /* captured takes (see Samples_add_take) */
+    Take *takes;
+    int ntakes;
 };
 
 void *
@@ -63,6 +118,9 @@ play_new_samples(void *arg);
 void *
 free_done_samples(void *arg);
 
+static void *
+convert_cache(void *arg);
+
 /**
  * Data for the thread we start that adds
  * Sample instances to a ringbuffer every
@@ -72,33 +130,53 @@ free_done_samples(void *arg);
  * thread-safe if there is exactly one writer thread
  * and exactly one reader thread and that these threads
  * never change.
+ * The thread runs until running is cleared and it is woken.
  */
 typedef struct LightningThreadData {
     Ringbuffer buf;
     LightningEvent event;
+    atomic_int *running;
 } *LightningThreadData;
 
 Samples
-Samples_init(nframes_t output_sr)
+Samples_init(nframes_t output_sr, const LightningOptions *options)
 {
     int i = 0;
     Samples samps;
     NEW(samps);
     samps->state = Realtime_init();
     samps->cache = BinTree_init((CmpFunction) strcmp);
+    samps->cache_mutex = Mutex_init();
     samps->dirs = NULL;
+    samps->storage.format = options->cache_format;
+    samps->storage.layout = options->cache_layout;
+    samps->storage.arena = Arena_init(options->cache_size,
+                                      options->cache_lock_budget);
+    samps->storage.decoder = Decoder_init();
+    samps->storage.io = DiskIO_init();
+    samps->storage.stream_head_ms = options->stream_head_ms;
+    samps->storage.native_rate = options->native_rate;
+    samps->storage.quality = options->src_quality;
+    samps->stream_threshold_ms = options->stream_threshold_ms;
+    samps->cache_size = options->cache_size;
+    samps->cache_bytes = 0;
+    samps->banks = NULL;
+    samps->nbanks = 0;
+    samps->takes = NULL;
+    samps->ntakes = 0;
 
     /* allocate auxiliary buffers
-       each buffer will be able to hold 2048 samples
+       each buffer will be able to hold AUX_BUF_FRAMES samples
        and will be mlock'ed into RAM
-       there is one per channel and we just assume stereo */
+       there is one per output channel */
 
-    const size_t aux_buf_size = 2048;
+    const size_t aux_buf_size = AUX_BUF_FRAMES;
 
-    samps->sum_bufs = CALLOC(ASSUMED_CHANNELS, sizeof(sample_t*));
-    samps->collect_bufs = CALLOC(ASSUMED_CHANNELS, sizeof(sample_t*));
+    samps->channels = options->output_channels;
+    samps->sum_bufs = CALLOC(samps->channels, sizeof(sample_t*));
+    samps->collect_bufs = CALLOC(samps->channels, sizeof(sample_t*));
 
-    for (i = 0; i < ASSUMED_CHANNELS; i++) {
+    for (i = 0; i < samps->channels; i++) {
         samps->sum_bufs[i] = CALLOC(aux_buf_size, SAMPLE_SIZE);
         samps->collect_bufs[i] = CALLOC(aux_buf_size, SAMPLE_SIZE);
 
@@ -115,8 +193,23 @@ Samples_init(nframes_t output_sr)
         samps->active[i] = NULL;
     }
 
+    samps->bus_names[0] = ALLOC(sizeof("master"));
+    memcpy(samps->bus_names[0], "master", sizeof("master"));
+    samps->bus_bufs[0] = samps->sum_bufs;
+    atomic_init(&samps->nbuses, 1);
+    for (i = 0; i <= LIGHTNING_MAX_BUSES; i++) {
+        if (i > 0) {
+            samps->bus_names[i] = NULL;
+            samps->bus_bufs[i] = NULL;
+        }
+        atomic_init(&samps->bus_gain[i], 1.0f);
+        samps->bus_level[i] = 1.0f;
+    }
+
     samps->output_sr = output_sr;
 
+    atomic_init(&samps->running, 1);
+
     /* setup play thread */
 
     LightningThreadData play_thread;
@@ -128,6 +221,7 @@ Samples_init(nframes_t output_sr)
     samps->play_event = LightningEvent_init();
     play_thread->buf = samps->play_buf;
     play_thread->event = samps->play_event;
+    play_thread->running = &samps->running;
     samps->play_thread = LightningThread_create(play_new_samples, play_thread);
 
     /* setup free thread */
@@ -135,9 +229,18 @@ Samples_init(nframes_t output_sr)
     LightningThreadData free_thread;
     NEW(free_thread);
     samps->free_event = LightningEvent_init();
+    free_thread->buf = NULL;
     free_thread->event = samps->free_event;
+    free_thread->running = &samps->running;
     samps->free_thread = LightningThread_create(free_done_samples, free_thread);
 
+    /* setup the thread that converts the cache when the
+       output sample rate changes */
+
+    atomic_init(&samps->target_sr, output_sr);
+    sem_init(&samps->rate_wake, 0, 0);
+    samps->rate_thread = LightningThread_create(convert_cache, samps);
+
     /* samps->new_sample = ALLOC(sizeof(Sample)); */
 
     if (Realtime_set_processing(samps->state)) {
@@ -146,16 +249,204 @@ Samples_init(nframes_t output_sr)
     return samps;
 }
 
-Sample
-Samples_load(Samples samps, const char *path)
+int
+Samples_add_bus(Samples samps, const char *name)
+{
+    assert(samps && name);
+    int chan, bus;
+    size_t name_bytes = strlen(name);
+    /* the mutex keeps two callers from taking the same bus */
+    Mutex_lock(samps->cache_mutex);
+    bus = atomic_load(&samps->nbuses);
+    if (Samples_bus(samps, name) >= 0) {
+        Mutex_unlock(samps->cache_mutex);
+        LOG(Error, "there is a bus named %s already", name);
+        return -1;
+    }
+    if (bus > LIGHTNING_MAX_BUSES) {
+        Mutex_unlock(samps->cache_mutex);
+        LOG(Error, "no room for bus %s", name);
+        return -1;
+    }
+    samps->bus_names[bus] = ALLOC(name_bytes + 1);
+    memcpy(samps->bus_names[bus], name, name_bytes + 1);
+    /* a bus that was taken back leaves its buffers behind */
+    if (samps->bus_bufs[bus] == NULL) {
+        samps->bus_bufs[bus] = CALLOC(samps->channels, sizeof(sample_t *));
+        for (chan = 0; chan < samps->channels; chan++) {
+            samps->bus_bufs[bus][chan] = CALLOC(AUX_BUF_FRAMES, SAMPLE_SIZE);
+            if (0 != mlock(samps->bus_bufs[bus][chan],
+                           AUX_BUF_FRAMES * SAMPLE_SIZE)) {
+                LOG(Error, "Could not lock memory into %s", "RAM");
+            }
+        }
+    }
+    /* the realtime thread starts mixing the bus from here */
+    atomic_store(&samps->nbuses, bus + 1);
+    Mutex_unlock(samps->cache_mutex);
+    return bus;
+}
+
+void
+Samples_remove_bus(Samples samps, int bus)
+{
+    assert(samps && bus > 0);
+    Mutex_lock(samps->cache_mutex);
+    assert(bus == atomic_load(&samps->nbuses) - 1);
+    /* the realtime thread stops mixing it from the next cycle */
+    atomic_store(&samps->nbuses, bus);
+    FREE(samps->bus_names[bus]);
+    Mutex_unlock(samps->cache_mutex);
+}
+
+int
+Samples_bus(Samples samps, const char *name)
 {
     assert(samps);
+    int bus, nbuses = atomic_load(&samps->nbuses);
+    if (name == NULL) {
+        return 0;
+    }
+    for (bus = 0; bus < nbuses; bus++) {
+        if (strcmp(samps->bus_names[bus], name) == 0) {
+            return bus;
+        }
+    }
+    return -1;
+}
+
+sample_t **
+Samples_bus_buffers(Samples samps, int bus)
+{
+    assert(samps && bus >= 0 && bus < atomic_load(&samps->nbuses));
+    return samps->bus_bufs[bus];
+}
+
+void
+Samples_set_bus_gain(Samples samps, int bus, gain_t gain)
+{
+    assert(samps && bus >= 0 && bus < atomic_load(&samps->nbuses));
+    atomic_store(&samps->bus_gain[bus], (sample_t) gain);
+}
+
+/**
+ * Decide whether @a path is cached in RAM or streamed from disk.
+ * Short samples are cached so they can be retriggered cheaply,
+ * long ones (and anything that would overflow the cache) are
+ * streamed. @a bytes is set to the RAM a cached copy would take.
+ */
+static SampleType
+choose_type(Samples samps, const char *path, size_t *bytes)
+{
+    SF sf = SF_open_read(path);
+    nframes_t sr, frames, file_frames;
+    channels_t channels;
+    size_t sample_bytes;
+    *bytes = 0;
+    if (sf == NULL) {
+        /* let Sample_init report the error */
+        return SampleType_RAM;
+    }
+    sr = SF_samplerate(sf);
+    channels = SF_channels(sf);
+    file_frames = SF_frames(sf);
+    /* frames a cached copy would hold */
+    frames = samps->storage.native_rate
+        ? file_frames
+        : (nframes_t) ((uint64_t) file_frames * samps->output_sr / sr);
+    switch (samps->storage.format) {
+    case SampleFormat_FLOAT32:
+        sample_bytes = 4;
+        break;
+    case SampleFormat_AUTO:
+        sample_bytes = SF_bits(sf) <= 16 ? 2 : 4;
+        break;
+    default:
+        /* blocks are usually smaller, but this is an upper bound */
+        sample_bytes = 2;
+        break;
+    }
+    SF_close(&sf);
+    *bytes = (size_t) frames * channels * sample_bytes;
+    if ((uint64_t) file_frames * 1000 > (uint64_t) samps->stream_threshold_ms * sr) {
+        return SampleType_DISK;
+    }
+    if (samps->cache_bytes + *bytes > samps->cache_size) {
+        LOG(Info, "cache is full, streaming %s", path);
+        return SampleType_DISK;
+    }
+    return SampleType_RAM;
+}
+
+/**
+ * Jobs shared out between the threads of run_parallel.
+ */
+typedef struct Parallel {
+    int count;
+    void (*job)(void *arg, int i);
+    void *arg;
+    atomic_int next;
+} Parallel;
+
+static void *
+parallel_worker(void *arg)
+{
+    Parallel *p = (Parallel *) arg;
+    int i;
+    while ((i = atomic_fetch_add(&p->next, 1)) < p->count) {
+        p->job(p->arg, i);
+    }
+    return NULL;
+}
+
+/**
+ * Call @a job for 0 through @a count - 1 on as many threads
+ * as there are cores, and wait for every call to return.
+ */
+static void
+run_parallel(int count, void (*job)(void *arg, int i), void *arg)
+{
+    int i;
+    Parallel p;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cores < 1 ? 1 : cores < count ? (int) cores : count;
+    LightningThread *threads;
+    if (count <= 0) {
+        return;
+    }
+    p.count = count;
+    p.job = job;
+    p.arg = arg;
+    atomic_init(&p.next, 0);
+    threads = CALLOC(nthreads, sizeof(LightningThread));
+    for (i = 0; i < nthreads; i++) {
+        threads[i] = LightningThread_create(parallel_worker, &p);
+    }
+    for (i = 0; i < nthreads; i++) {
+        LightningThread_join(threads[i]);
+        LightningThread_free(&threads[i]);
+    }
+    FREE(threads);
+}
+
+/**
+ * Samples_load with cache_mutex held, loading from @a storage.
+ */
+static Sample
+load(Samples samps, const char *path, const SampleStorage *storage)
+{
     LOG(Debug, "looking up %s in sample cache", path);
     Sample cached = (Sample) BinTree_lookup(samps->cache, path);
     if (NULL == cached) {
         LOG(Debug, "sample %s was not cached", path);
         /* initialize and cache it */
-        Sample samp = Sample_init(path, 1.0, 1.0, samps->output_sr);
+        size_t bytes;
+        SampleType type = choose_type(samps, path, &bytes);
+        Sample samp = Sample_init(path, type, 1.0, 1.0, samps->output_sr,
+                                  storage);
+        if (type == SampleType_RAM && !Sample_isnull(samp)) {
+            samps->cache_bytes += bytes;
+        }
         /* Sample samp = Samples_find_file(samps, path, samps->output_sr); */
         if (samp != NULL) {
             LOG(Debug, "storing %s -> %p in cache", path, samp);
@@ -170,6 +461,236 @@ Samples_load(Samples samps, const char *path)
     }
 }
 
+Sample
+Samples_load(Samples samps, const char *path)
+{
+    assert(samps);
+    Mutex_lock(samps->cache_mutex);
+    Sample samp = load(samps, path, &samps->storage);
+    Mutex_unlock(samps->cache_mutex);
+    return samp;
+}
+
+/**
+ * A batch of samples being loaded by Samples_load_all.
+ */
+typedef struct Batch {
+    SampleStorage storage;
+    nframes_t output_sr;
+    const char **paths;
+    SampleType *types;
+    size_t *bytes;
+    Sample *out;
+} Batch;
+
+static void
+load_one(void *arg, int i)
+{
+    Batch *b = (Batch *) arg;
+    b->out[i] = Sample_init(b->paths[i], b->types[i], 1.0, 1.0,
+                            b->output_sr, &b->storage);
+}
+
+int
+Samples_load_all(Samples samps, const char **paths, int count,
+                 SRCQuality quality)
+{
+    assert(samps && (paths || count == 0));
+    int i, n = 0, failed = 0;
+    Batch b;
+    BinTree seen = BinTree_init((CmpFunction) strcmp);
+    b.storage = samps->storage;
+    b.storage.quality = quality;
+    b.paths = CALLOC(count > 0 ? count : 1, sizeof(const char *));
+    b.types = CALLOC(count > 0 ? count : 1, sizeof(SampleType));
+    b.bytes = CALLOC(count > 0 ? count : 1, sizeof(size_t));
+    b.out = CALLOC(count > 0 ? count : 1, sizeof(Sample));
+
+    /* choose where each new sample goes and reserve its share of
+       the cache up front, so the batch cannot overflow it */
+    Mutex_lock(samps->cache_mutex);
+    b.output_sr = samps->output_sr;
+    for (i = 0; i < count; i++) {
+        if (BinTree_lookup(samps->cache, paths[i]) != NULL ||
+            BinTree_lookup(seen, paths[i]) != NULL) {
+            continue;
+        }
+        BinTree_insert(seen, paths[i], (void *) paths[i]);
+        b.paths[n] = paths[i];
+        b.types[n] = choose_type(samps, paths[i], &b.bytes[n]);
+        if (b.types[n] == SampleType_RAM) {
+            samps->cache_bytes += b.bytes[n];
+        }
+        n++;
+    }
+    Mutex_unlock(samps->cache_mutex);
+    BinTree_free(&seen);
+
+    LOG(Debug, "loading %d samples in parallel", n);
+    run_parallel(n, load_one, &b);
+
+    Mutex_lock(samps->cache_mutex);
+    for (i = 0; i < n; i++) {
+        Sample samp = b.out[i];
+        int isnull = Sample_isnull(samp);
+        if (!isnull && b.output_sr == samps->output_sr &&
+            BinTree_lookup(samps->cache, b.paths[i]) == NULL) {
+            BinTree_insert(samps->cache, b.paths[i], samp);
+            continue;
+        }
+        /* hand back the space we reserved for it */
+        if (b.types[i] == SampleType_RAM) {
+            samps->cache_bytes -= b.bytes[i] < samps->cache_bytes
+                ? b.bytes[i] : samps->cache_bytes;
+        }
+        if (samp != NULL) {
+            Sample_release(&samp);
+        }
+        if (isnull) {
+            LOG(Info, "could not open %s", b.paths[i]);
+            failed = 1;
+        } else if (b.output_sr != samps->output_sr) {
+            /* the cache was converted while we were loading */
+            failed |= Sample_isnull(load(samps, b.paths[i], &b.storage));
+        }
+        /* otherwise someone else loaded it while we were busy */
+    }
+    Mutex_unlock(samps->cache_mutex);
+    FREE(b.paths);
+    FREE(b.types);
+    FREE(b.bytes);
+    FREE(b.out);
+    return failed;
+}
+
+int
+Samples_load_bank(Samples samps, const char *file)
+{
+    assert(samps && file);
+    int i, count;
+    Bank bank = Bank_open(file);
+    if (bank == NULL) {
+        return 1;
+    }
+    Mutex_lock(samps->cache_mutex);
+    if (Bank_samplerate(bank) != samps->output_sr) {
+        LOG(Error, "bank %s is at %u Hz but output is at %u Hz",
+            file, Bank_samplerate(bank), samps->output_sr);
+        Mutex_unlock(samps->cache_mutex);
+        Bank_free(&bank);
+        return 1;
+    }
+    if (samps->banks == NULL) {
+        samps->banks = ALLOC(sizeof(Bank));
+    } else {
+        RESIZE(samps->banks, (samps->nbanks + 1) * sizeof(Bank));
+    }
+    samps->banks[samps->nbanks++] = bank;
+
+    count = Bank_count(bank);
+    for (i = 0; i < count; i++) {
+        const char *name = Bank_name(bank, i);
+        if (NULL != BinTree_lookup(samps->cache, name)) {
+            LOG(Info, "%s is already cached, skipping bank entry", name);
+            continue;
+        }
+        Sample samp = Sample_init_mapped(name,
+                                         Bank_channels(bank, i),
+                                         Bank_frames(bank, i),
+                                         Bank_samplerate(bank),
+                                         Bank_format(bank),
+                                         SampleLayout_PLANAR,
+                                         Bank_buffers(bank, i));
+        BinTree_insert(samps->cache, name, samp);
+    }
+    Mutex_unlock(samps->cache_mutex);
+    LOG(Debug, "loaded %d samples from bank %s", count, file);
+    return 0;
+}
+
+int
+Samples_add_take(Samples samps, const char *name, channels_t channels,
+                 nframes_t frames, nframes_t samplerate, sample_t **bufs)
+{
+    assert(samps && name && bufs && channels > 0);
+    Sample samp, converted;
+    nframes_t output_sr;
+    Mutex_lock(samps->cache_mutex);
+    output_sr = samps->output_sr;
+    if (NULL != BinTree_lookup(samps->cache, name)) {
+        Mutex_unlock(samps->cache_mutex);
+        LOG(Error, "%s is already cached, not replacing it with a take",
+            name);
+        return 1;
+    }
+    Mutex_unlock(samps->cache_mutex);
+
+    samp = Sample_init_mapped(name, channels, frames, samplerate,
+                              SampleFormat_FLOAT32, SampleLayout_PLANAR,
+                              (void **) bufs);
+    if (samplerate != output_sr) {
+        /* the converted sample keeps the take as its origin, so
+           the cache converts it again from the take's own rate */
+        converted = Sample_resample(samp, output_sr, &samps->storage);
+        Sample_release(&samp);
+        if (Sample_isnull(converted)) {
+            if (converted != NULL) {
+                Sample_release(&converted);
+            }
+            LOG(Error, "could not convert take %s", name);
+            return 1;
+        }
+        samp = converted;
+    }
+
+    Mutex_lock(samps->cache_mutex);
+    if (NULL != BinTree_lookup(samps->cache, name)) {
+        Mutex_unlock(samps->cache_mutex);
+        LOG(Error, "%s is already cached, not replacing it with a take",
+            name);
+        Sample_release(&samp);
+        return 1;
+    }
+    if (samps->takes == NULL) {
+        samps->takes = ALLOC(sizeof(Take));
+    } else {
+        RESIZE(samps->takes, (samps->ntakes + 1) * sizeof(Take));
+    }
+    samps->takes[samps->ntakes].bufs = bufs;
+    samps->takes[samps->ntakes].channels = channels;
+    samps->ntakes++;
+    samps->cache_bytes += (size_t) frames * channels * SAMPLE_SIZE;
+    BinTree_insert(samps->cache, name, samp);
+    Mutex_unlock(samps->cache_mutex);
+    LOG(Debug, "cached take %s of %u frames", name, frames);
+    return 0;
+}
+
+nframes_t
+Samples_samplerate(Samples samps)
+{
+    assert(samps);
+    Mutex_lock(samps->cache_mutex);
+    nframes_t sr = samps->output_sr;
+    Mutex_unlock(samps->cache_mutex);
+    return sr;
+}
+
+int
+Samples_set_samplerate(Samples samps, nframes_t sr)
+{
+    assert(samps);
+    atomic_store(&samps->target_sr, sr);
+    return sem_post(&samps->rate_wake);
+}
+
+void
+Samples_stream_stats(Samples samps, LightningStreamStats *stats)
+{
+    assert(samps);
+    DiskIO_stats(samps->storage.io, stats);
+}
+
 /**
  * Get a new instance of the sample specified by path.
  * If the sample was not in the cache and had to be loaded from disk,
@@ -179,41 +700,189 @@ Samples_load(Samples samps, const char *path)
 Sample
 Samples_play(Samples samps, const char *path, pitch_t pitch, gain_t gain)
 {
-    assert(samps);
+    return Samples_play_on_bus(samps, path, pitch, gain, 0);
+}
+
+Sample
+Samples_play_on_bus(Samples samps, const char *path, pitch_t pitch,
+                    gain_t gain, int bus)
+{
+    assert(samps && bus >= 0 && bus < atomic_load(&samps->nbuses));
     LOG(Debug, "playing %s", path);
-    Sample cached = Samples_load(samps, path);
+    /* the clone takes a reference to the cached sample before
+       the rate thread can replace it */
+    Mutex_lock(samps->cache_mutex);
+    Sample cached = load(samps, path, &samps->storage);
     if (Sample_isnull(cached)) {
+        Mutex_unlock(samps->cache_mutex);
         LOG(Error, "could not load %s", path);
         return NULL;
     }
     LOG(Debug, "loaded %p", cached);
     Sample samp = Sample_clone(cached, pitch, gain, samps->output_sr);
+    Mutex_unlock(samps->cache_mutex);
+    Sample_set_bus(samp, bus);
     LOG(Debug, "cloned %p to %p", cached, samp);
     LightningEvent_broadcast(samps->play_event, samp);
     return samp;
 }
 
+/**
+ * Add @a channels channels of @a in to @a sum.
+ * Inlined into the kernels below, which each get a copy of the
+ * loop with the channel count known at compile time for the
+ * compiler to unroll and vectorize.
+ */
+static inline void
+mix_channels(sample_t **sum, sample_t **in, const int channels,
+             nframes_t frames)
+{
+    int chan;
+    nframes_t frame;
+    for (chan = 0; chan < channels; chan++) {
+        sample_t *restrict out = sum[chan];
+        const sample_t *restrict src = in[chan];
+        for (frame = 0; frame < frames; frame++) {
+            out[frame] += src[frame];
+        }
+    }
+}
+
+static void
+mix_mono(sample_t **sum, sample_t **in, nframes_t frames)
+{
+    mix_channels(sum, in, 1, frames);
+}
+
+static void
+mix_stereo(sample_t **sum, sample_t **in, nframes_t frames)
+{
+    mix_channels(sum, in, 2, frames);
+}
+
+static void
+mix_quad(sample_t **sum, sample_t **in, nframes_t frames)
+{
+    mix_channels(sum, in, 4, frames);
+}
+
+static void
+mix_5_1(sample_t **sum, sample_t **in, nframes_t frames)
+{
+    mix_channels(sum, in, 6, frames);
+}
+
+/**
+ * Add a voice to the summing buffers, using a kernel
+ * specialized for common layouts.
+ */
+static void
+mix(sample_t **sum, sample_t **in, channels_t channels, nframes_t frames)
+{
+    switch (channels) {
+    case 1:
+        mix_mono(sum, in, frames);
+        break;
+    case 2:
+        mix_stereo(sum, in, frames);
+        break;
+    case 4:
+        mix_quad(sum, in, frames);
+        break;
+    case 6:
+        mix_5_1(sum, in, frames);
+        break;
+    default:
+        mix_channels(sum, in, channels, frames);
+        break;
+    }
+}
+
+/**
+ * Scale @a bus in place by a gain that goes in a straight line
+ * from @a from to @a to over the cycle, and add it to @a sum, in
+ * one pass. The bus keeps its scaled mix for exporting.
+ */
+static void
+mix_bus(sample_t **sum, sample_t **bus, channels_t channels,
+        nframes_t frames, sample_t from, sample_t to)
+{
+    const sample_t step = (to - from) / (sample_t) frames;
+    channels_t chan;
+    nframes_t frame;
+    if (from == to && to == 1.0f) {
+        mix(sum, bus, channels, frames);
+        return;
+    }
+    for (chan = 0; chan < channels; chan++) {
+        sample_t *restrict out = sum[chan];
+        sample_t *restrict src = bus[chan];
+        if (from == to) {
+            for (frame = 0; frame < frames; frame++) {
+                src[frame] *= to;
+                out[frame] += src[frame];
+            }
+        } else {
+            for (frame = 0; frame < frames; frame++) {
+                src[frame] *= from + step * (sample_t) (frame + 1);
+                out[frame] += src[frame];
+            }
+        }
+    }
+}
+
+/**
+ * Copy @a sum to @a out scaled like mix_bus.
+ */
+static void
+copy_master(sample_t **out, sample_t **sum, channels_t channels,
+            nframes_t frames, sample_t from, sample_t to)
+{
+    const sample_t step = (to - from) / (sample_t) frames;
+    channels_t chan;
+    nframes_t frame;
+    for (chan = 0; chan < channels; chan++) {
+        sample_t *restrict dst = out[chan];
+        const sample_t *restrict src = sum[chan];
+        if (from == to && to == 1.0f) {
+            memcpy(dst, src, frames * SAMPLE_SIZE);
+        } else if (from == to) {
+            for (frame = 0; frame < frames; frame++) {
+                dst[frame] = src[frame] * to;
+            }
+        } else {
+            for (frame = 0; frame < frames; frame++) {
+                dst[frame] = src[frame] * (from + step * (sample_t) (frame + 1));
+            }
+        }
+    }
+}
+
 int
 Samples_write(Samples samps,
               sample_t **buffers,
               channels_t channels,
               nframes_t frames)
 {
-    assert(samps);
+    assert(samps && channels <= samps->channels);
 
     int i = 0;
     int chan = 0;
-    int frame = 0;
+    int bus = 0;
+    int nbuses = atomic_load(&samps->nbuses);
     int sample_write_error = 0;
+    sample_t gain;
 
     if (!Realtime_is_processing(samps->state)) {
         return 0;
     }
 
-    /* zero out sum buffers */
+    /* zero out sum buffers (the master bus's included) */
 
-    for (chan = 0; chan < channels; chan++) {
-        memset(samps->sum_bufs[chan], 0, frames * SAMPLE_SIZE);
+    for (bus = 0; bus < nbuses; bus++) {
+        for (chan = 0; chan < channels; chan++) {
+            memset(samps->bus_bufs[bus][chan], 0, frames * SAMPLE_SIZE);
+        }
     }
 
     /* add any new samples to the active list */
@@ -246,11 +915,8 @@ Samples_write(Samples samps,
             return sample_write_error;
         }
 
-        for (chan = 0; chan < ASSUMED_CHANNELS; chan++) {
-            for (frame = 0; frame < frames; frame++) {
-                samps->sum_bufs[chan][frame] += samps->collect_bufs[chan][frame];
-            }
-        }
+        mix(samps->bus_bufs[Sample_bus(samps->active[i])],
+            samps->collect_bufs, channels, frames);
 
         if (Sample_done(samps->active[i])) {
             /* remove from the active list and free the sample */
@@ -260,14 +926,25 @@ Samples_write(Samples samps,
         }
     }
 
-    /* copy sum buffers to output buffers */
+    /* apply the gain of each bus and sum it into the master
+       bus, then copy that to the output buffers at the master
+       gain. this is once per bus, however many voices play on
+       it. the bus buffers keep their own mix until the next
+       cycle, for exporting stems */
 
-    for (chan = 0; chan < channels; chan++) {
-        for (frame = 0; frame < frames; frame++) {
-            buffers[chan][frame] = samps->sum_bufs[chan][frame];
-        }
+    for (bus = 1; bus < nbuses; bus++) {
+        gain = atomic_load_explicit(&samps->bus_gain[bus],
+                                    memory_order_relaxed);
+        mix_bus(samps->sum_bufs, samps->bus_bufs[bus], channels, frames,
+                samps->bus_level[bus], gain);
+        samps->bus_level[bus] = gain;
     }
 
+    gain = atomic_load_explicit(&samps->bus_gain[0], memory_order_relaxed);
+    copy_master(buffers, samps->sum_bufs, channels, frames,
+                samps->bus_level[0], gain);
+    samps->bus_level[0] = gain;
+
     return 0;
 }
 
@@ -295,14 +972,55 @@ Samples_free(Samples *samps)
     assert(samps && *samps);
     int i = 0;
     Samples s = *samps;
+    atomic_store(&s->running, 0);
+    sem_post(&s->rate_wake);
+    LightningThread_join(s->rate_thread);
+    LightningThread_free(&s->rate_thread);
+    sem_destroy(&s->rate_wake);
+    /* the play and free threads wait on their events, which can't
+       be freed until they have seen that we are done */
+    LightningEvent_broadcast(s->play_event, NULL);
+    LightningEvent_broadcast(s->free_event, NULL);
+    LightningThread_join(s->play_thread);
+    LightningThread_join(s->free_thread);
     LightningEvent_free(&s->play_event);
+    LightningEvent_free(&s->free_event);
     Ringbuffer_free(&s->play_buf);
     BinTree_free(&s->cache);
+    Mutex_free(&s->cache_mutex);
+    for (i = 0; i < s->nbanks; i++) {
+        Bank_free(&s->banks[i]);
+    }
+    FREE(s->banks);
+    for (i = 0; i < s->ntakes; i++) {
+        int chan;
+        for (chan = 0; chan < s->takes[i].channels; chan++) {
+            FREE(s->takes[i].bufs[chan]);
+        }
+        FREE(s->takes[i].bufs);
+    }
+    FREE(s->takes);
+    Decoder_free(&s->storage.decoder);
+    DiskIO_free(&s->storage.io);
+    if (s->storage.arena != NULL) {
+        Arena_free(&s->storage.arena);
+    }
     /* free auxiliary buffers */
-    for (i = 0; i < ASSUMED_CHANNELS; i++) {
+    for (i = 0; i < s->channels; i++) {
         FREE(s->sum_bufs[i]);
         FREE(s->collect_bufs[i]);
     }
+    /* buses that were taken back still have buffers */
+    for (i = 0; i <= LIGHTNING_MAX_BUSES; i++) {
+        int chan;
+        if (i > 0 && s->bus_bufs[i] != NULL) {
+            for (chan = 0; chan < s->channels; chan++) {
+                FREE(s->bus_bufs[i][chan]);
+            }
+            FREE(s->bus_bufs[i]);
+        }
+        FREE(s->bus_names[i]);
+    }
     LightningThread_free(&s->play_thread);
     LightningThread_free(&s->free_thread);
     Realtime_free(&s->state);
@@ -318,14 +1036,24 @@ play_new_samples(void *arg)
     LightningThreadData data = (LightningThreadData) arg;
     LightningEvent event = data->event;
     Ringbuffer rb = data->buf;
-    while (1) {
-        LightningEvent_wait(event);
+    /* the event is only unlocked while we wait on it, so a wakeup
+       can't come between checking running and waiting, and the
+       value is taken before waiting so a sample played before we
+       first wait isn't lost */
+    LightningEvent_lock(event);
+    while (atomic_load(data->running)) {
         Sample samp = (Sample) LightningEvent_value(event);
-        if (samp != NULL) {
-            LOG(Debug, "play_new_samples adding %p to the ringbuffer", samp);
-            Ringbuffer_write(rb, (void *) &samp, sizeof(Sample));
+        if (samp == NULL) {
+            LightningEvent_wait(event);
+            continue;
         }
+        LightningEvent_set_value(event, NULL);
+        LOG(Debug, "play_new_samples adding %p to the ringbuffer", samp);
+        Ringbuffer_write(rb, (void *) &samp, sizeof(Sample));
     }
+    LightningEvent_unlock(event);
+    FREE(data);
+    return NULL;
 }
 
 void *
@@ -333,12 +1061,181 @@ free_done_samples(void *arg)
 {
     LightningThreadData data = (LightningThreadData) arg;
     LightningEvent event = data->event;
-    while (1) {
-        LightningEvent_wait(event);
+    LightningEvent_lock(event);
+    while (atomic_load(data->running)) {
         Sample samp = (Sample) LightningEvent_value(event);
-        if (samp != NULL) {
-            LOG(Debug, "free_done_samples freeing %p", samp);
-            Sample_free(&samp);
+        if (samp == NULL) {
+            LightningEvent_wait(event);
+            continue;
+        }
+        LightningEvent_set_value(event, NULL);
+        LOG(Debug, "free_done_samples freeing %p", samp);
+        Sample_free(&samp);
+    }
+    LightningEvent_unlock(event);
+    FREE(data);
+    return NULL;
+}
+
+/**
+ * Cached samples that still have to be converted, and the
+ * converted copies. Workers take the next sample off the list
+ * until there are none left. Samples that could not be
+ * converted are kept in failed, and left out of the new cache.
+ */
+typedef struct Conversion {
+    Samples samps;
+    nframes_t output_sr;
+    BinTree done;
+    BinTree failed;
+    const char **keys;
+    Sample *in;
+    Sample *out;
+    int count;
+    int size;
+} Conversion;
+
+static void
+add_stale(const char *key, void *value, void *arg)
+{
+    Conversion *c = (Conversion *) arg;
+    if (BinTree_lookup(c->done, key) != NULL ||
+        BinTree_lookup(c->failed, key) != NULL) {
+        return;
+    }
+    if (c->count == c->size) {
+        c->size = c->size ? 2 * c->size : 64;
+        if (c->keys == NULL) {
+            c->keys = ALLOC(c->size * sizeof(const char *));
+            c->in = ALLOC(c->size * sizeof(Sample));
+        } else {
+            RESIZE(c->keys, c->size * sizeof(const char *));
+            RESIZE(c->in, c->size * sizeof(Sample));
+        }
+    }
+    c->keys[c->count] = key;
+    c->in[c->count] = (Sample) value;
+    c->count++;
+}
+
+static void
+release_entry(const char *key, void *value, void *arg)
+{
+    Sample samp = (Sample) value;
+    Sample_release(&samp);
+}
+
+static void
+convert_one(void *arg, int i)
+{
+    Conversion *c = (Conversion *) arg;
+    c->out[i] = Sample_resample(c->in[i], c->output_sr,
+                                &c->samps->storage);
+}
+
+/**
+ * Convert the samples in @a c on as many threads as there
+ * are cores.
+ */
+static void
+convert_parallel(Conversion *c)
+{
+    c->out = CALLOC(c->count, sizeof(Sample));
+    run_parallel(c->count, convert_one, c);
+}
+
+/**
+ * Convert every cached sample to @a output_sr, then swap the
+ * converted cache in for the old one. Samples loaded while we
+ * were converting are picked up before the swap. Clones hold
+ * references to the old samples, so voices that are playing
+ * carry on from the old data, which is freed when the last of
+ * them finishes. Samples that cannot be converted are dropped
+ * from the cache, so they are loaded again the next time they
+ * are played.
+ */
+static void
+convert_to(Samples samps, nframes_t output_sr)
+{
+    Conversion c;
+    BinTree old;
+    int i;
+    c.samps = samps;
+    c.output_sr = output_sr;
+    c.done = BinTree_init((CmpFunction) strcmp);
+    c.failed = BinTree_init((CmpFunction) strcmp);
+    c.keys = NULL;
+    c.in = NULL;
+    c.out = NULL;
+    c.size = 0;
+    LOG(Info, "converting sample cache to %u Hz", output_sr);
+    for (;;) {
+        c.count = 0;
+        Mutex_lock(samps->cache_mutex);
+        BinTree_foreach(samps->cache, add_stale, &c);
+        if (c.count == 0) {
+            old = samps->cache;
+            samps->cache = c.done;
+            if (!samps->storage.native_rate) {
+                samps->cache_bytes = (size_t) ((double) samps->cache_bytes *
+                                               output_sr / samps->output_sr);
+            }
+            samps->output_sr = output_sr;
+            Mutex_unlock(samps->cache_mutex);
+            break;
+        }
+        Mutex_unlock(samps->cache_mutex);
+        convert_parallel(&c);
+        /* inserting interns the key, which has to be done
+           under the mutex like every other atom */
+        Mutex_lock(samps->cache_mutex);
+        for (i = 0; i < c.count; i++) {
+            if (Sample_isnull(c.out[i])) {
+                LOG(Warn, "could not convert %s, dropping it from the cache",
+                    c.keys[i]);
+                Sample_release(&c.out[i]);
+                BinTree_insert(c.failed, c.keys[i], c.in[i]);
+            } else {
+                BinTree_insert(c.done, c.keys[i], c.out[i]);
+            }
+        }
+        Mutex_unlock(samps->cache_mutex);
+        FREE(c.out);
+        if (atomic_load(&samps->target_sr) != output_sr) {
+            /* the rate changed again, start over */
+            LOG(Info, "abandoning conversion to %u Hz", output_sr);
+            BinTree_foreach(c.done, release_entry, NULL);
+            BinTree_free(&c.done);
+            BinTree_free(&c.failed);
+            FREE(c.keys);
+            FREE(c.in);
+            return;
+        }
+    }
+    FREE(c.keys);
+    FREE(c.in);
+    BinTree_free(&c.failed);
+    BinTree_foreach(old, release_entry, NULL);
+    BinTree_free(&old);
+    LOG(Info, "sample cache is now at %u Hz", output_sr);
+}
+
+static void *
+convert_cache(void *arg)
+{
+    Samples samps = (Samples) arg;
+    nframes_t sr;
+    while (atomic_load(&samps->running)) {
+        if (sem_wait(&samps->rate_wake) != 0 && errno == EINTR) {
+            continue;
+        }
+        /* only the latest rate matters */
+        while (sem_trywait(&samps->rate_wake) == 0)
+            ;
+        sr = atomic_load(&samps->target_sr);
+        if (atomic_load(&samps->running) && sr != Samples_samplerate(samps)) {
+            convert_to(samps, sr);
         }
     }
+    return NULL;
 }
@@ -13,18 +13,90 @@ typedef struct Samples *Samples;
 
 /**
  * Initialize a Sample object.
+ * Cached sample data is kept in an arena sized by @a options.
  */
 Samples
-Samples_init(nframes_t output_sr);
+Samples_init(nframes_t output_sr, const LightningOptions *options);
 
 /**
  * Load a sample into the cache.
  * Do nothing if the sample was already loaded.
+ * The sample belongs to the cache, and is replaced by a copy
+ * when the output sample rate changes.
  */
 Sample
 Samples_load(Samples samps,
              const char *path);
 
+/**
+ * Load @a count samples into the cache, decoding and resampling
+ * them on as many threads as there are cores. Samples that are
+ * resampled use a converter of @a quality, which they keep
+ * when the output sample rate changes.
+ * Samples that are already cached are left alone.
+ *
+ * @return 0 on success, nonzero if any sample could not be loaded
+ */
+int
+Samples_load_all(Samples samps,
+                 const char **paths,
+                 int count,
+                 SRCQuality quality);
+
+/**
+ * Map a sample bank and register every sample in it
+ * in the cache under the name it was packed with.
+ * Samples that are already cached are left alone.
+ * The bank stays mapped until the Samples object is freed.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+Samples_load_bank(Samples samps,
+                  const char *file);
+
+/**
+ * Cache a take captured from the input ports under @a name, so it
+ * can be played with Samples_play right away. The take is played
+ * from @a bufs, which hold @a channels channels of @a frames
+ * frames at @a samplerate and belong to @a samps from now on,
+ * unless this fails. A take at another rate than the output is
+ * converted here, on the calling thread.
+ *
+ * @return 0 on success, nonzero if @a name is already cached or
+ *         the take could not be converted
+ */
+int
+Samples_add_take(Samples samps, const char *name, channels_t channels,
+                 nframes_t frames, nframes_t samplerate, sample_t **bufs);
+
+/**
+ * Output sample rate the cache is at.
+ */
+nframes_t
+Samples_samplerate(Samples samps);
+
+/**
+ * Convert the cache to a new output sample rate.
+ * Cached samples are converted in the background and swapped in
+ * once they are all ready. Until then they keep playing at the
+ * old rate, and voices that are already playing finish from the
+ * old data. Does not block, so it can be called from JACK's
+ * sample rate callback.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+Samples_set_samplerate(Samples samps,
+                       nframes_t sr);
+
+/**
+ * Get statistics for samples streamed from disk.
+ */
+void
+Samples_stream_stats(Samples samps,
+                     LightningStreamStats *stats);
+
 /**
  * Get a new instance of the sample specified by path.
  * If the sample was not in the cache and had to be loaded from disk,
@@ -40,6 +112,70 @@ Samples_play(Samples samps,
              pitch_t pitch,
              gain_t gain);
 
+/**
+ * Get a new instance of the sample specified by path, like
+ * Samples_play, that plays on mix bus @a bus.
+ */
+Sample
+Samples_play_on_bus(Samples samps,
+                    const char *path,
+                    pitch_t pitch,
+                    gain_t gain,
+                    int bus);
+
+/**
+ * Add a named mix bus. Voices played on it are summed into its
+ * own buffers, which are summed into the master bus.
+ *
+ * @return the number of the bus, or -1 if the name is taken or
+ *         there is no room for another bus
+ */
+int
+Samples_add_bus(Samples samps,
+                const char *name);
+
+/**
+ * Take back mix bus @a bus, which must be the last one added and
+ * must not have been played on, when something that goes with it
+ * could not be set up. Its buffers are kept for the next bus, as
+ * the realtime thread may still be summing into them.
+ * Must not be called at the same time as Samples_bus.
+ */
+void
+Samples_remove_bus(Samples samps,
+                   int bus);
+
+/**
+ * Find a mix bus by name. NULL and "master" are the master bus,
+ * which is bus 0.
+ *
+ * @return the number of the bus, or -1 if there is no such bus
+ */
+int
+Samples_bus(Samples samps,
+            const char *name);
+
+/**
+ * Summing buffers of mix bus @a bus, one per output channel.
+ * They hold the bus's mix from the last call to Samples_write
+ * until the next one, and stay at the same address for as long
+ * as @a samps exists.
+ */
+sample_t **
+Samples_bus_buffers(Samples samps,
+                    int bus);
+
+/**
+ * Set the gain of mix bus @a bus, which is applied to its mix
+ * before it is summed into the master bus (or, for the master
+ * bus, to the output). The realtime thread ramps to it over a
+ * cycle, so changing it does not click.
+ */
+void
+Samples_set_bus_gain(Samples samps,
+                     int bus,
+                     gain_t gain);
+
 /**
  * Samples_write writes the data for all currently playing samples
  * to a pair of stereo buffers.
@@ -0,0 +1,168 @@
+package lightning
+
+import (
+	"path/filepath"
+	"testing"
+	"time"
+)
+
+// playLength writes cycles until the voices started before it have
+// all finished, and returns the number of frames from the first that
+// is not silent to the last
+func playLength(t *testing.T, samps *testSamples, during func(cycle int)) int {
+	t.Helper()
+	first, last := -1, -1
+	for cycle := 0; cycle < 2000; cycle++ {
+		if during != nil {
+			during(cycle)
+		}
+		out, err := samps.write()
+		if err != nil {
+			t.Fatal(err)
+		}
+		for i, v := range out[0] {
+			if v != 0 {
+				if first < 0 {
+					first = cycle*samplesCycle + i
+				}
+				last = cycle*samplesCycle + i
+			}
+		}
+		if first >= 0 && last < cycle*samplesCycle {
+			return last - first + 1
+		}
+		if first < 0 {
+			// the voice is handed to the realtime thread by another
+			time.Sleep(time.Millisecond)
+		}
+	}
+	t.Fatal("sample did not finish playing")
+	return 0
+}
+
+// waitForSamplerate waits for the cache to be converted to samplerate
+func waitForSamplerate(t *testing.T, samps *testSamples, samplerate int) {
+	t.Helper()
+	for wait := 0; samps.samplerate() != samplerate; wait++ {
+		if wait == 1000 {
+			t.Fatalf("cache is still at %d Hz, want %d", samps.samplerate(), samplerate)
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+func TestSampleCacheFollowsSamplerate(t *testing.T) {
+	const frames = 12000
+	file := filepath.Join(t.TempDir(), "tone.wav")
+	tone := make([]float32, frames)
+	for i := range tone {
+		tone[i] = 0.5
+	}
+	writeWAV(t, file, 48000, [][]float32{tone})
+	samps := newSamples(48000)
+	defer samps.free()
+
+	near := func(got int, want int) bool {
+		// the converter smears the ends by a few frames
+		return got >= want-8 && got <= want+8
+	}
+	if err := samps.play(file, 0); err != nil {
+		t.Fatal(err)
+	}
+	if got := playLength(t, samps, nil); got != frames {
+		t.Fatalf("at 48 kHz played %d frames, want %d", got, frames)
+	}
+
+	// a voice that is playing when the cache is swapped finishes
+	// from the old data
+	if err := samps.play(file, 0); err != nil {
+		t.Fatal(err)
+	}
+	got := playLength(t, samps, func(cycle int) {
+		if cycle == 10 {
+			if err := samps.setSamplerate(96000); err != nil {
+				t.Fatal(err)
+			}
+			waitForSamplerate(t, samps, 96000)
+		}
+	})
+	if got != frames {
+		t.Fatalf("across the change to 96 kHz played %d frames, want %d", got, frames)
+	}
+
+	if err := samps.play(file, 0); err != nil {
+		t.Fatal(err)
+	}
+	if got := playLength(t, samps, nil); !near(got, 2*frames) {
+		t.Fatalf("at 96 kHz played %d frames, want about %d", got, 2*frames)
+	}
+
+	if err := samps.setSamplerate(44100); err != nil {
+		t.Fatal(err)
+	}
+	waitForSamplerate(t, samps, 44100)
+	if err := samps.play(file, 0); err != nil {
+		t.Fatal(err)
+	}
+	if got := playLength(t, samps, nil); !near(got, frames*441/480) {
+		t.Fatalf("at 44.1 kHz played %d frames, want about %d", got, frames*441/480)
+	}
+}
+
+func TestBusCanBeTakenBack(t *testing.T) {
+	file := filepath.Join(t.TempDir(), "tone.wav")
+	tone := make([]float32, 4*samplesCycle)
+	for i := range tone {
+		tone[i] = 0.25
+	}
+	writeWAV(t, file, 48000, [][]float32{tone})
+	samps := newSamples(48000)
+	defer samps.free()
+
+	if bus := samps.bus("master"); bus != 0 {
+		t.Fatalf("master is bus %d, want 0", bus)
+	}
+	drums := samps.addBus("drums")
+	if drums != 1 {
+		t.Fatalf("first bus is %d, want 1", drums)
+	}
+	if bus := samps.addBus("drums"); bus != -1 {
+		t.Fatalf("adding drums again gave bus %d, want -1", bus)
+	}
+	if err := samps.play(file, drums); err != nil {
+		t.Fatal(err)
+	}
+	// wait for the voice to reach the realtime thread
+	var out [][]float32
+	for wait := 0; wait < 1000; wait++ {
+		var err error
+		if out, err = samps.write(); err != nil {
+			t.Fatal(err)
+		}
+		if out[0][0] != 0 {
+			break
+		}
+		time.Sleep(time.Millisecond)
+	}
+	address, mix := samps.busBuffers(drums)
+	if mix[0][0] != 0.25 || out[0][0] != 0.25 {
+		t.Fatalf("voice on drums mixed %v into the bus and %v into the output, want 0.25",
+			mix[0][0], out[0][0])
+	}
+	// the voice has to finish before its bus can be taken back
+	if got := playLength(t, samps, nil); got > len(tone) {
+		t.Fatalf("voice on drums played %d more frames, want at most %d", got, len(tone))
+	}
+
+	samps.removeBus(drums)
+	if bus := samps.bus("drums"); bus != -1 {
+		t.Fatalf("drums is bus %d once taken back, want -1", bus)
+	}
+	keys := samps.addBus("keys")
+	if keys != drums {
+		t.Fatalf("bus after taking back drums is %d, want %d", keys, drums)
+	}
+	if again, _ := samps.busBuffers(keys); again != address {
+		t.Fatal("bus taken back did not leave its buffers for the next")
+	}
+}
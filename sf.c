@@ -1,25 +1,88 @@
+/* fallocate and sync_file_range */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sndfile.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
 #include "lightning.h"
 #include "log.h"
 #include "mem.h"
 #include "sf.h"
 
+/* streams read the file in requests aligned to this many bytes */
+#define SF_READAHEAD_ALIGN 4096
+
 typedef enum {
     SF_MODE_READ,
     SF_MODE_WRITE
 } SF_MODE;
 
+/**
+ * File access for streams. libsndfile asks for a few kilobytes
+ * at a time, which turns into a lot of small reads when hundreds
+ * of files are streamed at once, so we hand it data from an
+ * aligned buffer that is refilled with one pread at a time. The
+ * window a refill will read can be asked for ahead of time with
+ * SF_prefetch.
+ */
+typedef struct Readahead {
+    int fd;
+    sf_count_t length;
+    /* position libsndfile thinks it is at */
+    sf_count_t pos;
+    /* buf holds buf_len of its size bytes of the file starting
+       at buf_start */
+    char *buf;
+    size_t size;
+    sf_count_t buf_start;
+    size_t buf_len;
+    /* start of the last window passed to SF_prefetch */
+    sf_count_t prefetched;
+    unsigned long reads;
+    uint64_t bytes;
+} Readahead;
+
+/* WAVE_FORMAT_IEEE_FLOAT and WAVE_FORMAT_EXTENSIBLE */
+#define WAV_FORMAT_FLOAT 0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+struct SFMap {
+    void *base;
+    size_t size;
+    const sample_t *data;
+    nframes_t frames;
+    channels_t channels;
+    nframes_t samplerate;
+};
+
 struct SF {
     SNDFILE *sfp;
     nframes_t frames;
     channels_t channels;
     nframes_t samplerate;
+    int format;
     SF_MODE mode;
+    /* NULL unless opened with SF_open_stream */
+    Readahead *ra;
+    /* file descriptor of a file opened with SF_open_write (-1
+       otherwise), the bytes that have been reserved for it, and
+       the bytes up to which writeback was started by the last
+       two calls to SF_writeback */
+    int fd;
+    uint64_t reserved;
+    uint64_t synced;
+    uint64_t synced_before;
 };
 
 SF
@@ -39,14 +102,181 @@ SF_open_read(const char *file)
     sf->channels = sfinfo.channels;
     sf->frames = sfinfo.frames;
     sf->samplerate = sfinfo.samplerate;
+    sf->format = sfinfo.format;
     sf->mode = SF_MODE_READ;
+    sf->ra = NULL;
+    sf->fd = -1;
+
+    return sf;
+}
+
+static sf_count_t
+ra_get_filelen(void *data)
+{
+    return ((Readahead *) data)->length;
+}
+
+static sf_count_t
+ra_seek(sf_count_t offset, int whence, void *data)
+{
+    Readahead *ra = (Readahead *) data;
+    switch (whence) {
+    case SEEK_SET: ra->pos = offset; break;
+    case SEEK_CUR: ra->pos += offset; break;
+    case SEEK_END: ra->pos = ra->length + offset; break;
+    default: return -1;
+    }
+    return ra->pos;
+}
+
+static sf_count_t
+ra_read(void *ptr, sf_count_t count, void *data)
+{
+    Readahead *ra = (Readahead *) data;
+    sf_count_t done = 0;
+    while (done < count && ra->pos < ra->length) {
+        if (ra->pos < ra->buf_start ||
+            ra->pos >= ra->buf_start + (sf_count_t) ra->buf_len) {
+            sf_count_t start = ra->pos & ~((sf_count_t) SF_READAHEAD_ALIGN - 1);
+            ssize_t n = pread(ra->fd, ra->buf, ra->size, start);
+            if (n <= 0) {
+                break;
+            }
+            ra->buf_start = start;
+            ra->buf_len = n;
+            ra->reads++;
+            ra->bytes += n;
+        }
+        sf_count_t avail = ra->buf_start + ra->buf_len - ra->pos;
+        sf_count_t n = count - done < avail ? count - done : avail;
+        memcpy((char *) ptr + done, ra->buf + (ra->pos - ra->buf_start), n);
+        done += n;
+        ra->pos += n;
+    }
+    return done;
+}
+
+static sf_count_t
+ra_write(const void *ptr, sf_count_t count, void *data)
+{
+    return 0;
+}
+
+static sf_count_t
+ra_tell(void *data)
+{
+    return ((Readahead *) data)->pos;
+}
+
+static void
+ra_free(Readahead **ra)
+{
+    close((*ra)->fd);
+    FREE((*ra)->buf);
+    FREE(*ra);
+}
+
+SF
+SF_open_stream(const char *file)
+{
+    SF sf;
+    Readahead *ra;
+    struct stat st;
+    SF_INFO sfinfo;
+    SF_VIRTUAL_IO vio = { ra_get_filelen, ra_seek, ra_read, ra_write, ra_tell };
 
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return SF_open_read(file);
+    }
+    NEW(ra);
+    ra->fd = fd;
+    ra->length = st.st_size;
+    ra->pos = 0;
+    ra->buf_start = 0;
+    ra->buf_len = 0;
+    ra->prefetched = -1;
+    ra->reads = 0;
+    ra->bytes = 0;
+    ra->size = SF_READAHEAD_ALIGN;
+    if (posix_memalign((void **) &ra->buf, SF_READAHEAD_ALIGN, ra->size)) {
+        close(fd);
+        FREE(ra);
+        return SF_open_read(file);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    NEW(sf);
+    sf->sfp = sf_open_virtual(&vio, SFM_READ, &sfinfo, ra);
+    if (sf->sfp == NULL) {
+        /* let libsndfile have a go at it on its own */
+        ra_free(&ra);
+        FREE(sf);
+        return SF_open_read(file);
+    }
+    sf->channels = sfinfo.channels;
+    sf->frames = sfinfo.frames;
+    sf->samplerate = sfinfo.samplerate;
+    sf->format = sfinfo.format;
+    sf->mode = SF_MODE_READ;
+    sf->ra = ra;
+    sf->fd = -1;
     return sf;
 }
 
+int
+SF_readahead(SF sf, size_t bytes)
+{
+    assert(sf);
+    char *buf;
+    Readahead *ra = sf->ra;
+    if (ra == NULL) {
+        return 0;
+    }
+    bytes = (bytes + SF_READAHEAD_ALIGN - 1) &
+        ~((size_t) SF_READAHEAD_ALIGN - 1);
+    bytes = bytes > 0 ? bytes : SF_READAHEAD_ALIGN;
+    if (posix_memalign((void **) &buf, SF_READAHEAD_ALIGN, bytes)) {
+        return 1;
+    }
+    FREE(ra->buf);
+    ra->buf = buf;
+    ra->size = bytes;
+    /* the next read fills the new buffer */
+    ra->buf_len = 0;
+    return 0;
+}
+
+void
+SF_prefetch(SF sf)
+{
+    assert(sf);
+    sf_count_t next;
+    Readahead *ra = sf->ra;
+    if (ra == NULL) {
+        return;
+    }
+    /* the refill after the buffer is used up, or the one that
+       is due now if it is empty */
+    if (ra->buf_len > 0) {
+        next = ra->buf_start + ra->buf_len;
+    } else {
+        next = ra->pos & ~((sf_count_t) SF_READAHEAD_ALIGN - 1);
+    }
+    if (next >= ra->length || next == ra->prefetched) {
+        return;
+    }
+    posix_fadvise(ra->fd, next, ra->size, POSIX_FADV_WILLNEED);
+    ra->prefetched = next;
+}
+
 SF
 SF_open_write(const char *file, channels_t channels,
-              nframes_t samplerate, SF_FMT format)
+              nframes_t samplerate, SF_FMT format,
+              int bits, double quality)
 {
     SF sf;
     NEW(sf);
@@ -56,6 +286,8 @@ SF_open_write(const char *file, channels_t channels,
 
     sf->frames = 0;
     sf->mode = SF_MODE_WRITE;
+    sf->ra = NULL;
+    sf->reserved = sf->synced = sf->synced_before = 0;
     sfinfo.channels = sf->channels = channels;
     sfinfo.samplerate = sf->samplerate = samplerate;
 
@@ -67,15 +299,55 @@ SF_open_write(const char *file, channels_t channels,
     default:            sndfile_format = SF_FORMAT_WAV;
     }
 
-    sndfile_format |= SF_FORMAT_FLOAT;
-    sfinfo.format = sndfile_format;
-    sf->sfp = sf_open(file, SFM_WRITE, &sfinfo);
-
+    /* FLAC has no float samples, and Vorbis has no bit depth */
+    switch (format) {
+    case SF_FMT_OGG:
+        sndfile_format |= SF_FORMAT_VORBIS;
+        break;
+    case SF_FMT_FLAC:
+        sndfile_format |= bits == 16 ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24;
+        break;
+    default:
+        sndfile_format |= bits == 16 ? SF_FORMAT_PCM_16
+            : bits == 24 ? SF_FORMAT_PCM_24
+            : SF_FORMAT_FLOAT;
+        break;
+    }
+    sfinfo.format = sf->format = sndfile_format;
+    /* we keep the descriptor to manage the file's space and
+       writeback. libsndfile is told not to close it, as it would
+       on its own error path too, so it is only ever closed here
+       and in SF_close */
+    sf->fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sf->fd < 0) {
+        LOG(Error, "could not open %s: %s", file, strerror(errno));
+        FREE(sf);
+        return NULL;
+    }
+    sf->sfp = sf_open_fd(sf->fd, SFM_WRITE, &sfinfo, 0);
     if (sf->sfp == NULL) {
         LOG(Error, "could not open %s: %s", file, sf_strerror(sf->sfp));
+        close(sf->fd);
+        FREE(sf);
         return NULL;
     }
 
+    switch (sndfile_format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_16:
+    case SF_FORMAT_PCM_24:
+        /* clip samples past full scale instead of wrapping */
+        sf_command(sf->sfp, SFC_SET_CLIPPING, NULL, SF_TRUE);
+        break;
+    }
+    quality = quality < 0.0 ? 0.0 : quality > 1.0 ? 1.0 : quality;
+    if (format == SF_FMT_FLAC) {
+        sf_command(sf->sfp, SFC_SET_COMPRESSION_LEVEL, &quality,
+                   sizeof(quality));
+    } else if (format == SF_FMT_OGG) {
+        sf_command(sf->sfp, SFC_SET_VBR_ENCODING_QUALITY, &quality,
+                   sizeof(quality));
+    }
+
     return sf;
 }
 
@@ -100,6 +372,23 @@ SF_samplerate(SF sf)
     return sf->samplerate;
 }
 
+int
+SF_bits(SF sf)
+{
+    assert(sf);
+    switch (sf->format & SF_FORMAT_SUBMASK) {
+    case SF_FORMAT_PCM_S8:
+    case SF_FORMAT_PCM_U8:
+        return 8;
+    case SF_FORMAT_PCM_16:
+        return 16;
+    case SF_FORMAT_PCM_24:
+        return 24;
+    default:
+        return 32;
+    }
+}
+
 nframes_t
 SF_read(SF sf, sample_t *buf, nframes_t frames)
 {
@@ -107,6 +396,13 @@ SF_read(SF sf, sample_t *buf, nframes_t frames)
     return (nframes_t) sf_readf_float(sf->sfp, buf, frames);
 }
 
+int
+SF_seek(SF sf, nframes_t frame)
+{
+    assert(sf);
+    return sf_seek(sf->sfp, frame, SEEK_SET) < 0;
+}
+
 nframes_t
 SF_write(SF sf, sample_t *buf, nframes_t frames)
 {
@@ -114,6 +410,13 @@ SF_write(SF sf, sample_t *buf, nframes_t frames)
     return (nframes_t) sf_writef_float(sf->sfp, buf, frames);
 }
 
+nframes_t
+SF_write_int(SF sf, int32_t *buf, nframes_t frames)
+{
+    assert(sf);
+    return (nframes_t) sf_writef_int(sf->sfp, (int *) buf, frames);
+}
+
 const char *
 SF_strerror(SF sf)
 {
@@ -121,10 +424,234 @@ SF_strerror(SF sf)
     return sf_strerror(sf->sfp);
 }
 
+int
+SF_reserve(SF sf, uint64_t bytes)
+{
+    assert(sf && sf->fd >= 0);
+    struct stat st;
+    uint64_t end;
+    int error = 0;
+    if (fstat(sf->fd, &st) != 0) {
+        return 1;
+    }
+    if (sf->reserved > (uint64_t) st.st_size + bytes / 2) {
+        return 0;
+    }
+    end = (uint64_t) st.st_size + bytes;
+#ifdef FALLOC_FL_KEEP_SIZE
+    /* the file keeps the size of what has been written, so it
+       stays valid if we never get to use the space */
+    error = fallocate(sf->fd, FALLOC_FL_KEEP_SIZE, sf->reserved,
+                      end - sf->reserved);
+#else
+    error = 1;
+#endif
+    if (error) {
+        return 1;
+    }
+    sf->reserved = end;
+    return 0;
+}
+
+void
+SF_writeback(SF sf)
+{
+    assert(sf && sf->fd >= 0);
+    struct stat st;
+    if (fstat(sf->fd, &st) != 0 || (uint64_t) st.st_size <= sf->synced) {
+        return;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    /* start writing out what is new, and wait for what we
+       started last time, which has had a block to finish */
+    sync_file_range(sf->fd, sf->synced, st.st_size - sf->synced,
+                    SYNC_FILE_RANGE_WRITE);
+    if (sf->synced > sf->synced_before) {
+        sync_file_range(sf->fd, sf->synced_before,
+                        sf->synced - sf->synced_before,
+                        SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+    /* nothing reads it back, so it need not stay cached (a
+       length of 0 would drop the whole file) */
+    if (sf->synced > sf->synced_before) {
+        posix_fadvise(sf->fd, sf->synced_before,
+                      sf->synced - sf->synced_before, POSIX_FADV_DONTNEED);
+    }
+    sf->synced_before = sf->synced;
+    sf->synced = st.st_size;
+}
+
+int
+SF_update_header(SF sf)
+{
+    assert(sf);
+    sf_command(sf->sfp, SFC_UPDATE_HEADER_NOW, NULL, 0);
+    return 0;
+}
+
+void
+SF_io_stats(SF sf, unsigned long *reads, uint64_t *bytes)
+{
+    assert(sf && reads && bytes);
+    *reads = sf->ra ? sf->ra->reads : 0;
+    *bytes = sf->ra ? sf->ra->bytes : 0;
+}
+
 void
 SF_close(SF *sf)
 {
     assert(sf && *sf);
+    struct stat st;
+    if ((*sf)->fd >= 0 && (*sf)->reserved > 0) {
+        /* give back the space we reserved but did not use */
+        sf_command((*sf)->sfp, SFC_UPDATE_HEADER_NOW, NULL, 0);
+        if (fstat((*sf)->fd, &st) == 0 && (uint64_t) st.st_size < (*sf)->reserved) {
+            if (ftruncate((*sf)->fd, st.st_size) != 0) {
+                LOG(Warn, "could not release space reserved for %s", "export");
+            }
+        }
+    }
     sf_close((*sf)->sfp);
+    if ((*sf)->fd >= 0) {
+        close((*sf)->fd);
+    }
+    if ((*sf)->ra) {
+        ra_free(&(*sf)->ra);
+    }
     FREE(*sf);
 }
+
+static uint16_t
+le16(const unsigned char *p)
+{
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t
+le32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/**
+ * Find the data chunk of a float WAV file mapped at @a base.
+ *
+ * @return 0 if @a map has been filled in, nonzero if the file
+ *         is not a float WAV file
+ */
+static int
+parse_wav(const unsigned char *base, size_t size, SFMap map)
+{
+    size_t pos = 12, len;
+    uint16_t tag, bits = 0;
+    int have_fmt = 0;
+    if (size < 12 || memcmp(base, "RIFF", 4) || memcmp(base + 8, "WAVE", 4)) {
+        return 1;
+    }
+    while (pos + 8 <= size) {
+        const unsigned char *chunk = base + pos;
+        len = le32(chunk + 4);
+        if (!memcmp(chunk, "fmt ", 4) && len >= 16 && pos + 8 + len <= size) {
+            tag = le16(chunk + 8);
+            map->channels = le16(chunk + 10);
+            map->samplerate = le32(chunk + 12);
+            bits = le16(chunk + 22);
+            if (tag == WAV_FORMAT_EXTENSIBLE && len >= 40) {
+                /* the first two bytes of the sub-format GUID */
+                tag = le16(chunk + 32);
+            }
+            have_fmt = tag == WAV_FORMAT_FLOAT && bits == 32 &&
+                map->channels > 0;
+        } else if (!memcmp(chunk, "data", 4)) {
+            if (!have_fmt || (pos + 8) % sizeof(sample_t) != 0) {
+                return 1;
+            }
+            /* the size of the last chunk may be left unset by
+               programs that were writing it as a stream */
+            len = len < size - pos - 8 ? len : size - pos - 8;
+            map->data = (const sample_t *) (chunk + 8);
+            map->frames = len / (sizeof(sample_t) * map->channels);
+            return 0;
+        }
+        /* chunks are padded to an even number of bytes */
+        pos += 8 + len + (len & 1);
+    }
+    return 1;
+}
+
+SFMap
+SFMap_open(const char *file)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    SFMap map;
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    NEW(map);
+    map->size = st.st_size;
+    map->base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map->base == MAP_FAILED) {
+        LOG(Warn, "could not mmap %s", file);
+        FREE(map);
+        return NULL;
+    }
+    if (parse_wav(map->base, map->size, map)) {
+        munmap(map->base, map->size);
+        FREE(map);
+        return NULL;
+    }
+    /* we are about to play from it, so start reading it in now */
+    madvise(map->base, map->size, MADV_WILLNEED);
+    return map;
+#else
+    /* WAV data is little endian */
+    return NULL;
+#endif
+}
+
+const sample_t *
+SFMap_data(SFMap map)
+{
+    assert(map);
+    return map->data;
+}
+
+nframes_t
+SFMap_frames(SFMap map)
+{
+    assert(map);
+    return map->frames;
+}
+
+channels_t
+SFMap_channels(SFMap map)
+{
+    assert(map);
+    return map->channels;
+}
+
+nframes_t
+SFMap_samplerate(SFMap map)
+{
+    assert(map);
+    return map->samplerate;
+}
+
+void
+SFMap_free(SFMap *map)
+{
+    assert(map && *map);
+    munmap((*map)->base, (*map)->size);
+    FREE(*map);
+}
@@ -2,6 +2,7 @@
 #define SF_H_INCLUDED
 
 #include <sndfile.h>
+#include <stdint.h>
 
 #include "lightning.h"
 
@@ -15,6 +16,8 @@ typedef enum {
 
 typedef struct SF *SF;
 
+typedef struct SFMap *SFMap;
+
 /**
  * Open a sound file for reading.
  *
@@ -24,6 +27,40 @@ typedef struct SF *SF;
 SF
 SF_open_read(const char *file);
 
+/**
+ * Open a sound file for streaming.
+ * Reads go through a read-ahead buffer that is filled with one
+ * aligned request at a time, which keeps the number of disk
+ * requests down when many files are streamed at once. The buffer
+ * is a page, enough to read the header, until SF_readahead sizes
+ * it for the file.
+ * Falls back to SF_open_read if that can't be set up.
+ */
+SF
+SF_open_stream(const char *file);
+
+/**
+ * Make the read-ahead buffer of a file opened with SF_open_stream
+ * @a bytes long (rounded up to a page). Does nothing for files
+ * opened any other way.
+ *
+ * @return 0 on success, nonzero if the buffer could not be
+ *         allocated (the old one is kept)
+ */
+int
+SF_readahead(SF sf, size_t bytes);
+
+/**
+ * Ask the kernel to start reading the window of a file opened
+ * with SF_open_stream that its read-ahead buffer will be refilled
+ * with next, without waiting for it. Prefetching the windows of
+ * several files before reading any of them hands the kernel all
+ * of their requests at once. Does nothing if that window was
+ * already asked for, or for files opened any other way.
+ */
+void
+SF_prefetch(SF sf);
+
 /**
  * Open a sound file for writing.
  *
@@ -31,12 +68,19 @@ SF_open_read(const char *file);
  * @param channels - The number of channels to write.
  * @param samplerate - The sample rate of the file.
  * @param format - The format of the file.
+ * @param bits - Bits per sample: 16 or 24 for integer samples
+ *               and 32 for float. FLAC is 24-bit unless this is
+ *               16, and OGG ignores it.
+ * @param quality - From 0 to 1. How hard FLAC compresses (higher
+ *                  is smaller and slower), or the Vorbis quality
+ *                  of OGG (higher is better and larger).
  *
  * @return struct SF *
  */
 SF
 SF_open_write(const char *file, channels_t channels,
-              nframes_t samplerate, SF_FMT format);
+              nframes_t samplerate, SF_FMT format,
+              int bits, double quality);
 
 /**
  * Get the channels of a sound file.
@@ -56,6 +100,13 @@ SF_frames(SF sf);
 nframes_t
 SF_samplerate(SF sf);
 
+/**
+ * Get the bits per sample of a sound file's encoding.
+ * Returns 32 for float and compressed encodings.
+ */
+int
+SF_bits(SF sf);
+
 /**
  * Read @a frames frames from a sound file, and
  * store them in @a buf. @a buf must be large enough
@@ -66,12 +117,60 @@ SF_samplerate(SF sf);
 nframes_t
 SF_read(SF sf, sample_t *buf, nframes_t frames);
 
+/**
+ * Move the read position of a sound file to @a frame.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+SF_seek(SF sf, nframes_t frame);
+
 /**
  * Write @a frames frames of data to a sound file.
  */
 nframes_t
 SF_write(SF sf, sample_t *buf, nframes_t frames);
 
+/**
+ * Write @a frames frames of integer samples to a sound file. Each
+ * sample is in the high bits of its int32_t, so 16-bit samples
+ * are multiples of 65536.
+ */
+nframes_t
+SF_write_int(SF sf, int32_t *buf, nframes_t frames);
+
+/**
+ * Reserve disk space for the next @a bytes bytes written to a
+ * file opened with SF_open_write, so writing it does not have to
+ * allocate blocks as it goes and the file is not fragmented.
+ * Does nothing while more than half of that is still reserved
+ * past the end of the file. The file's size is not changed.
+ *
+ * @return 0 on success, nonzero if space could not be reserved
+ */
+int
+SF_reserve(SF sf, uint64_t bytes);
+
+/**
+ * Start writing out what has been written to a file opened with
+ * SF_open_write since the last call, wait for what the last call
+ * started, and drop that from the page cache. Calling this after
+ * every large write keeps a long recording from building up dirty
+ * pages that are then written out all at once.
+ */
+void
+SF_writeback(SF sf);
+
+/**
+ * Update the header of a file being written to describe the
+ * frames written so far, so the file can be read as it is if
+ * it is never closed.
+ *
+ * @return 0 on success, nonzero on failure
+ */
+int
+SF_update_header(SF sf);
+
 /**
  * Get a string that describes the last error that occured
  * with the given SF object.
@@ -79,6 +178,46 @@ SF_write(SF sf, sample_t *buf, nframes_t frames);
 const char *
 SF_strerror(SF sf);
 
+/**
+ * Number of read requests, and bytes read, by a sound file
+ * opened with SF_open_stream so far.
+ */
+void
+SF_io_stats(SF sf, unsigned long *reads, uint64_t *bytes);
+
+/**
+ * Map the sample data of @a file into memory, if it is a WAV
+ * file of interleaved 32-bit float samples, which can be played
+ * straight from the mapping without decoding it. The pages are
+ * shared with every other process that maps or reads the file.
+ *
+ * @return SFMap, or NULL if @a file is not in that format or
+ *         could not be mapped
+ */
+SFMap
+SFMap_open(const char *file);
+
+/**
+ * The mapped frames, interleaved.
+ */
+const sample_t *
+SFMap_data(SFMap map);
+
+nframes_t
+SFMap_frames(SFMap map);
+
+channels_t
+SFMap_channels(SFMap map);
+
+nframes_t
+SFMap_samplerate(SFMap map);
+
+/**
+ * Unmap a file.
+ */
+void
+SFMap_free(SFMap *map);
+
 /**
  * Close the soundfile.
  */
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <pthread.h>
 #include <samplerate.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -10,15 +11,54 @@
 
 struct SRC {
     SRC_STATE *state;
+    SRCQuality quality;
+    channels_t channels;
+    /* next converter in the pool */
+    SRC next;
 };
 
+/* converters that have been freed, and how many there are */
+static SRC pool = NULL;
+static int pooled = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+converter_type(SRCQuality quality)
+{
+    switch (quality) {
+    case SRCQuality_MEDIUM:
+        return SRC_SINC_MEDIUM_QUALITY;
+    case SRCQuality_BEST:
+        return SRC_SINC_BEST_QUALITY;
+    case SRCQuality_LINEAR:
+        return SRC_LINEAR;
+    default:
+        return SRC_SINC_FASTEST;
+    }
+}
+
 SRC
-SRC_init() {
-    SRC src;
+SRC_init(SRCQuality quality, channels_t channels) {
+    assert(channels > 0);
+    SRC src, *p;
+    pthread_mutex_lock(&pool_mutex);
+    for (p = &pool; *p != NULL; p = &(*p)->next) {
+        if ((*p)->quality == quality && (*p)->channels == channels) {
+            src = *p;
+            *p = src->next;
+            pooled--;
+            pthread_mutex_unlock(&pool_mutex);
+            return src;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
     NEW(src);
+    src->quality = quality;
+    src->channels = channels;
+    src->next = NULL;
     /* initialize SRC_STATE */
     int error;
-    src->state = src_new(SRC_SINC_FASTEST, 1, &error);
+    src->state = src_new(converter_type(quality), channels, &error);
     if (src->state == NULL) {
         fprintf(stderr, "Could not initialize sample rate converter: %s\n",
                 src_strerror(error));
@@ -75,6 +115,34 @@ SRC_process(SRC src,
     return 0;
 }
 
+int
+SRC_process_chunk(SRC src,
+                  double src_ratio,
+                  AudioData data,
+                  int last,
+                  nframes_t *input_frames_used,
+                  nframes_t *output_frames_gen) {
+    assert(src);
+    SRC_DATA src_data;
+    int error;
+
+    src_data.src_ratio = src_ratio;
+    src_data.end_of_input = last;
+    src_data.input_frames = data.input_frames;
+    src_data.output_frames = data.output_frames;
+    src_data.data_in = data.input;
+    src_data.data_out = data.output;
+    error = src_process(src->state, &src_data);
+
+    if (error) {
+        return error;
+    }
+
+    *input_frames_used = src_data.input_frames_used;
+    *output_frames_gen = src_data.output_frames_gen;
+    return 0;
+}
+
 const char *
 SRC_strerror(int error) {
     return src_strerror(error);
@@ -83,6 +151,19 @@ SRC_strerror(int error) {
 void
 SRC_free(SRC *src) {
     assert(src && *src);
-    src_delete((*src)->state);
-    FREE(*src);
+    SRC s = *src;
+    *src = NULL;
+    if (src_reset(s->state) == 0) {
+        pthread_mutex_lock(&pool_mutex);
+        if (pooled < SRC_POOL_SIZE) {
+            s->next = pool;
+            pool = s;
+            pooled++;
+            pthread_mutex_unlock(&pool_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    src_delete(s->state);
+    FREE(s);
 }
@@ -9,11 +9,18 @@
 
 typedef struct SRC *SRC;
 
+/* converters kept for reuse once they are freed */
+#define SRC_POOL_SIZE 32
+
 /**
- * Initialize a Sample Rate Converter
+ * Initialize a Sample Rate Converter for @a channels
+ * interleaved channels.
+ * Converters are pooled, so this reuses a converter of the
+ * same quality and channel count that was freed earlier if
+ * there is one. Thread safe.
  */
 SRC
-SRC_init();
+SRC_init(SRCQuality quality, channels_t channels);
 
 /**
  * Process some audio data.
@@ -36,11 +43,26 @@ SRC_process(SRC src,
             /* will be non-zero if we hit the end of the input buffer */
             int *end);
 
+/**
+ * Process one chunk of a longer stream of audio data.
+ * Unlike SRC_process, the converter is only told the input has
+ * ended when @a last is nonzero, so its state carries over from
+ * one chunk to the next.
+ */
+int
+SRC_process_chunk(SRC src,
+                  double src_ratio,
+                  AudioData data,
+                  int last,
+                  nframes_t *input_frames_used,
+                  nframes_t *output_frames_gen);
+
 const char *
 SRC_strerror(int error);
 
 /**
- * Free system resources allocated by a Sample Rate Converter
+ * Free system resources allocated by a Sample Rate Converter,
+ * or reset it and keep it in the pool.
  */
 void
 SRC_free(SRC *src);
@@ -0,0 +1,86 @@
+package lightning
+
+import (
+	"encoding/binary"
+	"errors"
+	"math"
+	"os"
+	"testing"
+)
+
+// writeWAV writes planar channels to a 32-bit float WAV file
+func writeWAV(t *testing.T, file string, samplerate int, channels [][]float32) {
+	t.Helper()
+	frames := len(channels[0])
+	data := make([]byte, 0, 44+4*frames*len(channels))
+	u16 := func(v int) { data = binary.LittleEndian.AppendUint16(data, uint16(v)) }
+	u32 := func(v int) { data = binary.LittleEndian.AppendUint32(data, uint32(v)) }
+	data = append(data, "RIFF"...)
+	u32(36 + 4*frames*len(channels))
+	data = append(data, "WAVEfmt "...)
+	u32(16)
+	u16(3) // IEEE float
+	u16(len(channels))
+	u32(samplerate)
+	u32(samplerate * 4 * len(channels))
+	u16(4 * len(channels))
+	u16(32)
+	data = append(data, "data"...)
+	u32(4 * frames * len(channels))
+	for i := 0; i < frames; i++ {
+		for _, ch := range channels {
+			u32(int(math.Float32bits(ch[i])))
+		}
+	}
+	if err := os.WriteFile(file, data, 0o644); err != nil {
+		t.Fatal(err)
+	}
+}
+
+// readWAV reads a 32-bit float WAV file into planar channels
+func readWAV(file string) ([][]float32, error) {
+	data, err := os.ReadFile(file)
+	if err != nil {
+		return nil, err
+	}
+	if len(data) < 12 || string(data[0:4]) != "RIFF" || string(data[8:12]) != "WAVE" {
+		return nil, errors.New("not a WAV file")
+	}
+	channels := 0
+	for pos := 12; pos+8 <= len(data); {
+		id := string(data[pos : pos+4])
+		size := int(binary.LittleEndian.Uint32(data[pos+4:]))
+		body := data[pos+8:]
+		if size > len(body) {
+			size = len(body)
+		}
+		switch id {
+		case "fmt ":
+			tag := binary.LittleEndian.Uint16(body)
+			if tag == 0xfffe && size >= 26 {
+				// WAVE_FORMAT_EXTENSIBLE, the format is in the sub format
+				tag = binary.LittleEndian.Uint16(body[24:])
+			}
+			if tag != 3 || binary.LittleEndian.Uint16(body[14:]) != 32 {
+				return nil, errors.New("not a 32-bit float WAV file")
+			}
+			channels = int(binary.LittleEndian.Uint16(body[2:]))
+		case "data":
+			if channels == 0 {
+				return nil, errors.New("WAV data before its format")
+			}
+			frames := size / (4 * channels)
+			out := make([][]float32, channels)
+			for ch := range out {
+				out[ch] = make([]float32, frames)
+				for i := range out[ch] {
+					bits := binary.LittleEndian.Uint32(body[4*(i*channels+ch):])
+					out[ch][i] = math.Float32frombits(bits)
+				}
+			}
+			return out, nil
+		}
+		pos += 8 + size + size&1
+	}
+	return nil, errors.New("WAV file has no data")
+}